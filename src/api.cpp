@@ -19,45 +19,58 @@
 #include "api.h"
 
 #include <Arduino.h>
+#include <CBOR.h>
+#include <CBOR_parsing.h>
+#include <CBOR_streams.h>
 #include <esp_timer.h>
 
+#include <algorithm>
+#include <array>
 #include <mutex>
-#include <iostream>
-#include <sstream>
 #include <string>
+#include <string_view>
+#include <vector>
 
+#include "benchmark.h"
 #include "config.h"
 #include "dali.h"
 #include "dimmers.h"
+#include "latency.h"
 #include "lights.h"
 #include "network.h"
+#include "remote_lights.h"
 #include "ui.h"
 #include "util.h"
 
+/**
+ * Splits text on a separator without copying it, returning the same items
+ * as std::getline() would: an empty string has no items and a trailing
+ * separator does not add an empty item.
+ */
 class StringParser {
 public:
-	StringParser(const std::string &topic, char sep) {
-		std::istringstream input{topic};
-		std::string item;
-
-		while (std::getline(input, item, sep)) {
-			topic_.push_back(std::move(item));
-		}
+	StringParser(std::string_view text, char sep) : text_(text), sep_(sep) {
 	}
 
-	bool get_string(std::string &value) {
-		if (!topic_.empty()) {
-			value = std::move(topic_.front());
-			topic_.pop_front();
+	bool get_string(std::string_view &value) {
+		if (pos_ < text_.size()) {
+			size_t end = text_.find(sep_, pos_);
+
+			if (end == std::string_view::npos) {
+				end = text_.size();
+			}
+
+			value = text_.substr(pos_, end - pos_);
+			pos_ = end + 1;
 			return true;
 		} else {
-			value.clear();
+			value = {};
 			return false;
 		}
 	}
 
 	bool get_long(long &value) {
-		std::string text;
+		std::string_view text;
 
 		if (get_string(text)) {
 			return long_from_string(text, value);
@@ -67,16 +80,19 @@ public:
 	}
 
 private:
-	std::deque<std::string> topic_;
+	const std::string_view text_;
+	const char sep_;
+	size_t pos_{0};
 };
 
-API::API(std::mutex &file_mutex, Network &network, Config &config, Dali &dali,
-		Dimmers &dimmers, Lights &lights, UI &ui) : file_mutex_(file_mutex),
+API::API(ProfiledMutex &file_mutex, Network &network, Config &config,
+		const std::array<Dali*,NUM_DALI_BUSES> &dali, Dimmers &dimmers, Lights &lights, UI &ui) : file_mutex_(file_mutex),
 		network_(network), config_(config), dali_(dali), dimmers_(dimmers),
 		lights_(lights), ui_(ui), topic_prefix_(FixedConfig::mqttTopic("/")) {
 }
 
 void API::connected() {
+	ui_.boot_stage("mqtt");
 	startup_complete(false);
 
 	network_.subscribe(FixedConfig::mqttTopic("/startup_complete"));
@@ -86,11 +102,14 @@ void API::connected() {
 	network_.subscribe(FixedConfig::mqttTopic("/reboot"));
 	network_.subscribe(FixedConfig::mqttTopic("/reload"));
 	network_.subscribe(FixedConfig::mqttTopic("/status"));
+	network_.subscribe(FixedConfig::mqttTopic("/benchmark"));
+	network_.subscribe(FixedConfig::mqttTopic("/export"));
 	network_.subscribe(FixedConfig::mqttTopic("/ota/+"));
 	if (FixedConfig::isLocal()) {
 		network_.subscribe(FixedConfig::mqttTopic("/addresses"));
 		network_.subscribe(FixedConfig::mqttTopic("/group/+"));
 		network_.subscribe(FixedConfig::mqttTopic("/groups/sync"));
+		network_.subscribe(FixedConfig::mqttTopic("/trace"));
 		network_.subscribe(FixedConfig::mqttTopic("/switch/+/group"));
 		network_.subscribe(FixedConfig::mqttTopic("/switch/+/name"));
 		network_.subscribe(FixedConfig::mqttTopic("/switch/+/preset"));
@@ -125,219 +144,552 @@ void API::startup_complete(bool state) {
 	ui_.startup_complete(state);
 }
 
-void API::receive(std::string &&topic, std::string &&payload) {
+constexpr std::array<API::TopicHandler,18> API::TOPIC_HANDLERS{{
+	{"addresses",        &API::receive_addresses},
+	{"benchmark",        &API::receive_benchmark},
+	{"button",           &API::receive_button},
+	{"command",          &API::receive_command},
+	{"dimmer",           &API::receive_dimmer},
+	{"export",           &API::receive_export},
+	{"group",            &API::receive_group},
+	{"ota",              &API::receive_ota},
+	{"preset",           &API::receive_preset},
+	{"reboot",           &API::receive_reboot},
+	{"reload",           &API::receive_reload},
+	{"selector",         &API::receive_selector},
+	{"set",              &API::receive_set},
+	{"startup_complete", &API::receive_startup_complete},
+	{"status",           &API::receive_status},
+	{"switch",           &API::receive_switch},
+	{"trace",            &API::receive_trace},
+	{"x",                &API::receive_x},
+}};
+
+const API::TopicHandler *API::find_topic_handler(std::string_view name) {
+	auto handler = std::lower_bound(TOPIC_HANDLERS.cbegin(), TOPIC_HANDLERS.cend(),
+		name, [] (const TopicHandler &handler, std::string_view name) {
+			return handler.name < name;
+		});
+
+	if (handler != TOPIC_HANDLERS.cend() && handler->name == name) {
+		return &*handler;
+	}
+
+	return nullptr;
+}
+
+void API::receive(std::string_view topic, std::string_view payload) {
+	static_assert([] {
+		for (size_t i = 1; i < TOPIC_HANDLERS.size(); i++) {
+			if (!(TOPIC_HANDLERS[i - 1].name < TOPIC_HANDLERS[i].name)) {
+				return false;
+			}
+		}
+
+		return true;
+	}(), "Topic handlers must be sorted");
+
 	if (topic == "meta/mqtt-agents/poll") {
 		network_.publish("meta/mqtt-agents/reply", network_.device_id());
-		topic.clear();
-	} else if (topic.rfind(topic_prefix_, 0) == 0) {
-		topic = topic.substr(topic_prefix_.size());
+		topic = {};
+	} else if (topic.substr(0, topic_prefix_.size()) == topic_prefix_) {
+		topic.remove_prefix(topic_prefix_.size());
 	} else {
-		topic.clear();
+		topic = {};
 	}
 
 	StringParser topic_parser{topic, '/'};
 
-	topic_parser.get_string(topic);
+	if (topic_parser.get_string(topic) && !topic.empty()) {
+		const TopicHandler *handler = find_topic_handler(topic);
 
-	if (topic.empty()) {
-		/* Do nothing */
-	} else if (topic == "x") {
-		StringParser payload_parser{payload, ' '};
-		std::string command;
+		if (handler) {
+			const LatencyOrigin &origin = Latency::origin();
 
-		if (payload_parser.get_string(command)) {
-			if (command == "dg" || command == "di") {
-				std::string groups;
-				long value;
+			if (origin.source == LatencySource::MQTT) {
+				Latency::record(LatencyPoint::MQTT_DISPATCH, esp_timer_get_time() - origin.us);
+			}
 
-				if (payload_parser.get_long(value)
-						&& payload_parser.get_string(groups)) {
-					lights_.dim_adjust(command == "dg" ? DimmerMode::GROUP
-						: DimmerMode::INDIVIDUAL, groups, value);
-				}
-			} else if (command == "pt") {
-				std::string preset_name;
-				std::string light_ids;
+			(this->*(handler->receive))(topic_parser, payload);
+		}
+	}
 
-				if (payload_parser.get_string(preset_name)
-						&& payload_parser.get_string(light_ids)) {
-					lights_.select_preset(preset_name, light_ids);
-				}
-			} else if (command == "sl") {
-				std::string light_ids;
-				long value;
+	yield();
+	network_.send_queued_messages();
+}
 
-				if (payload_parser.get_string(light_ids)
-						&& payload_parser.get_long(value)) {
-					lights_.set_level(light_ids, value);
-				}
+static bool read_text(cbor::Reader &reader, std::string &text, size_t max_length) {
+	uint64_t length;
+	bool indefinite;
+
+	if (!cbor::expectText(reader, &length, &indefinite) || indefinite)
+		return false;
+
+	if (length > max_length)
+		return false;
+
+	text.resize(length);
+
+	return cbor::readFully(reader, reinterpret_cast<uint8_t*>(text.data()), length) == length;
+}
+
+static bool read_text(cbor::Reader &reader, std::vector<std::string> &texts, size_t max_length) {
+	uint64_t length;
+	bool indefinite;
+
+	if (!cbor::expectArray(reader, &length, &indefinite) || indefinite)
+		return false;
+
+	if (length > max_length)
+		return false;
+
+	texts.resize(length);
+
+	for (auto &text : texts) {
+		if (!read_text(reader, text, max_length))
+			return false;
+	}
+
+	return true;
+}
+
+void API::receive_x(StringParser &topic, std::string_view payload) {
+	if (RemoteLights::binary_payload(payload)) {
+		receive_x_binary(payload);
+		return;
+	}
+
+	StringParser payload_parser{payload, ' '};
+	std::string_view command;
+
+	if (payload_parser.get_string(command)) {
+		if (command == "dg" || command == "di") {
+			std::string_view groups;
+			long value;
+
+			if (payload_parser.get_long(value)
+					&& payload_parser.get_string(groups)) {
+				lights_.dim_adjust(command == "dg" ? DimmerMode::GROUP
+					: DimmerMode::INDIVIDUAL, std::string{groups}, value);
 			}
-		}
-	} else if (topic == "preset") {
-		std::string preset_name;
+		} else if (command == "pt") {
+			std::string_view preset_name;
+			std::string_view light_ids;
 
-		if (topic_parser.get_string(preset_name)) {
-			std::string light_ids;
-
-			if (topic_parser.get_string(light_ids)) {
-				if (light_ids == RESERVED_GROUP_DELETE) {
-					config_.delete_preset(preset_name);
-				} else if (light_ids == RESERVED_GROUP_LEVELS) {
-					if (!payload.empty()) {
-						config_.set_preset(preset_name, payload);
-					}
-				} else {
-					long value = Config::LEVEL_NO_CHANGE;
-
-					if (payload.empty()
-							|| long_from_string(payload, value)) {
-						config_.set_preset(preset_name, light_ids, value);
-					}
-				}
-			} else {
-				if (preset_name == RESERVED_PRESET_ORDER) {
-					config_.set_ordered_presets(payload);
-				} else {
-					if (payload.empty()) {
-						payload = BUILTIN_GROUP_ALL;
-					}
-
-					lights_.select_preset(preset_name, payload);
-				}
+			if (payload_parser.get_string(preset_name)
+					&& payload_parser.get_string(light_ids)) {
+				lights_.select_preset(std::string{preset_name}, std::string{light_ids});
+			}
+		} else if (command == "sl") {
+			std::string_view light_ids;
+			long value;
+
+			if (payload_parser.get_string(light_ids)
+					&& payload_parser.get_long(value)) {
+				lights_.set_level(std::string{light_ids}, value);
 			}
 		}
-	} else if (topic == "set") {
-		std::string light_ids;
-		long value;
+	}
+}
+
+void API::receive_x_binary(std::string_view payload) {
+	cbor::BytesStream stream{reinterpret_cast<const uint8_t*>(payload.data()), payload.size()};
+	cbor::Reader reader{stream};
+	uint64_t count;
+	bool indefinite;
 
-		if (topic_parser.get_string(light_ids)
-				&& long_from_string(payload, value)) {
-			lights_.set_level(light_ids, value);
+	if (!cbor::expectArray(reader, &count, &indefinite) || indefinite) {
+		return;
+	}
+
+	for (uint64_t i = 0; i < count; i++) {
+		if (!receive_x_command(reader, payload.size())) {
+			return;
 		}
-	} else if (topic == "startup_complete") {
-		if (!startup_complete_) {
-			ESP_LOGE(TAG, "Startup complete");
-			startup_complete(true);
-			config_.save_config();
-			config_.publish_config();
+	}
+}
+
+bool API::receive_x_command(cbor::Reader &reader, size_t max_length) {
+	uint64_t length;
+	bool indefinite;
+	uint64_t command;
+
+	if (!cbor::expectArray(reader, &length, &indefinite) || indefinite
+			|| length != 3 || !cbor::expectUnsignedInt(reader, &command)) {
+		return false;
+	}
+
+	RemoteCommand type = static_cast<RemoteCommand>(command);
+
+	if (type == RemoteCommand::PRESET_LIGHTS) {
+		std::string preset_name;
+		std::string light_ids;
+
+		if (read_text(reader, preset_name, max_length)
+				&& read_text(reader, light_ids, max_length)) {
+			lights_.select_preset(std::move(preset_name), light_ids);
+			return true;
 		}
-	} else if (topic == "reboot") {
-		config_.save_config();
+	} else if (type == RemoteCommand::PRESET_GROUPS) {
+		std::string preset_name;
+		std::vector<std::string> groups;
 
-		std::lock_guard lock{file_mutex_};
+		if (read_text(reader, preset_name, max_length)
+				&& read_text(reader, groups, max_length)) {
+			lights_.select_preset(std::move(preset_name), groups);
+			return true;
+		}
+	} else if (type == RemoteCommand::SET_LEVEL) {
+		std::string light_ids;
+		uint64_t value;
 
-		esp_restart();
-	} else if (topic == "reload") {
-		config_.load_config();
-		config_.save_config();
-		config_.publish_config();
-		lights_.address_config_changed();
-		dali_.wake_up();
-	} else if (topic == "status") {
-		ui_.status_report();
-	} else if (topic == "ota") {
-		if (topic_parser.get_string(topic)) {
-			if (topic == "update") {
-				ui_.ota_update();
-			} else if (topic == "good") {
-				ui_.ota_good();
-			} else if (topic == "bad") {
-				ui_.ota_bad();
+		if (read_text(reader, light_ids, max_length)
+				&& cbor::expectUnsignedInt(reader, &value)) {
+			if (value <= Dali::MAX_LEVEL) {
+				lights_.set_level(light_ids, value);
 			}
+			return true;
 		}
-	} else if (topic == "addresses") {
-		config_.set_addresses(payload);
-		lights_.address_config_changed(BUILTIN_GROUP_ALL);
-		dali_.wake_up();
-	} else if (topic == "switch") {
-		long switch_id;
-
-		if (topic_parser.get_long(switch_id)
-				&& topic_parser.get_string(topic)) {
-			if (topic == "group") {
-				config_.set_switch_group(switch_id, payload);
-			} else if (topic == "name") {
-				config_.set_switch_name(switch_id, payload);
-			} else if (topic == "preset") {
-				config_.set_switch_preset(switch_id, payload);
+	} else if (type == RemoteCommand::DIM_INDIVIDUAL
+			|| type == RemoteCommand::DIM_GROUP) {
+		std::vector<std::string> groups;
+		int64_t value;
+
+		if (cbor::expectInt(reader, &value)
+				&& read_text(reader, groups, max_length)) {
+			if (value >= -(int64_t)Dali::MAX_LEVEL && value <= (int64_t)Dali::MAX_LEVEL) {
+				lights_.dim_adjust(type == RemoteCommand::DIM_GROUP
+					? DimmerMode::GROUP : DimmerMode::INDIVIDUAL,
+					vector_text(groups), value);
 			}
+			return true;
 		}
-	} else if (topic == "button") {
-		long button_id;
-
-		if (topic_parser.get_long(button_id)
-				&& topic_parser.get_string(topic)) {
-			if (topic == "groups") {
-				config_.set_button_groups(button_id, payload);
-			} else if (topic == "preset") {
-				config_.set_button_preset(button_id, payload);
+	}
+
+	return false;
+}
+
+void API::receive_preset(StringParser &topic, std::string_view payload) {
+	std::string_view preset_name;
+
+	if (topic.get_string(preset_name)) {
+		std::string_view light_ids;
+
+		if (topic.get_string(light_ids)) {
+			if (light_ids == RESERVED_GROUP_DELETE) {
+				config_.delete_preset(std::string{preset_name});
+			} else if (light_ids == RESERVED_GROUP_LEVELS) {
+				if (!payload.empty()) {
+					config_.set_preset(std::string{preset_name}, std::string{payload});
+				}
+			} else {
+				long value = Config::LEVEL_NO_CHANGE;
+
+				if (payload.empty()
+						|| long_from_string(payload, value)) {
+					config_.set_preset(std::string{preset_name},
+						std::string{light_ids}, value);
+				}
 			}
-		}
-	} else if (topic == "dimmer") {
-		long dimmer_id;
-
-		if (topic_parser.get_long(dimmer_id)
-				&& topic_parser.get_string(topic)) {
-			if (topic == "groups") {
-				config_.set_dimmer_groups(dimmer_id, payload);
-			} else if (topic == "encoder_steps") {
-				long value;
-
-				if (long_from_string(payload, value)) {
-					config_.set_dimmer_encoder_steps(dimmer_id, value);
+		} else {
+			if (preset_name == RESERVED_PRESET_ORDER) {
+				config_.set_ordered_presets(std::string{payload});
+			} else {
+				StringParser payload_parser{payload, ' '};
+				std::string_view light_ids;
+				unsigned long transition_ms = 0;
+
+				if (!payload_parser.get_string(light_ids) || light_ids.empty()) {
+					light_ids = BUILTIN_GROUP_ALL;
 				}
-			} else if (topic == "level_steps") {
-				long value;
 
-				if (long_from_string(payload, value)) {
-					config_.set_dimmer_level_steps(dimmer_id, value);
+				if (receive_transition(payload_parser, transition_ms)) {
+					lights_.select_preset(std::string{preset_name}, std::string{light_ids},
+						false, transition_ms);
 				}
-			} else if (topic == "mode") {
-				config_.set_dimmer_mode(dimmer_id, payload);
-			} else if (topic == "get_debug") {
-				dimmers_.publish_debug(dimmer_id);
 			}
 		}
-	} else if (topic == "selector") {
-		long option_id;
+	}
+}
+
+void API::receive_set(StringParser &topic, std::string_view payload) {
+	StringParser payload_parser{payload, ' '};
+	std::string_view light_ids;
+	unsigned long transition_ms = 0;
+	long value;
+
+	if (topic.get_string(light_ids)
+			&& payload_parser.get_long(value)
+			&& receive_transition(payload_parser, transition_ms)) {
+		lights_.set_level(std::string{light_ids}, value, transition_ms);
+	}
+}
+
+/* Optional transition time (ms) after the other values */
+bool API::receive_transition(StringParser &payload, unsigned long &transition_ms) {
+	std::string_view text;
+	long value;
+
+	transition_ms = 0;
+
+	if (!payload.get_string(text)) {
+		return true;
+	}
+
+	if (!long_from_string(text, value) || value < 0
+			|| (unsigned long)value > Dali::MAX_TRANSITION_MS) {
+		return false;
+	}
+
+	transition_ms = value;
+	return true;
+}
+
+void API::receive_startup_complete(StringParser &topic, std::string_view payload) {
+	if (!startup_complete_) {
+		ESP_LOGE(TAG, "Startup complete");
+		startup_complete(true);
+		config_.save_config();
+		config_.publish_config();
+	}
+}
+
+void API::receive_reboot(StringParser &topic, std::string_view payload) {
+	config_.save_config();
+
+	std::lock_guard lock{file_mutex_};
+
+	esp_restart();
+}
+
+void API::receive_reload(StringParser &topic, std::string_view payload) {
+	config_.load_config();
+	config_.save_config();
+	config_.publish_config(true);
+	lights_.address_config_changed();
+	wake_up_dali();
+}
+
+void API::wake_up_dali() {
+	for (Dali *dali : dali_) {
+		dali->wake_up();
+	}
+}
 
-		if (topic_parser.get_long(option_id)
-				&& topic_parser.get_string(topic)) {
-			if (topic == "groups") {
-				config_.set_selector_groups(option_id, payload);
+void API::receive_export(StringParser &topic, std::string_view payload) {
+	std::string_view action;
+
+	if (topic.get_string(action)) {
+		return;
+	}
+
+	config_.export_config();
+}
+
+/*
+ * Topic dispatch is measured here without calling the handlers, the rest of
+ * the benchmarks are run by the UI so that they don't block the network
+ * thread.
+ */
+void API::receive_benchmark(StringParser &topic, std::string_view payload) {
+	Benchmark benchmark{network_};
+
+	this->benchmark(benchmark);
+	ui_.benchmark();
+}
+
+void API::benchmark(Benchmark &benchmark) const {
+	std::vector<std::string> topics;
+
+	for (const auto &handler : TOPIC_HANDLERS) {
+		topics.push_back(topic_prefix_ + std::string{handler.name} + "/benchmark/0");
+	}
+	topics.push_back(topic_prefix_ + "unknown");
+
+	benchmark.run("api/dispatch", 100, [&] {
+		for (std::string_view topic : topics) {
+			topic.remove_prefix(topic_prefix_.size());
+
+			StringParser topic_parser{topic, '/'};
+
+			if (topic_parser.get_string(topic)) {
+				find_topic_handler(topic);
 			}
 		}
-	} else if (topic == "group") {
-		std::string group_name;
-
-		if (topic_parser.get_string(group_name)) {
-			if (group_name == RESERVED_GROUP_SYNC) {
-				lights_.request_group_sync();
-			} else if (payload.empty()) {
-				config_.delete_group(group_name);
-			} else if (payload == "sync") {
-				lights_.request_group_sync(group_name);
-			} else {
-				if (config_.set_group_addresses(group_name, payload)) {
-					lights_.address_config_changed(group_name);
-					lights_.request_group_sync(group_name);
+	});
+}
+
+void API::receive_status(StringParser &topic, std::string_view payload) {
+	ui_.status_report();
+}
+
+/*
+ * Output the recently transmitted DALI frames in binary, split over multiple
+ * messages that each start with the sequence number of their first frame.
+ */
+void API::receive_trace(StringParser &topic, std::string_view payload) {
+	std::string_view action;
+
+	if (topic.get_string(action)) {
+		return;
+	}
+
+	for (Dali *dali : dali_) {
+		/* The first bus keeps the original topic */
+		const std::string suffix = dali->bus() == 0
+			? "/trace/frames" : std::string{"/trace/"} + dali->name() + "/frames";
+		uint32_t sequence;
+		const std::vector<DaliTraceFrame> frames = dali->get_trace(sequence);
+
+		for (size_t i = 0; i < frames.size(); i += TRACE_FRAMES_PER_MESSAGE) {
+			const size_t count = std::min(frames.size() - i, TRACE_FRAMES_PER_MESSAGE);
+
+			network_.publish({FixedConfig::mqttTopic(), suffix}, 4 + 8 * count,
+					[&] (char *buffer, size_t size) {
+				const uint32_t first = sequence + i;
+				size_t offset = 0;
+
+				buffer[offset++] = (first >> 24) & 0xFF;
+				buffer[offset++] = (first >> 16) & 0xFF;
+				buffer[offset++] = (first >> 8) & 0xFF;
+				buffer[offset++] = first & 0xFF;
+
+				for (size_t j = i; j < i + count; j++) {
+					const DaliTraceFrame &frame = frames[j];
+
+					buffer[offset++] = (frame.time_us >> 24) & 0xFF;
+					buffer[offset++] = (frame.time_us >> 16) & 0xFF;
+					buffer[offset++] = (frame.time_us >> 8) & 0xFF;
+					buffer[offset++] = frame.time_us & 0xFF;
+					buffer[offset++] = frame.address;
+					buffer[offset++] = frame.data;
+					buffer[offset++] = frame.flags;
+					buffer[offset++] = frame.response;
 				}
+
+				return offset;
+			});
+		}
+	}
+}
+
+void API::receive_ota(StringParser &topic, std::string_view payload) {
+	std::string_view action;
+
+	if (topic.get_string(action)) {
+		if (action == "update") {
+			ui_.ota_update();
+		} else if (action == "good") {
+			ui_.ota_good();
+		} else if (action == "bad") {
+			ui_.ota_bad();
+		}
+	}
+}
+
+void API::receive_addresses(StringParser &topic, std::string_view payload) {
+	config_.set_addresses(std::string{payload});
+	lights_.address_config_changed(BUILTIN_GROUP_ALL);
+	wake_up_dali();
+}
+
+void API::receive_switch(StringParser &topic, std::string_view payload) {
+	long switch_id;
+	std::string_view setting;
+
+	if (topic.get_long(switch_id) && topic.get_string(setting)) {
+		if (setting == "group") {
+			config_.set_switch_group(switch_id, std::string{payload});
+		} else if (setting == "name") {
+			config_.set_switch_name(switch_id, std::string{payload});
+		} else if (setting == "preset") {
+			config_.set_switch_preset(switch_id, std::string{payload});
+		}
+	}
+}
+
+void API::receive_button(StringParser &topic, std::string_view payload) {
+	long button_id;
+	std::string_view setting;
+
+	if (topic.get_long(button_id) && topic.get_string(setting)) {
+		if (setting == "groups") {
+			config_.set_button_groups(button_id, std::string{payload});
+		} else if (setting == "preset") {
+			config_.set_button_preset(button_id, std::string{payload});
+		}
+	}
+}
+
+void API::receive_dimmer(StringParser &topic, std::string_view payload) {
+	long dimmer_id;
+	std::string_view setting;
+
+	if (topic.get_long(dimmer_id) && topic.get_string(setting)) {
+		if (setting == "groups") {
+			config_.set_dimmer_groups(dimmer_id, std::string{payload});
+		} else if (setting == "encoder_steps") {
+			long value;
+
+			if (long_from_string(payload, value)) {
+				config_.set_dimmer_encoder_steps(dimmer_id, value);
+			}
+		} else if (setting == "level_steps") {
+			long value;
+
+			if (long_from_string(payload, value)) {
+				config_.set_dimmer_level_steps(dimmer_id, value);
 			}
+		} else if (setting == "mode") {
+			config_.set_dimmer_mode(dimmer_id, std::string{payload});
+		} else if (setting == "get_debug") {
+			dimmers_.publish_debug(dimmer_id);
 		}
-	} else if (topic == "command") {
-		if (topic_parser.get_string(topic)) {
-			if (topic == "store") {
-				if (topic_parser.get_string(topic)) {
-					if (topic == "power_on_level") {
-						lights_.request_broadcast_power_on_level();
-					} else if (topic == "system_failure_level") {
-						lights_.request_broadcast_system_failure_level();
-					}
-				}
+	}
+}
+
+void API::receive_selector(StringParser &topic, std::string_view payload) {
+	long option_id;
+	std::string_view setting;
+
+	if (topic.get_long(option_id) && topic.get_string(setting)) {
+		if (setting == "groups") {
+			config_.set_selector_groups(option_id, std::string{payload});
+		}
+	}
+}
+
+void API::receive_group(StringParser &topic, std::string_view payload) {
+	std::string_view group_name;
+
+	if (topic.get_string(group_name)) {
+		if (group_name == RESERVED_GROUP_SYNC) {
+			lights_.request_group_sync();
+		} else if (payload.empty()) {
+			config_.delete_group(std::string{group_name});
+		} else if (payload == "sync") {
+			lights_.request_group_sync(std::string{group_name});
+		} else {
+			std::string name{group_name};
+
+			if (config_.set_group_addresses(name, std::string{payload})) {
+				lights_.address_config_changed(name);
+				lights_.request_group_sync(name);
 			}
 		}
 	}
+}
 
-	yield();
-	network_.send_queued_messages();
+void API::receive_command(StringParser &topic, std::string_view payload) {
+	std::string_view command;
+
+	if (topic.get_string(command) && command == "store") {
+		if (topic.get_string(command)) {
+			if (command == "power_on_level") {
+				lights_.request_broadcast_power_on_level();
+			} else if (command == "system_failure_level") {
+				lights_.request_broadcast_system_failure_level();
+			}
+		}
+	}
 }
@@ -19,37 +19,89 @@
 #pragma once
 
 #include <Arduino.h>
+#include <CBOR.h>
 
+#include <array>
 #include <mutex>
 #include <string>
+#include <string_view>
 
+#include "dali.h"
+#include "profiled_mutex.h"
+
+class Benchmark;
 class Config;
-class Dali;
 class Dimmers;
 class Lights;
 class Network;
+class StringParser;
 class UI;
 
+namespace cbor = qindesign::cbor;
+
 class API {
 public:
-	API(std::mutex &file_mutex, Network &network, Config &config, Dali &dali,
+	API(ProfiledMutex &file_mutex, Network &network, Config &config,
+		const std::array<Dali*,NUM_DALI_BUSES> &dali,
 		Dimmers &dimmers, Lights &lights, UI &ui);
 
 	void connected();
-	void receive(std::string &&topic, std::string &&payload);
+	void receive(std::string_view topic, std::string_view payload);
 	bool startup_complete();
 
 private:
 	static constexpr const char *TAG = "API";
 
+	/** Number of DALI frames in each trace message */
+	static constexpr size_t TRACE_FRAMES_PER_MESSAGE = 48;
+
 	~API() = delete;
 
+	using receive_function = void (API::*)(StringParser &topic, std::string_view payload);
+
+	/**
+	 * Handler for the first segment of a topic, looked up by binary search
+	 * of a table sorted at compile time.
+	 */
+	struct TopicHandler {
+		std::string_view name; /**< Top-level topic segment */
+		receive_function receive; /**< Handler for the remaining segments */
+	};
+
+	static const std::array<TopicHandler,18> TOPIC_HANDLERS;
+
+	static const TopicHandler *find_topic_handler(std::string_view name);
+
 	void startup_complete(bool state);
+	void benchmark(Benchmark &benchmark) const;
+
+	void receive_addresses(StringParser &topic, std::string_view payload);
+	void receive_benchmark(StringParser &topic, std::string_view payload);
+	void receive_button(StringParser &topic, std::string_view payload);
+	void receive_command(StringParser &topic, std::string_view payload);
+	void receive_dimmer(StringParser &topic, std::string_view payload);
+	void receive_export(StringParser &topic, std::string_view payload);
+	void receive_group(StringParser &topic, std::string_view payload);
+	void receive_ota(StringParser &topic, std::string_view payload);
+	void receive_preset(StringParser &topic, std::string_view payload);
+	void receive_reboot(StringParser &topic, std::string_view payload);
+	void receive_reload(StringParser &topic, std::string_view payload);
+	void receive_selector(StringParser &topic, std::string_view payload);
+	void receive_set(StringParser &topic, std::string_view payload);
+	bool receive_transition(StringParser &payload, unsigned long &transition_ms);
+	void receive_startup_complete(StringParser &topic, std::string_view payload);
+	void receive_status(StringParser &topic, std::string_view payload);
+	void receive_switch(StringParser &topic, std::string_view payload);
+	void receive_trace(StringParser &topic, std::string_view payload);
+	void receive_x(StringParser &topic, std::string_view payload);
+	void receive_x_binary(std::string_view payload);
+	void wake_up_dali();
+	bool receive_x_command(cbor::Reader &reader, size_t max_length);
 
-	std::mutex &file_mutex_;
+	ProfiledMutex &file_mutex_;
 	Network &network_;
 	Config &config_;
-	Dali &dali_;
+	const std::array<Dali*,NUM_DALI_BUSES> dali_;
 	Dimmers &dimmers_;
 	Lights &lights_;
 	UI &ui_;
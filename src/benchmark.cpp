@@ -0,0 +1,44 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "benchmark.h"
+
+#include <Arduino.h>
+
+#include <string>
+
+#include "network.h"
+#include "util.h"
+
+Benchmark::Benchmark(Network &network) : network_(network) {
+}
+
+void Benchmark::publish(const char *name, const BenchmarkResult &result) {
+	std::string topic = FixedConfig::mqttTopic("/benchmark/") + name;
+
+	ESP_LOGE(TAG, "%s: %u iterations in %lluµs", name, result.iterations,
+		(unsigned long long)result.total_us);
+
+	network_.publish(topic + "/iterations", std::to_string(result.iterations));
+	network_.publish(topic + "/total_us", std::to_string(result.total_us));
+
+	if (result.iterations > 0) {
+		network_.publish(topic + "/min_us", std::to_string(result.min_us));
+		network_.publish(topic + "/max_us", std::to_string(result.max_us));
+	}
+}
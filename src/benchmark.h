@@ -0,0 +1,76 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <cstdint>
+
+class Network;
+
+struct BenchmarkResult {
+	unsigned int iterations{0}; /**< Number of times the function was run */
+	uint64_t total_us{0}; /**< Total run time (µs) */
+	uint64_t min_us{UINT64_MAX}; /**< Minimum run time (µs) */
+	uint64_t max_us{0}; /**< Maximum run time (µs) */
+};
+
+/**
+ * Times functions on the hot paths repeatedly and publishes the results.
+ * Benchmarks must not modify any state or send anything to the DALI bus
+ * because they're run on a live system.
+ */
+class Benchmark {
+public:
+	explicit Benchmark(Network &network);
+
+	template<typename Function>
+	void run(const char *name, unsigned int iterations, Function &&function) {
+		BenchmarkResult result;
+
+		for (unsigned int i = 0; i < iterations; i++) {
+			uint64_t start_us = esp_timer_get_time();
+
+			function();
+
+			uint64_t duration_us = esp_timer_get_time() - start_us;
+
+			result.iterations++;
+			result.total_us += duration_us;
+			result.min_us = std::min(result.min_us, duration_us);
+			result.max_us = std::max(result.max_us, duration_us);
+
+			if (i % YIELD_INTERVAL == YIELD_INTERVAL - 1) {
+				yield();
+			}
+		}
+
+		publish(name, result);
+	}
+
+private:
+	static constexpr const char *TAG = "Benchmark";
+	static constexpr unsigned int YIELD_INTERVAL = 100;
+
+	void publish(const char *name, const BenchmarkResult &result);
+
+	Network &network_;
+};
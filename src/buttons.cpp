@@ -26,6 +26,7 @@
 #include <string>
 
 #include "config.h"
+#include "latency.h"
 #include "lights.h"
 #include "util.h"
 
@@ -57,9 +58,7 @@ void Buttons::setup() {
 		debounce_[i].start(*this);
 	}
 
-	std::thread t;
-	make_thread(t, "buttons", 8192, 1, 20, &Buttons::run_loop, this);
-	t.detach();
+	start_thread(8192, 1, 20);
 }
 
 unsigned long Buttons::run_tasks() {
@@ -85,6 +84,8 @@ unsigned long Buttons::run_button(unsigned int button_id) {
 		ESP_LOGE(TAG, "Button %u pressed", button_id);
 
 		if (!groups.empty() && !preset.empty()) {
+			LatencyTrace trace{LatencySource::CONTROL, debounce_[button_id].interrupt_us()};
+
 			lights_.select_preset(preset, groups, false);
 		}
 	}
@@ -24,6 +24,7 @@
 #include "config.h"
 
 #include <Arduino.h>
+#include <esp_crc.h>
 #include <esp_timer.h>
 #include <CBOR.h>
 #include <CBOR_parsing.h>
@@ -33,13 +34,17 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <bitset>
+#include <cstring>
 #include <mutex>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#include "benchmark.h"
+#include "config_snapshot.h"
 #include "dali.h"
 #include "dimmers.h"
 #include "lights.h"
@@ -54,6 +59,9 @@ static const std::string BUILTIN_GROUP_IDLE = "idle";
 static constexpr size_t MAX_TEXT_LEN = 256;
 static const std::string FILENAME = "/config.cbor";
 static const std::string BACKUP_FILENAME = "/config.cbor~";
+static const std::string JOURNAL_FILENAME = "/config.journal";
+static const std::string SNAPSHOT_FILENAME = "/config.bin";
+static const std::string SOURCE_FILENAME = "/config.cbor.src";
 
 namespace cbor = qindesign::cbor;
 
@@ -93,9 +101,25 @@ static void writeText(cbor::Writer &writer, const std::string &value) {
 	writer.writeBytes(reinterpret_cast<const uint8_t*>(value.c_str()), length);
 }
 
-Config::Config(std::mutex &file_mutex, Network &network,
+class BufferPrint: public Print {
+public:
+	size_t write(uint8_t c) override {
+		buffer_.push_back(c);
+		return 1;
+	}
+
+	size_t write(const uint8_t *buffer, size_t size) override {
+		buffer_.insert(buffer_.end(), buffer, buffer + size);
+		return size;
+	}
+
+	std::vector<uint8_t> buffer_;
+};
+
+Config::Config(ProfiledMutex &file_mutex, Network &network,
 	const Selector &selector) : network_(network), selector_(selector),
-	file_mutex_(file_mutex), file_(network) {
+	file_mutex_(file_mutex), file_(network),
+	current_(std::allocate_shared<ConfigData>(PsramAllocator<ConfigData>{})) {
 }
 
 ConfigFile::ConfigFile(Network &network) : network_(network) {
@@ -111,6 +135,8 @@ void Config::setup() {
 
 void Config::loop() {
 	save_config();
+	publish_config_messages();
+	export_config_messages();
 }
 
 bool Config::valid_group_name(const std::string &name, bool use) {
@@ -180,7 +206,7 @@ std::string Config::group_addresses_text(const std::string &group) const {
 	return addresses_text(get_group_addresses(group));
 }
 
-std::string Config::addresses_text(const Dali::addresses_t &addresses) {
+std::string Config::addresses_text(const Dali::lights_t &addresses) {
 	std::vector<char> buffer(2 * addresses.size() + 1);
 	size_t offset = 0;
 
@@ -195,8 +221,8 @@ std::string Config::addresses_text(const Dali::addresses_t &addresses) {
 }
 
 std::string Config::preset_levels_text(
-		const std::array<Dali::level_fast_t,Dali::num_addresses> &levels,
-		const Dali::addresses_t *filter) {
+		const std::array<Dali::level_fast_t,Dali::num_lights> &levels,
+		const Dali::lights_t *filter) {
 	std::vector<char> buffer(2 * levels.size() + 1);
 	size_t offset = 0;
 
@@ -251,32 +277,205 @@ void ConfigData::assign_group_ids() {
 
 void Config::load_config() {
 	std::lock_guard file_lock{file_mutex_};
-	ConfigData new_data;
+	auto new_data = std::allocate_shared<ConfigData>(PsramAllocator<ConfigData>{});
 
-	if (!file_.read_config(new_data)) {
+	if (!file_.read_config(*new_data)) {
 		return;
 	}
 
 	std::lock_guard data_lock{data_mutex_};
 
-	current_ = new_data;
-	last_saved_ = current_;
+	current_ = std::move(new_data);
+	changes_ = {};
+	addresses_generation_++;
 	dirty_ = false;
 	saved_ = true;
+	generation_++;
+}
+
+uint32_t Config::generation() const {
+	return generation_.load();
 }
 
 bool ConfigFile::read_config(ConfigData &data) {
-	if (!read_config(FILENAME, true)) {
-		if (!read_config(BACKUP_FILENAME, true)) {
+	bool rewrite = false;
+
+	source_ = {};
+
+	if (!read_binary_config()) {
+		if (read_config(FILENAME, true)) {
+			/* Before reading the journal, which isn't in the file */
+			if (file_source(FILENAME, source_)) {
+				write_saved_source(source_);
+				write_binary_config(data_, source_);
+			}
+		} else if (read_config(BACKUP_FILENAME, true)) {
+			file_source(BACKUP_FILENAME, source_);
+			rewrite = true;
+		} else {
 			return false;
 		}
-		write_config(FILENAME);
 	}
 
-	data = data_;
+	if (!read_journal()) {
+		/* Remove the incomplete record so that more can be appended */
+		rewrite = true;
+	}
+
+	if (rewrite) {
+		write_snapshot(data_);
+	}
+
+	data = std::move(data_);
+	data_ = {};
 	return true;
 }
 
+bool ConfigFile::read_journal() {
+	uint64_t start = esp_timer_get_time();
+	const char mode[2] = {'r', '\0'};
+	unsigned int count = 0;
+
+	journal_size_ = 0;
+
+	if (!FS.exists(JOURNAL_FILENAME.c_str())) {
+		return true;
+	}
+
+	auto file = FS.open(JOURNAL_FILENAME.c_str(), mode);
+	if (!file) {
+		ESP_LOGE(TAG, "Unable to open config journal %s", JOURNAL_FILENAME.c_str());
+		return false;
+	}
+
+	cbor::Reader reader{file};
+	ConfigSnapshot::Source base = source_;
+	bool valid = true;
+
+	journal_size_ = file.size();
+
+	while (file.available() > 0) {
+		if (!read_journal_record(reader, base)) {
+			ESP_LOGE(TAG, "Invalid config journal record %u", count);
+			valid = false;
+			break;
+		}
+
+		if (base != source_) {
+			/*
+			 * The journal was appended to a different config file, so a
+			 * newer config file was written but the journal wasn't removed
+			 */
+			ESP_LOGW(TAG, "Ignoring config journal %s for a different config file",
+				JOURNAL_FILENAME.c_str());
+			file.close();
+			return remove_journal();
+		}
+
+		count++;
+	}
+
+	data_.assign_group_ids();
+
+	CFG_LOG(TAG, "Loaded %u config journal records", count);
+	uint64_t finish = esp_timer_get_time();
+	network_.publish(FixedConfig::mqttTopic("/config_journal_size"), std::to_string(journal_size_), true);
+	network_.publish(FixedConfig::mqttTopic("/config_journal_read_time_us"), std::to_string(finish - start));
+	return valid;
+}
+
+bool ConfigFile::read_journal_record(cbor::Reader &reader, ConfigSnapshot::Source &base) {
+	uint64_t length;
+	bool indefinite;
+	std::string key;
+
+	if (!cbor::expectArray(reader, &length, &indefinite) || indefinite || length < 1) {
+		return false;
+	}
+
+	if (!readText(reader, key, UINT8_MAX)) {
+		return false;
+	}
+
+	length--;
+
+	if (key == "base" && length == 2) {
+		uint64_t crc;
+		uint64_t size;
+
+		if (!cbor::expectUnsignedInt(reader, &crc)
+				|| !cbor::expectUnsignedInt(reader, &size)) {
+			return false;
+		}
+
+		base.crc = crc;
+		base.size = size;
+		return true;
+	} else if (key == "lights" && length == 1) {
+		return read_config_lights(reader, data_.lights);
+	} else if (key == "group" && length == 1) {
+		return read_config_group(reader, true);
+	} else if (key == "delete_group" && length == 1) {
+		std::string name;
+
+		if (!readText(reader, name, UINT8_MAX)) {
+			return false;
+		}
+
+		CFG_LOG(TAG, "Delete group %s", name.c_str());
+		data_.groups_by_name.erase(name);
+		return true;
+	} else if ((key == "switch" || key == "button" || key == "dimmer"
+			|| key == "selector") && length == 2) {
+		uint64_t id;
+
+		if (!cbor::expectUnsignedInt(reader, &id)) {
+			return false;
+		}
+
+		if (key == "switch" && id < NUM_SWITCHES) {
+			data_.switches[id] = {};
+			return read_config_switch(reader, id);
+		} else if (key == "button" && id < NUM_BUTTONS) {
+			data_.buttons[id] = {};
+			return read_config_button(reader, id);
+		} else if (key == "dimmer" && id < NUM_DIMMERS) {
+			data_.dimmers[id] = {};
+			return read_config_dimmer(reader, id);
+		} else if (key == "selector" && id < NUM_OPTIONS) {
+			data_.selector_groups[id] = {};
+			return read_config_selector(reader, id);
+		} else {
+			return reader.isWellFormed();
+		}
+	} else if (key == "preset" && length == 1) {
+		return read_config_preset(reader, true);
+	} else if (key == "delete_preset" && length == 1) {
+		std::string name;
+
+		if (!readText(reader, name, UINT8_MAX)) {
+			return false;
+		}
+
+		CFG_LOG(TAG, "Delete preset %s", name.c_str());
+		data_.presets.erase(name);
+		return true;
+	} else if (key == "order" && length == 1) {
+		data_.ordered.clear();
+		return read_config_order(reader);
+	} else {
+		CFG_LOG(TAG, "Unknown journal key: %s", key.c_str());
+
+		while (length-- > 0) {
+			if (!reader.isWellFormed()) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+}
+
 bool ConfigFile::read_config(const std::string &filename, bool load) {
 	uint64_t start = esp_timer_get_time();
 
@@ -316,6 +515,157 @@ bool ConfigFile::read_config(const std::string &filename, bool load) {
 	}
 }
 
+bool ConfigFile::read_binary_config() {
+	uint64_t start = esp_timer_get_time();
+	const char mode[2] = {'r', '\0'};
+
+	if (!FS.exists(SNAPSHOT_FILENAME.c_str())) {
+		return false;
+	}
+
+	CFG_LOG(TAG, "Reading config snapshot %s", SNAPSHOT_FILENAME.c_str());
+	std::vector<uint8_t> buffer;
+	{
+		auto file = FS.open(SNAPSHOT_FILENAME.c_str(), mode);
+		if (!file) {
+			ESP_LOGE(TAG, "Unable to open config snapshot %s", SNAPSHOT_FILENAME.c_str());
+			return false;
+		}
+
+		if (file.size() > ConfigSnapshot::MAX_SIZE) {
+			ESP_LOGE(TAG, "Config snapshot %s too large", SNAPSHOT_FILENAME.c_str());
+			return false;
+		}
+
+		buffer.resize(file.size());
+		if (file.read(buffer.data(), buffer.size()) != buffer.size()) {
+			ESP_LOGE(TAG, "Failed to read config snapshot %s", SNAPSHOT_FILENAME.c_str());
+			return false;
+		}
+	}
+
+	ConfigData data;
+	ConfigSnapshot::Source source;
+	ConfigSnapshot::Source expected;
+
+	if (!ConfigSnapshot::decode(buffer, data, source)) {
+		ESP_LOGE(TAG, "Invalid config snapshot %s", SNAPSHOT_FILENAME.c_str());
+		return false;
+	}
+
+	/*
+	 * The CBOR file could have been written without updating the snapshot
+	 * (e.g. by an older version), so check that it still matches. To avoid
+	 * reading the whole file, use the CRC that was saved when it was written
+	 * if the size hasn't changed. Versions without a snapshot don't update
+	 * either of them, so a change that keeps the same size isn't detected.
+	 */
+	if (!read_saved_source(expected) || source != expected) {
+		if (!file_source(FILENAME, expected) || source != expected) {
+			ESP_LOGE(TAG, "Config snapshot %s does not match %s",
+				SNAPSHOT_FILENAME.c_str(), FILENAME.c_str());
+			return false;
+		}
+
+		write_saved_source(expected);
+	} else {
+		auto file = FS.open(FILENAME.c_str(), mode);
+
+		if (!file || file.size() != source.size) {
+			ESP_LOGE(TAG, "Config snapshot %s does not match %s size",
+				SNAPSHOT_FILENAME.c_str(), FILENAME.c_str());
+			return false;
+		}
+	}
+
+	data_ = std::move(data);
+	source_ = source;
+
+	CFG_LOG(TAG, "Loaded config from snapshot %s", SNAPSHOT_FILENAME.c_str());
+	uint64_t finish = esp_timer_get_time();
+	network_.publish(FixedConfig::mqttTopic("/loaded_config"), SNAPSHOT_FILENAME);
+	network_.publish(FixedConfig::mqttTopic("/config_size"), std::to_string(source.size), true);
+	network_.publish(FixedConfig::mqttTopic("/config_read_time_us"), std::to_string(finish - start));
+	return true;
+}
+
+bool ConfigFile::file_source(const std::string &filename, ConfigSnapshot::Source &source) const {
+	const char mode[2] = {'r', '\0'};
+	auto file = FS.open(filename.c_str(), mode);
+
+	if (!file) {
+		return false;
+	}
+
+	std::array<uint8_t,256> buffer;
+	uint32_t crc = 0;
+	size_t size = 0;
+
+	while (file.available() > 0) {
+		size_t length = file.read(buffer.data(), buffer.size());
+
+		if (length == 0) {
+			return false;
+		}
+
+		crc = esp_crc32_le(crc, buffer.data(), length);
+		size += length;
+	}
+
+	source.crc = crc;
+	source.size = size;
+	return true;
+}
+
+/*
+ * The size and CRC of the config file are saved in another file when it's
+ * written, so that the snapshot can be checked without reading it.
+ */
+bool ConfigFile::read_saved_source(ConfigSnapshot::Source &source) const {
+	const char mode[2] = {'r', '\0'};
+
+	if (!FS.exists(SOURCE_FILENAME.c_str())) {
+		return false;
+	}
+
+	auto file = FS.open(SOURCE_FILENAME.c_str(), mode);
+	std::array<uint8_t,8> buffer;
+
+	if (!file || file.size() != buffer.size()
+			|| file.read(buffer.data(), buffer.size()) != buffer.size()) {
+		return false;
+	}
+
+	source.crc = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+	source.size = buffer[4] | (buffer[5] << 8) | (buffer[6] << 16) | ((uint32_t)buffer[7] << 24);
+	return true;
+}
+
+bool ConfigFile::write_saved_source(const ConfigSnapshot::Source &source) const {
+	const char mode[2] = {'w', '\0'};
+	const std::array<uint8_t,8> buffer{
+		static_cast<uint8_t>(source.crc), static_cast<uint8_t>(source.crc >> 8),
+		static_cast<uint8_t>(source.crc >> 16), static_cast<uint8_t>(source.crc >> 24),
+		static_cast<uint8_t>(source.size), static_cast<uint8_t>(source.size >> 8),
+		static_cast<uint8_t>(source.size >> 16), static_cast<uint8_t>(source.size >> 24),
+	};
+	bool ok = false;
+
+	{
+		auto file = FS.open(SOURCE_FILENAME.c_str(), mode);
+		if (file) {
+			file.write(buffer.data(), buffer.size());
+			ok = !file.getWriteError();
+		}
+	}
+
+	if (!ok) {
+		FS.remove(SOURCE_FILENAME.c_str());
+	}
+
+	return ok;
+}
+
 bool ConfigFile::read_config(cbor::Reader &reader) {
 	uint64_t length;
 	bool indefinite;
@@ -379,7 +729,7 @@ bool ConfigFile::read_config(cbor::Reader &reader) {
 	return true;
 }
 
-bool ConfigFile::read_config_lights(cbor::Reader &reader, Dali::addresses_t &lights) {
+bool ConfigFile::read_config_lights(cbor::Reader &reader, Dali::lights_t &lights) {
 	uint64_t length;
 	bool indefinite;
 	unsigned int i = 0;
@@ -423,7 +773,7 @@ bool ConfigFile::read_config_groups(cbor::Reader &reader) {
 	return true;
 }
 
-bool ConfigFile::read_config_group(cbor::Reader &reader) {
+bool ConfigFile::read_config_group(cbor::Reader &reader, bool replace) {
 	uint64_t length;
 	bool indefinite;
 	std::string name;
@@ -470,6 +820,10 @@ bool ConfigFile::read_config_group(cbor::Reader &reader) {
 	}
 
 	if (Config::valid_group_name(name)) {
+		if (replace) {
+			data_.groups_by_name.erase(name);
+		}
+
 		if (data_.groups_by_name.size() < Config::MAX_GROUPS) {
 			auto result = data_.groups_by_name.emplace(name, std::move(group));
 
@@ -907,11 +1261,11 @@ bool ConfigFile::read_config_presets(cbor::Reader &reader) {
 	return true;
 }
 
-bool ConfigFile::read_config_preset(cbor::Reader &reader) {
+bool ConfigFile::read_config_preset(cbor::Reader &reader, bool replace) {
 	uint64_t length;
 	bool indefinite;
 	std::string name;
-	std::array<Dali::level_fast_t,Dali::num_addresses> levels;
+	std::array<Dali::level_fast_t,Dali::num_lights> levels;
 
 	if (!cbor::expectMap(reader, &length, &indefinite) || indefinite) {
 		return false;
@@ -944,6 +1298,10 @@ bool ConfigFile::read_config_preset(cbor::Reader &reader) {
 	}
 
 	if (Config::valid_preset_name(name)) {
+		if (replace) {
+			data_.presets.erase(name);
+		}
+
 		auto result = data_.presets.emplace(name, std::move(levels));
 
 		if (result.second) {
@@ -960,7 +1318,7 @@ bool ConfigFile::read_config_preset(cbor::Reader &reader) {
 }
 
 bool ConfigFile::read_config_preset_levels(cbor::Reader &reader,
-		std::array<Dali::level_fast_t,Dali::num_addresses> &levels) {
+		std::array<Dali::level_fast_t,Dali::num_lights> &levels) {
 	uint64_t length;
 	bool indefinite;
 	unsigned int i = 0;
@@ -1015,10 +1373,24 @@ bool ConfigFile::read_config_order(cbor::Reader &reader) {
 	return true;
 }
 
+/*
+ * Get the current config for modification, copying it first if it's being
+ * used by save_config().
+ */
+ConfigData& Config::modify_config() {
+	if (current_.use_count() > 1) {
+		current_ = std::allocate_shared<ConfigData>(PsramAllocator<ConfigData>{}, *current_);
+	}
+
+	/* Only the one that isn't shared can be modified */
+	return const_cast<ConfigData&>(*current_);
+}
+
 void Config::dirty_config() {
 	std::lock_guard lock{data_mutex_};
 
 	dirty_ = true;
+	generation_++;
 }
 
 void Config::save_config() {
@@ -1029,257 +1401,924 @@ void Config::save_config() {
 		return;
 	}
 
-	if (current_ == last_saved_) {
-		dirty_ = false;
-		return;
-	}
-
-	ConfigData save_data{current_};
-
 	/*
 	 * If the config changes while we're writing it,
 	 * it'll have to be written again.
 	 */
 	dirty_ = false;
 
-	data_lock.unlock();
+	if (saved_ && !file_.journal_full()) {
+		auto records = ConfigFile::journal_records(*current_, changes_);
+
+		changes_ = {};
+
+		data_lock.unlock();
+		if (file_.append_journal(records)) {
+			return;
+		}
+		data_lock.lock();
+	}
+
 	/* If this fails, don't retry - wait until the config changes again */
-	file_.write_config(save_data);
+	write_config(data_lock);
+}
+
+/*
+ * Write the whole config to the file, replacing the journal. Must be called
+ * with both locks held, but the data lock is released while writing.
+ */
+bool Config::write_config(std::unique_lock<ProfiledRecursiveMutex> &data_lock) {
+	/* The config is only copied if it's modified while it's being written */
+	std::shared_ptr<const ConfigData> save_data = current_;
+
+	dirty_ = false;
+	changes_ = {};
+
+	data_lock.unlock();
+	bool ok = file_.write_config(*save_data);
 	data_lock.lock();
 
-	last_saved_ = save_data;
 	saved_ = true;
+	return ok;
 }
 
-bool ConfigFile::write_config(const ConfigData &data) {
-	data_ = data;
-	return write_config(FILENAME) && read_config(FILENAME, false) && write_config(BACKUP_FILENAME);
+/*
+ * Export the config file without the journal, so it's rewritten first if
+ * there are any changes that haven't been written to it. The file is output
+ * gradually by loop().
+ */
+void Config::export_config() {
+	std::lock_guard file_lock{file_mutex_};
+	std::unique_lock data_lock{data_mutex_};
+
+	if (!saved_ || dirty_ || !file_.journal_empty()) {
+		if (!write_config(data_lock)) {
+			return;
+		}
+	}
+
+	data_lock.unlock();
+	file_.export_config();
 }
 
-bool ConfigFile::write_config(const std::string &filename) const {
-	uint64_t start = esp_timer_get_time();
-	CFG_LOG(TAG, "Writing config file %s", filename.c_str());
-	{
-		const char mode[2] = {'w', '\0'};
-		auto file = FS.open(filename.c_str(), mode);
-		if (file) {
-			cbor::Writer writer{file};
+void Config::export_config_messages() {
+	if (!network_.connected() || network_.queued_message_count() >= PUBLISH_MAX_QUEUED) {
+		return;
+	}
 
-			writer.writeTag(cbor::kSelfDescribeTag);
-			write_config(writer);
+	std::lock_guard file_lock{file_mutex_};
 
-			if (file.getWriteError()) {
-				network_.report(TAG, std::string{"Failed to write config file "} + filename
-						+ ": " + std::to_string(file.getWriteError()));
-				return false;
-			}
-		} else {
-			network_.report(TAG, std::string{"Unable to open config file "} + filename + " for writing");
-			return false;
-		}
+	file_.export_config_messages(PUBLISH_PER_LOOP);
+}
+
+/*
+ * Restart exporting the config file from the beginning, which is done
+ * gradually by Config::loop().
+ */
+void ConfigFile::export_config() {
+	exporting_ = true;
+	export_offset_ = 0;
+	export_source_ = source_;
+	export_start_us_ = esp_timer_get_time();
+}
+
+/*
+ * Copy the config file directly into messages, each one starting with the
+ * offset (32-bit big-endian) and total size (32-bit big-endian) of the file.
+ */
+void ConfigFile::export_config_messages(size_t count) {
+	if (!exporting_) {
+		return;
 	}
-	{
-		const char mode[2] = {'r', '\0'};
-		auto file = FS.open(filename.c_str(), mode);
-		if (file) {
-			CFG_LOG(TAG, "Saved config to file %s", filename.c_str());
-			uint64_t finish = esp_timer_get_time();
-			network_.publish(FixedConfig::mqttTopic("/saved_config"), filename);
-			network_.publish(FixedConfig::mqttTopic("/config_size"), std::to_string(file.size()), true);
-			network_.publish(FixedConfig::mqttTopic("/config_write_time_us"), std::to_string(finish - start));
-			return true;
-		} else {
-			network_.report(TAG, std::string{"Unable to open config file "} + filename + " for reading");
-			return false;
-		}
+
+	if (source_ != export_source_) {
+		/* The config file has been rewritten, so start again */
+		export_offset_ = 0;
+		export_source_ = source_;
 	}
-}
 
-void ConfigFile::write_config(cbor::Writer &writer) const {
-	writer.beginMap(FixedConfig::isLocal() ? 8 : 3);
+	const char mode[2] = {'r', '\0'};
+	auto file = FS.open(FILENAME.c_str(), mode);
 
-	if (FixedConfig::isLocal()) {
-		writeText(writer, "lights");
-		writer.beginArray(data_.lights.size());
-		for (unsigned int i = 0; i < data_.lights.size(); i++) {
-			writer.writeBoolean(data_.lights[i]);
-		}
+	if (!file) {
+		network_.report(TAG, std::string{"Unable to open config file "} + FILENAME + " for export");
+		exporting_ = false;
+		return;
+	}
 
-		writeText(writer, "groups");
-		writer.beginArray(data_.groups_by_name.size());
-		for (const auto &group : data_.groups_by_name) {
-			writer.beginMap(3);
+	const uint32_t size = file.size();
 
-			writeText(writer, "name");
-			writeText(writer, group.first);
+	while (count-- > 0) {
+		const uint32_t offset = export_offset_;
+		const size_t length = std::min(static_cast<size_t>(size - offset), EXPORT_CHUNK_SIZE);
+		bool ok = false;
 
-			writeText(writer, "id");
-			writer.writeUnsignedInt(group.second.id);
+		if (file.seek(offset)) {
+			network_.publish({FixedConfig::mqttTopic(), "/export/config"}, EXPORT_HEADER_SIZE + length,
+					[&] (char *buffer, size_t max_length) {
+				buffer[0] = (offset >> 24) & 0xFF;
+				buffer[1] = (offset >> 16) & 0xFF;
+				buffer[2] = (offset >> 8) & 0xFF;
+				buffer[3] = offset & 0xFF;
+				buffer[4] = (size >> 24) & 0xFF;
+				buffer[5] = (size >> 16) & 0xFF;
+				buffer[6] = (size >> 8) & 0xFF;
+				buffer[7] = size & 0xFF;
 
-			writeText(writer, "lights");
-			writer.beginArray(group.second.addresses.size());
-			for (unsigned int i = 0; i < group.second.addresses.size(); i++) {
-				writer.writeBoolean(group.second.addresses[i]);
-			}
+				ok = file.read(reinterpret_cast<uint8_t*>(buffer) + EXPORT_HEADER_SIZE, length) == length;
+				return EXPORT_HEADER_SIZE + length;
+			});
 		}
 
-		writeText(writer, "switches");
-		writer.beginArray(NUM_SWITCHES);
-		for (unsigned int i = 0; i < NUM_SWITCHES; i++) {
-			writer.beginMap(3);
+		if (!ok) {
+			network_.report(TAG, std::string{"Failed to export config file "} + FILENAME);
+			exporting_ = false;
+			return;
+		}
 
-			writeText(writer, "name");
-			writeText(writer, data_.switches[i].name);
+		export_offset_ += length;
 
-			writeText(writer, "group");
-			writeText(writer, data_.switches[i].group);
+		if (export_offset_ >= size) {
+			uint64_t finish = esp_timer_get_time();
 
-			writeText(writer, "preset");
-			writeText(writer, data_.switches[i].preset);
+			network_.publish(FixedConfig::mqttTopic("/config_export_time_us"),
+				std::to_string(finish - export_start_us_));
+			exporting_ = false;
+			return;
 		}
 	}
+}
 
-	writeText(writer, "buttons");
-	writer.beginArray(NUM_BUTTONS);
-	for (unsigned int i = 0; i < NUM_BUTTONS; i++) {
-		writer.beginMap(2);
+bool ConfigFile::write_config(const ConfigData &data) {
+	return write_snapshot(data);
+}
 
-		writeText(writer, "groups");
-		writer.beginArray(data_.buttons[i].groups.size());
-		for (const auto &group : data_.buttons[i].groups) {
-			writeText(writer, group);
+std::vector<uint8_t> ConfigFile::encode(const ConfigData &data) const {
+	BufferPrint output;
+	cbor::Writer writer{output};
+
+	writer.writeTag(cbor::kSelfDescribeTag);
+	write_config(writer, data);
+	return std::move(output.buffer_);
+}
+
+bool ConfigFile::decode(const std::vector<uint8_t> &buffer) {
+	cbor::BytesStream stream{buffer.data(), buffer.size()};
+	cbor::Reader reader{stream};
+
+	return cbor::expectValue(reader, cbor::DataType::kTag, cbor::kSelfDescribeTag)
+		&& read_config(reader);
+}
+
+bool ConfigFile::write_snapshot(const ConfigData &data) {
+	const std::vector<uint8_t> buffer = encode(data);
+
+	/* The saved CRC won't match if the write is interrupted */
+	if (FS.exists(SOURCE_FILENAME.c_str())) {
+		FS.remove(SOURCE_FILENAME.c_str());
+	}
+
+	if (!write_config(FILENAME, buffer) || !verify_config(FILENAME, buffer)) {
+		return false;
+	}
+
+	/*
+	 * The existing journal is for the previous config file, so it'll be
+	 * ignored if it can't be removed (e.g. because of a power failure)
+	 */
+	source_ = {esp_crc32_le(0, buffer.data(), buffer.size()),
+		static_cast<uint32_t>(buffer.size())};
+	write_saved_source(source_);
+
+	if (!write_config(BACKUP_FILENAME, buffer)) {
+		return false;
+	}
+
+	write_binary_config(data, source_);
+	return remove_journal();
+}
+
+bool ConfigFile::remove_journal() {
+	if (journal_size_ > 0 || FS.exists(JOURNAL_FILENAME.c_str())) {
+		if (!FS.remove(JOURNAL_FILENAME.c_str())) {
+			network_.report(TAG, std::string{"Unable to remove config journal "} + JOURNAL_FILENAME);
+
+			/* Records appended to it would be ignored, so write the whole config next time */
+			journal_size_ = MAX_JOURNAL_SIZE;
+			return false;
 		}
 
-		writeText(writer, "preset");
-		writeText(writer, data_.buttons[i].preset);
+		journal_size_ = 0;
+		network_.publish(FixedConfig::mqttTopic("/config_journal_size"), "0", true);
 	}
 
-	writeText(writer, "dimmers");
-	writer.beginArray(NUM_DIMMERS);
-	for (unsigned int i = 0; i < NUM_DIMMERS; i++) {
-		writer.beginMap(4);
+	return true;
+}
 
-		writeText(writer, "groups");
-		writer.beginArray(data_.dimmers[i].groups.size());
-		for (const auto &group : data_.dimmers[i].groups) {
-			writeText(writer, group);
+bool ConfigFile::journal_full() const {
+	return journal_size_ >= MAX_JOURNAL_SIZE;
+}
+
+bool ConfigFile::journal_empty() const {
+	return journal_size_ == 0;
+}
+
+bool ConfigFile::append_journal(const std::vector<uint8_t> &records) {
+	if (records.empty()) {
+		return true;
+	}
+
+	uint64_t start = esp_timer_get_time();
+	const char mode[2] = {'a', '\0'};
+	auto file = FS.open(JOURNAL_FILENAME.c_str(), mode);
+
+	if (!file) {
+		network_.report(TAG, std::string{"Unable to open config journal "} + JOURNAL_FILENAME + " for writing");
+		return false;
+	}
+
+	size_t length = records.size();
+	size_t written = 0;
+
+	if (journal_size_ == 0) {
+		/* Identify the config file that the journal applies to */
+		BufferPrint output;
+		cbor::Writer writer{output};
+
+		writer.beginArray(3);
+		writeText(writer, "base");
+		writer.writeUnsignedInt(source_.crc);
+		writer.writeUnsignedInt(source_.size);
+
+		length += output.buffer_.size();
+		written += file.write(output.buffer_.data(), output.buffer_.size());
+	}
+
+	written += file.write(records.data(), records.size());
+
+	if (written != length || file.getWriteError()) {
+		network_.report(TAG, std::string{"Failed to write config journal "} + JOURNAL_FILENAME
+				+ ": " + std::to_string(file.getWriteError()));
+		file.close();
+
+		/* The journal may now end with an incomplete record */
+		journal_size_ = MAX_JOURNAL_SIZE;
+		return false;
+	}
+
+	file.close();
+	journal_size_ += length;
+
+	uint64_t finish = esp_timer_get_time();
+	network_.publish(FixedConfig::mqttTopic("/config_journal_size"), std::to_string(journal_size_), true);
+	network_.publish(FixedConfig::mqttTopic("/config_journal_write_time_us"), std::to_string(finish - start));
+	return true;
+}
+
+std::vector<uint8_t> ConfigFile::journal_records(const ConfigData &data,
+		const ConfigChanges &changes) {
+	BufferPrint output;
+	cbor::Writer writer{output};
+
+	if (changes.lights) {
+		writer.beginArray(2);
+		writeText(writer, "lights");
+		write_config_lights(writer, data.lights);
+	}
+
+	for (const auto &name : changes.groups) {
+		const auto it = data.groups_by_name.find(name);
+
+		writer.beginArray(2);
+		if (it != data.groups_by_name.cend()) {
+			writeText(writer, "group");
+			write_config_group(writer, it->first, it->second);
+		} else {
+			writeText(writer, "delete_group");
+			writeText(writer, name);
 		}
+	}
 
-		writeText(writer, "encoder_steps");
-		writer.writeInt(data_.dimmers[i].encoder_steps);
+	for (unsigned int i = 0; i < NUM_SWITCHES; i++) {
+		if (changes.switches[i]) {
+			writer.beginArray(3);
+			writeText(writer, "switch");
+			writer.writeUnsignedInt(i);
+			write_config_switch(writer, data.switches[i]);
+		}
+	}
 
-		writeText(writer, "level_steps");
-		writer.writeUnsignedInt(data_.dimmers[i].level_steps);
+	for (unsigned int i = 0; i < NUM_BUTTONS; i++) {
+		if (changes.buttons[i]) {
+			writer.beginArray(3);
+			writeText(writer, "button");
+			writer.writeUnsignedInt(i);
+			write_config_button(writer, data.buttons[i]);
+		}
+	}
 
-		writeText(writer, "mode");
-		writeText(writer, Dimmers::mode_text(data_.dimmers[i].mode));
+	for (unsigned int i = 0; i < NUM_DIMMERS; i++) {
+		if (changes.dimmers[i]) {
+			writer.beginArray(3);
+			writeText(writer, "dimmer");
+			writer.writeUnsignedInt(i);
+			write_config_dimmer(writer, data.dimmers[i]);
+		}
 	}
 
-	writeText(writer, "selector");
-	writer.beginArray(NUM_OPTIONS);
 	for (unsigned int i = 0; i < NUM_OPTIONS; i++) {
-		writer.beginMap(1);
+		if (changes.selectors[i]) {
+			writer.beginArray(3);
+			writeText(writer, "selector");
+			writer.writeUnsignedInt(i);
+			write_config_selector(writer, data.selector_groups[i]);
+		}
+	}
 
-		writeText(writer, "groups");
-		writer.beginArray(data_.selector_groups[i].size());
-		for (const auto &group : data_.selector_groups[i]) {
-			writeText(writer, group);
+	for (const auto &name : changes.presets) {
+		const auto it = data.presets.find(name);
+
+		writer.beginArray(2);
+		if (it != data.presets.cend()) {
+			writeText(writer, "preset");
+			write_config_preset(writer, it->first, it->second);
+		} else {
+			writeText(writer, "delete_preset");
+			writeText(writer, name);
 		}
 	}
 
-	if (FixedConfig::isLocal) {
-		writeText(writer, "presets");
-		writer.beginArray(data_.presets.size());
-		for (const auto &preset : data_.presets) {
-			writer.beginMap(2);
-
-			writeText(writer, "name");
-			writeText(writer, preset.first);
-
-			writeText(writer, "levels");
-			writer.beginArray(preset.second.size());
-			for (unsigned int i = 0; i < preset.second.size(); i++) {
-				if (preset.second[i] == Dali::LEVEL_NO_CHANGE) {
-					writer.writeInt(Config::LEVEL_NO_CHANGE);
-				} else {
-					writer.writeInt(preset.second[i]);
-				}
+	if (changes.order) {
+		writer.beginArray(2);
+		writeText(writer, "order");
+		write_config_order(writer, data.ordered);
+	}
+
+	return std::move(output.buffer_);
+}
+
+bool ConfigFile::write_config(const std::string &filename,
+		const std::vector<uint8_t> &buffer) const {
+	uint64_t start = esp_timer_get_time();
+	CFG_LOG(TAG, "Writing config file %s", filename.c_str());
+	{
+		const char mode[2] = {'w', '\0'};
+		auto file = FS.open(filename.c_str(), mode);
+		if (file) {
+			file.write(buffer.data(), buffer.size());
+
+			if (file.getWriteError()) {
+				network_.report(TAG, std::string{"Failed to write config file "} + filename
+						+ ": " + std::to_string(file.getWriteError()));
+				return false;
 			}
+		} else {
+			network_.report(TAG, std::string{"Unable to open config file "} + filename + " for writing");
+			return false;
+		}
+	}
+	{
+		const char mode[2] = {'r', '\0'};
+		auto file = FS.open(filename.c_str(), mode);
+		if (file) {
+			CFG_LOG(TAG, "Saved config to file %s", filename.c_str());
+			uint64_t finish = esp_timer_get_time();
+			network_.publish(FixedConfig::mqttTopic("/saved_config"), filename);
+			network_.publish(FixedConfig::mqttTopic("/config_size"), std::to_string(file.size()), true);
+			network_.publish(FixedConfig::mqttTopic("/config_write_time_us"), std::to_string(finish - start));
+			return true;
+		} else {
+			network_.report(TAG, std::string{"Unable to open config file "} + filename + " for reading");
+			return false;
 		}
+	}
+}
 
-		writeText(writer, "order");
-		writer.beginArray(data_.ordered.size());
-		for (const auto &preset : data_.ordered) {
-			writeText(writer, preset);
+/*
+ * Compare the file with what was written instead of parsing it again
+ */
+bool ConfigFile::verify_config(const std::string &filename,
+		const std::vector<uint8_t> &buffer) const {
+	const char mode[2] = {'r', '\0'};
+	auto file = FS.open(filename.c_str(), mode);
+
+	if (!file) {
+		network_.report(TAG, std::string{"Unable to open config file "} + filename + " for reading");
+		return false;
+	}
+
+	std::array<uint8_t,256> data;
+	size_t offset = 0;
+
+	while (offset < buffer.size()) {
+		size_t length = file.read(data.data(), std::min(data.size(), buffer.size() - offset));
+
+		if (length == 0 || std::memcmp(data.data(), &buffer[offset], length)) {
+			break;
 		}
+
+		offset += length;
 	}
+
+	if (offset != buffer.size() || file.available() > 0) {
+		network_.report(TAG, std::string{"Config file "} + filename
+			+ " does not match after writing (" + std::to_string(offset)
+			+ "/" + std::to_string(buffer.size()) + ")");
+		return false;
+	}
+
+	return true;
 }
 
-void Config::publish_config() const {
-	std::lock_guard lock{data_mutex_};
+bool ConfigFile::write_binary_config(const ConfigData &data,
+		const ConfigSnapshot::Source &source) const {
+	const char mode[2] = {'w', '\0'};
+	auto buffer = ConfigSnapshot::encode(data, source);
+	bool ok = false;
 
-	if (FixedConfig::isLocal()) {
-		network_.publish(FixedConfig::mqttTopic("/addresses"),
-			addresses_text(current_.lights), true);
+	CFG_LOG(TAG, "Writing config snapshot %s", SNAPSHOT_FILENAME.c_str());
+	{
+		auto file = FS.open(SNAPSHOT_FILENAME.c_str(), mode);
+		if (file) {
+			file.write(buffer.data(), buffer.size());
+			ok = !file.getWriteError();
+		}
+	}
+
+	if (ok) {
+		ok = verify_config(SNAPSHOT_FILENAME, buffer);
+	} else {
+		network_.report(TAG, std::string{"Failed to write config snapshot "} + SNAPSHOT_FILENAME);
+	}
+
+	if (!ok) {
+		/* Don't leave a partially written snapshot */
+		FS.remove(SNAPSHOT_FILENAME.c_str());
+	}
+
+	return ok;
+}
+
+void ConfigFile::write_config_lights(cbor::Writer &writer, const Dali::lights_t &lights) {
+	writer.beginArray(lights.size());
+	for (unsigned int i = 0; i < lights.size(); i++) {
+		writer.writeBoolean(lights[i]);
+	}
+}
+
+void ConfigFile::write_config_group(cbor::Writer &writer, const std::string &name,
+		const ConfigGroupData &group) {
+	writer.beginMap(3);
+
+	writeText(writer, "name");
+	writeText(writer, name);
+
+	writeText(writer, "id");
+	writer.writeUnsignedInt(group.id);
+
+	writeText(writer, "lights");
+	write_config_lights(writer, group.addresses);
+}
+
+void ConfigFile::write_config_switch(cbor::Writer &writer, const ConfigSwitchData &data) {
+	writer.beginMap(3);
+
+	writeText(writer, "name");
+	writeText(writer, data.name);
+
+	writeText(writer, "group");
+	writeText(writer, data.group);
+
+	writeText(writer, "preset");
+	writeText(writer, data.preset);
+}
 
-		for (const auto &group : current_.groups_by_name) {
-			network_.publish(FixedConfig::mqttTopic("/group/") + group.first,
-				addresses_text(group.second.addresses), true);
+void ConfigFile::write_config_button(cbor::Writer &writer, const ConfigButtonData &data) {
+	writer.beginMap(2);
+
+	writeText(writer, "groups");
+	writer.beginArray(data.groups.size());
+	for (const auto &group : data.groups) {
+		writeText(writer, group);
+	}
+
+	writeText(writer, "preset");
+	writeText(writer, data.preset);
+}
+
+void ConfigFile::write_config_dimmer(cbor::Writer &writer, const ConfigDimmerData &data) {
+	writer.beginMap(4);
+
+	writeText(writer, "groups");
+	writer.beginArray(data.groups.size());
+	for (const auto &group : data.groups) {
+		writeText(writer, group);
+	}
+
+	writeText(writer, "encoder_steps");
+	writer.writeInt(data.encoder_steps);
+
+	writeText(writer, "level_steps");
+	writer.writeUnsignedInt(data.level_steps);
+
+	writeText(writer, "mode");
+	writeText(writer, Dimmers::mode_text(data.mode));
+}
+
+void ConfigFile::write_config_selector(cbor::Writer &writer, const std::vector<std::string> &groups) {
+	writer.beginMap(1);
+
+	writeText(writer, "groups");
+	writer.beginArray(groups.size());
+	for (const auto &group : groups) {
+		writeText(writer, group);
+	}
+}
+
+void ConfigFile::write_config_preset(cbor::Writer &writer, const std::string &name,
+		const std::array<Dali::level_fast_t,Dali::num_lights> &levels) {
+	writer.beginMap(2);
+
+	writeText(writer, "name");
+	writeText(writer, name);
+
+	writeText(writer, "levels");
+	writer.beginArray(levels.size());
+	for (unsigned int i = 0; i < levels.size(); i++) {
+		if (levels[i] == Dali::LEVEL_NO_CHANGE) {
+			writer.writeInt(Config::LEVEL_NO_CHANGE);
+		} else {
+			writer.writeInt(levels[i]);
 		}
+	}
+}
 
-		publish_group_ids();
+void ConfigFile::write_config_order(cbor::Writer &writer, const std::vector<std::string> &ordered) {
+	writer.beginArray(ordered.size());
+	for (const auto &preset : ordered) {
+		writeText(writer, preset);
+	}
+}
 
-		for (unsigned int i = 0; i < NUM_SWITCHES; i++) {
-			auto switch_prefix = FixedConfig::mqttTopic("/switch/") + std::to_string(i);
+void ConfigFile::write_config(cbor::Writer &writer, const ConfigData &data) const {
+	writer.beginMap(FixedConfig::isLocal() ? 8 : 3);
 
-			network_.publish(switch_prefix + "/name", current_.switches[i].name, true);
-			network_.publish(switch_prefix + "/group", current_.switches[i].group, true);
-			network_.publish(switch_prefix + "/preset", current_.switches[i].preset, true);
+	if (FixedConfig::isLocal()) {
+		writeText(writer, "lights");
+		write_config_lights(writer, data.lights);
+
+		writeText(writer, "groups");
+		writer.beginArray(data.groups_by_name.size());
+		for (const auto &group : data.groups_by_name) {
+			write_config_group(writer, group.first, group.second);
+		}
+
+		writeText(writer, "switches");
+		writer.beginArray(NUM_SWITCHES);
+		for (unsigned int i = 0; i < NUM_SWITCHES; i++) {
+			write_config_switch(writer, data.switches[i]);
 		}
 	}
 
+	writeText(writer, "buttons");
+	writer.beginArray(NUM_BUTTONS);
 	for (unsigned int i = 0; i < NUM_BUTTONS; i++) {
-		auto button_prefix = FixedConfig::mqttTopic("/button/") + std::to_string(i);
-
-		network_.publish(button_prefix + "/groups",
-				vector_text(current_.buttons[i].groups), true);
-		network_.publish(button_prefix + "/preset", current_.buttons[i].preset, true);
+		write_config_button(writer, data.buttons[i]);
 	}
 
+	writeText(writer, "dimmers");
+	writer.beginArray(NUM_DIMMERS);
 	for (unsigned int i = 0; i < NUM_DIMMERS; i++) {
-		auto dimmer_prefix = FixedConfig::mqttTopic("/dimmer/") + std::to_string(i);
-
-		network_.publish(dimmer_prefix + "/groups",
-			vector_text(current_.dimmers[i].groups), true);
-		network_.publish(dimmer_prefix + "/encoder_steps",
-			std::to_string(current_.dimmers[i].encoder_steps), true);
-		network_.publish(dimmer_prefix + "/level_steps",
-			std::to_string(current_.dimmers[i].level_steps), true);
-		network_.publish(dimmer_prefix + "/mode",
-			Dimmers::mode_text(current_.dimmers[i].mode), true);
+		write_config_dimmer(writer, data.dimmers[i]);
 	}
 
+	writeText(writer, "selector");
+	writer.beginArray(NUM_OPTIONS);
 	for (unsigned int i = 0; i < NUM_OPTIONS; i++) {
-		auto selector_prefix = FixedConfig::mqttTopic("/selector/") + std::to_string(i);
-
-		network_.publish(selector_prefix + "/groups",
-				vector_text(current_.selector_groups[i]), true);
+		write_config_selector(writer, data.selector_groups[i]);
 	}
 
 	if (FixedConfig::isLocal()) {
-		for (const auto &preset : current_.presets) {
-			publish_preset(preset.first, preset.second);
+		writeText(writer, "presets");
+		writer.beginArray(data.presets.size());
+		for (const auto &preset : data.presets) {
+			write_config_preset(writer, preset.first, preset.second);
 		}
 
-		network_.publish(FixedConfig::mqttTopic("/preset/order"),
-			vector_text(current_.ordered), true);
+		writeText(writer, "order");
+		write_config_order(writer, data.ordered);
 	}
 }
 
-void Config::publish_group_ids() const {
+/*
+ * Encode and decode a copy of the config in memory without using the
+ * filesystem.
+ */
+void ConfigFile::benchmark(Benchmark &benchmark, const ConfigData &data) {
+	std::vector<uint8_t> buffer;
+	ConfigData decoded;
+	ConfigSnapshot::Source source;
+
+	benchmark.run("config/cbor_encode", 100, [&] {
+		buffer = encode(data);
+	});
+
+	benchmark.run("config/cbor_decode", 100, [&] {
+		decode(buffer);
+	});
+
+	benchmark.run("config/snapshot_encode", 100, [&] {
+		buffer = ConfigSnapshot::encode(data, source);
+	});
+
+	benchmark.run("config/snapshot_decode", 100, [&] {
+		ConfigSnapshot::decode(buffer, decoded, source);
+	});
+}
+
+void Config::benchmark(Benchmark &benchmark) const {
+	std::shared_ptr<const ConfigData> data;
+	std::string light_ids;
+
+	{
+		std::lock_guard lock{data_mutex_};
+
+		data = current_;
+	}
+
+	for (const auto &group : data->groups_by_name) {
+		light_ids += group.first;
+		light_ids += ',';
+	}
+	light_ids += "0-" + std::to_string(Dali::num_lights - 1);
+
+	/* Use separate caches so that the benchmark doesn't affect the real ones */
+	LightIdsCache light_ids_cache;
+	DimmerConfigCache dimmer_cache;
+
+	benchmark.run("config/parse_light_ids", 1000, [&] {
+		bool idle_only;
+
+		parse_light_ids(light_ids, idle_only, light_ids_cache);
+	});
+
+	benchmark.run("config/get_dimmer", 1000, [&] {
+		get_dimmer(0, dimmer_cache);
+	});
+
+	ConfigFile file{network_};
+
+	file.benchmark(benchmark, *data);
+}
+
+/*
+ * Restart publishing the config from the beginning, which is done gradually
+ * by loop(). Topics that have already been published with the same payload
+ * are skipped unless this is a full publish.
+ */
+void Config::publish_config(bool full) {
+	std::lock_guard lock{data_mutex_};
+
+	if (full) {
+		published_.clear();
+	}
+
+	publish_stage_ = PublishStage::ADDRESSES;
+	publish_index_ = 0;
+	publish_name_.clear();
+}
+
+void Config::publish_config_messages() {
+	std::lock_guard lock{data_mutex_};
+	const uint32_t lost_generation = network_.lost_message_generation();
+	size_t count = 0;
+
+	if (lost_generation != lost_generation_) {
+		lost_generation_ = lost_generation;
+
+		/*
+		 * Messages that were queued may not have been sent, so the topics
+		 * recorded as published could be out of date
+		 */
+		if (!published_.empty()) {
+			published_.clear();
+			publish_stage_ = PublishStage::ADDRESSES;
+			publish_index_ = 0;
+			publish_name_.clear();
+		}
+	}
+
+	if (publish_stage_ == PublishStage::DONE || !network_.connected()
+			|| network_.queued_message_count() >= PUBLISH_MAX_QUEUED) {
+		return;
+	}
+
+	while (publish_stage_ != PublishStage::DONE && count < PUBLISH_PER_LOOP) {
+		if (!publish_config_message(count)) {
+			publish_stage_ = static_cast<PublishStage>(static_cast<int>(publish_stage_) + 1);
+			publish_index_ = 0;
+			publish_name_.clear();
+		}
+	}
+}
+
+/*
+ * Find the next entry by name, so that the position is kept if entries are
+ * added or removed.
+ */
+template <typename T>
+static typename T::const_iterator next_by_name(const T &entries, const std::string &name) {
+	auto next = entries.cend();
+
+	for (auto it = entries.cbegin(); it != entries.cend(); ++it) {
+		if (it->first > name && (next == entries.cend() || it->first < next->first)) {
+			next = it;
+		}
+	}
+
+	return next;
+}
+
+/*
+ * Publish the next topic in the current stage, returning false when there
+ * are no more topics in the current stage.
+ */
+bool Config::publish_config_message(size_t &count) {
+	const bool local = FixedConfig::isLocal();
+
+	switch (publish_stage_) {
+	case PublishStage::ADDRESSES:
+		if (!local || publish_index_ > 0) {
+			return false;
+		}
+
+		publish_config_entry(FixedConfig::mqttTopic("/addresses"),
+			addresses_text(current_->lights), count);
+		break;
+
+	case PublishStage::GROUPS: {
+			if (!local) {
+				return false;
+			}
+
+			auto group = next_by_name(current_->groups_by_name, publish_name_);
+
+			if (group == current_->groups_by_name.cend()) {
+				return false;
+			}
+
+			publish_config_entry(FixedConfig::mqttTopic("/group/") + group->first,
+				addresses_text(group->second.addresses), count);
+			publish_name_ = group->first;
+		}
+		break;
+
+	case PublishStage::GROUP_IDS:
+		if (!local || publish_index_ > 0) {
+			return false;
+		}
+
+		publish_config_entry(FixedConfig::mqttTopic("/groups/ids"), group_ids_text(), count);
+		break;
+
+	case PublishStage::SWITCHES: {
+			if (!local || publish_index_ >= NUM_SWITCHES * 3) {
+				return false;
+			}
+
+			const unsigned int i = publish_index_ / 3;
+			const auto switch_prefix = FixedConfig::mqttTopic("/switch/") + std::to_string(i);
+
+			switch (publish_index_ % 3) {
+			case 0:
+				publish_config_entry(switch_prefix + "/name", current_->switches[i].name, count);
+				break;
+
+			case 1:
+				publish_config_entry(switch_prefix + "/group", current_->switches[i].group, count);
+				break;
+
+			case 2:
+				publish_config_entry(switch_prefix + "/preset", current_->switches[i].preset, count);
+				break;
+			}
+		}
+		break;
+
+	case PublishStage::BUTTONS: {
+			if (publish_index_ >= NUM_BUTTONS * 2) {
+				return false;
+			}
+
+			const unsigned int i = publish_index_ / 2;
+			const auto button_prefix = FixedConfig::mqttTopic("/button/") + std::to_string(i);
+
+			switch (publish_index_ % 2) {
+			case 0:
+				publish_config_entry(button_prefix + "/groups",
+					vector_text(current_->buttons[i].groups), count);
+				break;
+
+			case 1:
+				publish_config_entry(button_prefix + "/preset", current_->buttons[i].preset, count);
+				break;
+			}
+		}
+		break;
+
+	case PublishStage::DIMMERS: {
+			if (publish_index_ >= NUM_DIMMERS * 4) {
+				return false;
+			}
+
+			const unsigned int i = publish_index_ / 4;
+			const auto dimmer_prefix = FixedConfig::mqttTopic("/dimmer/") + std::to_string(i);
+
+			switch (publish_index_ % 4) {
+			case 0:
+				publish_config_entry(dimmer_prefix + "/groups",
+					vector_text(current_->dimmers[i].groups), count);
+				break;
+
+			case 1:
+				publish_config_entry(dimmer_prefix + "/encoder_steps",
+					std::to_string(current_->dimmers[i].encoder_steps), count);
+				break;
+
+			case 2:
+				publish_config_entry(dimmer_prefix + "/level_steps",
+					std::to_string(current_->dimmers[i].level_steps), count);
+				break;
+
+			case 3:
+				publish_config_entry(dimmer_prefix + "/mode",
+					Dimmers::mode_text(current_->dimmers[i].mode), count);
+				break;
+			}
+		}
+		break;
+
+	case PublishStage::SELECTORS:
+		if (publish_index_ >= NUM_OPTIONS) {
+			return false;
+		}
+
+		publish_config_entry(FixedConfig::mqttTopic("/selector/")
+			+ std::to_string(publish_index_) + "/groups",
+			vector_text(current_->selector_groups[publish_index_]), count);
+		break;
+
+	case PublishStage::PRESETS: {
+			if (!local) {
+				return false;
+			}
+
+			auto preset = next_by_name(current_->presets, publish_name_);
+
+			if (preset == current_->presets.cend()) {
+				return false;
+			}
+
+			publish_config_entry(FixedConfig::mqttTopic("/preset/") + preset->first + "/levels",
+				preset_levels_text(preset->second, nullptr), count);
+			publish_name_ = preset->first;
+		}
+		break;
+
+	case PublishStage::PRESET_ORDER:
+		if (!local || publish_index_ > 0) {
+			return false;
+		}
+
+		publish_config_entry(FixedConfig::mqttTopic("/preset/order"),
+			vector_text(current_->ordered), count);
+		break;
+
+	case PublishStage::DONE:
+		return false;
+	}
+
+	publish_index_++;
+	return true;
+}
+
+void Config::publish_config_entry(const std::string &topic, const std::string &payload, size_t &count) {
+	const size_t hash = std::hash<std::string>{}(payload);
+	auto it = published_.find(topic);
+
+	if (it != published_.end() && it->second == hash) {
+		return;
+	}
+
+	network_.publish(topic, payload, true);
+	published_[topic] = hash;
+	count++;
+}
+
+std::string Config::group_ids_text() const {
 	std::array<std::string,Dali::num_groups> groups;
 
-	for (const auto &group : current_.groups_by_name) {
+	for (const auto &group : current_->groups_by_name) {
 		if (group.second.id < groups.size()) {
 			groups[group.second.id] = group.first;
 		}
@@ -1297,16 +2336,20 @@ void Config::publish_group_ids() const {
 		first = false;
 	}
 
-	network_.publish(FixedConfig::mqttTopic("/groups/ids"), text, true);
+	return text;
+}
+
+void Config::publish_group_ids() const {
+	network_.publish(FixedConfig::mqttTopic("/groups/ids"), group_ids_text(), true);
 }
 
 void Config::publish_preset(const std::string &name,
-		const std::array<Dali::level_fast_t,Dali::num_addresses> &levels) const {
+		const std::array<Dali::level_fast_t,Dali::num_lights> &levels) const {
 	network_.publish(FixedConfig::mqttTopic("/preset/") + name + "/levels",
 		preset_levels_text(levels, nullptr), true);
 }
 
-Dali::addresses_t Config::get_addresses() const {
+Dali::lights_t Config::get_addresses() const {
 	return get_group_addresses(BUILTIN_GROUP_ALL);
 }
 
@@ -1318,7 +2361,7 @@ std::vector<std::string> Config::group_names() const {
 
 	std::unique_lock lock{data_mutex_};
 
-	for (const auto &group : current_.groups_by_name) {
+	for (const auto &group : current_->groups_by_name) {
 		groups.emplace_back(group.first);
 	}
 
@@ -1331,24 +2374,24 @@ std::vector<std::string> Config::group_names() const {
 
 Dali::group_t Config::get_group_id(const std::string &group) const {
 	std::lock_guard lock{data_mutex_};
-	auto it = current_.groups_by_name.find(group);
+	auto it = current_->groups_by_name.find(group);
 
-	if (it == current_.groups_by_name.end()) {
+	if (it == current_->groups_by_name.end()) {
 		return Dali::GROUP_NONE;
 	}
 
 	return it->second.id;
 }
 
-Dali::addresses_t Config::get_group_addresses(const std::string &group) const {
+Dali::lights_t Config::get_group_addresses(const std::string &group) const {
 	std::lock_guard lock{data_mutex_};
 
 	if (group == BUILTIN_GROUP_ALL) {
-		return current_.lights;
+		return current_->lights;
 	} else {
-		auto it = current_.groups_by_name.find(group);
+		auto it = current_->groups_by_name.find(group);
 
-		if (it == current_.groups_by_name.end()) {
+		if (it == current_->groups_by_name.end()) {
 			return {};
 		}
 
@@ -1356,20 +2399,20 @@ Dali::addresses_t Config::get_group_addresses(const std::string &group) const {
 	}
 }
 
-Dali::addresses_t Config::get_group_addresses(Dali::group_t group) const {
+Dali::lights_t Config::get_group_addresses(Dali::group_t group) const {
 	std::lock_guard lock{data_mutex_};
 
-	if (group < current_.groups_by_id.size()) {
-		return current_.groups_by_id[group];
+	if (group < current_->groups_by_id.size()) {
+		return current_->groups_by_id[group];
 	} else {
 		return {};
 	}
 }
 
-std::array<Dali::addresses_t,Dali::num_groups> Config::get_group_addresses() const {
+std::array<Dali::lights_t,Dali::num_groups> Config::get_group_addresses() const {
 	std::lock_guard lock{data_mutex_};
 
-	return current_.groups_by_id;
+	return current_->groups_by_id;
 }
 
 void Config::set_addresses(const std::string &addresses) {
@@ -1390,7 +2433,8 @@ bool Config::set_group_addresses(const std::string &name, const std::string &add
 
 bool Config::set_addresses(const std::string &group, std::string addresses) {
 	std::lock_guard lock{data_mutex_};
-	Dali::addresses_t lights;
+	ConfigData &current = modify_config();
+	Dali::lights_t lights;
 
 	auto before = group_addresses_text(group);
 
@@ -1420,26 +2464,34 @@ bool Config::set_addresses(const std::string &group, std::string addresses) {
 		addresses = addresses.substr(2);
 	}
 
+	bool created = false;
+
 	if (group == BUILTIN_GROUP_ALL) {
-		current_.lights = lights;
+		current.lights = lights;
 	} else {
-		auto it = current_.groups_by_name.find(group);
+		auto it = current.groups_by_name.find(group);
 
-		if (it == current_.groups_by_name.end()) {
+		if (it == current.groups_by_name.end()) {
 			ConfigGroupData data{Dali::GROUP_NONE, lights};
 
-			if (current_.groups_by_name.size() >= MAX_GROUPS) {
+			if (current.groups_by_name.size() >= MAX_GROUPS) {
 				return false;
 			}
 
-			current_.groups_by_name.emplace(group, std::move(data));
-			current_.assign_group_ids();
+			current.groups_by_name.emplace(group, std::move(data));
+			current.assign_group_ids();
+			created = true;
 			publish_group_ids();
+
+			/* Other groups may have had their IDs changed */
+			for (const auto &other : current.groups_by_name) {
+				changes_.groups.insert(other.first);
+			}
 		} else {
 			it->second.addresses = lights;
 
-			if (it->second.id < current_.groups_by_id.size()) {
-				current_.groups_by_id[it->second.id] = lights;
+			if (it->second.id < current.groups_by_id.size()) {
+				current.groups_by_id[it->second.id] = lights;
 			}
 		}
 	}
@@ -1462,6 +2514,17 @@ bool Config::set_addresses(const std::string &group, std::string addresses) {
 		}
 	}
 
+	/* Retained messages are received again on every connection */
+	if (!changed && !created) {
+		return false;
+	}
+
+	if (group == BUILTIN_GROUP_ALL) {
+		changes_.lights = true;
+	} else {
+		changes_.groups.insert(group);
+	}
+	addresses_generation_++;
 	dirty_config();
 
 	return changed;
@@ -1469,9 +2532,10 @@ bool Config::set_addresses(const std::string &group, std::string addresses) {
 
 void Config::delete_group(const std::string &name) {
 	std::lock_guard lock{data_mutex_};
-	const auto it = current_.groups_by_name.find(name);
+	ConfigData &current = modify_config();
+	const auto it = current.groups_by_name.find(name);
 
-	if (it == current_.groups_by_name.cend()) {
+	if (it == current.groups_by_name.cend()) {
 		return;
 	}
 
@@ -1479,16 +2543,18 @@ void Config::delete_group(const std::string &name) {
 	network_.report(TAG, std::string{"Group "} + name + ": "
 		+ quoted_string(group_addresses_text(name)) + " (deleted)");
 
-	if (it->second.id < current_.groups_by_id.size()) {
-		current_.groups_by_id[it->second.id].reset();
+	if (it->second.id < current.groups_by_id.size()) {
+		current.groups_by_id[it->second.id].reset();
 	}
-	current_.groups_by_name.erase(it);
+	current.groups_by_name.erase(it);
 	network_.publish(FixedConfig::mqttTopic("/group/") + name, "", true);
 	publish_group_ids();
 	for (const auto &preset : preset_names()) {
 		network_.publish(FixedConfig::mqttTopic("/active/") + name + "/" + preset, "", true);
 	}
 
+	changes_.groups.insert(name);
+	addresses_generation_++;
 	dirty_config();
 }
 
@@ -1496,7 +2562,7 @@ std::string Config::get_switch_name(unsigned int switch_id) const {
 	std::lock_guard lock{data_mutex_};
 
 	if (switch_id < NUM_SWITCHES) {
-		return current_.switches[switch_id].name;
+		return current_->switches[switch_id].name;
 	} else {
 		return "";
 	}
@@ -1504,17 +2570,19 @@ std::string Config::get_switch_name(unsigned int switch_id) const {
 
 void Config::set_switch_name(unsigned int switch_id, const std::string &name) {
 	std::lock_guard lock{data_mutex_};
+	ConfigData &current = modify_config();
 
 	if (switch_id < NUM_SWITCHES) {
 		auto new_name = name.substr(0, MAX_SWITCH_NAME_LEN);
 
-		if (current_.switches[switch_id].name != new_name) {
+		if (current.switches[switch_id].name != new_name) {
 			network_.report(TAG, std::string{"Switch "}
 				+ std::to_string(switch_id) + " name: "
-				+ quoted_string(current_.switches[switch_id].name)
+				+ quoted_string(current.switches[switch_id].name)
 				+ " -> " + quoted_string(new_name));
 
-			current_.switches[switch_id].name = new_name;
+			current.switches[switch_id].name = new_name;
+			changes_.switches[switch_id] = true;
 			dirty_config();
 		}
 	}
@@ -1524,7 +2592,7 @@ std::string Config::get_switch_group(unsigned int switch_id) const {
 	std::lock_guard lock{data_mutex_};
 
 	if (switch_id < NUM_SWITCHES) {
-		return current_.switches[switch_id].group;
+		return current_->switches[switch_id].group;
 	} else {
 		return "";
 	}
@@ -1532,19 +2600,21 @@ std::string Config::get_switch_group(unsigned int switch_id) const {
 
 void Config::set_switch_group(unsigned int switch_id, const std::string &group) {
 	std::lock_guard lock{data_mutex_};
+	ConfigData &current = modify_config();
 
 	if (switch_id < NUM_SWITCHES) {
 		if (!group.empty() && !valid_group_name(group, true)) {
 			return;
 		}
 
-		if (current_.switches[switch_id].group != group) {
+		if (current.switches[switch_id].group != group) {
 			network_.report(TAG, std::string{"Switch "}
 				+ std::to_string(switch_id) + " group: "
-				+ quoted_string(current_.switches[switch_id].group)
+				+ quoted_string(current.switches[switch_id].group)
 				+ " -> " + quoted_string(group));
 
-			current_.switches[switch_id].group = group;
+			current.switches[switch_id].group = group;
+			changes_.switches[switch_id] = true;
 			dirty_config();
 		}
 	}
@@ -1554,7 +2624,7 @@ std::string Config::get_switch_preset(unsigned int switch_id) const {
 	std::lock_guard lock{data_mutex_};
 
 	if (switch_id < NUM_SWITCHES) {
-		return current_.switches[switch_id].preset;
+		return current_->switches[switch_id].preset;
 	} else {
 		return "";
 	}
@@ -1562,19 +2632,21 @@ std::string Config::get_switch_preset(unsigned int switch_id) const {
 
 void Config::set_switch_preset(unsigned int switch_id, const std::string &preset) {
 	std::lock_guard lock{data_mutex_};
+	ConfigData &current = modify_config();
 
 	if (switch_id < NUM_SWITCHES) {
 		if (!preset.empty() && !valid_preset_name(preset, true)) {
 			return;
 		}
 
-		if (current_.switches[switch_id].preset != preset) {
+		if (current.switches[switch_id].preset != preset) {
 			network_.report(TAG, std::string{"Switch "}
 				+ std::to_string(switch_id) + " preset: "
-				+ quoted_string(current_.switches[switch_id].preset)
+				+ quoted_string(current.switches[switch_id].preset)
 				+ " -> " + quoted_string(preset));
 
-			current_.switches[switch_id].preset = preset;
+			current.switches[switch_id].preset = preset;
+			changes_.switches[switch_id] = true;
 			dirty_config();
 		}
 	}
@@ -1584,7 +2656,7 @@ std::vector<std::string> Config::get_button_groups(unsigned int button_id) const
 	std::lock_guard lock{data_mutex_};
 
 	if (button_id < NUM_BUTTONS) {
-		return current_.buttons[button_id].groups;
+		return current_->buttons[button_id].groups;
 	} else {
 		return {};
 	}
@@ -1594,7 +2666,7 @@ std::vector<std::string> Config::button_active_groups(unsigned int button_id) co
 	std::lock_guard lock{data_mutex_};
 
 	if (button_id < NUM_BUTTONS) {
-		return selector_group(current_.buttons[button_id].groups);
+		return selector_group(current_->buttons[button_id].groups);
 	} else {
 		return {};
 	}
@@ -1606,11 +2678,12 @@ void Config::set_button_groups(unsigned int button_id, const std::string &groups
 	}
 
 	std::lock_guard lock{data_mutex_};
+	ConfigData &current = modify_config();
 	std::istringstream input{groups};
 	std::string item;
 	std::vector<std::string> new_groups;
 
-	auto before = vector_text(current_.buttons[button_id].groups);
+	auto before = vector_text(current.buttons[button_id].groups);
 
 	while (std::getline(input, item, ',')) {
 		if (valid_group_name(item, true)) {
@@ -1618,16 +2691,19 @@ void Config::set_button_groups(unsigned int button_id, const std::string &groups
 		}
 	}
 
-	current_.buttons[button_id].groups = std::move(new_groups);
+	if (current.buttons[button_id].groups == new_groups) {
+		return;
+	}
 
-	auto after = vector_text(current_.buttons[button_id].groups);
+	current.buttons[button_id].groups = std::move(new_groups);
 
-	if (before != after) {
-		network_.report(TAG, std::string{"Button "}
-			+ std::to_string(button_id) + " groups: "
-			+ quoted_string(before) + " -> " + quoted_string(after));
-	}
+	auto after = vector_text(current.buttons[button_id].groups);
+
+	network_.report(TAG, std::string{"Button "}
+		+ std::to_string(button_id) + " groups: "
+		+ quoted_string(before) + " -> " + quoted_string(after));
 
+	changes_.buttons[button_id] = true;
 	dirty_config();
 }
 
@@ -1635,7 +2711,7 @@ std::string Config::get_button_preset(unsigned int button_id) const {
 	std::lock_guard lock{data_mutex_};
 
 	if (button_id < NUM_BUTTONS) {
-		return current_.buttons[button_id].preset;
+		return current_->buttons[button_id].preset;
 	} else {
 		return "";
 	}
@@ -1643,47 +2719,62 @@ std::string Config::get_button_preset(unsigned int button_id) const {
 
 void Config::set_button_preset(unsigned int button_id, const std::string &preset) {
 	std::lock_guard lock{data_mutex_};
+	ConfigData &current = modify_config();
 
 	if (button_id < NUM_BUTTONS) {
 		if (!preset.empty() && !valid_preset_name(preset, true)) {
 			return;
 		}
 
-		if (current_.buttons[button_id].preset != preset) {
+		if (current.buttons[button_id].preset != preset) {
 			network_.report(TAG, std::string{"Button "}
 				+ std::to_string(button_id) + " preset: "
-				+ quoted_string(current_.buttons[button_id].preset)
+				+ quoted_string(current.buttons[button_id].preset)
 				+ " -> " + quoted_string(preset));
 
-			current_.buttons[button_id].preset = preset;
+			current.buttons[button_id].preset = preset;
+			changes_.buttons[button_id] = true;
 			dirty_config();
 		}
 	}
 }
 
 DimmerConfig Config::get_dimmer(unsigned int dimmer_id) const {
-	std::lock_guard lock{data_mutex_};
-
 	if (dimmer_id < NUM_DIMMERS) {
-		return make_dimmer(current_.dimmers[dimmer_id].mode,
-			selector_group(current_.dimmers[dimmer_id].groups));
+		return get_dimmer(dimmer_id, dimmer_cache_[dimmer_id]);
 	} else {
 		return {
 			.mode = DimmerMode::INDIVIDUAL,
 			.addresses{},
 			.groups{},
-			.address_group{},
 			.group_addresses{},
 			.all = false,
 		};
 	}
 }
 
+DimmerConfig Config::get_dimmer(unsigned int dimmer_id, DimmerConfigCache &cache) const {
+	std::lock_guard lock{data_mutex_};
+	const auto mode = current_->dimmers[dimmer_id].mode;
+	const auto &groups = selector_group(current_->dimmers[dimmer_id].groups);
+
+	if (!cache.valid || cache.addresses_generation != addresses_generation_
+			|| cache.mode != mode || cache.groups != groups) {
+		cache.config = make_dimmer(mode, groups);
+		cache.groups = groups;
+		cache.mode = mode;
+		cache.addresses_generation = addresses_generation_;
+		cache.valid = true;
+	}
+
+	return cache.config;
+}
+
 std::vector<std::string> Config::dimmer_active_groups(unsigned int dimmer_id) const {
 	std::lock_guard lock{data_mutex_};
 
 	if (dimmer_id < NUM_DIMMERS) {
-		return selector_group(current_.dimmers[dimmer_id].groups);
+		return selector_group(current_->dimmers[dimmer_id].groups);
 	} else {
 		return {};
 	}
@@ -1711,17 +2802,14 @@ DimmerConfig Config::make_dimmer(DimmerMode mode,
 		.mode = mode,
 		.addresses{},
 		.groups{},
-		.address_group{},
 		.group_addresses{},
 		.all = false,
 	};
 
-	dimmer_config.address_group.fill(Dali::GROUP_NONE);
-
 	for (const auto &group : groups) {
 		if (group == BUILTIN_GROUP_ALL) {
 			dimmer_config.all = true;
-			dimmer_config.addresses = current_.lights;
+			dimmer_config.addresses = current_->lights;
 
 			if (dimmer_config.groups.any()) {
 				goto invalid;
@@ -1729,9 +2817,9 @@ DimmerConfig Config::make_dimmer(DimmerMode mode,
 		} else if (dimmer_config.all) {
 			goto invalid;
 		} else {
-			auto it = current_.groups_by_name.find(group);
+			auto it = current_->groups_by_name.find(group);
 
-			if (it == current_.groups_by_name.end()) {
+			if (it == current_->groups_by_name.end()) {
 				continue;
 			}
 
@@ -1739,20 +2827,16 @@ DimmerConfig Config::make_dimmer(DimmerMode mode,
 				continue;
 			}
 
-			dimmer_config.groups[it->second.id] = true;
-
-			for (unsigned int address = 0;
-					address < dimmer_config.address_group.size(); address++) {
-				if (current_.lights[address] && it->second.addresses[address]) {
-					if (dimmer_config.address_group[address] != Dali::GROUP_NONE) {
-						goto invalid;
-					}
+			const auto group_addresses = current_->lights & it->second.addresses;
 
-					dimmer_config.addresses[address] = true;
-					dimmer_config.group_addresses[it->second.id][address] = true;
-					dimmer_config.address_group[address] = it->second.id;
-				}
+			/* Lights can only be dimmed as a member of one group */
+			if ((dimmer_config.addresses & group_addresses).any()) {
+				goto invalid;
 			}
+
+			dimmer_config.groups[it->second.id] = true;
+			dimmer_config.addresses |= group_addresses;
+			dimmer_config.group_addresses[it->second.id] |= group_addresses;
 		}
 	}
 
@@ -1763,7 +2847,6 @@ invalid:
 		.mode = DimmerMode::INDIVIDUAL,
 		.addresses{},
 		.groups{},
-		.address_group{},
 		.group_addresses{},
 		.all = false,
 	};
@@ -1780,7 +2863,7 @@ const std::vector<std::string>& Config::selector_group(
 	int option_id = selector_.read();
 
 	if (option_id < NUM_OPTIONS) {
-		return current_.selector_groups[option_id];
+		return current_->selector_groups[option_id];
 	}
 
 	return empty;
@@ -1790,7 +2873,7 @@ std::vector<std::string> Config::get_dimmer_groups(unsigned int dimmer_id) const
 	std::lock_guard lock{data_mutex_};
 
 	if (dimmer_id < NUM_DIMMERS) {
-		return current_.dimmers[dimmer_id].groups;
+		return current_->dimmers[dimmer_id].groups;
 	} else {
 		return {};
 	}
@@ -1802,11 +2885,12 @@ void Config::set_dimmer_groups(unsigned int dimmer_id, const std::string &groups
 	}
 
 	std::lock_guard lock{data_mutex_};
+	ConfigData &current = modify_config();
 	std::istringstream input{groups};
 	std::string item;
 	std::vector<std::string> new_groups;
 
-	auto before = vector_text(current_.dimmers[dimmer_id].groups);
+	auto before = vector_text(current.dimmers[dimmer_id].groups);
 
 	while (std::getline(input, item, ',')) {
 		if (valid_group_name(item, true)) {
@@ -1814,16 +2898,19 @@ void Config::set_dimmer_groups(unsigned int dimmer_id, const std::string &groups
 		}
 	}
 
-	current_.dimmers[dimmer_id].groups = std::move(new_groups);
+	if (current.dimmers[dimmer_id].groups == new_groups) {
+		return;
+	}
 
-	auto after = vector_text(current_.dimmers[dimmer_id].groups);
+	current.dimmers[dimmer_id].groups = std::move(new_groups);
 
-	if (before != after) {
-		network_.report(TAG, std::string{"Dimmer "}
-			+ std::to_string(dimmer_id) + " groups: "
-			+ quoted_string(before) + " -> " + quoted_string(after));
-	}
+	auto after = vector_text(current.dimmers[dimmer_id].groups);
 
+	network_.report(TAG, std::string{"Dimmer "}
+		+ std::to_string(dimmer_id) + " groups: "
+		+ quoted_string(before) + " -> " + quoted_string(after));
+
+	changes_.dimmers[dimmer_id] = true;
 	dirty_config();
 }
 
@@ -1831,7 +2918,7 @@ int Config::get_dimmer_encoder_steps(unsigned int dimmer_id) const {
 	std::lock_guard lock{data_mutex_};
 
 	if (dimmer_id < NUM_DIMMERS) {
-		return current_.dimmers[dimmer_id].encoder_steps;
+		return current_->dimmers[dimmer_id].encoder_steps;
 	} else {
 		return 0;
 	}
@@ -1843,15 +2930,17 @@ void Config::set_dimmer_encoder_steps(unsigned int dimmer_id, int encoder_steps)
 	}
 
 	std::lock_guard lock{data_mutex_};
+	ConfigData &current = modify_config();
 
 	if (dimmer_id < NUM_DIMMERS) {
-		if (current_.dimmers[dimmer_id].encoder_steps != encoder_steps) {
+		if (current.dimmers[dimmer_id].encoder_steps != encoder_steps) {
 			network_.report(TAG, std::string{"Dimmer "}
 				+ std::to_string(dimmer_id) + " encoder steps: "
-				+ std::to_string(current_.dimmers[dimmer_id].encoder_steps)
+				+ std::to_string(current.dimmers[dimmer_id].encoder_steps)
 				+ " -> " + std::to_string(encoder_steps));
 
-			current_.dimmers[dimmer_id].encoder_steps = encoder_steps;
+			current.dimmers[dimmer_id].encoder_steps = encoder_steps;
+			changes_.dimmers[dimmer_id] = true;
 			dirty_config();
 		}
 	}
@@ -1861,7 +2950,7 @@ unsigned int Config::get_dimmer_level_steps(unsigned int dimmer_id) const {
 	std::lock_guard lock{data_mutex_};
 
 	if (dimmer_id < NUM_DIMMERS) {
-		return current_.dimmers[dimmer_id].level_steps;
+		return current_->dimmers[dimmer_id].level_steps;
 	} else {
 		return 0;
 	}
@@ -1873,15 +2962,17 @@ void Config::set_dimmer_level_steps(unsigned int dimmer_id, unsigned int level_s
 	}
 
 	std::lock_guard lock{data_mutex_};
+	ConfigData &current = modify_config();
 
 	if (dimmer_id < NUM_DIMMERS) {
-		if (current_.dimmers[dimmer_id].level_steps != level_steps) {
+		if (current.dimmers[dimmer_id].level_steps != level_steps) {
 			network_.report(TAG, std::string{"Dimmer "}
 				+ std::to_string(dimmer_id) + " level steps: "
-				+ std::to_string(current_.dimmers[dimmer_id].level_steps)
+				+ std::to_string(current.dimmers[dimmer_id].level_steps)
 				+ " -> " + std::to_string(level_steps));
 
-			current_.dimmers[dimmer_id].level_steps = level_steps;
+			current.dimmers[dimmer_id].level_steps = level_steps;
+			changes_.dimmers[dimmer_id] = true;
 			dirty_config();
 		}
 	}
@@ -1891,7 +2982,7 @@ DimmerMode Config::get_dimmer_mode(unsigned int dimmer_id) const {
 	std::lock_guard lock{data_mutex_};
 
 	if (dimmer_id < NUM_DIMMERS) {
-		return current_.dimmers[dimmer_id].mode;
+		return current_->dimmers[dimmer_id].mode;
 	} else {
 		return DimmerMode::INDIVIDUAL;
 	}
@@ -1899,18 +2990,20 @@ DimmerMode Config::get_dimmer_mode(unsigned int dimmer_id) const {
 
 void Config::set_dimmer_mode(unsigned int dimmer_id, const std::string &mode) {
 	std::lock_guard lock{data_mutex_};
+	ConfigData &current = modify_config();
 
 	if (dimmer_id < NUM_DIMMERS) {
 		DimmerMode new_dimmer_mode;
 
 		if (Dimmers::mode_value(mode, new_dimmer_mode)
-				&& current_.dimmers[dimmer_id].mode != new_dimmer_mode) {
+				&& current.dimmers[dimmer_id].mode != new_dimmer_mode) {
 			network_.report(TAG, std::string{"Dimmer "}
 				+ std::to_string(dimmer_id) + " mode: "
-				+ quoted_string(Dimmers::mode_text(current_.dimmers[dimmer_id].mode))
+				+ quoted_string(Dimmers::mode_text(current.dimmers[dimmer_id].mode))
 				+ " -> " + quoted_string(Dimmers::mode_text(new_dimmer_mode)));
 
-			current_.dimmers[dimmer_id].mode = new_dimmer_mode;
+			current.dimmers[dimmer_id].mode = new_dimmer_mode;
+			changes_.dimmers[dimmer_id] = true;
 			dirty_config();
 		}
 	}
@@ -1920,7 +3013,7 @@ std::vector<std::string> Config::get_selector_groups(unsigned int option_id) con
 	std::lock_guard lock{data_mutex_};
 
 	if (option_id < NUM_OPTIONS) {
-		return current_.selector_groups[option_id];
+		return current_->selector_groups[option_id];
 	} else {
 		return {};
 	}
@@ -1932,11 +3025,12 @@ void Config::set_selector_groups(unsigned int option_id, const std::string &grou
 	}
 
 	std::lock_guard lock{data_mutex_};
+	ConfigData &current = modify_config();
 	std::istringstream input{groups};
 	std::string item;
 	std::vector<std::string> new_groups;
 
-	auto before = vector_text(current_.selector_groups[option_id]);
+	auto before = vector_text(current.selector_groups[option_id]);
 
 	while (std::getline(input, item, ',')) {
 		if (valid_group_name(item, true)) {
@@ -1944,16 +3038,19 @@ void Config::set_selector_groups(unsigned int option_id, const std::string &grou
 		}
 	}
 
-	current_.selector_groups[option_id] = std::move(new_groups);
+	if (current.selector_groups[option_id] == new_groups) {
+		return;
+	}
 
-	auto after = vector_text(current_.selector_groups[option_id]);
+	current.selector_groups[option_id] = std::move(new_groups);
 
-	if (before != after) {
-		network_.report(TAG, std::string{"Selector option "}
-			+ std::to_string(option_id) + " groups: "
-			+ quoted_string(before) + " -> " + quoted_string(after));
-	}
+	auto after = vector_text(current.selector_groups[option_id]);
+
+	network_.report(TAG, std::string{"Selector option "}
+		+ std::to_string(option_id) + " groups: "
+		+ quoted_string(before) + " -> " + quoted_string(after));
 
+	changes_.selectors[option_id] = true;
 	dirty_config();
 }
 
@@ -1966,7 +3063,7 @@ std::vector<std::string> Config::preset_names() const {
 
 	std::unique_lock lock{data_mutex_};
 
-	for (const auto &preset : current_.presets) {
+	for (const auto &preset : current_->presets) {
 		presets.emplace_back(preset.first);
 	}
 
@@ -1978,15 +3075,15 @@ std::vector<std::string> Config::preset_names() const {
 }
 
 bool Config::get_preset(const std::string &name,
-		std::array<Dali::level_fast_t,Dali::num_addresses> &levels) const {
+		std::array<Dali::level_fast_t,Dali::num_lights> &levels) const {
 	std::lock_guard lock{data_mutex_};
 
 	if (name == BUILTIN_PRESET_OFF) {
 		levels.fill(0);
 	} else {
-		const auto it = current_.presets.find(name);
+		const auto it = current_->presets.find(name);
 
-		if (it == current_.presets.cend()) {
+		if (it == current_->presets.cend()) {
 			return false;
 		}
 
@@ -1999,11 +3096,11 @@ bool Config::get_preset(const std::string &name,
 bool Config::get_ordered_preset(unsigned long long idx, std::string &name) const {
 	std::lock_guard lock{data_mutex_};
 
-	if (current_.ordered.empty()) {
+	if (current_->ordered.empty()) {
 		return false;
 	}
 
-	name = current_.ordered[idx % current_.ordered.size()];
+	name = current_->ordered[idx % current_->ordered.size()];
 	return true;
 }
 
@@ -2019,25 +3116,29 @@ void Config::set_preset(const std::string &name, const std::string &light_ids, l
 	}
 
 	std::lock_guard lock{data_mutex_};
+	ConfigData &current = modify_config();
 	bool idle_only;
 	auto lights = parse_light_ids(light_ids, idle_only);
-	auto it = current_.presets.find(name);
+	auto it = current.presets.find(name);
+	bool created = false;
 
-	if (it == current_.presets.cend()) {
-		if (current_.presets.size() == MAX_PRESETS) {
+	if (it == current.presets.cend()) {
+		if (current.presets.size() == MAX_PRESETS) {
 			return;
 		}
 
-		std::array<Dali::level_fast_t,Dali::num_addresses> levels;
+		std::array<Dali::level_fast_t,Dali::num_lights> levels;
 
 		levels.fill(Dali::LEVEL_NO_CHANGE);
-		it = current_.presets.emplace(name, std::move(levels)).first;
+		it = current.presets.emplace(name, std::move(levels)).first;
+		created = true;
 	}
 
-	auto before = preset_levels_text(it->second, &current_.lights);
+	const auto previous = it->second;
+	auto before = preset_levels_text(it->second, &current.lights);
 
-	for (unsigned int i = 0; i < current_.lights.size(); i++) {
-		if (current_.lights[i]) {
+	for (unsigned int i = 0; i < current.lights.size(); i++) {
+		if (current.lights[i]) {
 			if (lights[i]) {
 				it->second[i] = level;
 			}
@@ -2046,7 +3147,7 @@ void Config::set_preset(const std::string &name, const std::string &light_ids, l
 		}
 	}
 
-	auto after = preset_levels_text(it->second, &current_.lights);
+	auto after = preset_levels_text(it->second, &current.lights);
 
 	if (before != after) {
 		publish_preset(it->first, it->second);
@@ -2060,16 +3161,22 @@ void Config::set_preset(const std::string &name, const std::string &light_ids, l
 			+ quoted_string(before) + " -> " + quoted_string(after));
 	}
 
+	if (!created && it->second == previous) {
+		return;
+	}
+
+	changes_.presets.insert(name);
 	dirty_config();
 }
 
 void Config::set_ordered_presets(const std::string &names) {
 	std::lock_guard lock{data_mutex_};
+	ConfigData &current = modify_config();
 	std::istringstream input{names};
 	std::string item;
 	std::vector<std::string> new_ordered;
 
-	auto before = vector_text(current_.ordered);
+	auto before = vector_text(current.ordered);
 
 	while (std::getline(input, item, ',')) {
 		if (valid_preset_name(item, true)) {
@@ -2077,15 +3184,18 @@ void Config::set_ordered_presets(const std::string &names) {
 		}
 	}
 
-	current_.ordered = std::move(new_ordered);
+	if (current.ordered == new_ordered) {
+		return;
+	}
 
-	auto after = vector_text(current_.ordered);
+	current.ordered = std::move(new_ordered);
 
-	if (before != after) {
-		network_.report(TAG, std::string{"Preset order: "}
-			+ quoted_string(before) + " -> " + quoted_string(after));
-	}
+	auto after = vector_text(current.ordered);
+
+	network_.report(TAG, std::string{"Preset order: "}
+		+ quoted_string(before) + " -> " + quoted_string(after));
 
+	changes_.order = true;
 	dirty_config();
 }
 
@@ -2095,22 +3205,27 @@ void Config::set_preset(const std::string &name, std::string levels) {
 	}
 
 	std::lock_guard lock{data_mutex_};
-	auto it = current_.presets.find(name);
+	ConfigData &current = modify_config();
+	auto it = current.presets.find(name);
 	std::string before;
+	bool created = false;
 
-	if (it == current_.presets.cend()) {
-		if (current_.presets.size() == MAX_PRESETS) {
+	if (it == current.presets.cend()) {
+		if (current.presets.size() == MAX_PRESETS) {
 			return;
 		}
 
-		std::array<Dali::level_fast_t,Dali::num_addresses> empty_levels;
+		std::array<Dali::level_fast_t,Dali::num_lights> empty_levels;
 
 		empty_levels.fill(Dali::LEVEL_NO_CHANGE);
-		it = current_.presets.emplace(name, std::move(empty_levels)).first;
+		it = current.presets.emplace(name, std::move(empty_levels)).first;
+		created = true;
 	} else {
-		before = preset_levels_text(it->second, &current_.lights);
+		before = preset_levels_text(it->second, &current.lights);
 	}
 
+	const auto previous = it->second;
+
 	unsigned int light_id = 0;
 
 	it->second.fill(Dali::LEVEL_NO_CHANGE);
@@ -2139,49 +3254,125 @@ void Config::set_preset(const std::string &name, std::string levels) {
 		it->second[light_id++] = level;
 	}
 
-	auto after = preset_levels_text(it->second, &current_.lights);
+	auto after = preset_levels_text(it->second, &current.lights);
 
 	if (before != after) {
 		network_.report(TAG, std::string{"Preset "} + name + ": "
 			+ quoted_string(before) + " -> " + quoted_string(after));
 	}
 
+	if (!created && it->second == previous) {
+		return;
+	}
+
+	changes_.presets.insert(name);
 	dirty_config();
 }
 
 void Config::delete_preset(const std::string &name) {
 	std::lock_guard lock{data_mutex_};
-	const auto it = current_.presets.find(name);
+	ConfigData &current = modify_config();
+	const auto it = current.presets.find(name);
 
-	if (it == current_.presets.cend()) {
+	if (it == current.presets.cend()) {
 		return;
 	}
 
 	network_.report(TAG, std::string{"Preset "} + name + ": "
-		+ quoted_string(preset_levels_text(it->second, &current_.lights))
+		+ quoted_string(preset_levels_text(it->second, &current.lights))
 		+ " (deleted)");
 
-	current_.presets.erase(it);
+	current.presets.erase(it);
 
 	network_.publish(FixedConfig::mqttTopic("/preset/") + name + "/levels", "", true);
 	for (const auto &group : group_names()) {
 		network_.publish(FixedConfig::mqttTopic("/active/") + group + "/" + name, "", true);
 	}
 
+	changes_.presets.insert(name);
 	dirty_config();
 }
 
-Dali::addresses_t Config::parse_light_ids(const std::string &light_ids,
+bool LightIdsCache::get(const std::string &light_ids, uint32_t generation,
+		Dali::lights_t &lights, bool &idle_only) {
+	if (generation != generation_) {
+		clear(generation);
+	}
+
+	auto it = index_.find(light_ids);
+
+	if (it == index_.end()) {
+		stats_.miss_count++;
+		return false;
+	}
+
+	entries_.splice(entries_.begin(), entries_, it->second);
+	lights = it->second->lights;
+	idle_only = it->second->idle_only;
+	stats_.hit_count++;
+	return true;
+}
+
+void LightIdsCache::put(const std::string &light_ids, uint32_t generation,
+		const Dali::lights_t &lights, bool idle_only) {
+	if (generation != generation_) {
+		clear(generation);
+	}
+
+	if (index_.find(light_ids) != index_.end()) {
+		return;
+	}
+
+	if (entries_.size() >= MAX_ENTRIES) {
+		index_.erase(entries_.back().light_ids);
+		entries_.pop_back();
+		stats_.evict_count++;
+	}
+
+	entries_.push_front({light_ids, lights, idle_only});
+	index_.emplace(entries_.front().light_ids, entries_.begin());
+}
+
+void LightIdsCache::clear(uint32_t generation) {
+	index_.clear();
+	entries_.clear();
+	generation_ = generation;
+}
+
+LightIdsCacheStats LightIdsCache::get_stats() {
+	LightIdsCacheStats stats = stats_;
+
+	stats_ = {};
+	return stats;
+}
+
+LightIdsCacheStats Config::light_ids_cache_stats() const {
+	std::lock_guard lock{data_mutex_};
+
+	return light_ids_cache_.get_stats();
+}
+
+Dali::lights_t Config::parse_light_ids(const std::string &light_ids,
 		bool &idle_only) const {
+	return parse_light_ids(light_ids, idle_only, light_ids_cache_);
+}
+
+Dali::lights_t Config::parse_light_ids(const std::string &light_ids,
+		bool &idle_only, LightIdsCache &cache) const {
 	std::lock_guard lock{data_mutex_};
+	Dali::lights_t lights;
+
+	if (cache.get(light_ids, addresses_generation_, lights, idle_only)) {
+		return lights;
+	}
+
 	std::istringstream input{light_ids};
 	std::string item;
-	Dali::addresses_t lights;
 
 	idle_only = false;
 
 	while (std::getline(input, item, ',')) {
-		auto group = current_.groups_by_name.find(item);
+		auto group = current_->groups_by_name.find(item);
 		auto dash_idx = item.find('-');
 		unsigned long begin, end;
 
@@ -2191,7 +3382,7 @@ Dali::addresses_t Config::parse_light_ids(const std::string &light_ids,
 		} else if (item == BUILTIN_GROUP_IDLE) {
 			idle_only = true;
 			continue;
-		} else if (group != current_.groups_by_name.end()) {
+		} else if (group != current_->groups_by_name.end()) {
 			for (unsigned int i = 0; i < group->second.addresses.size(); i++) {
 				if (group->second.addresses[i]) {
 					lights[i] = true;
@@ -2223,11 +3414,11 @@ Dali::addresses_t Config::parse_light_ids(const std::string &light_ids,
 			continue;
 		}
 
-		if (begin >= Dali::num_addresses) {
+		if (begin >= Dali::num_lights) {
 			continue;
 		}
 
-		if (end >= Dali::num_addresses) {
+		if (end >= Dali::num_lights) {
 			continue;
 		}
 
@@ -2236,19 +3427,20 @@ Dali::addresses_t Config::parse_light_ids(const std::string &light_ids,
 		}
 	}
 
+	cache.put(light_ids, addresses_generation_, lights, idle_only);
 	return lights;
 }
 
-Dali::addresses_t Config::parse_groups(const std::vector<std::string> &groups) const {
+Dali::lights_t Config::parse_groups(const std::vector<std::string> &groups) const {
 	std::lock_guard lock{data_mutex_};
-	Dali::addresses_t lights;
+	Dali::lights_t lights;
 
 	for (const auto &item : groups) {
-		auto group = current_.groups_by_name.find(item);
+		auto group = current_->groups_by_name.find(item);
 
 		if (item == BUILTIN_GROUP_ALL) {
 			lights.set();
-		} else if (group != current_.groups_by_name.end()) {
+		} else if (group != current_->groups_by_name.end()) {
 			for (unsigned int i = 0; i < group->second.addresses.size(); i++) {
 				if (group->second.addresses[i]) {
 					lights[i] = true;
@@ -2260,7 +3452,7 @@ Dali::addresses_t Config::parse_groups(const std::vector<std::string> &groups) c
 	return lights;
 }
 
-std::string Config::lights_text(const Dali::addresses_t &lights) const {
+std::string Config::lights_text(const Dali::lights_t &lights) const {
 	std::lock_guard lock{data_mutex_};
 	std::vector<std::string> light_texts;
 	std::string list = "";
@@ -2269,8 +3461,8 @@ std::string Config::lights_text(const Dali::addresses_t &lights) const {
 	unsigned int begin = INT_MAX;
 	unsigned int previous = INT_MAX;
 
-	for (unsigned int i = 0; i < current_.lights.size(); i++) {
-		if (current_.lights[i]) {
+	for (unsigned int i = 0; i < current_->lights.size(); i++) {
+		if (current_->lights[i]) {
 			total++;
 		} else {
 			continue;
@@ -24,14 +24,23 @@
 #include <CBOR_streams.h>
 
 #include <array>
+#include <atomic>
+#include <bitset>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
 #include "buttons.h"
+#include "config_snapshot.h"
 #include "dali.h"
 #include "dimmers.h"
+#include "profiled_mutex.h"
+#include "psram_allocator.h"
 #include "selector.h"
 #include "switches.h"
 
@@ -44,6 +53,7 @@ static const std::string RESERVED_PRESET_ORDER = "order";
 
 namespace cbor = qindesign::cbor;
 
+class Benchmark;
 class Network;
 
 struct ConfigSwitchData {
@@ -90,7 +100,7 @@ struct ConfigDimmerData {
 
 struct ConfigGroupData {
 	Dali::group_fast_t id;
-	Dali::addresses_t addresses;
+	Dali::lights_t addresses;
 
 	bool operator==(const ConfigGroupData &other) const {
 		return this->id == other.id
@@ -100,15 +110,19 @@ struct ConfigGroupData {
 	inline bool operator!=(const ConfigGroupData &other) const { return !(*this == other); }
 };
 
+template <typename T>
+using ConfigMap = std::unordered_map<std::string,T,std::hash<std::string>,
+	std::equal_to<std::string>,PsramAllocator<std::pair<const std::string,T>>>;
+
 struct ConfigData {
-	Dali::addresses_t lights;
+	Dali::lights_t lights;
 	std::array<ConfigDimmerData,NUM_DIMMERS> dimmers;
 	std::array<ConfigSwitchData,NUM_SWITCHES> switches;
 	std::array<ConfigButtonData,NUM_BUTTONS> buttons;
 	std::array<std::vector<std::string>,NUM_OPTIONS> selector_groups;
-	std::unordered_map<std::string,ConfigGroupData> groups_by_name;
-	std::array<Dali::addresses_t,Dali::num_groups> groups_by_id;
-	std::unordered_map<std::string,std::array<Dali::level_fast_t,Dali::num_addresses>> presets;
+	ConfigMap<ConfigGroupData> groups_by_name;
+	std::array<Dali::lights_t,Dali::num_groups> groups_by_id;
+	ConfigMap<std::array<Dali::level_fast_t,Dali::num_lights>> presets;
 	std::vector<std::string> ordered;
 
 	void assign_group_ids();
@@ -128,21 +142,59 @@ struct ConfigData {
 	inline bool operator!=(const ConfigData &other) const { return !(*this == other); }
 };
 
+/**
+ * Items of the config that have changed since it was last saved, so that only
+ * those items need to be appended to the journal.
+ */
+struct ConfigChanges {
+	bool lights{false};
+	std::set<std::string> groups; /**< Changed or deleted groups */
+	std::bitset<NUM_SWITCHES> switches;
+	std::bitset<NUM_BUTTONS> buttons;
+	std::bitset<NUM_DIMMERS> dimmers;
+	std::bitset<NUM_OPTIONS> selectors;
+	std::set<std::string> presets; /**< Changed or deleted presets */
+	bool order{false};
+};
+
+/**
+ * The config is stored as a snapshot of the whole config followed by a
+ * journal of records that each replace one item in the snapshot. The journal
+ * starts with the CRC and size of the config file that it applies to, so that
+ * an old journal left behind when the next snapshot is written is ignored
+ * instead of reverting the newer items in the snapshot.
+ */
 class ConfigFile {
 public:
 	explicit ConfigFile(Network &network);
 
+	void benchmark(Benchmark &benchmark, const ConfigData &data);
+
 	bool read_config(ConfigData &data);
 	bool write_config(const ConfigData &data);
+	bool journal_full() const;
+	bool journal_empty() const;
+	bool append_journal(const std::vector<uint8_t> &records);
+	void export_config();
+	void export_config_messages(size_t count);
+
+	static std::vector<uint8_t> journal_records(const ConfigData &data,
+		const ConfigChanges &changes);
 
 private:
 	static constexpr const char *TAG = "ConfigFile";
+	static constexpr size_t MAX_JOURNAL_SIZE = 8192;
+	static constexpr size_t EXPORT_HEADER_SIZE = 8;
+	static constexpr size_t EXPORT_CHUNK_SIZE = 384;
 
 	bool read_config(const std::string &filename, bool load);
 	bool read_config(cbor::Reader &reader);
-	bool read_config_lights(cbor::Reader &reader, Dali::addresses_t &lights);
+	bool read_binary_config();
+	bool read_journal();
+	bool read_journal_record(cbor::Reader &reader, ConfigSnapshot::Source &base);
+	bool read_config_lights(cbor::Reader &reader, Dali::lights_t &lights);
 	bool read_config_groups(cbor::Reader &reader);
-	bool read_config_group(cbor::Reader &reader);
+	bool read_config_group(cbor::Reader &reader, bool replace = false);
 	bool read_config_switches(cbor::Reader &reader);
 	bool read_config_switch(cbor::Reader &reader, unsigned int switch_id);
 	bool read_config_buttons(cbor::Reader &reader);
@@ -155,54 +207,134 @@ private:
 	bool read_config_selector(cbor::Reader &reader, unsigned int option_id);
 	bool read_config_selector_groups(cbor::Reader &reader, unsigned int option_id);
 	bool read_config_presets(cbor::Reader &reader);
-	bool read_config_preset(cbor::Reader &reader);
-	bool read_config_preset_levels(cbor::Reader &reader, std::array<Dali::level_fast_t,Dali::num_addresses> &levels);
+	bool read_config_preset(cbor::Reader &reader, bool replace = false);
+	bool read_config_preset_levels(cbor::Reader &reader, std::array<Dali::level_fast_t,Dali::num_lights> &levels);
 	bool read_config_order(cbor::Reader &reader);
 
-	void write_config(cbor::Writer &writer) const;
-	bool write_config(const std::string &filename) const;
+	static void write_config_lights(cbor::Writer &writer, const Dali::lights_t &lights);
+	static void write_config_group(cbor::Writer &writer, const std::string &name,
+		const ConfigGroupData &group);
+	static void write_config_switch(cbor::Writer &writer, const ConfigSwitchData &data);
+	static void write_config_button(cbor::Writer &writer, const ConfigButtonData &data);
+	static void write_config_dimmer(cbor::Writer &writer, const ConfigDimmerData &data);
+	static void write_config_selector(cbor::Writer &writer, const std::vector<std::string> &groups);
+	static void write_config_preset(cbor::Writer &writer, const std::string &name,
+		const std::array<Dali::level_fast_t,Dali::num_lights> &levels);
+	static void write_config_order(cbor::Writer &writer, const std::vector<std::string> &ordered);
+
+	void write_config(cbor::Writer &writer, const ConfigData &data) const;
+	std::vector<uint8_t> encode(const ConfigData &data) const;
+	bool decode(const std::vector<uint8_t> &buffer);
+	bool write_config(const std::string &filename, const std::vector<uint8_t> &buffer) const;
+	bool verify_config(const std::string &filename, const std::vector<uint8_t> &buffer) const;
+	bool write_binary_config(const ConfigData &data, const ConfigSnapshot::Source &source) const;
+	bool file_source(const std::string &filename, ConfigSnapshot::Source &source) const;
+	bool read_saved_source(ConfigSnapshot::Source &source) const;
+	bool write_saved_source(const ConfigSnapshot::Source &source) const;
+	bool write_snapshot(const ConfigData &data);
+	bool remove_journal();
 
 	Network &network_;
 	ConfigData data_;
+	ConfigSnapshot::Source source_; /**< Config file that the journal applies to */
+	size_t journal_size_{0};
+
+	bool exporting_{false};
+	uint32_t export_offset_{0}; /**< Position of the next message in the config file */
+	ConfigSnapshot::Source export_source_; /**< Config file being exported */
+	uint64_t export_start_us_{0};
+};
+
+class LightIdsCacheStats {
+public:
+	uint64_t hit_count{0}; /**< Light IDs found in the cache */
+	uint64_t miss_count{0}; /**< Light IDs that had to be parsed */
+	uint64_t evict_count{0}; /**< Entries removed to make space */
+};
+
+/**
+ * Least recently used cache of parsed light IDs, because switches and buttons
+ * resolve the same text every time they're used. Entries are only valid for
+ * the generation of group addresses that they were parsed with.
+ */
+class LightIdsCache {
+public:
+	bool get(const std::string &light_ids, uint32_t generation,
+		Dali::lights_t &lights, bool &idle_only);
+	void put(const std::string &light_ids, uint32_t generation,
+		const Dali::lights_t &lights, bool idle_only);
+	LightIdsCacheStats get_stats();
+
+private:
+	static constexpr size_t MAX_ENTRIES = 16;
+
+	struct Entry {
+		std::string light_ids;
+		Dali::lights_t lights;
+		bool idle_only;
+	};
+
+	void clear(uint32_t generation);
+
+	std::list<Entry> entries_; /**< Most recently used first */
+	std::unordered_map<std::string_view,std::list<Entry>::iterator> index_;
+	uint32_t generation_{0};
+	LightIdsCacheStats stats_;
 };
 
 struct DimmerConfig {
 	DimmerMode mode;
-	Dali::addresses_t addresses;
+	Dali::lights_t addresses;
 	Dali::groups_t groups;
-	std::array<Dali::group_t,Dali::num_addresses> address_group;
-	std::array<Dali::addresses_t,Dali::num_groups> group_addresses;
+	std::array<Dali::lights_t,Dali::num_groups> group_addresses;
 	bool all;
 };
 
+/**
+ * Dimmer configuration from the last call to get_dimmer(), which is only
+ * rebuilt if the dimmer's mode or groups (including the selected groups)
+ * have changed or the group addresses have been modified.
+ */
+struct DimmerConfigCache {
+	bool valid{false};
+	uint32_t addresses_generation{0};
+	DimmerMode mode{DimmerMode::INDIVIDUAL};
+	std::vector<std::string> groups;
+	DimmerConfig config{};
+};
+
 class Config {
 public:
 	static constexpr int64_t LEVEL_NO_CHANGE = -1;
 	static constexpr size_t MAX_GROUPS = 16;
 
-	explicit Config(std::mutex &file_mutex, Network &network, const Selector &selector);
+	explicit Config(ProfiledMutex &file_mutex, Network &network, const Selector &selector);
 
 	static bool valid_group_name(const std::string &name, bool use = false);
 	static bool valid_preset_name(const std::string &name, bool use = false);
-	static std::string addresses_text(const Dali::addresses_t &addresses);
-	static std::string preset_levels_text(const std::array<Dali::level_fast_t,Dali::num_addresses> &levels,
-		const Dali::addresses_t *filter);
+	static std::string addresses_text(const Dali::lights_t &addresses);
+	static std::string preset_levels_text(const std::array<Dali::level_fast_t,Dali::num_lights> &levels,
+		const Dali::lights_t *filter);
 
 	void setup();
 	void loop();
 	void load_config();
 	void save_config();
-	void publish_config() const;
+	void publish_config(bool full = false);
+	void export_config();
+	void benchmark(Benchmark &benchmark) const;
+	uint32_t generation() const;
+	LightIdsCacheStats light_ids_cache_stats() const;
 
-	Dali::addresses_t get_addresses() const;
+	Dali::lights_t get_addresses() const;
 	void set_addresses(const std::string &addresses);
 	std::string addresses_text() const;
 
 	std::vector<std::string> group_names() const;
 	Dali::group_t get_group_id(const std::string &name) const;
-	Dali::addresses_t get_group_addresses(const std::string &name) const;
-	Dali::addresses_t get_group_addresses(Dali::group_t group) const;
-	std::array<Dali::addresses_t,Dali::num_groups> get_group_addresses() const;
+	Dali::lights_t get_group_addresses(const std::string &name) const;
+	Dali::lights_t get_group_addresses(Dali::group_t group) const;
+	std::array<Dali::lights_t,Dali::num_groups> get_group_addresses() const;
 	bool set_group_addresses(const std::string &name, const std::string &addresses);
 	std::string group_addresses_text(const std::string &name) const;
 	void delete_group(const std::string &name);
@@ -243,16 +375,16 @@ public:
 	void set_selector_groups(unsigned int option_id, const std::string &groups);
 
 	std::vector<std::string> preset_names() const;
-	bool get_preset(const std::string &name, std::array<Dali::level_fast_t,Dali::num_addresses> &levels) const;
+	bool get_preset(const std::string &name, std::array<Dali::level_fast_t,Dali::num_lights> &levels) const;
 	bool get_ordered_preset(unsigned long long idx, std::string &name) const;
 	void set_preset(const std::string &name, const std::string &light_ids, long level);
 	void set_preset(const std::string &name, std::string levels);
 	void set_ordered_presets(const std::string &names);
 	void delete_preset(const std::string &name);
 
-	Dali::addresses_t parse_light_ids(const std::string &light_ids, bool &idle_only) const;
-	Dali::addresses_t parse_groups(const std::vector<std::string> &groups) const;
-	std::string lights_text(const Dali::addresses_t &lights) const;
+	Dali::lights_t parse_light_ids(const std::string &light_ids, bool &idle_only) const;
+	Dali::lights_t parse_groups(const std::vector<std::string> &groups) const;
+	std::string lights_text(const Dali::lights_t &lights) const;
 
 private:
 	static constexpr const char *TAG = "Config";
@@ -262,25 +394,65 @@ private:
 	static constexpr size_t MAX_PRESET_NAME_LEN = 50;
 	static constexpr size_t MAX_SWITCH_NAME_LEN = 50;
 
+	/*
+	 * Publish the config gradually so that it doesn't fill up the message
+	 * queue, stopping while the queue is busy or MQTT is disconnected.
+	 */
+	static constexpr size_t PUBLISH_PER_LOOP = 10;
+	static constexpr size_t PUBLISH_MAX_QUEUED = 100;
+
+	enum class PublishStage {
+		ADDRESSES,
+		GROUPS,
+		GROUP_IDS,
+		SWITCHES,
+		BUTTONS,
+		DIMMERS,
+		SELECTORS,
+		PRESETS,
+		PRESET_ORDER,
+		DONE,
+	};
+
 	Config(const Config&) = delete;
 	Config& operator=(const Config&) = delete;
 
+	ConfigData& modify_config();
 	void dirty_config();
+	bool write_config(std::unique_lock<ProfiledRecursiveMutex> &data_lock);
 	bool set_addresses(const std::string &group, std::string addresses);
+	DimmerConfig get_dimmer(unsigned int dimmer_id, DimmerConfigCache &cache) const;
 	DimmerConfig make_dimmer(DimmerMode mode, const std::vector<std::string> &groups) const;
 	const std::vector<std::string>& selector_group(const std::vector<std::string> &groups) const;
+	Dali::lights_t parse_light_ids(const std::string &light_ids, bool &idle_only,
+		LightIdsCache &cache) const;
+	void publish_config_messages();
+	void export_config_messages();
+	bool publish_config_message(size_t &count);
+	void publish_config_entry(const std::string &topic, const std::string &payload, size_t &count);
+	std::string group_ids_text() const;
 	void publish_group_ids() const;
-	void publish_preset(const std::string &name, const std::array<Dali::level_fast_t,Dali::num_addresses> &levels) const;
+	void publish_preset(const std::string &name, const std::array<Dali::level_fast_t,Dali::num_lights> &levels) const;
 
 	Network &network_;
 	const Selector &selector_;
 
-	std::mutex &file_mutex_;
+	ProfiledMutex &file_mutex_;
 	ConfigFile file_;
-	ConfigData last_saved_;
 	bool saved_{false};
 
-	mutable std::recursive_mutex data_mutex_;
-	ConfigData current_;
+	mutable ProfiledRecursiveMutex data_mutex_{"config_data"};
+	std::shared_ptr<const ConfigData> current_; /**< Shared with the config being saved */
+	ConfigChanges changes_;
 	bool dirty_{false};
+	std::atomic<uint32_t> generation_{0};
+	uint32_t addresses_generation_{0};
+	mutable LightIdsCache light_ids_cache_;
+	mutable std::array<DimmerConfigCache,NUM_DIMMERS> dimmer_cache_;
+
+	PublishStage publish_stage_{PublishStage::DONE};
+	unsigned int publish_index_{0}; /**< Position in the current stage */
+	std::string publish_name_; /**< Last group/preset published in the current stage */
+	std::unordered_map<std::string,size_t> published_; /**< Hash of the last payload published for each topic */
+	uint32_t lost_generation_{0}; /**< Network lost message generation when published_ was last checked */
 };
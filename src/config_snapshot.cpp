@@ -0,0 +1,376 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config_snapshot.h"
+
+#include <Arduino.h>
+#include <esp_crc.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "config.h"
+#include "util.h"
+
+void ConfigSnapshot::Writer::u8(uint8_t value) {
+	records_.push_back(value);
+}
+
+void ConfigSnapshot::Writer::u16(std::vector<uint8_t> &buffer, uint16_t value) {
+	buffer.push_back(value & 0xFFU);
+	buffer.push_back((value >> 8) & 0xFFU);
+}
+
+void ConfigSnapshot::Writer::u16(uint16_t value) {
+	u16(records_, value);
+}
+
+void ConfigSnapshot::Writer::u32(uint32_t value) {
+	u16(value & 0xFFFFU);
+	u16((value >> 16) & 0xFFFFU);
+}
+
+void ConfigSnapshot::Writer::u64(uint64_t value) {
+	u32(value & 0xFFFFFFFFU);
+	u32((value >> 32) & 0xFFFFFFFFU);
+}
+
+uint16_t ConfigSnapshot::Writer::string_id(const std::string &value) {
+	auto result = string_ids_.emplace(value, string_count_);
+
+	if (result.second) {
+		/* Names are much shorter than this */
+		size_t length = std::min(value.length(), (size_t)UINT8_MAX);
+
+		strings_.push_back(length);
+		strings_.insert(strings_.end(), value.cbegin(), value.cbegin() + length);
+		string_count_++;
+	}
+
+	return result.first->second;
+}
+
+void ConfigSnapshot::Writer::string(const std::string &value) {
+	u16(string_id(value));
+}
+
+void ConfigSnapshot::Writer::list(const std::vector<std::string> &values) {
+	u16(list_size_);
+	u16(values.size());
+
+	for (const auto &value : values) {
+		u16(lists_, string_id(value));
+		list_size_++;
+	}
+}
+
+void ConfigSnapshot::Writer::lights(const Dali::lights_t &lights) {
+	for (unsigned int bus = 0; bus < NUM_DALI_BUSES; bus++) {
+		u64(Dali::bus_addresses(lights, bus).to_ullong());
+	}
+}
+
+uint8_t ConfigSnapshot::Reader::u8() {
+	const uint8_t *data = bytes(1);
+
+	return data ? data[0] : 0;
+}
+
+uint16_t ConfigSnapshot::Reader::u16() {
+	const uint8_t *data = bytes(2);
+
+	return data ? (data[0] | (data[1] << 8)) : 0;
+}
+
+uint32_t ConfigSnapshot::Reader::u32() {
+	uint32_t value = u16();
+
+	return value | ((uint32_t)u16() << 16);
+}
+
+uint64_t ConfigSnapshot::Reader::u64() {
+	uint64_t value = u32();
+
+	return value | ((uint64_t)u32() << 32);
+}
+
+Dali::lights_t ConfigSnapshot::Reader::lights() {
+	Dali::lights_t lights;
+
+	for (unsigned int bus = 0; bus < NUM_DALI_BUSES; bus++) {
+		lights |= Dali::bus_lights(Dali::addresses_t{u64()}, bus);
+	}
+
+	return lights;
+}
+
+const uint8_t *ConfigSnapshot::Reader::bytes(size_t length) {
+	if (!ok_ || length > size_ - pos_) {
+		ok_ = false;
+		return nullptr;
+	}
+
+	const uint8_t *data = &data_[pos_];
+
+	pos_ += length;
+	return data;
+}
+
+std::vector<uint8_t> ConfigSnapshot::encode(const ConfigData &data, const Source &source) {
+	Writer writer;
+
+	writer.lights(data.lights);
+
+	for (const auto &group : data.groups_by_name) {
+		writer.string(group.first);
+		writer.u8(group.second.id);
+		writer.u8(0);
+		writer.lights(group.second.addresses);
+	}
+
+	for (const auto &switch_data : data.switches) {
+		writer.string(switch_data.name);
+		writer.string(switch_data.group);
+		writer.string(switch_data.preset);
+	}
+
+	for (const auto &button : data.buttons) {
+		writer.list(button.groups);
+		writer.string(button.preset);
+	}
+
+	for (const auto &dimmer : data.dimmers) {
+		writer.list(dimmer.groups);
+		writer.u8(static_cast<int8_t>(dimmer.encoder_steps));
+		writer.u8(dimmer.level_steps);
+		writer.u8(dimmer.mode);
+		writer.u8(0);
+	}
+
+	for (const auto &groups : data.selector_groups) {
+		writer.list(groups);
+	}
+
+	writer.list(data.ordered);
+
+	for (const auto &preset : data.presets) {
+		writer.string(preset.first);
+
+		for (const auto level : preset.second) {
+			writer.u8(level);
+		}
+	}
+
+	std::vector<uint8_t> body;
+
+	body.reserve(writer.strings_.size() + writer.lists_.size() + writer.records_.size());
+	body.insert(body.end(), writer.strings_.cbegin(), writer.strings_.cend());
+	body.insert(body.end(), writer.lists_.cbegin(), writer.lists_.cend());
+	body.insert(body.end(), writer.records_.cbegin(), writer.records_.cend());
+
+	Writer header;
+
+	header.u32(MAGIC);
+	header.u16(VERSION);
+	header.u16(FixedConfig::isLocal() ? FLAG_LOCAL : 0);
+	header.u32(HEADER_SIZE + body.size());
+	header.u32(esp_crc32_le(0, body.data(), body.size()));
+	header.u32(source.crc);
+	header.u32(source.size);
+	header.u16(writer.string_count_);
+	header.u16(writer.list_size_);
+	header.u8(data.groups_by_name.size());
+	header.u8(NUM_DALI_BUSES);
+	header.u16(data.presets.size());
+
+	std::vector<uint8_t> buffer = std::move(header.records_);
+
+	buffer.insert(buffer.end(), body.cbegin(), body.cend());
+	return buffer;
+}
+
+bool ConfigSnapshot::decode(const std::vector<uint8_t> &buffer, ConfigData &data, Source &source) {
+	Reader header{buffer.data(), std::min(buffer.size(), HEADER_SIZE)};
+
+	if (header.u32() != MAGIC || header.u16() != VERSION) {
+		ESP_LOGE(TAG, "Unknown snapshot format");
+		return false;
+	}
+
+	uint16_t flags = header.u16();
+	uint32_t size = header.u32();
+	uint32_t crc = header.u32();
+
+	source.crc = header.u32();
+	source.size = header.u32();
+
+	uint16_t string_count = header.u16();
+	uint16_t list_size = header.u16();
+	uint8_t group_count = header.u8();
+	uint8_t buses = header.u8();
+	uint16_t preset_count = header.u16();
+
+	if (!header.ok() || size != buffer.size()
+			|| crc != esp_crc32_le(0, buffer.data() + HEADER_SIZE, size - HEADER_SIZE)) {
+		ESP_LOGE(TAG, "Invalid snapshot");
+		return false;
+	}
+
+	if (!!(flags & FLAG_LOCAL) != FixedConfig::isLocal()) {
+		ESP_LOGE(TAG, "Snapshot is for a different type of controller");
+		return false;
+	}
+
+	/* Older snapshots have 0 for the number of buses */
+	if (buses == 0) {
+		buses = 1;
+	}
+
+	if (buses != NUM_DALI_BUSES) {
+		ESP_LOGE(TAG, "Snapshot is for %u DALI buses", buses);
+		return false;
+	}
+
+	Reader reader{buffer.data() + HEADER_SIZE, size - HEADER_SIZE};
+	std::vector<std::string_view> strings;
+
+	strings.reserve(string_count);
+
+	for (unsigned int i = 0; i < string_count; i++) {
+		uint8_t length = reader.u8();
+		const char *text = reinterpret_cast<const char*>(reader.bytes(length));
+
+		if (!text) {
+			return false;
+		}
+
+		strings.emplace_back(text, length);
+	}
+
+	const uint8_t *lists = reader.bytes(list_size * 2);
+
+	if (!lists) {
+		return false;
+	}
+
+	auto read_string = [&] (std::string &value) {
+		uint16_t id = reader.u16();
+
+		if (id < strings.size()) {
+			value = strings[id];
+		} else {
+			reader.fail();
+		}
+	};
+
+	auto read_list = [&] (std::vector<std::string> &values) {
+		uint16_t start = reader.u16();
+		uint16_t length = reader.u16();
+
+		values.clear();
+
+		if ((size_t)start + length > list_size) {
+			reader.fail();
+			return;
+		}
+
+		values.reserve(length);
+
+		for (unsigned int i = start; i < start + length; i++) {
+			uint16_t id = lists[i * 2] | (lists[i * 2 + 1] << 8);
+
+			if (id >= strings.size()) {
+				reader.fail();
+				return;
+			}
+
+			values.emplace_back(strings[id]);
+		}
+	};
+
+	data = {};
+	data.lights = reader.lights();
+
+	for (unsigned int i = 0; i < group_count; i++) {
+		std::string name;
+		ConfigGroupData group;
+
+		read_string(name);
+		group.id = reader.u8();
+		reader.u8();
+		group.addresses = reader.lights();
+
+		if (Config::valid_group_name(name) && data.groups_by_name.size() < Config::MAX_GROUPS) {
+			data.groups_by_name.emplace(std::move(name), std::move(group));
+		}
+	}
+
+	for (auto &switch_data : data.switches) {
+		read_string(switch_data.name);
+		read_string(switch_data.group);
+		read_string(switch_data.preset);
+	}
+
+	for (auto &button : data.buttons) {
+		read_list(button.groups);
+		read_string(button.preset);
+	}
+
+	for (auto &dimmer : data.dimmers) {
+		read_list(dimmer.groups);
+		dimmer.encoder_steps = static_cast<int8_t>(reader.u8());
+		dimmer.level_steps = reader.u8();
+		dimmer.mode = reader.u8() == DimmerMode::GROUP ? DimmerMode::GROUP : DimmerMode::INDIVIDUAL;
+		reader.u8();
+	}
+
+	for (auto &groups : data.selector_groups) {
+		read_list(groups);
+	}
+
+	read_list(data.ordered);
+
+	for (unsigned int i = 0; i < preset_count; i++) {
+		std::string name;
+		std::array<Dali::level_fast_t,Dali::num_lights> levels;
+
+		read_string(name);
+
+		for (auto &level : levels) {
+			level = reader.u8();
+
+			if (level > Dali::MAX_LEVEL) {
+				level = Dali::LEVEL_NO_CHANGE;
+			}
+		}
+
+		if (Config::valid_preset_name(name)) {
+			data.presets.emplace(std::move(name), std::move(levels));
+		}
+	}
+
+	if (!reader.ok() || reader.position() != size - HEADER_SIZE) {
+		ESP_LOGE(TAG, "Invalid snapshot contents");
+		data = {};
+		return false;
+	}
+
+	data.assign_group_ids();
+	return true;
+}
@@ -0,0 +1,123 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "dali.h"
+
+struct ConfigData;
+
+/**
+ * Fixed layout binary copy of the config, which can be loaded without
+ * parsing CBOR. The CBOR file is still the primary format and the snapshot
+ * is only used if it was created from the current CBOR file.
+ *
+ * All values are little-endian:
+ * - Header (32 bytes)
+ * - String table: each string is a length (u8) followed by the text
+ * - List table: string IDs (u16) for lists of names
+ * - Lights: addresses (u64 for each bus)
+ * - Groups: name ID (u16), group ID (u8), reserved (u8), addresses (u64 for each bus)
+ * - Switches: name ID (u16), group ID (u16), preset ID (u16)
+ * - Buttons: groups list start (u16), groups list length (u16), preset ID (u16)
+ * - Dimmers: groups list start (u16), groups list length (u16),
+ *            encoder steps (s8), level steps (u8), mode (u8), reserved (u8)
+ * - Selector options: groups list start (u16), groups list length (u16)
+ * - Order: presets list start (u16), presets list length (u16)
+ * - Presets: name ID (u16), levels (64 × u8 for each bus)
+ */
+class ConfigSnapshot {
+public:
+	static constexpr uint32_t MAGIC = 0x47464344; /**< "DCFG" */
+	static constexpr uint16_t VERSION = 1;
+	static constexpr size_t HEADER_SIZE = 32;
+	static constexpr size_t MAX_SIZE = 64 * 1024;
+
+	/** Source of the snapshot, to check that it matches the CBOR file */
+	struct Source {
+		uint32_t crc{0};
+		uint32_t size{0};
+
+		bool operator==(const Source &other) const {
+			return this->crc == other.crc && this->size == other.size;
+		}
+
+		inline bool operator!=(const Source &other) const { return !(*this == other); }
+	};
+
+	static std::vector<uint8_t> encode(const ConfigData &data, const Source &source);
+	static bool decode(const std::vector<uint8_t> &buffer, ConfigData &data, Source &source);
+
+private:
+	static constexpr const char *TAG = "ConfigSnapshot";
+	static constexpr uint16_t FLAG_LOCAL = (1U << 0);
+
+	ConfigSnapshot() = delete;
+
+	class Writer {
+	public:
+		void u8(uint8_t value);
+		void u16(uint16_t value);
+		void u32(uint32_t value);
+		void u64(uint64_t value);
+		void string(const std::string &value);
+		void list(const std::vector<std::string> &values);
+		void lights(const Dali::lights_t &lights);
+
+		std::vector<uint8_t> strings_;
+		std::vector<uint8_t> lists_;
+		std::vector<uint8_t> records_;
+		uint16_t string_count_{0};
+		uint16_t list_size_{0};
+
+	private:
+		static void u16(std::vector<uint8_t> &buffer, uint16_t value);
+		uint16_t string_id(const std::string &value);
+
+		std::unordered_map<std::string,uint16_t> string_ids_;
+	};
+
+	class Reader {
+	public:
+		Reader(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+		inline bool ok() const { return ok_; }
+		inline void fail() { ok_ = false; }
+		inline size_t position() const { return pos_; }
+		uint8_t u8();
+		uint16_t u16();
+		uint32_t u32();
+		uint64_t u64();
+		Dali::lights_t lights();
+		const uint8_t *bytes(size_t length);
+
+	private:
+		const uint8_t *data_;
+		size_t size_;
+		size_t pos_{0};
+		bool ok_{true};
+	};
+};
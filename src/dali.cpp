@@ -20,22 +20,28 @@
 
 #include <Arduino.h>
 #include <esp32-hal.h>
+#include <driver/gpio.h>
 #include <driver/rmt.h>
 #include <hal/rmt_types.h>
 #include <esp_task_wdt.h>
 #include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
 
 #include <cassert>
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <memory>
 #include <mutex>
 
+#include "benchmark.h"
 #include "config.h"
+#include "latency.h"
 #include "local_lights.h"
 #include "util.h"
 
-/* github:espressif/arduino-esp32 cores/esp32/esp32-hal-rmt.h v2.0.17 */
-#if 0
+/* github:espressif/arduino-esp32 cores/esp32/esp32-hal-rmt.c v2.0.17 */
 struct rmt_obj_s {
 	bool allocated;
 	EventGroupHandle_t events;
@@ -49,24 +55,60 @@ struct rmt_obj_s {
 	bool rx_completed;
 	bool tx_not_rx;
 };
-#endif
 
-static constexpr unsigned int RX_GPIO = 40;
-static constexpr unsigned int TX_GPIO = 21;
+struct DaliBusConfig {
+	const char *name; /**< Thread and stats name */
+	gpio_num_t rx_gpio; /**< Receive pin */
+	gpio_num_t tx_gpio; /**< Transmit pin */
+};
+
+static constexpr std::array<DaliBusConfig,2> BUS_CONFIG{{
+	{"dali", (gpio_num_t)40, (gpio_num_t)21},
+	{"dali1", (gpio_num_t)5, (gpio_num_t)6},
+}};
+static_assert(NUM_DALI_BUSES <= BUS_CONFIG.size());
+
+std::array<Dali*,RMT_CHANNEL_MAX> Dali::tx_channels_{};
 
 #define DALI_LOG ESP_LOGD
 
-Dali::Dali(const Config &config, const LocalLights &lights)
-		: WakeupThread("dali", true), config_(config),
-		lights_(lights) {
+constexpr std::array<Dali::ByteSymbols,256> Dali::make_byte_symbols() {
+	std::array<ByteSymbols,256> table{};
+
+	for (unsigned int value = 0; value < table.size(); value++) {
+		for (unsigned int i = 0; i < table[value].size(); i++) {
+			table[value][i] = ((value >> (7 - i)) & 1) ? DALI_1 : DALI_0;
+		}
+	}
+
+	return table;
+}
+
+DRAM_ATTR constexpr const std::array<Dali::ByteSymbols,256> Dali::BYTE_SYMBOLS = Dali::make_byte_symbols();
+
+Dali::Dali(const Config &config, const LocalLights &lights, unsigned int bus)
+		: WakeupThread(BUS_CONFIG[bus].name, true), bus_(bus), name_(BUS_CONFIG[bus].name),
+		rx_gpio_(BUS_CONFIG[bus].rx_gpio), tx_gpio_(BUS_CONFIG[bus].tx_gpio),
+		config_(config), lights_(lights), state_(std::make_unique<LightsState>()),
+		trace_frames_(std::make_unique<std::array<DaliTraceFrame,TRACE_SIZE>>()) {
 	tx_levels_.fill(LEVEL_NO_CHANGE);
 	tx_group_levels_.fill(LEVEL_NO_CHANGE);
+	mismatch_levels_.fill(LEVEL_NO_CHANGE);
+	mismatch_actual_levels_.fill(LEVEL_NO_CHANGE);
+	tx_fade_times_.fill(FADE_TIME_UNKNOWN);
+	fade_times_.fill(FADE_TIME_UNKNOWN);
+	original_fade_times_.fill(FADE_TIME_UNKNOWN);
 }
 
 void Dali::setup() {
-	pinMode(RX_GPIO, INPUT);
-	pinMode(TX_GPIO, OUTPUT);
-	digitalWrite(TX_GPIO, BUS_ARDUINO_IDLE);
+#if defined(DALI_SIMULATOR)
+	ESP_LOGW(TAG, "Using simulated bus for %s", name_);
+	return;
+#endif
+
+	pinMode(rx_gpio_, INPUT);
+	pinMode(tx_gpio_, OUTPUT);
+	digitalWrite(tx_gpio_, BUS_ARDUINO_IDLE);
 
 	/*
 	 * github:espressif/arduino-esp32 cores/esp32/esp32-hal-rmt.h v2.0.17
@@ -79,220 +121,1465 @@ void Dali::setup() {
 	 *
 	 * Idle state defaults to 0 (LOW), which is BUS_RMT_IDLE (HIGH)
 	 */
-	rmt_ = rmtInit(TX_GPIO, RMT_TX_MODE, RMT_MEM_256);
+	rmt_ = rmtInit(tx_gpio_, RMT_TX_MODE, RMT_MEM_256);
+	if (!rmt_) {
+		ESP_LOGE(TAG, "Unable to allocate RMT channel for %s", name_);
+		return;
+	}
+
 	static_assert((uint32_t)(1000/12.5f) == 80U);
 	rmtSetTick(rmt_, TICK_NS);
 	tx_idle();
+
+	/*
+	 * There's only one callback for all channels, so it needs to find the
+	 * bus for the channel. Nothing else in the application uses the RMT
+	 * peripheral.
+	 */
+	tx_channels_[rmt_->channel] = this;
+	rmt_register_tx_end_callback(tx_done_isr, nullptr);
+
+	ESP_ERROR_CHECK(gpio_isr_handler_add(rx_gpio_, rx_edge_isr, this));
+	ESP_ERROR_CHECK(gpio_set_intr_type(rx_gpio_, GPIO_INTR_ANYEDGE));
+	ESP_ERROR_CHECK(gpio_intr_enable(rx_gpio_));
+}
+
+const char *Dali::name() const {
+	return name_;
+}
+
+unsigned int Dali::bus() const {
+	return bus_;
+}
+
+void Dali::start() {
+	std::thread t;
+	make_thread(t, name_, 8192, 1, 19, &Dali::run_loop, this);
+	t.detach();
+}
+
+DaliStats Dali::get_stats() {
+	std::lock_guard lock{stats_mutex_};
+	DaliStats stats = stats_;
+
+	stats_ = {};
+	stats.refresh_period_ms = current_refresh_period_ms_;
+	return stats;
+}
+
+std::array<Dali::Ballast,Dali::num_addresses> Dali::get_ballasts() {
+	std::lock_guard lock{ballasts_mutex_};
+
+	return ballasts_;
+}
+
+std::vector<DaliTraceFrame> Dali::get_trace(uint32_t &first_sequence) {
+	std::lock_guard lock{trace_mutex_};
+	const size_t count = std::min(static_cast<size_t>(trace_sequence_), TRACE_SIZE);
+	std::vector<DaliTraceFrame> frames;
+
+	first_sequence = trace_sequence_ - count;
+	frames.reserve(count);
+
+	for (uint32_t i = first_sequence; i != trace_sequence_; i++) {
+		frames.push_back((*trace_frames_)[i % TRACE_SIZE]);
+	}
+
+	return frames;
+}
+
+/*
+ * Plan the commands for the current light levels as if nothing has been
+ * transmitted yet, without sending anything.
+ */
+void Dali::benchmark(Benchmark &benchmark) const {
+	auto state = std::make_unique<LightsState>();
+	std::array<level_fast_t,num_addresses> tx_levels;
+	std::array<level_fast_t,num_addresses> fade_times;
+
+	lights_.get_state(bus_, *state);
+	tx_levels.fill(LEVEL_NO_CHANGE);
+	fade_times.fill(FADE_TIME_UNKNOWN);
+
+	benchmark.run("dali/plan_levels", 1000, [&] {
+		plan_levels(*state, tx_levels, fade_times);
+	});
+}
+
+uint32_t Dali::last_interactive_ms() const {
+	return last_interactive_ms_.load();
+}
+
+const char *Dali::priority_name(DaliPriority priority) {
+	switch (priority) {
+	case DaliPriority::INTERACTIVE:
+		return "interactive";
+
+	case DaliPriority::PRESET:
+		return "preset";
+
+	case DaliPriority::FORCE_REFRESH:
+		return "force_refresh";
+
+	case DaliPriority::CONFIG:
+		return "config";
+
+	case DaliPriority::REFRESH:
+		return "refresh";
+	}
+
+	return "unknown";
+}
+
+unsigned long Dali::run_tasks() {
+	LightsState &state = *state_;
+	const uint64_t start = esp_timer_get_time();
+	const uint64_t start_tx_count = tx_queued_count_;
+	unsigned long wait_ms = ULONG_MAX;
+
+	esp_task_wdt_reset();
+
+	if (tx_busy_ && async_ready()) {
+		tx_completed();
+	}
+
+	lights_.get_state(bus_, state);
+	update_fades(state);
+	trace_state(state);
+
+	const unsigned long num_lights = state.addresses.count();
+	const unsigned long refresh_period = refresh_period_ms(state, start);
+	const unsigned long refresh_delay_ms = num_lights == 0
+		? ULONG_MAX : std::max(0UL, refresh_period / num_lights - TX_POWER_LEVEL_MS);
+	uint64_t refresh_due_us = UINT64_MAX;
+
+	/*
+	 * Transmit one command at a time for the highest priority work that is
+	 * pending, reading the lights state again after every command so that
+	 * long sequences of commands (e.g. group sync) can be interrupted by
+	 * higher priority work. Lower priority work that has been waiting for
+	 * longer than its deadline gets to transmit a command first.
+	 */
+	while (true) {
+		const uint64_t now = esp_timer_get_time();
+		std::array<bool,NUM_DALI_PRIORITIES> pending{};
+		addresses_t known;
+
+		clear_unknown_levels(state);
+
+		for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+			known[address] = state.levels[address] != LEVEL_NO_CHANGE;
+		}
+		known &= state.addresses;
+
+		/*
+		 * Lights that have been set or verified within the refresh period
+		 * don't need to be refreshed yet.
+		 */
+		addresses_t refresh_due;
+
+		refresh_due_us = UINT64_MAX;
+
+		for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+			if (!known[address]) {
+				continue;
+			}
+
+			const uint64_t due_us = confirmed_us_[address] + refresh_period * 1000ULL;
+
+			if (!confirmed_us_[address] || now >= due_us) {
+				refresh_due[address] = true;
+			} else {
+				refresh_due_us = std::min(refresh_due_us, due_us);
+			}
+		}
+
+		const addresses_t changed = changed_addresses(state);
+		const addresses_t force_refresh = state.force_refresh & known & ~state.group_level_addresses;
+		bool group_changed = false;
+
+		for (unsigned int group = 0; group <= MAX_GROUP; group++) {
+			if (state.group_levels[group] != LEVEL_NO_CHANGE
+					&& state.group_levels[group] != tx_group_levels_[group]) {
+				group_changed = true;
+				break;
+			}
+		}
+
+		pending[static_cast<size_t>(DaliPriority::INTERACTIVE)] =
+			(state.broadcast_level != LEVEL_NO_CHANGE
+				&& state.broadcast_level != tx_broadcast_level_)
+			|| group_changed || (changed & state.interactive).any();
+		pending[static_cast<size_t>(DaliPriority::PRESET)] = (changed & ~state.interactive).any();
+		pending[static_cast<size_t>(DaliPriority::FORCE_REFRESH)] = force_refresh.any();
+		pending[static_cast<size_t>(DaliPriority::CONFIG)] = state.group_sync.any()
+			|| state.broadcast_power_on_level || state.broadcast_system_failure_level;
+		pending[static_cast<size_t>(DaliPriority::REFRESH)] = refresh_due.any() && now >= next_refresh_us_;
+
+		if (pending[static_cast<size_t>(DaliPriority::INTERACTIVE)]) {
+			last_interactive_ms_ = millis();
+		}
+
+		size_t selected = NUM_DALI_PRIORITIES;
+
+		for (size_t i = 0; i < NUM_DALI_PRIORITIES; i++) {
+			if (!pending[i]) {
+				pending_since_us_[i] = 0;
+			} else if (!pending_since_us_[i]) {
+				pending_since_us_[i] = now;
+			}
+		}
+
+		for (size_t i = 0; i < NUM_DALI_PRIORITIES; i++) {
+			if (pending[i] && PRIORITY_DEADLINE_MS[i] != ULONG_MAX
+					&& now - pending_since_us_[i] >= PRIORITY_DEADLINE_MS[i] * 1000ULL) {
+				selected = i;
+				break;
+			}
+		}
+
+		if (selected == NUM_DALI_PRIORITIES) {
+			for (size_t i = 0; i < NUM_DALI_PRIORITIES; i++) {
+				if (pending[i]) {
+					selected = i;
+					break;
+				}
+			}
+		}
+
+		if (selected == NUM_DALI_PRIORITIES) {
+			trace_finish();
+			break;
+		}
+
+		const DaliPriority priority = static_cast<DaliPriority>(selected);
+		const uint64_t tx_count = tx_queued_count_;
+		bool request = false;
+		uint64_t delay_us = 0;
+		bool ok = false;
+		address_t address;
+
+		if (priority == DaliPriority::REFRESH) {
+			request = true;
+			delay_us = now - next_refresh_us_;
+		} else if (state.request_us[selected] != served_request_us_[selected]) {
+			request = true;
+			delay_us = now - state.request_us[selected];
+			served_request_us_[selected] = state.request_us[selected];
+		}
+
+		tx_priority_ = priority;
+
+		switch (priority) {
+		case DaliPriority::INTERACTIVE:
+			ok = tx_interactive(state, changed);
+			break;
+
+		case DaliPriority::PRESET:
+			ok = tx_preset(state, changed);
+			break;
+
+		case DaliPriority::FORCE_REFRESH:
+			ok = next_address(force_refresh, address) && tx_address_level(state, address);
+			break;
+
+		case DaliPriority::CONFIG:
+			ok = tx_config(state);
+			break;
+
+		case DaliPriority::REFRESH:
+			/*
+			 * Refresh light power levels individually over a short time
+			 * period, cycling through the addresses each time to avoid
+			 * preferring low-numbered lights. Delays between lights keeps
+			 * the bus idle most of the time to improve responsiveness when
+			 * dimming with a rotary encoder.
+			 *
+			 * Lights that respond to queries are only sent their level if
+			 * the actual level is incorrect.
+			 */
+			{
+				const unsigned int first = next_address_;
+
+				if (next_address(refresh_due, address)) {
+					unsigned int skipped = 0;
+
+					for (unsigned int i = first; i != address; i = (i + 1) % (MAX_ADDR + 1)) {
+						if (known[i] && !refresh_due[i]) {
+							skipped++;
+						}
+					}
+
+					ok = refresh_address_level(state, address);
+
+					std::lock_guard lock{stats_mutex_};
+
+					stats_.refresh_count++;
+					stats_.refresh_skipped_count += skipped;
+				}
+
+				next_refresh_us_ = esp_timer_get_time() + refresh_delay_ms * 1000ULL;
+			}
+			break;
+		}
+
+		if (priority != DaliPriority::PRESET) {
+			planning_ = false;
+		}
+
+		if ((priority == DaliPriority::INTERACTIVE || priority == DaliPriority::PRESET)
+				&& tx_queued_count_ != tx_count) {
+			trace_tx();
+		}
+
+		{
+			std::lock_guard lock{stats_mutex_};
+			auto &priority_stats = stats_.priorities[selected];
+
+			priority_stats.tx_count += tx_queued_count_ - tx_count;
+
+			if (request) {
+				priority_stats.request_count++;
+				priority_stats.max_delay_us = std::max(priority_stats.max_delay_us, delay_us);
+			}
+		}
+
+		if (!ok) {
+			/* Try again later */
+			wait_ms = TX_POWER_LEVEL_MS;
+			break;
+		}
+
+		pending_since_us_[selected] = esp_timer_get_time();
+		lights_.get_state(bus_, state);
+		update_fades(state);
+		trace_state(state);
+		esp_task_wdt_reset();
+	}
+
+	const uint64_t finish = esp_timer_get_time();
+	const uint64_t count = tx_queued_count_ - start_tx_count;
+
+	if (count > 0) {
+		std::lock_guard lock{stats_mutex_};
+
+		stats_.max_burst_tx_count = std::max(stats_.max_burst_tx_count, count);
+		stats_.max_burst_us = std::max(stats_.max_burst_us, finish - start);
+	}
+
+	if (num_lights > 0) {
+		if (count > 0 && next_refresh_us_ < finish + refresh_delay_ms * 1000ULL) {
+			/* Delay the next refresh after any other activity */
+			next_refresh_us_ = finish + refresh_delay_ms * 1000ULL;
+		}
+
+		const uint64_t refresh_us = std::max(next_refresh_us_, refresh_due_us);
+
+		if (refresh_us != UINT64_MAX) {
+			wait_ms = std::min(wait_ms, refresh_us > finish
+				? (unsigned long)std::min((refresh_us - finish + 999U) / 1000U, (uint64_t)ULONG_MAX) : 1UL);
+		}
+	}
+
+	if (next_fade_us_ != UINT64_MAX) {
+		wait_ms = std::min(wait_ms, next_fade_us_ > finish
+			? (unsigned long)std::min((next_fade_us_ - finish + 999U) / 1000U, (uint64_t)ULONG_MAX) : 1UL);
+	}
+
+	return std::min(WATCHDOG_INTERVAL_MS, wait_ms);
+}
+
+/*
+ * Trace the latency of changes from MQTT messages and inputs, from the time
+ * the DALI thread sees the change through to the first and last frames that
+ * the change causes to be transmitted, until there's no more interactive or
+ * preset work pending (or the next traced change).
+ */
+void Dali::trace_state(const LightsState &state) {
+	if (state.trace_state_us == trace_state_us_) {
+		return;
+	}
+
+	trace_finish();
+
+	trace_active_ = state.trace_origin.source != LatencySource::NONE;
+	trace_origin_ = state.trace_origin;
+	trace_state_us_ = state.trace_state_us;
+
+	if (trace_active_) {
+		Latency::record(LatencyPoint::DALI_WAKEUP, esp_timer_get_time() - trace_state_us_);
+	}
+}
+
+void Dali::trace_tx() {
+	if (!trace_active_) {
+		return;
+	}
+
+	if (!trace_last_tx_us_) {
+		Latency::record(Latency::bus_first_point(trace_origin_.source),
+			tx_start_us_ - trace_origin_.us);
+	}
+
+	trace_last_tx_us_ = tx_start_us_;
+}
+
+void Dali::trace_finish() {
+	if (trace_active_ && trace_last_tx_us_) {
+		Latency::record(Latency::bus_last_point(trace_origin_.source),
+			trace_last_tx_us_ - trace_origin_.us);
+	}
+
+	trace_active_ = false;
+	trace_last_tx_us_ = 0;
+}
+
+void Dali::trace_frame(uint8_t address, uint8_t data, bool repeat) {
+	std::lock_guard lock{trace_mutex_};
+
+	(*trace_frames_)[trace_sequence_ % TRACE_SIZE] = {
+		static_cast<uint32_t>(tx_start_us_),
+		address,
+		data,
+		static_cast<uint8_t>((repeat ? DaliTraceFrame::FLAG_REPEAT : 0)
+			| ((static_cast<unsigned int>(tx_priority_) & DaliTraceFrame::PRIORITY_MASK)
+				<< DaliTraceFrame::PRIORITY_SHIFT)),
+		0,
+	};
+	trace_sequence_++;
+}
+
+/* Update the most recent frame with the result of the query */
+void Dali::trace_query(DaliQueryResult result, uint8_t value) {
+	std::lock_guard lock{trace_mutex_};
+	DaliTraceFrame &frame = (*trace_frames_)[(trace_sequence_ - 1) % TRACE_SIZE];
+
+	frame.flags |= DaliTraceFrame::FLAG_QUERY
+		| ((static_cast<unsigned int>(result) & DaliTraceFrame::RESULT_MASK)
+			<< DaliTraceFrame::RESULT_SHIFT);
+	frame.response = result == DaliQueryResult::OK ? value : 0;
+}
+
+void Dali::clear_unknown_levels(const LightsState &state) {
+	if (state.broadcast_level == LEVEL_NO_CHANGE) {
+		tx_broadcast_level_ = LEVEL_NO_CHANGE;
+	}
+
+	for (unsigned int group = 0; group <= MAX_GROUP; group++) {
+		if (state.group_levels[group] == LEVEL_NO_CHANGE) {
+			tx_group_levels_[group] = LEVEL_NO_CHANGE;
+		}
+	}
+
+	for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+		if (state.addresses[address] && state.levels[address] == LEVEL_NO_CHANGE) {
+			tx_levels_[address] = LEVEL_NO_CHANGE;
+		}
+	}
+}
+
+Dali::addresses_t Dali::changed_addresses(const LightsState &state) const {
+	addresses_t changed;
+
+	for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+		if (state.addresses[address]
+				&& !state.group_level_addresses[address]
+				&& state.levels[address] != LEVEL_NO_CHANGE
+				&& state.levels[address] != tx_levels_[address]) {
+			changed[address] = true;
+		}
+	}
+
+	return changed;
+}
+
+bool Dali::next_address(const addresses_t &addresses, address_t &address) {
+	/* Cycle through the addresses each time to avoid preferring low-numbered lights */
+	for (unsigned int i = 0; i <= MAX_ADDR; i++) {
+		unsigned int next = next_address_;
+
+		next_address_++;
+		next_address_ %= MAX_ADDR + 1;
+
+		if (addresses[next]) {
+			address = next;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+unsigned long Dali::refresh_period_ms(const LightsState &state, uint64_t now) {
+	if (state.config_generation != refresh_config_generation_) {
+		/* Refresh all lights at the normal rate after a config change */
+		refresh_config_generation_ = state.config_generation;
+		refresh_reset_us_ = now;
+		confirmed_us_.fill(0);
+	}
+
+	/*
+	 * Double the refresh period each time a whole period passes while the
+	 * lights are idle. Changes to the lights return to the normal period
+	 * immediately, as does a restart.
+	 */
+	const uint64_t idle_since_us = std::max(refresh_reset_us_,
+		state.last_activity_us + LocalLights::IDLE_US);
+	unsigned long period_ms = REFRESH_PERIOD_MS;
+
+	if (now >= idle_since_us) {
+		uint64_t elapsed_ms = (now - idle_since_us) / 1000U;
+		uint64_t total_ms = period_ms;
+
+		while (period_ms < MAX_REFRESH_PERIOD_MS && elapsed_ms >= total_ms) {
+			period_ms *= 2;
+			total_ms += period_ms;
+		}
+	}
+
+	period_ms = std::min(period_ms, MAX_REFRESH_PERIOD_MS);
+	current_refresh_period_ms_ = period_ms;
+	return period_ms;
+}
+
+void Dali::confirmed_level(address_t address) {
+	confirmed_us_[address] = esp_timer_get_time();
+}
+
+void Dali::confirmed_levels(const addresses_t &addresses) {
+	const uint64_t now = esp_timer_get_time();
+
+	for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+		if (addresses[address]) {
+			confirmed_us_[address] = now;
+		}
+	}
+}
+
+Dali::level_fast_t Dali::fade_time_code(unsigned long duration_ms) {
+	level_fast_t code = 0;
+
+	for (unsigned int i = 1; i < FADE_TIME_MS.size(); i++) {
+		if (std::max(duration_ms, FADE_TIME_MS[i]) - std::min(duration_ms, FADE_TIME_MS[i])
+				< std::max(duration_ms, FADE_TIME_MS[code]) - std::min(duration_ms, FADE_TIME_MS[code])) {
+			code = i;
+		}
+	}
+
+	return code;
+}
+
+/*
+ * Start a transition for every light with a new request and replace the
+ * levels of lights with an interpolated transition with their intermediate
+ * level. Transitions use the nearest fade time of the lights, so they're
+ * not exact.
+ *
+ * The fade time is stored in the non-volatile memory of the lights, so it's
+ * only changed for a transition. Other changes use the fade time that was
+ * configured in the light, which is restored before the next change without
+ * a transition.
+ *
+ * Interpolated transitions step through the levels at the same time for all
+ * lights with the same request so that they can still use broadcast/group
+ * commands, with the interval increasing when there are a lot of lights.
+ */
+void Dali::update_fades(LightsState &state) {
+	const uint64_t now = esp_timer_get_time();
+	unsigned int fade_count = 0;
+	unsigned int interpolated_fade_count = 0;
+	unsigned int interpolated_step_count = 0;
+	unsigned int interpolating = 0;
+
+	next_fade_us_ = UINT64_MAX;
+
+	for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+		Fade &fade = fades_[address];
+
+		if (state.transition_us[address] != fade.request_us) {
+			const unsigned long duration_ms = state.transition_ms[address];
+
+			fade = {};
+			fade.request_us = state.transition_us[address];
+
+			if (duration_ms > MAX_FADE_TIME_MS
+					&& state.levels[address] != LEVEL_NO_CHANGE
+					&& tx_levels_[address] != LEVEL_NO_CHANGE) {
+				fade.end_us = fade.request_us + duration_ms * 1000ULL;
+				fade.duration_ms = duration_ms;
+				fade.from_level = tx_levels_[address];
+				fade.to_level = state.levels[address];
+				fade.fade_time = 0;
+				fade.interpolate = true;
+				interpolated_fade_count++;
+			} else if (duration_ms > 0) {
+				fade.fade_time = fade_time_code(std::min(duration_ms, FADE_TIME_MS.back()));
+				fade.end_us = fade.request_us
+					+ (FADE_TIME_MS[fade.fade_time] + FADE_MARGIN_MS) * 1000ULL;
+				fade_count++;
+			}
+		}
+
+		if (state.interactive[address]) {
+			const uint64_t request_us = fade.request_us;
+
+			/* Dimming doesn't have a transition */
+			fade = {};
+			fade.request_us = request_us;
+		} else if (fade.interpolate) {
+			if (now < fade.end_us && state.levels[address] != LEVEL_NO_CHANGE) {
+				interpolating++;
+			} else {
+				state.levels[address] = fade.to_level;
+				fade.interpolate = false;
+			}
+		}
+
+		const bool pending = state.levels[address] != LEVEL_NO_CHANGE
+			&& state.levels[address] != tx_levels_[address];
+
+		if (!state.addresses[address]
+				|| original_fade_times_[address] == FADE_TIME_UNAVAILABLE) {
+			fade_times_[address] = FADE_TIME_UNKNOWN;
+		} else if (fade.fade_time != FADE_TIME_UNKNOWN
+				&& (now < fade.end_us || pending)) {
+			fade_times_[address] = fade.fade_time;
+		} else if (pending && original_fade_times_[address] != FADE_TIME_UNKNOWN
+				&& tx_fade_times_[address] != original_fade_times_[address]) {
+			fade_times_[address] = original_fade_times_[address];
+		} else {
+			fade_times_[address] = FADE_TIME_UNKNOWN;
+		}
+	}
+
+	if (interpolating > 0) {
+		const uint64_t interval_us = std::max(MIN_INTERPOLATE_INTERVAL_MS,
+			interpolating * TX_POWER_LEVEL_MS * 2) * 1000ULL;
+
+		for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+			Fade &fade = fades_[address];
+
+			if (!fade.interpolate) {
+				continue;
+			}
+
+			const uint64_t elapsed_us = now - fade.request_us;
+			const uint64_t step_us = elapsed_us - elapsed_us % interval_us;
+			const long long from_level = fade.from_level;
+			const long long to_level = fade.to_level;
+			const level_fast_t level = from_level + (to_level - from_level)
+				* (long long)step_us / (long long)(fade.duration_ms * 1000ULL);
+
+			if (level != fade.step_level) {
+				fade.step_level = level;
+				interpolated_step_count++;
+			}
+
+			state.levels[address] = level;
+			next_fade_us_ = std::min(next_fade_us_, fade.request_us + step_us + interval_us);
+		}
+	}
+
+	if (fade_count || interpolated_fade_count || interpolated_step_count) {
+		std::lock_guard lock{stats_mutex_};
+
+		stats_.fade_count += fade_count;
+		stats_.interpolated_fade_count += interpolated_fade_count;
+		stats_.interpolated_step_count += interpolated_step_count;
+	}
+}
+
+/*
+ * Set the fade time of lights before their levels are transmitted, using
+ * broadcast commands when every light needs the same one (or already has
+ * it). The fade time is copied from the DTR so this may take two commands.
+ * The original fade time of each light is queried before it's changed so
+ * that it can be restored. Sets "sent" if a command was transmitted.
+ */
+bool Dali::tx_fade_times(const LightsState &state, const addresses_t &lights, bool &sent) {
+	addresses_t pending;
+	level_fast_t fade_time = FADE_TIME_UNKNOWN;
+	bool uniform = true;
+
+	sent = false;
+
+	for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+		if (lights[address] && state.addresses[address]
+				&& fade_times_[address] != FADE_TIME_UNKNOWN
+				&& fade_times_[address] != tx_fade_times_[address]) {
+			if (original_fade_times_[address] == FADE_TIME_UNKNOWN) {
+				const DaliQueryResult result = query_fade_time(address);
+
+				sent = true;
+				return result == DaliQueryResult::OK
+					|| result == DaliQueryResult::NO_RESPONSE;
+			}
+
+			if (fade_time == FADE_TIME_UNKNOWN) {
+				fade_time = fade_times_[address];
+			}
+
+			if (fade_times_[address] == fade_time) {
+				pending[address] = true;
+			}
+		}
+	}
+
+	if (pending.none()) {
+		return true;
+	}
+
+	for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+		if (state.addresses[address] && fade_times_[address] != fade_time
+				&& (fade_times_[address] != FADE_TIME_UNKNOWN
+					|| tx_fade_times_[address] != fade_time)) {
+			uniform = false;
+			break;
+		}
+	}
+
+	if (tx_dtr_ != fade_time) {
+		if (!tx_dtr(fade_time)) {
+			return false;
+		}
+	} else if (uniform) {
+		DALI_LOG(TAG, "Set fade time %u (broadcast)", fade_time);
+
+		if (!tx_broadcast_command(COMMAND_SET_FADE_TIME_FROM_DTR, true)) {
+			return false;
+		}
+
+		/* Lights that aren't configured can't have their fade time restored */
+		for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+			if (original_fade_times_[address] == FADE_TIME_UNKNOWN) {
+				original_fade_times_[address] = FADE_TIME_UNAVAILABLE;
+			}
+		}
+
+		tx_fade_times_.fill(fade_time);
+	} else {
+		address_t address = 0;
+
+		while (!pending[address]) {
+			address++;
+		}
+
+		DALI_LOG(TAG, "Set fade time %u (address %u)", fade_time, address);
+
+		if (!tx_address_command(address, COMMAND_SET_FADE_TIME_FROM_DTR, true)) {
+			return false;
+		}
+
+		tx_fade_times_[address] = fade_time;
+	}
+
+	std::lock_guard lock{stats_mutex_};
+
+	stats_.fade_time_tx_count++;
+	sent = true;
+	return true;
+}
+
+bool Dali::tx_interactive(const LightsState &state, const addresses_t &changed) {
+	bool sent;
+
+	if (state.broadcast_level != LEVEL_NO_CHANGE
+			&& state.broadcast_level != tx_broadcast_level_) {
+		if (!tx_fade_times(state, state.addresses, sent) || sent) {
+			return sent;
+		}
+
+		if (!tx_broadcast_power_level(state.broadcast_level)) {
+			return false;
+		}
+
+		tx_broadcast_level_ = state.broadcast_level;
+		tx_levels_.fill(state.broadcast_level);
+		confirmed_levels(state.addresses);
+		return true;
+	}
+
+	for (unsigned int i = 0; i <= MAX_GROUP; i++) {
+		unsigned int group = next_group_;
+
+		next_group_++;
+		next_group_ %= MAX_GROUP + 1;
+
+		if (state.group_levels[group] != LEVEL_NO_CHANGE
+				&& state.group_levels[group] != tx_group_levels_[group]) {
+			if (!tx_fade_times(state, state.group_addresses[group], sent) || sent) {
+				/* Return to this group next time */
+				next_group_ = group;
+				return sent;
+			}
+
+			if (!tx_group_power_level(group, state.group_levels[group])) {
+				return false;
+			}
+
+			tx_group_levels_[group] = state.group_levels[group];
+
+			for (unsigned int address = 0;
+					address < state.group_addresses[group].size();
+					address++) {
+				if (state.group_addresses[group][address]) {
+					tx_levels_[address] = state.group_levels[group];
+				}
+			}
+			confirmed_levels(state.group_addresses[group]);
+			return true;
+		}
+	}
+
+	address_t address;
+
+	if (!tx_fade_times(state, changed & state.interactive, sent) || sent) {
+		return sent;
+	}
+
+	return next_address(changed & state.interactive, address)
+		&& tx_address_level(state, address);
+}
+
+bool Dali::tx_preset(const LightsState &state, const addresses_t &changed) {
+	Plan plan = plan_levels(state, tx_levels_, fade_times_);
+	bool sent;
+
+	if (plan.tx_count < plan.individual_tx_count) {
+		/*
+		 * The plan is recalculated after every command, so only record stats
+		 * when it starts.
+		 */
+		if (!planning_) {
+			DALI_LOG(TAG, "Plan %u commands instead of %u",
+				plan.tx_count, plan.individual_tx_count);
+
+			std::lock_guard lock{stats_mutex_};
+
+			stats_.plan_count++;
+			stats_.plan_saved_tx_count += plan.individual_tx_count - plan.tx_count;
+			planning_ = true;
+		}
+
+		if (plan.broadcast_level != LEVEL_NO_CHANGE) {
+			if (!tx_fade_times(state, state.addresses, sent) || sent) {
+				return sent;
+			}
+
+			if (!tx_broadcast_power_level(plan.broadcast_level)) {
+				return false;
+			}
+
+			tx_levels_.fill(plan.broadcast_level);
+			confirmed_levels(state.addresses);
+			return true;
+		}
+
+		for (unsigned int group = 0; group <= MAX_GROUP; group++) {
+			if (plan.group_levels[group] == LEVEL_NO_CHANGE) {
+				continue;
+			}
+
+			if (!tx_fade_times(state, state.group_addresses[group], sent) || sent) {
+				return sent;
+			}
+
+			if (!tx_group_power_level(group, plan.group_levels[group])) {
+				return false;
+			}
+
+			for (unsigned int address = 0;
+					address < state.group_addresses[group].size();
+					address++) {
+				if (state.group_addresses[group][address]) {
+					tx_levels_[address] = plan.group_levels[group];
+				}
+			}
+			confirmed_levels(state.group_addresses[group]);
+			return true;
+		}
+	} else {
+		planning_ = false;
+	}
+
+	address_t address;
+
+	if (!tx_fade_times(state, changed & ~state.interactive, sent) || sent) {
+		return sent;
+	}
+
+	return next_address(changed & ~state.interactive, address)
+		&& tx_address_level(state, address);
+}
+
+bool Dali::tx_config(const LightsState &state) {
+	if (sync_group_ != GROUP_NONE
+			&& (!state.group_sync[sync_group_]
+				|| state.group_addresses[sync_group_] != sync_addresses_)) {
+		/* Group members have changed, start again */
+		sync_group_ = GROUP_NONE;
+	}
+
+	if (sync_group_ == GROUP_NONE) {
+		for (unsigned int group = 0; group < state.group_sync.size(); group++) {
+			if (state.group_sync[group]) {
+				sync_group_ = group;
+				sync_addresses_ = state.group_addresses[group];
+				sync_group_empty_ = false;
+				sync_address_ = 0;
+				break;
+			}
+		}
+	}
+
+	if (sync_group_ != GROUP_NONE) {
+		if (!sync_group_empty_) {
+			if (!tx_group_empty(sync_group_)) {
+				sync_group_ = GROUP_NONE;
+				return false;
+			}
+
+			sync_group_empty_ = true;
+			return true;
+		}
+
+		while (sync_address_ <= MAX_ADDR && !sync_addresses_[sync_address_]) {
+			sync_address_++;
+		}
+
+		if (sync_address_ <= MAX_ADDR) {
+			if (!tx_address_group_add(sync_address_, sync_group_)) {
+				sync_group_ = GROUP_NONE;
+				return false;
+			}
+
+			sync_address_++;
+			return true;
+		}
+
+		lights_.completed_group_sync(bus_, sync_group_);
+
+		/* Some of the lights may have missed the group level while syncing */
+		tx_group_levels_[sync_group_] = LEVEL_NO_CHANGE;
+		sync_group_ = GROUP_NONE;
+		return true;
+	}
+
+	if (state.broadcast_power_on_level || state.broadcast_system_failure_level) {
+		if (!dtr_actual_level_) {
+			if (!tx_set_dtr_from_actual_level()) {
+				return false;
+			}
+
+			dtr_actual_level_ = true;
+			return true;
+		}
+
+		if (state.broadcast_power_on_level) {
+			if (!tx_set_power_on_level_from_dtr()) {
+				return false;
+			}
+
+			lights_.completed_broadcast_power_on_level(bus_);
+			dtr_actual_level_ = state.broadcast_system_failure_level;
+			return true;
+		}
+
+		if (!tx_set_system_failure_level_from_dtr()) {
+			return false;
+		}
+
+		lights_.completed_broadcast_system_failure_level(bus_);
+		dtr_actual_level_ = false;
+		return true;
+	}
+
+	return false;
 }
 
-void Dali::start() {
-	std::thread t;
-	make_thread(t, "dali", 8192, 1, 19, &Dali::run_loop, this);
-	t.detach();
+bool Dali::tx_address_level(const LightsState &state, address_t address) {
+	if (!tx_address_power_level(address, state.levels[address])) {
+		return false;
+	}
+
+	tx_levels_[address] = state.levels[address];
+	confirmed_level(address);
+
+	if (state.force_refresh[address]) {
+		lights_.completed_force_refresh(bus_ * num_addresses + address);
+	}
+	return true;
 }
 
-DaliStats Dali::get_stats() {
-	std::lock_guard lock{stats_mutex_};
-	DaliStats stats = stats_;
+/*
+ * Broadcast/group commands can't be used for lights that need different
+ * fade times, but lights that aren't changing level or in a transition can
+ * have any fade time.
+ */
+bool Dali::same_fade_times(const addresses_t &addresses,
+		const std::array<level_fast_t,num_addresses> &fade_times) {
+	level_fast_t fade_time = FADE_TIME_UNKNOWN;
+
+	for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+		if (addresses[address] && fade_times[address] != FADE_TIME_UNKNOWN) {
+			if (fade_time == FADE_TIME_UNKNOWN) {
+				fade_time = fade_times[address];
+			} else if (fade_times[address] != fade_time) {
+				return false;
+			}
+		}
+	}
 
-	stats_ = {};
-	return stats;
+	return true;
 }
 
-unsigned long Dali::run_tasks() {
-	const unsigned long num_lights = config_.get_addresses().count();
-	const unsigned long refresh_delay_ms = num_lights == 0
-		? ULONG_MAX : std::max(0UL, REFRESH_PERIOD_MS / num_lights - TX_POWER_LEVEL_MS);
-	const unsigned long delay_ms = std::min(WATCHDOG_INTERVAL_MS, refresh_delay_ms);
-	bool changed = false;
-	bool refresh = true;
+Dali::Plan Dali::plan_levels(const LightsState &state,
+		const std::array<level_fast_t,num_addresses> &tx_levels,
+		const std::array<level_fast_t,num_addresses> &fade_times) {
+	Plan plan;
+	addresses_t known;
+	addresses_t pending;
 
-	esp_task_wdt_reset();
+	plan.group_levels.fill(LEVEL_NO_CHANGE);
 
-	uint64_t start = esp_timer_get_time();
-	LightsState state = lights_.get_state();
-	uint64_t count = 0;
 	/*
-	 * Set power level for lights that have changed level, cycling through the
-	 * addresses each time to avoid preferring low-numbered lights.
+	 * Lights that are being forced to refresh will be transmitted individually
+	 * regardless of their current level.
 	 */
-	do {
-		changed = false;
-
-		if (state.broadcast_level != tx_broadcast_level_) {
-			if (state.broadcast_level == LEVEL_NO_CHANGE) {
-				tx_broadcast_level_ = LEVEL_NO_CHANGE;
-			} else if (tx_broadcast_power_level(state.broadcast_level)) {
-				tx_broadcast_level_ = state.broadcast_level;
-				changed = true;
-				refresh = false;
-				count++;
-
-				tx_levels_.fill(state.broadcast_level);
-			}
-
-			state = lights_.get_state();
-			esp_task_wdt_reset();
-		}
-
-		for (unsigned int i = 0; i <= MAX_GROUP; i++) {
-			unsigned int group = next_group_;
-
-			if (state.group_levels[group] != tx_group_levels_[group]) {
-				if (state.group_levels[group] == LEVEL_NO_CHANGE) {
-					tx_group_levels_[group] = LEVEL_NO_CHANGE;
-				} else if (tx_group_power_level(group, state.group_levels[group])) {
-					tx_group_levels_[group] = state.group_levels[group];
-					changed = true;
-					refresh = false;
-					count++;
-
-					for (unsigned int address = 0;
-							address < state.group_addresses[group].size();
-							address++) {
-						if (state.group_addresses[group][address]) {
-							tx_levels_[address] = state.group_levels[group];
-						}
-					}
-				}
+	const addresses_t addresses = state.addresses & ~state.force_refresh;
 
-				state = lights_.get_state();
-				esp_task_wdt_reset();
-			}
+	for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+		if (state.addresses[address] && state.levels[address] != LEVEL_NO_CHANGE) {
+			known[address] = true;
 
-			next_group_++;
-			next_group_ %= MAX_GROUP + 1;
+			if (addresses[address] && state.levels[address] != tx_levels[address]) {
+				pending[address] = true;
+			}
 		}
+	}
 
-		for (unsigned int i = 0; i <= MAX_ADDR; i++) {
-			unsigned int address = next_address_;
-
-			if (state.addresses[address]
-					&& !state.group_level_addresses[address]
-					&& (state.force_refresh[address]
-						|| state.levels[address] != tx_levels_[address])) {
-				if (state.levels[address] == LEVEL_NO_CHANGE) {
-					tx_levels_[address] = LEVEL_NO_CHANGE;
-				} else if (tx_address_power_level(address, state.levels[address])) {
-					tx_levels_[address] = state.levels[address];
-					changed = true;
-					refresh = false;
-					count++;
+	plan.individual_tx_count = pending.count();
+	plan.tx_count = plan.individual_tx_count;
 
-					if (state.force_refresh[address]) {
-						lights_.completed_force_refresh(address);
-					}
-				}
+	/*
+	 * Don't interfere with the dimmer when it's using broadcast/group levels
+	 * (they'd need to be transmitted again).
+	 */
+	if (plan.individual_tx_count < 2
+			|| state.group_level_addresses.any()
+			|| state.broadcast_level != LEVEL_NO_CHANGE
+			|| std::any_of(state.group_levels.cbegin(), state.group_levels.cend(),
+				[] (level_fast_t level) { return level != LEVEL_NO_CHANGE; })) {
+		return plan;
+	}
 
-				state = lights_.get_state();
-				esp_task_wdt_reset();
+	/*
+	 * Broadcast the most common level (if every light has a level because
+	 * broadcast will change all of them) and then fix up the other lights.
+	 */
+	if (known == state.addresses
+			&& same_fade_times(state.addresses, fade_times)) {
+		std::array<uint8_t,MAX_LEVEL + 1> level_counts{};
+		level_fast_t level = 0;
+
+		for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+			if (addresses[address]) {
+				level_counts[state.levels[address]]++;
 			}
+		}
 
-			next_address_++;
-			next_address_ %= MAX_ADDR + 1;
+		for (unsigned int i = 0; i <= MAX_LEVEL; i++) {
+			if (level_counts[i] > level_counts[level]) {
+				level = i;
+			}
 		}
-	} while (changed);
 
-	if (count > 0) {
-		uint64_t finish = esp_timer_get_time();
-		std::lock_guard lock{stats_mutex_};
+		addresses_t broadcast_pending;
 
-		stats_.max_burst_tx_count = std::max(stats_.max_burst_tx_count, count);
-		stats_.max_burst_us = std::max(stats_.max_burst_us, finish - start);
-	}
+		for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+			if (addresses[address] && state.levels[address] != level) {
+				broadcast_pending[address] = true;
+			}
+		}
 
-	for (unsigned int group = 0; group < state.group_sync.size(); group++) {
-		if (!state.group_sync[group]) {
-			continue;
+		if (1 + broadcast_pending.count() < pending.count()) {
+			plan.broadcast_level = level;
+			pending = broadcast_pending;
 		}
+	}
+
+	/*
+	 * Use groups where every light in the group has the same level (excluding
+	 * groups that are waiting to be synchronised to the bus), preferring the
+	 * groups that fix the most lights.
+	 */
+	std::array<level_fast_t,num_groups> group_levels;
+	groups_t groups;
+
+	group_levels.fill(LEVEL_NO_CHANGE);
 
-		if (!tx_group_empty(group)) {
+	for (unsigned int group = 0; group <= MAX_GROUP; group++) {
+		const addresses_t members = state.group_addresses[group] & state.addresses;
+
+		if (state.group_sync[group] || members.none() || (members & ~known).any()
+				|| !same_fade_times(members, fade_times)) {
 			continue;
 		}
 
-		for (unsigned int address = 0;
-				address < state.group_addresses[group].size(); address++) {
-			if (state.group_addresses[group][address]) {
-				if (!tx_address_group_add(address, group)) {
-					goto group_sync_failed;
-				}
+		for (unsigned int address = 0; address <= MAX_ADDR; address++) {
+			if (!members[address]) {
+				continue;
+			}
+
+			if (group_levels[group] == LEVEL_NO_CHANGE) {
+				group_levels[group] = state.levels[address];
+			} else if (group_levels[group] != state.levels[address]) {
+				group_levels[group] = LEVEL_NO_CHANGE;
+				break;
 			}
 		}
 
-		lights_.completed_group_sync(group);
-group_sync_failed:;
+		groups[group] = group_levels[group] != LEVEL_NO_CHANGE;
 	}
 
-	if (state.broadcast_power_on_level || state.broadcast_system_failure_level) {
-		if (tx_set_dtr_from_actual_level()) {
-			if (state.broadcast_power_on_level) {
-				if (tx_set_power_on_level_from_dtr()) {
-					lights_.completed_broadcast_power_on_level();
+	while (groups.any()) {
+		group_fast_t best_group = GROUP_NONE;
+		size_t best_count = 1;
+
+		for (unsigned int group = 0; group <= MAX_GROUP; group++) {
+			if (groups[group]) {
+				size_t count = (pending & state.group_addresses[group]).count();
+
+				if (count > best_count) {
+					best_group = group;
+					best_count = count;
 				}
 			}
+		}
 
-			if (state.broadcast_system_failure_level) {
-				if (tx_set_system_failure_level_from_dtr()) {
-					lights_.completed_broadcast_system_failure_level();
-				}
+		if (best_group == GROUP_NONE) {
+			break;
+		}
+
+		plan.group_levels[best_group] = group_levels[best_group];
+		pending &= ~state.group_addresses[best_group];
+		groups[best_group] = false;
+	}
+
+	plan.tx_count = (plan.broadcast_level != LEVEL_NO_CHANGE ? 1 : 0)
+		+ std::count_if(plan.group_levels.cbegin(), plan.group_levels.cend(),
+			[] (level_fast_t level) { return level != LEVEL_NO_CHANGE; })
+		+ pending.count();
+	return plan;
+}
+
+bool Dali::refresh_address_level(const LightsState &state, address_t address) {
+	if (esp_timer_get_time() < fades_[address].end_us) {
+		/* The actual level won't match until the transition is complete */
+		confirmed_level(address);
+		return true;
+	}
+
+	const level_fast_t level = state.levels[address];
+	const unsigned int visit = refresh_visits_[address]++ % BALLAST_QUERY_INTERVAL;
+	Ballast ballast;
+	bool verified = false;
+
+	{
+		std::lock_guard lock{ballasts_mutex_};
+
+		ballast = ballasts_[address];
+	}
+
+	if (ballast.present || visit == 0) {
+		level_t actual_level;
+
+		switch (query_actual_level(address, actual_level)) {
+		case DaliQueryResult::OK:
+			ballast.present = true;
+			ballast.actual_level = actual_level;
+
+			if (actual_level == level) {
+				verified = true;
+			} else if (mismatch_levels_[address] == level
+					&& mismatch_actual_levels_[address] == actual_level) {
+				/*
+				 * The level has already been corrected once, so the
+				 * light can't reach this level (e.g. it's below the
+				 * minimum level)
+				 */
+				verified = true;
+			} else {
+				mismatch_levels_[address] = level;
+				mismatch_actual_levels_[address] = actual_level;
+
+				std::lock_guard lock{stats_mutex_};
+
+				stats_.refresh_corrected_count++;
 			}
+			break;
+
+		case DaliQueryResult::NO_RESPONSE:
+			ballast.present = false;
+			ballast.actual_level = LEVEL_NO_CHANGE;
+			break;
+
+		case DaliQueryResult::INVALID:
+			break;
+
+		case DaliQueryResult::TX_FAILED:
+			return false;
 		}
 	}
 
-	if (refresh) {
-		/*
-		* Refresh light power levels individually over a short time period,
-		* cycling through the addresses each time to avoid preferring
-		* low-numbered lights. Delays between lights keeps the bus idle most of
-		* the time to improve responsiveness when dimming with a rotary encoder.
-		*/
-		for (unsigned int i = 0; i <= MAX_ADDR && !changed; i++) {
-			unsigned address = next_address_;
-
-			if (state.addresses[address]) {
-				if (state.levels[address] == LEVEL_NO_CHANGE) {
-					tx_levels_[address] = LEVEL_NO_CHANGE;
-				} else if (tx_address_power_level(address, state.levels[address])) {
-					tx_levels_[address] = state.levels[address];
-					changed = true;
+	if (ballast.present) {
+		DaliQueryResult result = DaliQueryResult::OK;
+
+		switch (visit) {
+		case 1:
+			result = query_status(address, ballast.status);
+			ballast.status_known = result == DaliQueryResult::OK;
+			break;
+
+		case 2:
+			result = query_lamp_failure(address, ballast.lamp_failure);
+			break;
+
+		case 3:
+			result = query_groups(address, ballast.groups);
+			ballast.groups_known = result == DaliQueryResult::OK;
+
+			if (ballast.groups_known) {
+				groups_t groups;
+
+				for (unsigned int group = 0; group <= MAX_GROUP; group++) {
+					groups[group] = state.group_addresses[group][address];
 				}
 
-				esp_task_wdt_reset();
+				if (groups != ballast.groups) {
+					DALI_LOG(TAG, "Group membership mismatch A/%u = %04lX (expected %04lX)",
+						address, ballast.groups.to_ulong(), groups.to_ulong());
+
+					std::lock_guard lock{stats_mutex_};
+
+					stats_.group_mismatch_count++;
+				}
 			}
+			break;
+
+		case 4:
+			/* Only the original fade time is needed, before it's changed */
+			if (original_fade_times_[address] == FADE_TIME_UNKNOWN
+					|| (original_fade_times_[address] == FADE_TIME_UNAVAILABLE
+						&& tx_fade_times_[address] == FADE_TIME_UNKNOWN)) {
+				result = query_fade_time(address);
+			}
+			break;
+		}
 
-			next_address_++;
-			next_address_ %= MAX_ADDR + 1;
+		if (result == DaliQueryResult::TX_FAILED) {
+			return false;
 		}
 	}
 
-	return delay_ms;
+	{
+		std::lock_guard lock{ballasts_mutex_};
+
+		ballasts_[address] = ballast;
+	}
+
+	if (verified) {
+		tx_levels_[address] = level;
+		confirmed_level(address);
+
+		std::lock_guard lock{stats_mutex_};
+
+		stats_.refresh_verified_count++;
+		return true;
+	}
+
+	return tx_address_level(state, address);
 }
 
-#if 0
 bool Dali::async_ready() {
+#if defined(DALI_SIMULATOR)
+	return (uint64_t)esp_timer_get_time() >= tx_finish_time_us();
+#endif
+
 	return rmt_wait_tx_done(static_cast<rmt_channel_t>(rmt_->channel), 0) == ESP_OK;
 }
+
+void Dali::tx_done_isr(rmt_channel_t channel, void *arg) {
+	Dali *dali = channel < tx_channels_.size() ? tx_channels_[channel] : nullptr;
+
+	if (dali && dali->rmt_ && channel == dali->rmt_->channel) {
+		dali->tx_finish_us_.store(esp_timer_get_time(), std::memory_order_release);
+		dali->wake_up_isr();
+	}
+}
+
+bool Dali::tx_wait() {
+	if (!tx_busy_) {
+		return true;
+	}
+
+#if defined(DALI_SIMULATOR)
+	wait_until(tx_finish_time_us());
+	tx_completed();
+	return true;
 #endif
 
-inline size_t Dali::byte_to_symbols(rmt_data_t *symbols, uint8_t value) {
-	for (int i = 7; i >= 0; i--) {
-		*symbols = (((value >> i) & 1) ? DALI_1 : DALI_0);
-		symbols++;
+	if (rmt_wait_tx_done(static_cast<rmt_channel_t>(rmt_->channel),
+			pdMS_TO_TICKS(TX_TIMEOUT_MS)) != ESP_OK) {
+		ESP_LOGE(TAG, "Timeout waiting for transmit to complete");
+		return false;
+	}
+
+	tx_completed();
+	return true;
+}
+
+/*
+ * The ISR can only store a 32-bit time atomically, so extend it using the
+ * start time of the transmission (which is never more than a few seconds
+ * earlier). A finish time from a previous transmission is before the start.
+ */
+uint64_t Dali::tx_finish_time_us() const {
+	int32_t offset = tx_finish_us_.load(std::memory_order_acquire)
+		- static_cast<uint32_t>(tx_start_us_);
+
+	return offset < 0 ? 0 : tx_start_us_ + offset;
+}
+
+void Dali::tx_completed() {
+	uint64_t finish = tx_finish_time_us();
+
+	if (finish < tx_start_us_) {
+		finish = esp_timer_get_time();
+	}
+
+	std::lock_guard lock{stats_mutex_};
+	uint64_t duration_us = (finish - tx_start_us_) / tx_busy_count_;
+
+	stats_.min_tx_us = std::min(stats_.min_tx_us, duration_us);
+	stats_.max_tx_us = std::max(stats_.max_tx_us, duration_us);
+	stats_.tx_count += tx_busy_count_;
+	tx_busy_ = false;
+}
+
+void Dali::rx_edge_isr(void *arg) {
+	Dali *dali = static_cast<Dali*>(arg);
+	uint64_t now = esp_timer_get_time();
+
+	/* The ISR can only load a 32-bit time atomically, so compare wrapped times */
+	if (!dali || !dali->rx_window_open_.load(std::memory_order_acquire)
+			|| static_cast<int32_t>(static_cast<uint32_t>(now)
+				- dali->rx_window_us_.load(std::memory_order_relaxed)) < 0) {
+		return;
+	}
+
+	size_t count = dali->rx_edge_count_;
+
+	if (count < RX_MAX_EDGES) {
+		dali->rx_edges_[count] = {now, gpio_get_level(dali->rx_gpio_) == BUS_ARDUINO_LOW};
+	}
+
+	dali->rx_edge_count_ = count + 1;
+}
+
+bool Dali::decode_backward_frame(const RxEdge *edges, size_t count, uint8_t &value) {
+	/*
+	 * Microchip Technology, AN1465
+	 * Digitally Addressable Lighting Interface (DALI) Communication
+	 * Pages 3 to 6
+	 *
+	 * 1 - Start bit (1 bit: 1)
+	 * 8 - Data byte (8 bits)
+	 * 1 - Stop bits (2 bits: idle)
+	 *
+	 * Each bit is two half-bits with a transition in the middle, so the time
+	 * between edges is either one or two half-bits. The last half-bit merges
+	 * into the stop bits if it's high.
+	 */
+	std::array<bool,BACKWARD_FRAME_BITS * 2> half_bits;
+	size_t length = 0;
+
+	if (count == 0 || count > RX_MAX_EDGES || !edges[0].bus_low) {
+		return false;
+	}
+
+	for (size_t i = 1; i < count; i++) {
+		const uint64_t duration_us = edges[i].time_us - edges[i - 1].time_us;
+		size_t half_bit_count;
+
+		if (edges[i].bus_low == edges[i - 1].bus_low) {
+			return false;
+		}
+
+		if (duration_us >= HALF_SYMBOL_US / 2 && duration_us < HALF_SYMBOL_US * 3 / 2) {
+			half_bit_count = 1;
+		} else if (duration_us >= HALF_SYMBOL_US * 3 / 2 && duration_us < HALF_SYMBOL_US * 5 / 2) {
+			half_bit_count = 2;
+		} else {
+			return false;
+		}
+
+		if (length + half_bit_count > half_bits.size()) {
+			return false;
+		}
+
+		for (size_t j = 0; j < half_bit_count; j++) {
+			half_bits[length++] = edges[i - 1].bus_low;
+		}
+	}
+
+	if (length == half_bits.size() - 1 && !edges[count - 1].bus_low) {
+		half_bits[length++] = false;
+	}
+
+	if (length != half_bits.size()) {
+		return false;
+	}
+
+	/* Start bit */
+	if (!half_bits[0] || half_bits[1]) {
+		return false;
+	}
+
+	value = 0;
+
+	for (size_t i = 2; i < half_bits.size(); i += 2) {
+		if (half_bits[i] == half_bits[i + 1]) {
+			return false;
+		}
+
+		/* A 1 is low then high */
+		value = (value << 1) | (half_bits[i] ? 1 : 0);
 	}
-	return 8;
+
+	return true;
+}
+
+inline size_t Dali::byte_to_symbols(rmt_data_t *symbols, uint8_t value) {
+	const ByteSymbols &byte_symbols = BYTE_SYMBOLS[value];
+
+	std::copy(byte_symbols.begin(), byte_symbols.end(), symbols);
+	return byte_symbols.size();
 }
 
 bool Dali::tx_idle() {
 	DALI_LOG(TAG, "Idle");
 
+#if defined(DALI_SIMULATOR)
+	return true;
+#endif
+
 	std::array<rmt_data_t,1> symbols{DALI_STOP_IDLE};
 
 	return rmtWriteBlocking(rmt_, symbols.data(), symbols.size());
 }
 
 bool Dali::tx_frame(uint8_t address, uint8_t data, bool repeat) {
-	uint64_t start = esp_timer_get_time();
-
 	/*
 	 * Microchip Technology, AN1465
 	 * Digitally Addressable Lighting Interface (DALI) Communication
@@ -305,8 +1592,12 @@ bool Dali::tx_frame(uint8_t address, uint8_t data, bool repeat) {
 	 *
 	 * 1 - Stop bits (2 bits: idle)
 	 *     Time between consecutive forward frames (11 bits: idle)
+	 *
+	 * The frame is encoded while the previous frame is still being
+	 * transmitted, into a buffer that isn't in use by the RMT driver.
 	 */
-	std::array<rmt_data_t,2 * (1 + 8 + 8 + 1)> symbols;
+	TxFrame &frame = tx_queue_[tx_queue_next_];
+	auto &symbols = frame.symbols;
 	size_t i = 0;
 
 	symbols[i++] = DALI_1;
@@ -315,26 +1606,46 @@ bool Dali::tx_frame(uint8_t address, uint8_t data, bool repeat) {
 	symbols[i++] = DALI_STOP_IDLE;
 
 	if (repeat) {
-		symbols[i++] = DALI_1;
-		i += byte_to_symbols(&symbols[i], address);
-		i += byte_to_symbols(&symbols[i], data);
-		symbols[i++] = DALI_STOP_IDLE;
+		std::copy(symbols.begin(), symbols.begin() + i, symbols.begin() + i);
+		i *= 2;
 
 		assert(i == symbols.size());
 	} else {
 		assert(i == symbols.size() / 2);
 	}
 
-	bool ret = rmtWriteBlocking(rmt_, symbols.data(), i);
-	uint64_t finish = esp_timer_get_time();
-	std::lock_guard lock{stats_mutex_};
-	size_t tx_count = repeat ? 2 : 1;
-	uint64_t duration_us = (finish - start) / tx_count;
+	frame.size = i;
+	frame.count = repeat ? 2 : 1;
 
-	stats_.min_tx_us = std::min(stats_.min_tx_us, duration_us);
-	stats_.max_tx_us = std::max(stats_.max_tx_us, duration_us);
-	stats_.tx_count += tx_count;
-	return ret;
+	if (!tx_wait()) {
+		return false;
+	}
+
+	tx_start_us_ = esp_timer_get_time();
+#if defined(DALI_SIMULATOR)
+	/*
+	 * The frames are received by the simulated lights immediately but the
+	 * bus is busy for as long as it would take to transmit them.
+	 */
+	simulator_responded_ = simulator_.forward(address, data, false, simulator_response_);
+	if (repeat) {
+		simulator_responded_ = simulator_.forward(address, data, true, simulator_response_);
+	}
+	tx_finish_us_.store(tx_start_us_ + frame.count * (TX_POWER_LEVEL_NS / 1000UL),
+		std::memory_order_release);
+#else
+	if (!rmtWrite(rmt_, symbols.data(), frame.size)) {
+		return false;
+	}
+#endif
+
+	trace_frame(address, data, repeat);
+
+	tx_busy_ = true;
+	tx_busy_count_ = frame.count;
+	tx_queued_count_ += frame.count;
+	tx_queue_next_ = (tx_queue_next_ + 1) % TX_QUEUE_SIZE;
+	return true;
 }
 
 bool Dali::tx_address_power_level(address_t address, level_t level) {
@@ -463,6 +1774,7 @@ bool Dali::tx_broadcast_command(uint8_t command, bool repeat) {
 
 bool Dali::tx_set_dtr_from_actual_level() {
 	DALI_LOG(TAG, "Copy actual level to DTR (broadcast)");
+	tx_dtr_ = DTR_UNKNOWN;
 	return tx_broadcast_command(COMMAND_STORE_ACTUAL_LEVEL_IN_DTR, true);
 }
 
@@ -475,3 +1787,181 @@ bool Dali::tx_set_system_failure_level_from_dtr() {
 	DALI_LOG(TAG, "Copy DTR to system failure level (broadcast)");
 	return tx_broadcast_command(COMMAND_SET_SYSTEM_FAILURE_LEVEL_FROM_DTR, true);
 }
+
+bool Dali::tx_dtr(uint8_t value) {
+	DALI_LOG(TAG, "Set DTR to %u", value);
+
+	/* The actual level in the DTR is overwritten */
+	dtr_actual_level_ = false;
+	tx_dtr_ = DTR_UNKNOWN;
+
+	if (!tx_frame(SPECIAL_COMMAND_DTR0, value, false)) {
+		return false;
+	}
+
+	tx_dtr_ = value;
+	return true;
+}
+
+void Dali::wait_until(uint64_t time_us) {
+	uint64_t now = esp_timer_get_time();
+
+	if (now < time_us) {
+		delay((time_us - now + 999U) / 1000U);
+	}
+}
+
+DaliQueryResult Dali::query(address_t address, uint8_t command, uint8_t &value) {
+	DaliQueryResult result;
+	size_t count;
+
+	rx_edge_count_ = 0;
+
+	if (!tx_address_command(address, command, false)) {
+		return DaliQueryResult::TX_FAILED;
+	}
+
+	/*
+	 * The forward frame is still being transmitted, so it's safe to start
+	 * receiving edges from the end of the frame.
+	 */
+	rx_window_us_.store(tx_start_us_ + RX_WINDOW_START_US, std::memory_order_relaxed);
+	rx_window_open_.store(true, std::memory_order_release);
+
+	if (!tx_wait()) {
+		rx_window_open_.store(false, std::memory_order_release);
+		return DaliQueryResult::TX_FAILED;
+	}
+
+	wait_until(tx_start_us_ + RX_WINDOW_END_US);
+	rx_window_open_.store(false, std::memory_order_release);
+#if defined(DALI_SIMULATOR)
+	count = 0;
+
+	if (simulator_responded_) {
+		value = simulator_response_;
+		result = DaliQueryResult::OK;
+	} else {
+		result = DaliQueryResult::NO_RESPONSE;
+	}
+#else
+	std::atomic_thread_fence(std::memory_order_acquire);
+	count = rx_edge_count_;
+
+	if (count == 0) {
+		result = DaliQueryResult::NO_RESPONSE;
+	} else {
+		result = decode_backward_frame(rx_edges_.data(), count, value)
+			? DaliQueryResult::OK : DaliQueryResult::INVALID;
+
+		wait_until(rx_edges_[std::min(count, RX_MAX_EDGES) - 1].time_us + RX_IDLE_US);
+	}
+#endif
+
+	trace_query(result, value);
+
+	std::lock_guard lock{stats_mutex_};
+
+	switch (result) {
+	case DaliQueryResult::OK:
+		DALI_LOG(TAG, "Query A/%u %02X = %02X", address, command, value);
+		stats_.rx_count++;
+		break;
+
+	case DaliQueryResult::NO_RESPONSE:
+		DALI_LOG(TAG, "Query A/%u %02X = no response", address, command);
+		stats_.rx_no_response_count++;
+		break;
+
+	case DaliQueryResult::INVALID:
+		DALI_LOG(TAG, "Query A/%u %02X = invalid (%zu edges)", address, command, count);
+		stats_.rx_invalid_count++;
+		break;
+
+	case DaliQueryResult::TX_FAILED:
+		break;
+	}
+
+	return result;
+}
+
+DaliQueryResult Dali::query_actual_level(address_t address, level_t &level) {
+	uint8_t value;
+	DaliQueryResult result = query(address, COMMAND_QUERY_ACTUAL_LEVEL, value);
+
+	if (result == DaliQueryResult::OK) {
+		level = value;
+	}
+	return result;
+}
+
+DaliQueryResult Dali::query_status(address_t address, uint8_t &status) {
+	return query(address, COMMAND_QUERY_STATUS, status);
+}
+
+DaliQueryResult Dali::query_lamp_failure(address_t address, bool &lamp_failure) {
+	uint8_t value;
+	DaliQueryResult result = query(address, COMMAND_QUERY_LAMP_FAILURE, value);
+
+	/* There is no response for "no" */
+	switch (result) {
+	case DaliQueryResult::OK:
+		lamp_failure = value == RESPONSE_YES;
+		break;
+
+	case DaliQueryResult::NO_RESPONSE:
+		lamp_failure = false;
+		result = DaliQueryResult::OK;
+		break;
+
+	case DaliQueryResult::INVALID:
+	case DaliQueryResult::TX_FAILED:
+		break;
+	}
+
+	return result;
+}
+
+/*
+ * Query the fade time configured in a light so that it can be restored after
+ * a transition. Lights that don't respond won't have their fade time changed.
+ */
+DaliQueryResult Dali::query_fade_time(address_t address) {
+	uint8_t value;
+	DaliQueryResult result = query(address, COMMAND_QUERY_FADE_TIME_FADE_RATE, value);
+
+	switch (result) {
+	case DaliQueryResult::OK:
+		/* The fade rate is in the low bits */
+		original_fade_times_[address] = value >> 4;
+		tx_fade_times_[address] = original_fade_times_[address];
+		break;
+
+	case DaliQueryResult::NO_RESPONSE:
+		original_fade_times_[address] = FADE_TIME_UNAVAILABLE;
+		break;
+
+	case DaliQueryResult::INVALID:
+	case DaliQueryResult::TX_FAILED:
+		break;
+	}
+
+	return result;
+}
+
+DaliQueryResult Dali::query_groups(address_t address, groups_t &groups) {
+	uint8_t low;
+	uint8_t high;
+	DaliQueryResult result = query(address, COMMAND_QUERY_GROUPS_0_7, low);
+
+	if (result != DaliQueryResult::OK) {
+		return result;
+	}
+
+	result = query(address, COMMAND_QUERY_GROUPS_8_15, high);
+
+	if (result == DaliQueryResult::OK) {
+		groups = groups_t{((unsigned long)high << 8) | low};
+	}
+	return result;
+}
@@ -19,15 +19,78 @@
 #pragma once
 
 #include <Arduino.h>
+#include <driver/gpio.h>
+#include <driver/rmt.h>
 
 #include <array>
+#include <atomic>
 #include <bitset>
+#include <climits>
+#include <memory>
 #include <mutex>
+#include <vector>
 
+#include "latency.h"
 #include "thread.h"
 
+#if defined(DALI_SIMULATOR)
+#include "dali_simulator.h"
+#endif
+
+class Benchmark;
 class Config;
 class LocalLights;
+struct LightsState;
+
+enum class DaliPriority : unsigned int {
+	INTERACTIVE = 0, /**< Dimmer levels */
+	PRESET, /**< Preset and individual light levels */
+	FORCE_REFRESH, /**< Lights that have been powered on */
+	CONFIG, /**< Group sync and power on/system failure level stores */
+	REFRESH, /**< Background refresh of light levels */
+};
+
+static constexpr size_t NUM_DALI_PRIORITIES = 5;
+
+#if !defined(DALI_BUSES)
+# define DALI_BUSES 1
+#endif
+
+/** Number of DALI buses, each with its own 64 addresses */
+static constexpr size_t NUM_DALI_BUSES = DALI_BUSES;
+static_assert(NUM_DALI_BUSES >= 1);
+
+enum class DaliQueryResult : unsigned int {
+	OK = 0, /**< Valid backward frame received */
+	NO_RESPONSE, /**< No backward frame received */
+	INVALID, /**< Invalid backward frame received (e.g. collision) */
+	TX_FAILED, /**< Unable to transmit the forward frame */
+};
+
+/**
+ * Forward frame transmitted on the DALI bus, for analysis of the bus usage.
+ */
+struct DaliTraceFrame {
+	static constexpr uint8_t FLAG_REPEAT = (1U << 0); /**< Frame was sent twice */
+	static constexpr uint8_t FLAG_QUERY = (1U << 1); /**< Frame is a query */
+	static constexpr unsigned int RESULT_SHIFT = 2; /**< Query result (DaliQueryResult) */
+	static constexpr uint8_t RESULT_MASK = 0x3U;
+	static constexpr unsigned int PRIORITY_SHIFT = 4; /**< Priority of the work (DaliPriority) */
+	static constexpr uint8_t PRIORITY_MASK = 0x7U;
+
+	uint32_t time_us; /**< Start time of the frame (µs, wraps around) */
+	uint8_t address; /**< Address byte */
+	uint8_t data; /**< Data byte */
+	uint8_t flags; /**< FLAG_* bits, query result and priority */
+	uint8_t response; /**< Backward frame (only valid if the query result is OK) */
+};
+
+class DaliPriorityStats {
+public:
+	uint64_t tx_count{0}; /**< Number of transmitted commands */
+	uint64_t request_count{0}; /**< Number of requests */
+	uint64_t max_delay_us{0}; /**< Maximum delay from a request to the first transmitted command (µs) */
+};
 
 class DaliStats {
 public:
@@ -36,6 +99,22 @@ public:
 	uint64_t tx_count{0}; /**< Number of transmitted commands */
 	uint64_t max_burst_tx_count{0}; /**< Maximum number of consecutively transmitted commands  */
 	uint64_t max_burst_us{0}; /**< Maximum runtime of consecutively transmitted commands (µs) */
+	uint64_t plan_count{0}; /**< Number of times broadcast/group commands were used for individual levels */
+	uint64_t plan_saved_tx_count{0}; /**< Number of commands saved by using broadcast/group commands */
+	uint64_t fade_time_tx_count{0}; /**< Number of commands transmitted to change fade times */
+	uint64_t fade_count{0}; /**< Number of transitions using the fade time of the lights */
+	uint64_t interpolated_fade_count{0}; /**< Number of transitions too long for the fade time of the lights */
+	uint64_t interpolated_step_count{0}; /**< Number of intermediate levels for interpolated transitions */
+	std::array<DaliPriorityStats,NUM_DALI_PRIORITIES> priorities{}; /**< Stats for each priority */
+	uint64_t rx_count{0}; /**< Number of valid backward frames received */
+	uint64_t rx_no_response_count{0}; /**< Number of queries without a response */
+	uint64_t rx_invalid_count{0}; /**< Number of invalid backward frames received */
+	uint64_t refresh_verified_count{0}; /**< Number of refreshes where the actual level was already correct */
+	uint64_t refresh_corrected_count{0}; /**< Number of refreshes where the actual level was incorrect */
+	uint64_t group_mismatch_count{0}; /**< Number of lights found with different group membership */
+	uint64_t refresh_count{0}; /**< Number of background refreshes of lights */
+	uint64_t refresh_skipped_count{0}; /**< Number of lights skipped by the background refresh because they were recently set */
+	unsigned long refresh_period_ms{0}; /**< Current background refresh period (ms) */
 };
 
 class Dali: public WakeupThread {
@@ -53,23 +132,97 @@ private:
 public:
 	static constexpr size_t num_addresses = MAX_ADDR + 1;
 	static constexpr size_t num_groups = MAX_GROUP + 1;
+	/** Light IDs are the bus number × num_addresses + the address on that bus */
+	static constexpr size_t num_lights = num_addresses * NUM_DALI_BUSES;
 	static constexpr group_t GROUP_NONE = UINT8_MAX;
 	static constexpr level_t MAX_LEVEL = 254;
 	static constexpr level_t LEVEL_NO_CHANGE = 255;
 
+	/** Maximum duration of a transition between light levels (ms) */
+	static constexpr unsigned long MAX_TRANSITION_MS = 60 * 60 * 1000;
+
 	using addresses_t = std::bitset<num_addresses>;
+	using lights_t = std::bitset<num_lights>;
 	using groups_t = std::bitset<num_groups>;
 
-	Dali(const Config &config, const LocalLights &lights);
+	/**
+	 * Broadcast and group commands to transmit before the individual light
+	 * levels, to reach all of the levels using fewer commands.
+	 */
+	struct Plan {
+		level_fast_t broadcast_level{LEVEL_NO_CHANGE}; /**< Broadcast level to transmit first */
+		std::array<level_fast_t,num_groups> group_levels{}; /**< Group levels to transmit next */
+		unsigned int tx_count{0}; /**< Number of commands required with this plan */
+		unsigned int individual_tx_count{0}; /**< Number of commands required without this plan */
+	};
+
+	/**
+	 * State of a light as reported by queries on the DALI bus.
+	 */
+	struct Ballast {
+		bool present{false}; /**< Responded to the most recent query */
+		level_fast_t actual_level{LEVEL_NO_CHANGE}; /**< Actual level */
+		bool status_known{false}; /**< Status has been queried */
+		uint8_t status{0}; /**< Status (STATUS_* bits) */
+		bool lamp_failure{false}; /**< Lamp failure has been reported */
+		bool groups_known{false}; /**< Group membership has been queried */
+		groups_t groups; /**< Group membership */
+	};
+
+	/*
+	 * IEC62386-102:2014 Edition 2.0, Section 11 Definition of Commands, QUERY STATUS
+	 */
+	static constexpr uint8_t STATUS_CONTROL_GEAR_FAILURE = (1U << 0);
+	static constexpr uint8_t STATUS_LAMP_FAILURE = (1U << 1);
+	static constexpr uint8_t STATUS_LAMP_ON = (1U << 2);
+	static constexpr uint8_t STATUS_LIMIT_ERROR = (1U << 3);
+	static constexpr uint8_t STATUS_FADE_RUNNING = (1U << 4);
+	static constexpr uint8_t STATUS_RESET_STATE = (1U << 5);
+	static constexpr uint8_t STATUS_SHORT_ADDRESS_MISSING = (1U << 6);
+	static constexpr uint8_t STATUS_POWER_CYCLE_SEEN = (1U << 7);
+
+	Dali(const Config &config, const LocalLights &lights, unsigned int bus = 0);
+
+	/** Addresses on a bus from a set of light IDs */
+	static inline addresses_t bus_addresses(const lights_t &lights, unsigned int bus) {
+		return addresses_t{((lights >> (bus * num_addresses)) & lights_t{UINT64_MAX}).to_ullong()};
+	}
+
+	/** Light IDs from a set of addresses on a bus */
+	static inline lights_t bus_lights(const addresses_t &addresses, unsigned int bus) {
+		return lights_t{addresses.to_ullong()} << (bus * num_addresses);
+	}
+
+	static Plan plan_levels(const LightsState &state,
+		const std::array<level_fast_t,num_addresses> &tx_levels,
+		const std::array<level_fast_t,num_addresses> &fade_times);
+	static const char *priority_name(DaliPriority priority);
 
 	void setup();
 	void start();
+	const char *name() const;
+	unsigned int bus() const;
 	DaliStats get_stats();
+	std::array<Ballast,num_addresses> get_ballasts();
+
+	/**
+	 * Get the most recently transmitted frames, oldest first. The sequence
+	 * number counts every frame since boot so that gaps between successive
+	 * calls can be detected.
+	 */
+	std::vector<DaliTraceFrame> get_trace(uint32_t &first_sequence);
+	void benchmark(Benchmark &benchmark) const;
+
+	/** Time that interactive changes were last pending (millis()) */
+	uint32_t last_interactive_ms() const;
 
 	using WakeupThread::wake_up;
 	using WakeupThread::wake_up_isr;
 
 private:
+	/* The simulator uses the address and command definitions */
+	friend class DaliSimulator;
+
 	static constexpr const char *TAG = "DALI";
 
 	/**
@@ -116,9 +269,80 @@ private:
 	static constexpr unsigned long TX_POWER_LEVEL_MS = TX_POWER_LEVEL_NS / 1000000UL;
 	static_assert(TX_POWER_LEVEL_MS == 25);
 
+	static constexpr unsigned long TX_TIMEOUT_MS = TX_POWER_LEVEL_MS * 2 * 2;
+
+	/**
+	 * Microchip Technology, AN1465 (2012)
+	 * Digitally Addressable Lighting Interface (DALI) Communication
+	 *
+	 * A backward frame (1 start bit, 8 data bits and 2 stop bits) starts 7 to
+	 * 22 half-bits after the end of the forward frame. The next forward frame
+	 * must not start until 22 half-bits after the end of the backward frame.
+	 *
+	 * Edges are ignored until 2 half-bits after the end of the forward frame
+	 * so that our own transmission isn't received.
+	 */
+	static constexpr unsigned long HALF_SYMBOL_US = HALF_SYMBOL_TICKS * TICK_NS / 1000UL;
+	static constexpr unsigned long FORWARD_FRAME_US = (START_BITS + 8 + 8) * HALF_SYMBOL_US * 2;
+	static constexpr unsigned long BACKWARD_FRAME_BITS = START_BITS + 8;
+	static constexpr unsigned long RX_WINDOW_START_US = FORWARD_FRAME_US + HALF_SYMBOL_US * 2;
+	static constexpr unsigned long RX_WINDOW_END_US = FORWARD_FRAME_US + HALF_SYMBOL_US * 22
+		+ (BACKWARD_FRAME_BITS + STOP_BITS) * HALF_SYMBOL_US * 2;
+	static constexpr unsigned long RX_IDLE_US = (STOP_BITS * 2 + 22) * HALF_SYMBOL_US;
+	static constexpr size_t RX_MAX_EDGES = 32;
+
+	/**
+	 * IEC62386-102:2014 Edition 2.0, Section 9.5.2 Fade time
+	 *
+	 * Fade time codes 1 to 15 are 0.5 × √(2^N) seconds, 0 is no fade.
+	 */
+	static constexpr std::array<unsigned long,16> FADE_TIME_MS{
+		0, 707, 1000, 1414, 2000, 2828, 4000, 5657,
+		8000, 11314, 16000, 22627, 32000, 45255, 64000, 90510
+	};
+	static constexpr level_fast_t FADE_TIME_UNKNOWN = UINT8_MAX;
+	/** The light didn't respond to a query of its fade time */
+	static constexpr level_fast_t FADE_TIME_UNAVAILABLE = UINT8_MAX - 1;
+	static constexpr uint_fast16_t DTR_UNKNOWN = UINT16_MAX;
+
+	/**
+	 * Transitions longer than the maximum fade time (to the nearest fade
+	 * time code) are interpolated by transmitting intermediate levels, while
+	 * using at most half of the bus time.
+	 */
+	static constexpr unsigned long MAX_FADE_TIME_MS = FADE_TIME_MS.back() * 6 / 5;
+	static constexpr unsigned long MIN_INTERPOLATE_INTERVAL_MS = 200;
+
+	/** Additional time for the first level of a transition to be transmitted */
+	static constexpr unsigned long FADE_MARGIN_MS = 1000;
+
+	/** Number of transmitted frames to keep for the trace */
+	static constexpr size_t TRACE_SIZE = 1024;
+
+	/**
+	 * Number of refreshes of each light between queries of the status, lamp
+	 * failure and group membership, or attempting to query lights that didn't
+	 * previously respond.
+	 */
+	static constexpr unsigned int BALLAST_QUERY_INTERVAL = 12;
+
+	/**
+	 * Period over which all lights are refreshed. This backs off
+	 * exponentially up to the maximum while the lights are idle.
+	 */
 	static constexpr unsigned long REFRESH_PERIOD_MS = 5000;
+	static constexpr unsigned long MAX_REFRESH_PERIOD_MS = 80000;
 	static constexpr unsigned long WATCHDOG_INTERVAL_MS = CONFIG_ESP_TASK_WDT_TIMEOUT_S * 1000 / 4;
 
+	/**
+	 * Maximum time that pending work for each priority will wait for higher
+	 * priority work before it gets to transmit a command. The background
+	 * refresh never takes priority over anything else.
+	 */
+	static constexpr std::array<unsigned long,NUM_DALI_PRIORITIES> PRIORITY_DEADLINE_MS{
+		50, 250, 1000, 1000, ULONG_MAX
+	};
+
 	/*
 	 * Microchip Technology, AN1465
 	 * Digitally Addressable Lighting Interface (DALI) Communication
@@ -141,6 +365,11 @@ private:
 		.duration1 = HALF_SYMBOL_TICKS * IDLE_SYMBOLS * 2, .level1 = BUS_RMT_IDLE,
 	}}};
 
+	/*
+	 * IEC62386-102:2014 Edition 2.0, Section 11 Definition of Commands, Table 16
+	 */
+	static constexpr uint8_t SPECIAL_COMMAND_DTR0 = 0xA3;
+
 	static constexpr uint8_t GROUP_ADDRESS = 0x40;
 	static constexpr uint8_t BROADCAST_ADDRESS = 0x7F;
 	static constexpr uint8_t DATA_POWER_LEVEL = 0x00;
@@ -170,16 +399,93 @@ private:
 	static constexpr uint8_t COMMAND_STORE_ACTUAL_LEVEL_IN_DTR = 0x21;
 	static constexpr uint8_t COMMAND_SET_SYSTEM_FAILURE_LEVEL_FROM_DTR = 0x2C;
 	static constexpr uint8_t COMMAND_SET_POWER_ON_LEVEL_FROM_DTR = 0x2D;
+	static constexpr uint8_t COMMAND_SET_FADE_TIME_FROM_DTR = 0x2E;
 	static constexpr uint8_t COMMAND_ADD_TO_GROUP = 0x60;
 	static constexpr uint8_t COMMAND_REMOVE_FROM_GROUP = 0x70;
+	static constexpr uint8_t COMMAND_QUERY_STATUS = 0x90;
+	static constexpr uint8_t COMMAND_QUERY_LAMP_FAILURE = 0x92;
+	static constexpr uint8_t COMMAND_QUERY_ACTUAL_LEVEL = 0xA0;
+	static constexpr uint8_t COMMAND_QUERY_FADE_TIME_FADE_RATE = 0xA5;
+	static constexpr uint8_t COMMAND_QUERY_GROUPS_0_7 = 0xC0;
+	static constexpr uint8_t COMMAND_QUERY_GROUPS_8_15 = 0xC1;
+
+	static constexpr uint8_t RESPONSE_YES = 0xFF;
+
+	/**
+	 * Number of encoded frames that can be in use at the same time: one being
+	 * transmitted and one being prepared while the other is on the bus.
+	 */
+	static constexpr size_t TX_QUEUE_SIZE = 2;
 
+	using ByteSymbols = std::array<rmt_data_t,8>;
+
+	/**
+	 * Encoded symbols for every byte value, so that encoding a frame only
+	 * needs to copy the symbols for the address and data bytes.
+	 */
+	static const std::array<ByteSymbols,256> BYTE_SYMBOLS;
+
+	struct TxFrame {
+		std::array<rmt_data_t,2 * (1 + 8 + 8 + 1)> symbols; /**< Encoded frame (optionally repeated) */
+		size_t size{0}; /**< Number of symbols used */
+		unsigned int count{0}; /**< Number of forward frames */
+	};
+
+	/**
+	 * Transition of a light to its current level.
+	 */
+	struct Fade {
+		uint64_t request_us{0}; /**< Time of the request (identifies the transition) */
+		uint64_t end_us{0}; /**< Time that the transition will be complete */
+		unsigned long duration_ms{0}; /**< Duration of an interpolated transition */
+		level_fast_t fade_time{FADE_TIME_UNKNOWN}; /**< Fade time to transmit levels with (unknown if there's no transition) */
+		level_fast_t from_level{LEVEL_NO_CHANGE}; /**< Starting level of an interpolated transition */
+		level_fast_t to_level{LEVEL_NO_CHANGE}; /**< Final level of an interpolated transition */
+		level_fast_t step_level{LEVEL_NO_CHANGE}; /**< Current level of an interpolated transition */
+		bool interpolate{false}; /**< Transmit intermediate levels */
+	};
+
+	struct RxEdge {
+		uint64_t time_us; /**< Time of the edge */
+		bool bus_low; /**< Bus level after the edge */
+	};
+
+	static constexpr std::array<ByteSymbols,256> make_byte_symbols();
 	static size_t byte_to_symbols(rmt_data_t *symbols, uint8_t value);
+	static level_fast_t fade_time_code(unsigned long duration_ms);
+	static bool same_fade_times(const addresses_t &addresses,
+		const std::array<level_fast_t,num_addresses> &fade_times);
+	static bool decode_backward_frame(const RxEdge *edges, size_t count, uint8_t &value);
+	IRAM_ATTR static void tx_done_isr(rmt_channel_t channel, void *arg);
+	IRAM_ATTR static void rx_edge_isr(void *arg);
 
 	~Dali() = delete;
 
 	unsigned long run_tasks() override;
+	void clear_unknown_levels(const LightsState &state);
+	addresses_t changed_addresses(const LightsState &state) const;
+	bool next_address(const addresses_t &addresses, address_t &address);
+	unsigned long refresh_period_ms(const LightsState &state, uint64_t now);
+	void confirmed_level(address_t address);
+	void confirmed_levels(const addresses_t &addresses);
+	void update_fades(LightsState &state);
+	bool tx_fade_times(const LightsState &state, const addresses_t &lights, bool &sent);
+	void trace_state(const LightsState &state);
+	void trace_tx();
+	void trace_finish();
+	void trace_frame(uint8_t address, uint8_t data, bool repeat);
+	void trace_query(DaliQueryResult result, uint8_t value);
+
+	bool tx_interactive(const LightsState &state, const addresses_t &changed);
+	bool tx_preset(const LightsState &state, const addresses_t &changed);
+	bool tx_config(const LightsState &state);
+	bool tx_address_level(const LightsState &state, address_t address);
+	bool refresh_address_level(const LightsState &state, address_t address);
 
 	bool async_ready();
+	uint64_t tx_finish_time_us() const;
+	bool tx_wait();
+	void tx_completed();
 	bool tx_idle();
 	bool tx_frame(uint8_t address, uint8_t data, bool repeat);
 	bool tx_address_power_level(address_t address, level_t level);
@@ -196,15 +502,83 @@ private:
 	bool tx_set_dtr_from_actual_level();
 	bool tx_set_power_on_level_from_dtr();
 	bool tx_set_system_failure_level_from_dtr();
-
+	bool tx_dtr(uint8_t value);
+
+	void wait_until(uint64_t time_us);
+	DaliQueryResult query(address_t address, uint8_t command, uint8_t &value);
+	DaliQueryResult query_actual_level(address_t address, level_t &level);
+	DaliQueryResult query_status(address_t address, uint8_t &status);
+	DaliQueryResult query_lamp_failure(address_t address, bool &lamp_failure);
+	DaliQueryResult query_groups(address_t address, groups_t &groups);
+	DaliQueryResult query_fade_time(address_t address);
+
+	static std::array<Dali*,RMT_CHANNEL_MAX> tx_channels_;
+
+	const unsigned int bus_;
+	const char *name_;
+	const gpio_num_t rx_gpio_;
+	const gpio_num_t tx_gpio_;
 	const Config &config_;
 	const LocalLights &lights_;
+	std::unique_ptr<LightsState> state_;
 	rmt_obj_t *rmt_{nullptr};
+	std::array<TxFrame,TX_QUEUE_SIZE> tx_queue_{};
+	size_t tx_queue_next_{0};
+	bool tx_busy_{false};
+	unsigned int tx_busy_count_{0};
+	uint64_t tx_start_us_{0};
+	std::atomic<uint32_t> tx_finish_us_{0}; /**< Wrapped time that the transmission finished (written by the ISR) */
+	uint64_t next_refresh_us_{0};
+	uint32_t refresh_config_generation_{UINT32_MAX};
+	uint64_t refresh_reset_us_{0};
+	std::atomic<unsigned long> current_refresh_period_ms_{REFRESH_PERIOD_MS};
+	std::atomic<uint32_t> last_interactive_ms_{0};
+	std::array<uint64_t,num_addresses> confirmed_us_{};
 	std::array<level_fast_t,num_addresses> tx_levels_{};
 	std::array<level_fast_t,num_groups> tx_group_levels_{};
 	level_fast_t tx_broadcast_level_{LEVEL_NO_CHANGE};
+	std::array<level_fast_t,num_addresses> tx_fade_times_{};
+	uint_fast16_t tx_dtr_{DTR_UNKNOWN};
+	std::array<Fade,num_addresses> fades_{};
+	std::array<level_fast_t,num_addresses> fade_times_{}; /**< Required fade time of each light (or unknown if it doesn't matter) */
+	std::array<level_fast_t,num_addresses> original_fade_times_{}; /**< Fade time configured in each light before any transitions */
+	uint64_t next_fade_us_{UINT64_MAX}; /**< Time of the next interpolated level */
 	unsigned int next_address_{0};
 	unsigned int next_group_{0};
+	std::array<uint64_t,NUM_DALI_PRIORITIES> pending_since_us_{};
+	std::array<uint64_t,NUM_DALI_PRIORITIES> served_request_us_{};
+	uint64_t tx_queued_count_{0};
+	bool trace_active_{false}; /**< Waiting for the traced change to be transmitted */
+	LatencyOrigin trace_origin_{};
+	uint64_t trace_state_us_{0};
+	uint64_t trace_last_tx_us_{0};
+	bool planning_{false};
+	group_fast_t sync_group_{GROUP_NONE};
+	addresses_t sync_addresses_;
+	bool sync_group_empty_{false};
+	unsigned int sync_address_{0};
+	bool dtr_actual_level_{false};
+	std::array<RxEdge,RX_MAX_EDGES> rx_edges_{};
+	volatile size_t rx_edge_count_{0};
+	std::atomic<uint32_t> rx_window_us_{0}; /**< Wrapped time that the ISR starts receiving edges */
+	std::atomic<bool> rx_window_open_{false}; /**< ISR is receiving edges */
+	std::array<unsigned int,num_addresses> refresh_visits_{};
+	std::array<level_fast_t,num_addresses> mismatch_levels_{};
+	std::array<level_fast_t,num_addresses> mismatch_actual_levels_{};
+
+#if defined(DALI_SIMULATOR)
+	DaliSimulator simulator_;
+	bool simulator_responded_{false};
+	uint8_t simulator_response_{0};
+#endif
+
+	DaliPriority tx_priority_{DaliPriority::REFRESH};
+	std::mutex trace_mutex_;
+	std::unique_ptr<std::array<DaliTraceFrame,TRACE_SIZE>> trace_frames_;
+	uint32_t trace_sequence_{0}; /**< Number of frames traced */
+
+	std::mutex ballasts_mutex_;
+	std::array<Ballast,num_addresses> ballasts_{};
 
 	std::mutex stats_mutex_;
 	DaliStats stats_;
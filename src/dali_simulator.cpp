@@ -0,0 +1,197 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dali_simulator.h"
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+
+#include "dali.h"
+
+/*
+ * IEC62386-102:2014 Edition 2.0, Section 11 Definition of Commands
+ */
+static constexpr uint8_t SPECIAL_COMMAND_FIRST = 0xA1;
+static constexpr uint8_t SPECIAL_COMMAND_LAST = 0xFD;
+
+DaliSimulator::DaliSimulator() {
+}
+
+bool DaliSimulator::send_twice(uint8_t command) {
+	return command >= 0x20 && command <= 0x81;
+}
+
+/*
+ * Microchip Technology, AN1465
+ * Digitally Addressable Lighting Interface (DALI) Communication
+ * Page 5
+ */
+std::bitset<DaliSimulator::NUM_BALLASTS> DaliSimulator::addressed(uint8_t address) const {
+	std::bitset<NUM_BALLASTS> ballasts;
+
+	if ((address >> 1) == Dali::BROADCAST_ADDRESS) {
+		ballasts.set();
+	} else if (!(address & 0x80)) {
+		ballasts[(address >> 1) & 0x3F] = true;
+	} else if ((address & 0xE0) == Dali::GROUP_ADDRESS << 1) {
+		unsigned int group = (address >> 1) & 0x0F;
+
+		for (unsigned int i = 0; i < NUM_BALLASTS; i++) {
+			ballasts[i] = ballasts_[i].groups[group];
+		}
+	}
+
+	return ballasts;
+}
+
+bool DaliSimulator::forward(uint8_t address, uint8_t data, bool repeat, uint8_t &response) {
+	if (address >= SPECIAL_COMMAND_FIRST && address <= SPECIAL_COMMAND_LAST && (address & 1)) {
+		if (address == Dali::SPECIAL_COMMAND_DTR0) {
+			for (auto &ballast : ballasts_) {
+				ballast.dtr = data;
+			}
+		}
+
+		return false;
+	}
+
+	const std::bitset<NUM_BALLASTS> ballasts = addressed(address);
+	bool responded = false;
+
+	if ((address & 1) == Dali::DATA_POWER_LEVEL) {
+		if (data != MASK) {
+			for (unsigned int i = 0; i < NUM_BALLASTS; i++) {
+				if (ballasts[i]) {
+					ballasts_[i].level = data;
+					ballasts_[i].reset_state = false;
+				}
+			}
+		}
+
+		return false;
+	}
+
+	if (send_twice(data) && !repeat) {
+		return false;
+	}
+
+	for (unsigned int i = 0; i < NUM_BALLASTS; i++) {
+		if (ballasts[i]) {
+			/* Multiple responses would collide, the caller only queries one ballast */
+			responded = command(ballasts_[i], data, response) || responded;
+		}
+	}
+
+	return responded && ballasts.count() == 1;
+}
+
+bool DaliSimulator::command(Ballast &ballast, uint8_t command, uint8_t &response) {
+	switch (command) {
+	case Dali::COMMAND_TARGET_LEVEL_OFF:
+		ballast.level = 0;
+		break;
+
+	case Dali::COMMAND_STEP_UP:
+		if (ballast.level > 0 && ballast.level < MAX_LEVEL) {
+			ballast.level++;
+		}
+		break;
+
+	case Dali::COMMAND_STEP_DOWN:
+		if (ballast.level > MIN_LEVEL) {
+			ballast.level--;
+		}
+		break;
+
+	case Dali::COMMAND_STEP_DOWN_AND_OFF:
+		if (ballast.level > 0) {
+			ballast.level = ballast.level > MIN_LEVEL ? ballast.level - 1 : 0;
+		}
+		break;
+
+	case Dali::COMMAND_ON_AND_STEP_UP:
+		if (ballast.level == 0) {
+			ballast.level = MIN_LEVEL;
+		} else if (ballast.level < MAX_LEVEL) {
+			ballast.level++;
+		}
+		break;
+
+	case Dali::COMMAND_RESET:
+		ballast = {};
+		break;
+
+	case Dali::COMMAND_STORE_ACTUAL_LEVEL_IN_DTR:
+		ballast.dtr = ballast.level;
+		break;
+
+	case Dali::COMMAND_SET_SYSTEM_FAILURE_LEVEL_FROM_DTR:
+		ballast.system_failure_level = ballast.dtr;
+		break;
+
+	case Dali::COMMAND_SET_POWER_ON_LEVEL_FROM_DTR:
+		ballast.power_on_level = ballast.dtr;
+		break;
+
+	case Dali::COMMAND_SET_FADE_TIME_FROM_DTR:
+		ballast.fade_time = std::min(ballast.dtr, MAX_FADE_TIME);
+		break;
+
+	case Dali::COMMAND_QUERY_STATUS:
+		response = (ballast.level > 0 ? Dali::STATUS_LAMP_ON : 0)
+			| (ballast.reset_state ? Dali::STATUS_RESET_STATE : 0);
+		return true;
+
+	case Dali::COMMAND_QUERY_LAMP_FAILURE:
+		/* There is no response for "no" */
+		return false;
+
+	case Dali::COMMAND_QUERY_ACTUAL_LEVEL:
+		response = ballast.level;
+		return true;
+
+	case Dali::COMMAND_QUERY_FADE_TIME_FADE_RATE:
+		response = (ballast.fade_time << 4) | DEFAULT_FADE_RATE;
+		return true;
+
+	case Dali::COMMAND_QUERY_GROUPS_0_7:
+		response = ballast.groups.to_ulong() & 0xFFU;
+		return true;
+
+	case Dali::COMMAND_QUERY_GROUPS_8_15:
+		response = (ballast.groups.to_ulong() >> 8) & 0xFFU;
+		return true;
+
+	default:
+		if (command >= Dali::COMMAND_ADD_TO_GROUP
+				&& command < Dali::COMMAND_ADD_TO_GROUP + NUM_GROUPS) {
+			ballast.groups[command - Dali::COMMAND_ADD_TO_GROUP] = true;
+		} else if (command >= Dali::COMMAND_REMOVE_FROM_GROUP
+				&& command < Dali::COMMAND_REMOVE_FROM_GROUP + NUM_GROUPS) {
+			ballast.groups[command - Dali::COMMAND_REMOVE_FROM_GROUP] = false;
+		}
+		break;
+	}
+
+	if (command != Dali::COMMAND_RESET) {
+		ballast.reset_state = false;
+	}
+
+	return false;
+}
@@ -0,0 +1,64 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+
+/**
+ * Model of the control gear on a DALI bus, for testing without any lights.
+ * Every short address has a ballast that responds to the commands and
+ * queries used by the Dali class. Fade times are stored but not modelled
+ * so levels change immediately.
+ */
+class DaliSimulator {
+public:
+	static constexpr size_t NUM_BALLASTS = 64;
+	static constexpr size_t NUM_GROUPS = 16;
+
+	DaliSimulator();
+
+	/** Receive a forward frame, returning true if there's a backward frame */
+	bool forward(uint8_t address, uint8_t data, bool repeat, uint8_t &response);
+
+private:
+	static constexpr uint8_t MIN_LEVEL = 1;
+	static constexpr uint8_t MAX_LEVEL = 254;
+	static constexpr uint8_t MASK = 255;
+	static constexpr uint8_t MAX_FADE_TIME = 15;
+	static constexpr uint8_t DEFAULT_FADE_RATE = 7;
+
+	struct Ballast {
+		uint8_t level{MAX_LEVEL};
+		uint8_t dtr{0};
+		uint8_t power_on_level{MAX_LEVEL};
+		uint8_t system_failure_level{MAX_LEVEL};
+		uint8_t fade_time{0};
+		std::bitset<NUM_GROUPS> groups;
+		bool reset_state{true};
+	};
+
+	static bool send_twice(uint8_t command);
+
+	std::bitset<NUM_BALLASTS> addressed(uint8_t address) const;
+	bool command(Ballast &ballast, uint8_t command, uint8_t &response);
+
+	std::array<Ballast,NUM_BALLASTS> ballasts_{};
+};
@@ -19,7 +19,11 @@
 #include "debounce.h"
 
 #include <driver/gpio.h>
+#include <esp_timer.h>
 
+#include <algorithm>
+
+#include "latency.h"
 #include "thread.h"
 
 Debounce::Debounce(gpio_num_t pin, bool active_low, unsigned long duration_us)
@@ -55,6 +59,12 @@ void Debounce::start(WakeupThread &wakeup) {
 	ESP_ERROR_CHECK(gpio_intr_enable(pin_));
 }
 
+/*
+ * Interrupts only wake the thread when it isn't already going to run again
+ * (e.g. at the end of the debounce time) so that contact bounce doesn't
+ * cause a context switch for every edge. The time of the most recent edge
+ * is used to restart the debounce time.
+ */
 DebounceResult Debounce::run() {
 	unsigned long wait_ms = ULONG_MAX;
 	unsigned long change_count_copy = change_count_irq_;
@@ -64,7 +74,7 @@ DebounceResult Debounce::run() {
 
 	if (change_count_ != change_count_copy) {
 		change_count_ = change_count_copy;
-		change_us_ = now_us;
+		change_us_ = std::min(now_us, interrupt_us());
 	}
 
 	if (change_state_ != level) {
@@ -91,14 +101,31 @@ DebounceResult Debounce::run() {
 		}
 	}
 
+	if (wait_ms == ULONG_MAX) {
+		wakeup_pending_ = false;
+
+		if (change_count_irq_ != change_count_) {
+			/* Interrupted before the next interrupt could wake the thread */
+			wait_ms = 0;
+		}
+	}
+
 	return {wait_ms, changed};
 }
 
+uint64_t Debounce::interrupt_us() const {
+	return Latency::isr_time(change_us_irq_.load(std::memory_order_relaxed));
+}
+
 IRAM_ATTR void debounce_interrupt_handler(void *arg) {
 	static_cast<Debounce*>(arg)->interrupt_handler();
 }
 
 IRAM_ATTR void Debounce::interrupt_handler() {
+	change_us_irq_.store(esp_timer_get_time(), std::memory_order_relaxed);
 	change_count_irq_++;
-	wakeup_->wake_up_isr();
+
+	if (!wakeup_pending_.exchange(true)) {
+		wakeup_->wake_up_isr();
+	}
 }
@@ -45,6 +45,7 @@ public:
 	DebounceResult run();
 	inline bool value() const { return state_ == active(); }
 	inline bool first() const { return first_ == 1; }
+	uint64_t interrupt_us() const;
 
 private:
 	inline int active() const { return active_low_ ? 0 : 1; }
@@ -64,4 +65,6 @@ private:
 	int state_{0};
 	unsigned long change_count_{0};
 	std::atomic<unsigned long> change_count_irq_{0};
+	std::atomic<uint32_t> change_us_irq_{0}; /**< Time of the last interrupt */
+	std::atomic<bool> wakeup_pending_{false}; /**< Thread will run again without another interrupt */
 };
@@ -28,6 +28,7 @@
 #include <string>
 
 #include "config.h"
+#include "latency.h"
 #include "lights.h"
 #include "network.h"
 #include "rotary_encoder.h"
@@ -75,9 +76,7 @@ void Dimmers::setup() {
 		encoder_[i].start(*this);
 	}
 
-	std::thread t;
-	make_thread(t, "dimmers", 8192, 1, 20, &Dimmers::run_loop, this);
-	t.detach();
+	start_thread(8192, 1, 20);
 }
 
 unsigned long Dimmers::run_tasks() {
@@ -87,14 +86,75 @@ unsigned long Dimmers::run_tasks() {
 		return 1;
 	}
 
+	std::array<long,NUM_DIMMERS> levels;
+	bool pending = false;
+
+	{
+		std::lock_guard lock{stats_mutex_};
+
+		for (unsigned int i = 0; i < NUM_DIMMERS; i++) {
+			long level_change = run_dimmer(i);
+
+			if (level_change) {
+				stats_.tick_count++;
+
+				if (state_[i].level_change) {
+					stats_.coalesced_tick_count++;
+				} else {
+					state_[i].level_change_us = encoder_[i].change_us();
+				}
+
+				state_[i].level_change = std::max(-(long)MAX_LEVEL, std::min((long)MAX_LEVEL,
+					state_[i].level_change + level_change));
+			}
+
+			pending |= state_[i].level_change != 0;
+		}
+	}
+
+	if (!pending) {
+		return WATCHDOG_INTERVAL_MS;
+	}
+
+	/*
+	 * Send the first change after the dimmers have been idle immediately,
+	 * and then combine changes until the flush interval has elapsed so that
+	 * turning an encoder doesn't send a message for every step.
+	 */
+	uint64_t now_us = esp_timer_get_time();
+	uint64_t interval_us = flush_interval_ms() * 1000ULL;
+	uint64_t elapsed_us = now_us - last_flush_us_;
+
+	if (last_flush_us_ && elapsed_us < interval_us) {
+		return (interval_us - elapsed_us + 999) / 1000;
+	}
+
+	uint64_t change_us = UINT64_MAX;
+
 	for (unsigned int i = 0; i < NUM_DIMMERS; i++) {
-		run_dimmer(i);
+		levels[i] = state_[i].level_change;
+		state_[i].level_change = 0;
+
+		if (levels[i]) {
+			change_us = std::min(change_us, state_[i].level_change_us);
+		}
 	}
 
+	LatencyTrace trace{LatencySource::CONTROL, change_us};
+
+	lights_.dim_adjust(levels);
+	last_flush_us_ = now_us;
+
+	std::lock_guard lock{stats_mutex_};
+	stats_.flush_count++;
 	return WATCHDOG_INTERVAL_MS;
 }
 
-void Dimmers::run_dimmer(unsigned int dimmer_id) {
+unsigned long Dimmers::flush_interval_ms() const {
+	return FixedConfig::isRemote() ? FixedConfig::mqttRemoteDimIntervalMs() : 0;
+}
+
+long Dimmers::run_dimmer(unsigned int dimmer_id) {
 	long encoder_steps = config_.get_dimmer_encoder_steps(dimmer_id);
 	long encoder_change = encoder_[dimmer_id].read();
 
@@ -106,7 +166,7 @@ void Dimmers::run_dimmer(unsigned int dimmer_id) {
 	}
 
 	if (state_[dimmer_id].encoder_steps == 0) {
-		return;
+		return 0;
 	}
 
 	long abs_encoder_steps = std::abs(encoder_steps);
@@ -115,7 +175,7 @@ void Dimmers::run_dimmer(unsigned int dimmer_id) {
 	long change_count = std::abs(state_[dimmer_id].encoder_steps) / abs_encoder_steps;
 
 	if (change_count == 0) {
-		return;
+		return 0;
 	}
 
 	if (!encoder_forward) {
@@ -129,9 +189,15 @@ void Dimmers::run_dimmer(unsigned int dimmer_id) {
 	}
 
 	long level_steps = config_.get_dimmer_level_steps(dimmer_id);
-	long level_change = std::max(-(long)MAX_LEVEL, std::min((long)MAX_LEVEL, change_count * level_steps));
+	return std::max(-(long)MAX_LEVEL, std::min((long)MAX_LEVEL, change_count * level_steps));
+}
+
+DimmerStats Dimmers::get_stats() {
+	std::lock_guard lock{stats_mutex_};
+	DimmerStats stats = stats_;
 
-	lights_.dim_adjust(dimmer_id, level_change);
+	stats_ = {};
+	return stats;
 }
 
 void Dimmers::publish_debug(unsigned int dimmer_id) {
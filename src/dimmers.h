@@ -20,6 +20,7 @@
 
 #include <Arduino.h>
 #include <array>
+#include <mutex>
 #include <string>
 
 #include "dali.h"
@@ -45,6 +46,15 @@ public:
 	DimmerState() = default;
 
 	long encoder_steps{0};
+	long level_change{0}; /**< Level change that hasn't been sent yet */
+	uint64_t level_change_us{0}; /**< Time of the oldest level change that hasn't been sent yet */
+};
+
+class DimmerStats {
+public:
+	uint64_t tick_count{0}; /**< Number of level changes from the dimmers */
+	uint64_t coalesced_tick_count{0}; /**< Level changes combined with a previous change */
+	uint64_t flush_count{0}; /**< Number of times level changes have been sent */
 };
 
 class Dimmers: public WakeupThread {
@@ -56,6 +66,7 @@ public:
 
 	void setup();
 	void publish_debug(unsigned int dimmer_id);
+	DimmerStats get_stats();
 
 private:
 	static constexpr const char *TAG = "Dimmers";
@@ -65,7 +76,8 @@ private:
 	~Dimmers() = delete;
 
 	unsigned long run_tasks() override;
-	void run_dimmer(unsigned int dimmer_id);
+	long run_dimmer(unsigned int dimmer_id);
+	unsigned long flush_interval_ms() const;
 
 	Network &network_;
 	const Config &config_;
@@ -73,4 +85,8 @@ private:
 
 	std::array<RotaryEncoder,NUM_DIMMERS> encoder_;
 	std::array<DimmerState,NUM_DIMMERS> state_;
+	uint64_t last_flush_us_{0};
+
+	std::mutex stats_mutex_;
+	DimmerStats stats_;
 };
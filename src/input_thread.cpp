@@ -0,0 +1,35 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "input_thread.h"
+
+#include <climits>
+
+#include "thread.h"
+
+InputThread::InputThread() : WakeupThread("inputs", true) {
+}
+
+void InputThread::setup() {
+	start_thread(8192, 1, 20);
+}
+
+unsigned long InputThread::run_tasks() {
+	/* All of the tasks belong to the attached threads */
+	return ULONG_MAX;
+}
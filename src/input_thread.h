@@ -0,0 +1,37 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "thread.h"
+
+/**
+ * Single thread for the switches, buttons and dimmers (instead of one thread
+ * each) to save the memory used by their stacks.
+ */
+class InputThread: public WakeupThread {
+public:
+	InputThread();
+
+	void setup();
+
+private:
+	~InputThread() = delete;
+
+	unsigned long run_tasks() override;
+};
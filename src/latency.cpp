@@ -0,0 +1,164 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "latency.h"
+
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+std::array<LatencyHistogram,NUM_LATENCY_POINTS> Latency::histograms_{};
+thread_local LatencyOrigin Latency::origin_{};
+
+unsigned int LatencyHistogram::bucket(uint32_t value) {
+	if (value < SUB_BUCKETS) {
+		return value;
+	}
+
+	unsigned int msb = 31 - __builtin_clz(value);
+
+	return ((msb - SUB_BITS + 1) << SUB_BITS)
+		| ((value >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t LatencyHistogram::bucket_lower(unsigned int index) {
+	if (index < SUB_BUCKETS) {
+		return index;
+	}
+
+	return (uint64_t)((index & (SUB_BUCKETS - 1)) | SUB_BUCKETS)
+		<< ((index >> SUB_BITS) - 1);
+}
+
+void LatencyHistogram::record(uint64_t us) {
+	uint32_t value = std::min(us, (uint64_t)UINT32_MAX);
+	uint32_t max_us = max_us_.load(std::memory_order_relaxed);
+
+	buckets_[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+
+	while (value > max_us && !max_us_.compare_exchange_weak(max_us, value,
+			std::memory_order_relaxed)) {
+	}
+}
+
+LatencyStats LatencyHistogram::get_stats() {
+	std::array<uint32_t,NUM_BUCKETS> counts;
+	LatencyStats stats;
+
+	for (unsigned int i = 0; i < NUM_BUCKETS; i++) {
+		counts[i] = buckets_[i].exchange(0, std::memory_order_relaxed);
+		stats.count += counts[i];
+	}
+
+	stats.max_us = max_us_.exchange(0, std::memory_order_relaxed);
+
+	if (!stats.count) {
+		return stats;
+	}
+
+	/*
+	 * Report the upper bound of the bucket containing each percentile,
+	 * limited to the maximum value so that a single value is exact.
+	 */
+	auto percentile = [&] (unsigned int percent) {
+		uint64_t rank = ((uint64_t)stats.count * percent + 99) / 100;
+		uint64_t total = 0;
+
+		for (unsigned int i = 0; i < NUM_BUCKETS; i++) {
+			total += counts[i];
+
+			if (total >= rank) {
+				return (uint32_t)std::min(bucket_lower(i + 1) - 1, (uint64_t)stats.max_us);
+			}
+		}
+
+		return stats.max_us;
+	};
+
+	stats.p50_us = percentile(50);
+	stats.p95_us = percentile(95);
+	stats.p99_us = percentile(99);
+	return stats;
+}
+
+const char *Latency::name(LatencyPoint point) {
+	switch (point) {
+	case LatencyPoint::MQTT_DISPATCH:
+		return "mqtt/dispatch";
+
+	case LatencyPoint::MQTT_STATE:
+		return "mqtt/state";
+
+	case LatencyPoint::MQTT_BUS_FIRST:
+		return "mqtt/bus_first";
+
+	case LatencyPoint::MQTT_BUS_LAST:
+		return "mqtt/bus_last";
+
+	case LatencyPoint::CONTROL_STATE:
+		return "control/state";
+
+	case LatencyPoint::CONTROL_BUS_FIRST:
+		return "control/bus_first";
+
+	case LatencyPoint::CONTROL_BUS_LAST:
+		return "control/bus_last";
+
+	case LatencyPoint::DALI_WAKEUP:
+		return "dali/wakeup";
+	}
+
+	return "unknown";
+}
+
+void Latency::record(LatencyPoint point, uint64_t us) {
+	histograms_[static_cast<size_t>(point)].record(us);
+}
+
+LatencyStats Latency::get_stats(LatencyPoint point) {
+	return histograms_[static_cast<size_t>(point)].get_stats();
+}
+
+uint64_t Latency::isr_time(uint32_t isr_us) {
+	uint64_t now_us = esp_timer_get_time();
+
+	return now_us - (uint32_t)((uint32_t)now_us - isr_us);
+}
+
+LatencyPoint Latency::state_point(LatencySource source) {
+	return source == LatencySource::CONTROL ? LatencyPoint::CONTROL_STATE : LatencyPoint::MQTT_STATE;
+}
+
+LatencyPoint Latency::bus_first_point(LatencySource source) {
+	return source == LatencySource::CONTROL ? LatencyPoint::CONTROL_BUS_FIRST : LatencyPoint::MQTT_BUS_FIRST;
+}
+
+LatencyPoint Latency::bus_last_point(LatencySource source) {
+	return source == LatencySource::CONTROL ? LatencyPoint::CONTROL_BUS_LAST : LatencyPoint::MQTT_BUS_LAST;
+}
+
+LatencyTrace::LatencyTrace(LatencySource source, uint64_t us)
+		: previous_(Latency::origin_) {
+	Latency::origin_ = {us, source};
+}
+
+LatencyTrace::~LatencyTrace() {
+	Latency::origin_ = previous_;
+}
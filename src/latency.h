@@ -0,0 +1,124 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+enum class LatencySource : uint8_t {
+	NONE = 0,
+	MQTT, /**< MQTT messages */
+	CONTROL, /**< Switches, buttons and dimmers */
+};
+
+enum class LatencyPoint : unsigned int {
+	MQTT_DISPATCH = 0, /**< MQTT message received to topic handler */
+	MQTT_STATE, /**< MQTT message received to lights state changed */
+	MQTT_BUS_FIRST, /**< MQTT message received to first frame on the bus */
+	MQTT_BUS_LAST, /**< MQTT message received to last frame on the bus */
+	CONTROL_STATE, /**< Switch/button/dimmer interrupt to lights state changed */
+	CONTROL_BUS_FIRST, /**< Switch/button/dimmer interrupt to first frame on the bus */
+	CONTROL_BUS_LAST, /**< Switch/button/dimmer interrupt to last frame on the bus */
+	DALI_WAKEUP, /**< Lights state changed to DALI thread reading the state */
+};
+
+static constexpr size_t NUM_LATENCY_POINTS = static_cast<size_t>(LatencyPoint::DALI_WAKEUP) + 1;
+
+/** Time and source of the event that caused a change */
+struct LatencyOrigin {
+	uint64_t us{0};
+	LatencySource source{LatencySource::NONE};
+};
+
+struct LatencyStats {
+	uint32_t count{0}; /**< Number of recorded values */
+	uint32_t p50_us{0}; /**< 50th percentile (µs) */
+	uint32_t p95_us{0}; /**< 95th percentile (µs) */
+	uint32_t p99_us{0}; /**< 99th percentile (µs) */
+	uint32_t max_us{0}; /**< Maximum (µs) */
+};
+
+/**
+ * Fixed size histogram that can be updated from any thread without locking.
+ * Each power of 2 is split into 4 buckets, so percentiles are accurate to
+ * within 25%.
+ */
+class LatencyHistogram {
+public:
+	void record(uint64_t us);
+	LatencyStats get_stats();
+
+private:
+	static constexpr unsigned int SUB_BITS = 2;
+	static constexpr unsigned int SUB_BUCKETS = 1U << SUB_BITS;
+	static constexpr size_t NUM_BUCKETS = (32 - SUB_BITS + 1) * SUB_BUCKETS;
+
+	static unsigned int bucket(uint32_t value);
+	static uint64_t bucket_lower(unsigned int index);
+
+	std::array<std::atomic<uint32_t>,NUM_BUCKETS> buckets_{};
+	std::atomic<uint32_t> max_us_{0};
+};
+
+/**
+ * Latency from MQTT messages and local controls through to the DALI bus. The
+ * origin of the current change is tracked per thread so that it's available
+ * when the lights state changes without passing it through every function
+ * call.
+ */
+class Latency {
+public:
+	static const char *name(LatencyPoint point);
+	static void record(LatencyPoint point, uint64_t us);
+	static LatencyStats get_stats(LatencyPoint point);
+
+	/** Current origin for this thread */
+	static inline const LatencyOrigin &origin() { return origin_; }
+
+	/** Convert a 32-bit time recorded in an ISR to a 64-bit time */
+	static uint64_t isr_time(uint32_t isr_us);
+
+	/** Latency points for each source */
+	static LatencyPoint state_point(LatencySource source);
+	static LatencyPoint bus_first_point(LatencySource source);
+	static LatencyPoint bus_last_point(LatencySource source);
+
+private:
+	friend class LatencyTrace;
+
+	Latency() = delete;
+
+	static std::array<LatencyHistogram,NUM_LATENCY_POINTS> histograms_;
+	static thread_local LatencyOrigin origin_;
+};
+
+/** Set the origin for this thread until the end of the current scope */
+class LatencyTrace {
+public:
+	LatencyTrace(LatencySource source, uint64_t us);
+	~LatencyTrace();
+
+	LatencyTrace(const LatencyTrace&) = delete;
+	LatencyTrace& operator=(const LatencyTrace&) = delete;
+
+private:
+	const LatencyOrigin previous_;
+};
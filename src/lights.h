@@ -18,10 +18,12 @@
 
 #pragma once
 
+#include <array>
 #include <string>
 #include <vector>
 
 #include "config.h"
+#include "dimmers.h"
 #include "util.h"
 
 static const std::string RESERVED_PRESET_CUSTOM = "custom";
@@ -39,13 +41,26 @@ public:
 	virtual void address_config_changed() {};
 	virtual void address_config_changed(const std::string &group) {};
 
-	virtual void select_preset(std::string name, const std::string &light_ids, bool internal = false) = 0;
+	virtual void select_preset(std::string name, const std::string &light_ids, bool internal = false,
+		unsigned long transition_ms = 0) = 0;
 	virtual void select_preset(std::string name, const std::vector<std::string> &groups, bool internal = false) = 0;
-	virtual void set_level(const std::string &light_ids, long level) = 0;
-	virtual void set_power(const Dali::addresses_t &lights, bool on) {};
+	virtual void set_level(const std::string &light_ids, long level, unsigned long transition_ms = 0) = 0;
+	virtual void set_power(const Dali::lights_t &lights, bool on) {};
 	virtual void dim_adjust(unsigned int dimmer_id, long level) = 0;
 	virtual void dim_adjust(DimmerMode mode, const std::string &groups, long level) {};
 
+	/**
+	 * Adjust the level for all dimmers at the same time, so that the changes
+	 * can be sent together. Dimmers with no change are skipped.
+	 */
+	virtual void dim_adjust(const std::array<long,NUM_DIMMERS> &levels) {
+		for (unsigned int i = 0; i < NUM_DIMMERS; i++) {
+			if (levels[i]) {
+				dim_adjust(i, levels[i]);
+			}
+		}
+	};
+
 	virtual void request_group_sync() {};
 	virtual void request_group_sync(const std::string &group) {};
 
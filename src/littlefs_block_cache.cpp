@@ -16,20 +16,32 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "littlefs_block_cache.h"
+
 #include <Arduino.h>
 #include <esp_timer.h>
 
 #include <algorithm>
-#include <cstdlib>
+#include <bitset>
 #include <cstring>
+#include <mutex>
+
+#if defined(FILESYSTEM_CACHE)
 
 struct lfs_config;
 typedef uint32_t lfs_block_t;
 typedef uint32_t lfs_off_t;
 typedef uint32_t lfs_size_t;
 
-extern "C" int __real_littlefs_esp_part_read(const struct lfs_config *c,
+extern "C" {
+
+int __real_littlefs_esp_part_read(const struct lfs_config *c,
 	lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
+int __real_littlefs_esp_part_prog(const struct lfs_config *c,
+	lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
+int __real_littlefs_esp_part_erase(const struct lfs_config *c, lfs_block_t block);
+
+}
 
 namespace app {
 
@@ -43,72 +55,188 @@ static constexpr size_t FILESYSTEM_CACHE_SIZE = 512 * 1024;
 static constexpr size_t FILESYSTEM_BLOCK_SIZE = 4096;
 static constexpr size_t FILESYSTEM_SIZE = 8 * 1024 * 1024;
 static constexpr size_t FILESYSTEM_CACHE_SIZE = 512 * 1024;
+#elif !defined(ARDUINO)
+/* Host build for the tests, with a small cache so that blocks are evicted */
+static constexpr size_t FILESYSTEM_BLOCK_SIZE = 4096;
+static constexpr size_t FILESYSTEM_SIZE = 256 * 1024;
+static constexpr size_t FILESYSTEM_CACHE_SIZE = 64 * 1024;
 #endif
 
 static constexpr size_t FILESYSTEM_BLOCKS = FILESYSTEM_SIZE / FILESYSTEM_BLOCK_SIZE;
 static constexpr size_t FILESYSTEM_CACHE_BLOCKS = FILESYSTEM_CACHE_SIZE / FILESYSTEM_BLOCK_SIZE;
-static const struct lfs_config *config = nullptr;
-static uint8_t *cache = nullptr;
-static uint16_t *block_index = nullptr;
-static uint16_t *cache_index = nullptr;
-static unsigned int used_cache_size = 0;
-
-static void init(const struct lfs_config *c) {
-	if (!config) {
+/*
+ * Metadata pairs are usually allocated next to each other and littlefs
+ * reads both blocks of a pair to find the most recent revision
+ */
+static constexpr size_t FILESYSTEM_CACHE_READ_AHEAD = 1;
+static constexpr uint16_t NO_BLOCK = UINT16_MAX;
+
+static_assert(FILESYSTEM_BLOCKS < NO_BLOCK);
+static_assert(FILESYSTEM_CACHE_BLOCKS < NO_BLOCK);
+
+/**
+ * Cache of whole filesystem blocks in PSRAM.
+ *
+ * All operations (including the flash operations) are performed while
+ * holding the cache lock so that a block can't be read into the cache by
+ * one task while it's being modified by another task.
+ */
+class BlockCache {
+public:
+	BlockCache() = default;
+
+	int read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off,
+		uint8_t *buffer, lfs_size_t size);
+	int prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off,
+		const uint8_t *buffer, lfs_size_t size);
+	int erase(const struct lfs_config *c, lfs_block_t block);
+	Stats get_stats();
+
+private:
+	bool init(const struct lfs_config *c);
+	uint16_t allocate(lfs_block_t block);
+	int fill(const struct lfs_config *c, lfs_block_t block);
+	void read_ahead(const struct lfs_config *c, lfs_block_t block);
+	void write_through(lfs_block_t block, lfs_off_t off,
+		const uint8_t *buffer, lfs_size_t size);
+	void erased(lfs_block_t block);
+	void evict(lfs_block_t block, lfs_off_t off, lfs_size_t size);
+
+	std::mutex mutex_;
+	const struct lfs_config *config_{nullptr};
+	bool enabled_{false};
+	uint8_t *cache_{nullptr};
+	uint16_t *block_index_{nullptr}; /**< Cache position of each block */
+	uint16_t *cache_index_{nullptr}; /**< Block in each cache position */
+	unsigned int used_cache_size_{0};
+
+	/*
+	 * CLOCK replacement: blocks are marked as referenced when they're read
+	 * and the hand clears the referenced bits until it finds a block that
+	 * hasn't been read since the last time the hand passed it.
+	 */
+	std::bitset<FILESYSTEM_CACHE_BLOCKS> referenced_;
+	unsigned int clock_hand_{0};
+
+	Stats stats_;
+};
+
+static BlockCache block_cache;
+
+bool BlockCache::init(const struct lfs_config *c) {
+	if (!config_) {
 		ESP_LOGE("littlefs", "Block cache init");
-		config = c;
+		config_ = c;
+
+		cache_ = reinterpret_cast<uint8_t*>(::heap_caps_malloc(FILESYSTEM_CACHE_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));
+		block_index_ = reinterpret_cast<uint16_t*>(::heap_caps_malloc(FILESYSTEM_BLOCKS * sizeof(uint16_t), MALLOC_CAP_DMA | MALLOC_CAP_8BIT));
+		cache_index_ = reinterpret_cast<uint16_t*>(::heap_caps_malloc(FILESYSTEM_CACHE_BLOCKS * sizeof(uint16_t), MALLOC_CAP_DMA | MALLOC_CAP_8BIT));
+
+		if (cache_ && block_index_ && cache_index_) {
+			memset(block_index_, 0xFF, FILESYSTEM_BLOCKS * sizeof(uint16_t));
+			memset(cache_index_, 0xFF, FILESYSTEM_CACHE_BLOCKS * sizeof(uint16_t));
+			enabled_ = true;
+		} else {
+			ESP_LOGE("littlefs", "Block cache allocation failed");
+			::heap_caps_free(cache_);
+			::heap_caps_free(block_index_);
+			::heap_caps_free(cache_index_);
+			cache_ = nullptr;
+			block_index_ = nullptr;
+			cache_index_ = nullptr;
+		}
+	}
+	assert(c == config_);
+	return enabled_;
+}
+
+uint16_t BlockCache::allocate(lfs_block_t block) {
+	uint16_t pos;
+
+	if (used_cache_size_ < FILESYSTEM_CACHE_BLOCKS) {
+		pos = used_cache_size_++;
+	} else {
+		while (referenced_[clock_hand_]) {
+			referenced_[clock_hand_] = false;
+			clock_hand_ = (clock_hand_ + 1) % FILESYSTEM_CACHE_BLOCKS;
+		}
+
+		pos = clock_hand_;
+		clock_hand_ = (clock_hand_ + 1) % FILESYSTEM_CACHE_BLOCKS;
+
+		if (cache_index_[pos] != NO_BLOCK) {
+			block_index_[cache_index_[pos]] = NO_BLOCK;
+			stats_.evict_count++;
+		}
+	}
 
-		cache = reinterpret_cast<uint8_t*>(::heap_caps_malloc(FILESYSTEM_CACHE_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));
+	block_index_[block] = pos;
+	cache_index_[pos] = block;
+	referenced_[pos] = false;
+	return pos;
+}
+
+int BlockCache::fill(const struct lfs_config *c, lfs_block_t block) {
+	uint16_t pos = allocate(block);
+	int ret = __real_littlefs_esp_part_read(c, block, 0,
+		cache_ + pos * FILESYSTEM_BLOCK_SIZE, FILESYSTEM_BLOCK_SIZE);
+
+	if (ret) {
+		cache_index_[pos] = NO_BLOCK;
+		block_index_[block] = NO_BLOCK;
+	}
+
+	return ret;
+}
 
-		block_index = reinterpret_cast<uint16_t*>(::heap_caps_malloc(FILESYSTEM_BLOCKS * sizeof(uint16_t), MALLOC_CAP_DMA | MALLOC_CAP_8BIT));
-		memset(block_index, 0xFF, FILESYSTEM_BLOCKS * sizeof(uint16_t));
+void BlockCache::read_ahead(const struct lfs_config *c, lfs_block_t block) {
+	for (size_t i = 0; i < FILESYSTEM_CACHE_READ_AHEAD; i++, block++) {
+		if (block >= FILESYSTEM_BLOCKS) {
+			return;
+		}
+
+		if (block_index_[block] == NO_BLOCK) {
+			if (fill(c, block)) {
+				return;
+			}
 
-		cache_index = reinterpret_cast<uint16_t*>(::heap_caps_malloc(FILESYSTEM_CACHE_BLOCKS * sizeof(uint16_t), MALLOC_CAP_DMA | MALLOC_CAP_8BIT));
-		memset(block_index, 0xFF, FILESYSTEM_CACHE_BLOCKS * sizeof(uint16_t));
+			stats_.read_ahead_count++;
+		}
 	}
-	assert(c == config);
 }
 
-static int read(const struct lfs_config *c,
+int BlockCache::read(const struct lfs_config *c,
 		lfs_block_t block, lfs_off_t off, uint8_t *buffer, lfs_size_t size) {
-	init(c);
+	std::lock_guard lock{mutex_};
+
+	if (!init(c))
+		return __real_littlefs_esp_part_read(c, block, off, buffer, size);
 
 	block += off / FILESYSTEM_BLOCK_SIZE;
 	off %= FILESYSTEM_BLOCK_SIZE;
 
 	while (size > 0) {
-		size_t available = std::min(FILESYSTEM_BLOCK_SIZE - off, size);
+		size_t available = std::min<size_t>(FILESYSTEM_BLOCK_SIZE - off, size);
 
 		if (block >= FILESYSTEM_BLOCKS)
 			return __real_littlefs_esp_part_read(c, block, off, buffer, size);
 
-		if (block_index[block] == UINT16_MAX) {
-			if (used_cache_size >= FILESYSTEM_CACHE_BLOCKS) {
-				uint16_t pos = rand() % FILESYSTEM_CACHE_BLOCKS;
-
-				if (cache_index[pos] != UINT16_MAX) {
-					block_index[cache_index[pos]] = UINT16_MAX;
-				}
-				block_index[block] = pos;
-				cache_index[block_index[block]] = block;
-			} else {
-				block_index[block] = used_cache_size;
-				cache_index[block_index[block]] = block;
-				used_cache_size++;
-			}
-
-			int ret = __real_littlefs_esp_part_read(c, block, 0,
-				cache + block_index[block] * FILESYSTEM_BLOCK_SIZE,
-				FILESYSTEM_BLOCK_SIZE);
+		if (block_index_[block] == NO_BLOCK) {
+			int ret = fill(c, block);
 
 			if (ret) {
-				block_index[block] = UINT16_MAX;
-				cache_index[block_index[block]] = block;
 				return ret;
 			}
+
+			stats_.miss_count++;
+			referenced_[block_index_[block]] = true;
+			read_ahead(c, block + 1);
+		} else {
+			stats_.hit_count++;
+			referenced_[block_index_[block]] = true;
 		}
 
-		std::memcpy(buffer, cache + block_index[block] * FILESYSTEM_BLOCK_SIZE + off, available);
+		std::memcpy(buffer, cache_ + block_index_[block] * FILESYSTEM_BLOCK_SIZE + off, available);
 		buffer += available;
 		size -= available;
 		off = 0;
@@ -118,24 +246,94 @@ static int read(const struct lfs_config *c,
 	return 0;
 }
 
-static void evict(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, lfs_size_t size) {
-	init(c);
+int BlockCache::prog(const struct lfs_config *c, lfs_block_t block,
+		lfs_off_t off, const uint8_t *buffer, lfs_size_t size) {
+	std::lock_guard lock{mutex_};
+	int ret = __real_littlefs_esp_part_prog(c, block, off, buffer, size);
+
+	if (init(c)) {
+		if (ret) {
+			evict(block, off, size);
+		} else {
+			write_through(block, off, buffer, size);
+		}
+	}
+
+	return ret;
+}
+
+int BlockCache::erase(const struct lfs_config *c, lfs_block_t block) {
+	std::lock_guard lock{mutex_};
+	int ret = __real_littlefs_esp_part_erase(c, block);
+
+	if (init(c)) {
+		if (ret) {
+			evict(block, 0, FILESYSTEM_BLOCK_SIZE);
+		} else {
+			erased(block);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Programming flash can only clear bits, so the cached data is updated the
+ * same way instead of evicting the block
+ */
+void BlockCache::write_through(lfs_block_t block, lfs_off_t off,
+		const uint8_t *buffer, lfs_size_t size) {
+	block += off / FILESYSTEM_BLOCK_SIZE;
+	off %= FILESYSTEM_BLOCK_SIZE;
+
+	while (size > 0) {
+		size_t available = std::min<size_t>(FILESYSTEM_BLOCK_SIZE - off, size);
+
+		if (block >= FILESYSTEM_BLOCKS)
+			return;
+
+		if (block_index_[block] != NO_BLOCK) {
+			uint8_t *data = cache_ + block_index_[block] * FILESYSTEM_BLOCK_SIZE + off;
+
+			for (size_t i = 0; i < available; i++) {
+				data[i] &= buffer[i];
+			}
+
+			stats_.write_through_count++;
+		}
+
+		buffer += available;
+		size -= available;
+		off = 0;
+		block++;
+	}
+}
 
-	if (used_cache_size == 0)
+void BlockCache::erased(lfs_block_t block) {
+	if (block >= FILESYSTEM_BLOCKS)
 		return;
 
+	if (block_index_[block] != NO_BLOCK) {
+		std::memset(cache_ + block_index_[block] * FILESYSTEM_BLOCK_SIZE,
+			0xFF, FILESYSTEM_BLOCK_SIZE);
+		stats_.write_through_count++;
+	}
+}
+
+void BlockCache::evict(lfs_block_t block, lfs_off_t off, lfs_size_t size) {
 	block += off / FILESYSTEM_BLOCK_SIZE;
 	off %= FILESYSTEM_BLOCK_SIZE;
 
 	while (size > 0) {
-		size_t available = std::min(FILESYSTEM_BLOCK_SIZE - off, size);
+		size_t available = std::min<size_t>(FILESYSTEM_BLOCK_SIZE - off, size);
 
 		if (block >= FILESYSTEM_BLOCKS)
 			return;
 
-		if (block_index[block] != UINT16_MAX) {
-			cache_index[block_index[block]] = UINT16_MAX;
-			block_index[block] = UINT16_MAX;
+		if (block_index_[block] != NO_BLOCK) {
+			referenced_[block_index_[block]] = false;
+			cache_index_[block_index_[block]] = NO_BLOCK;
+			block_index_[block] = NO_BLOCK;
 		}
 
 		size -= available;
@@ -144,6 +342,18 @@ static void evict(const struct lfs_config *c, lfs_block_t block, lfs_off_t off,
 	}
 }
 
+Stats BlockCache::get_stats() {
+	std::lock_guard lock{mutex_};
+	Stats stats = stats_;
+
+	stats_ = {};
+	return stats;
+}
+
+Stats get_stats() {
+	return block_cache.get_stats();
+}
+
 } // namespace filesystem_cache
 
 } // namespace app
@@ -152,25 +362,34 @@ extern "C" {
 
 int __wrap_littlefs_esp_part_read(const struct lfs_config *c, lfs_block_t block,
 		lfs_off_t off, void *buffer, lfs_size_t size) {
-	return app::filesystem_cache::read(c, block, off,
+	return app::filesystem_cache::block_cache.read(c, block, off,
 		reinterpret_cast<uint8_t*>(buffer), size);
 }
 
-int __real_littlefs_esp_part_prog(const struct lfs_config *c, lfs_block_t block,
-		lfs_off_t off, const void *buffer, lfs_size_t size);
-
 int __wrap_littlefs_esp_part_prog(const struct lfs_config *c, lfs_block_t block,
 		lfs_off_t off, const void *buffer, lfs_size_t size) {
-	app::filesystem_cache::evict(c, block, off, size);
-	return __real_littlefs_esp_part_prog(c, block, off, buffer, size);
+	return app::filesystem_cache::block_cache.prog(c, block, off,
+		reinterpret_cast<const uint8_t*>(buffer), size);
 }
 
-int __real_littlefs_esp_part_erase(const struct lfs_config *c, lfs_block_t block);
-
 int __wrap_littlefs_esp_part_erase(const struct lfs_config *c, lfs_block_t block) {
-	app::filesystem_cache::evict(c, block, 0,
-		app::filesystem_cache::FILESYSTEM_BLOCK_SIZE);
-	return __real_littlefs_esp_part_erase(c, block);
+	return app::filesystem_cache::block_cache.erase(c, block);
+}
+
 }
 
+#else /* !FILESYSTEM_CACHE */
+
+namespace app {
+
+namespace filesystem_cache {
+
+Stats get_stats() {
+	return {};
 }
+
+} // namespace filesystem_cache
+
+} // namespace app
+
+#endif
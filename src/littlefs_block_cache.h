@@ -0,0 +1,44 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace app {
+
+namespace filesystem_cache {
+
+struct Stats {
+	uint32_t hit_count{0}; /**< Blocks read from the cache */
+	uint32_t miss_count{0}; /**< Blocks read from flash */
+	uint32_t evict_count{0}; /**< Blocks replaced to make space */
+	uint32_t read_ahead_count{0}; /**< Blocks read from flash in advance */
+	uint32_t write_through_count{0}; /**< Cached blocks updated by prog */
+};
+
+/**
+ * Get and reset the block cache statistics. Only available when the cache
+ * is enabled with FILESYSTEM_CACHE (and the littlefs_esp_part_* functions
+ * are wrapped at link time).
+ */
+Stats get_stats();
+
+} // namespace filesystem_cache
+
+} // namespace app
@@ -24,15 +24,17 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <mutex>
 #include <string>
-#include <unordered_set>
 #include <unordered_map>
 #include <vector>
 
+#include "benchmark.h"
 #include "config.h"
 #include "dali.h"
 #include "dimmers.h"
+#include "latency.h"
 #include "lights.h"
 #include "network.h"
 #include "util.h"
@@ -44,22 +46,117 @@ LocalLights::LocalLights(Network &network, const Config &config)
 		: network_(network), config_(config) {
 	levels_.fill(Dali::LEVEL_NO_CHANGE);
 	group_levels_.fill(Dali::LEVEL_NO_CHANGE);
-	active_presets_.fill(RESERVED_PRESET_UNKNOWN);
-	republish_presets_.insert(BUILTIN_PRESET_OFF);
-	republish_presets_.insert(RESERVED_PRESET_CUSTOM);
+	preset_names_[PRESET_NONE] = "";
+	preset_names_[PRESET_UNKNOWN] = RESERVED_PRESET_UNKNOWN;
+	preset_names_[PRESET_CUSTOM] = RESERVED_PRESET_CUSTOM;
+	preset_names_[PRESET_OFF] = BUILTIN_PRESET_OFF;
+	for (preset_id_t i = 0; i < NUM_RESERVED_PRESET_IDS; i++) {
+		preset_ids_.emplace(preset_names_[i], i);
+	}
+	active_presets_.fill(PRESET_UNKNOWN);
+	preset_lights_[PRESET_UNKNOWN].set();
+	republish_presets_[PRESET_OFF] = true;
+	republish_presets_[PRESET_CUSTOM] = true;
+	publish_state();
+}
+
+LocalLights::preset_id_t LocalLights::preset_id(const std::string &name) {
+	preset_id_t id;
+
+	if (find_preset_id(name, id)) {
+		return id;
+	}
+
+	if (preset_ids_.size() >= MAX_PRESET_IDS) {
+		std::bitset<MAX_PRESET_IDS> used = republish_presets_;
+
+		for (const auto active : active_presets_) {
+			used[active] = true;
+		}
+
+		for (auto it = preset_ids_.begin(); it != preset_ids_.end(); ) {
+			if (it->second >= NUM_RESERVED_PRESET_IDS && !used[it->second]) {
+				for (auto &known : published_known_) {
+					known[it->second] = false;
+				}
+
+				preset_names_[it->second].clear();
+				it = preset_ids_.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	for (size_t i = NUM_RESERVED_PRESET_IDS; i < MAX_PRESET_IDS; i++) {
+		if (preset_names_[i].empty()) {
+			preset_names_[i] = name;
+			preset_ids_.emplace(name, i);
+			return i;
+		}
+	}
+
+	return PRESET_UNKNOWN;
+}
+
+bool LocalLights::find_preset_id(const std::string &name, preset_id_t &id) const {
+	const auto it = preset_ids_.find(name);
+
+	if (it == preset_ids_.cend()) {
+		return false;
+	}
+
+	id = it->second;
+	return true;
+}
+
+void LocalLights::set_active_preset(unsigned int light_id, preset_id_t id) {
+	if (active_presets_[light_id] != id) {
+		republish_presets_[active_presets_[light_id]] = true;
+		republish_presets_[id] = true;
+		preset_lights_[active_presets_[light_id]][light_id] = false;
+		preset_lights_[id][light_id] = true;
+		active_presets_[light_id] = id;
+	}
 }
 
 void LocalLights::setup() {
+	std::lock_guard lock{lights_mutex_};
+
 	load_rtc_state();
+	publish_state();
 }
 
 void LocalLights::set_dali(Dali &dali) {
-	dali_ = &dali;
+	dali_[dali.bus()] = &dali;
+}
+
+void LocalLights::wake_up_dali() const {
+	for (Dali *dali : dali_) {
+		if (dali) {
+			dali->wake_up();
+		}
+	}
+}
+
+std::array<Dali::Ballast,Dali::num_lights> LocalLights::get_ballasts() const {
+	std::array<Dali::Ballast,Dali::num_lights> ballasts{};
+
+	for (unsigned int bus = 0; bus < NUM_DALI_BUSES; bus++) {
+		if (dali_[bus]) {
+			const auto bus_ballasts = dali_[bus]->get_ballasts();
+
+			std::copy(bus_ballasts.cbegin(), bus_ballasts.cend(),
+				ballasts.begin() + bus * Dali::num_addresses);
+		}
+	}
+
+	return ballasts;
 }
 
 void LocalLights::loop() {
 	if (startup_complete_ && network_.connected()) {
-		Dali::addresses_t lights;
+		Dali::lights_t lights;
 
 		lights.set();
 
@@ -91,37 +188,181 @@ BootRTCStatus LocalLights::rtc_boot_status() const {
 
 void LocalLights::address_config_changed() {
 	std::lock_guard publish_lock{publish_mutex_};
-	auto groups = config_.group_names();
-
-	republish_groups_.insert(groups.begin(), groups.end());
+	republish_groups_.set();
+	republish_all_group_ = true;
 
 	std::lock_guard lights_lock{lights_mutex_};
 	auto addresses = config_.get_addresses();
 
 	group_level_addresses_ &= addresses;
+	publish_state();
 }
 
 void LocalLights::address_config_changed(const std::string &group) {
 	std::lock_guard lock{publish_mutex_};
 
-	republish_groups_.insert(group);
+	if (group == BUILTIN_GROUP_ALL) {
+		republish_all_group_ = true;
+	} else {
+		Dali::group_t id = config_.get_group_id(group);
+
+		if (id < Dali::num_groups) {
+			republish_groups_[id] = true;
+		}
+	}
 }
 
-LightsState LocalLights::get_state() const {
+void LocalLights::copy_state(LightsState &dst, const LightsState &src) {
+	dst.levels = src.levels;
+	dst.group_levels = src.group_levels;
+	dst.group_level_addresses = src.group_level_addresses;
+	dst.broadcast_level = src.broadcast_level;
+	dst.group_sync = src.group_sync;
+	dst.force_refresh = src.force_refresh;
+	dst.broadcast_power_on_level = src.broadcast_power_on_level;
+	dst.broadcast_system_failure_level = src.broadcast_system_failure_level;
+	dst.interactive = src.interactive;
+	dst.transition_ms = src.transition_ms;
+	dst.transition_us = src.transition_us;
+	dst.request_us = src.request_us;
+	dst.last_activity_us = src.last_activity_us;
+	dst.trace_origin = src.trace_origin;
+	dst.trace_state_us = src.trace_state_us;
+	dst.version = src.version;
+}
+
+void LocalLights::publish_state() const {
 	std::lock_guard lock{lights_mutex_};
+	const LatencyOrigin &origin = Latency::origin();
+
+	/*
+	 * Only the first change from each MQTT message or input is traced, to
+	 * measure how long it takes to start acting on it.
+	 */
+	if (origin.source != LatencySource::NONE && origin.us != trace_origin_.us) {
+		trace_origin_ = origin;
+		trace_state_us_ = esp_timer_get_time();
+		Latency::record(Latency::state_point(origin.source), trace_state_us_ - origin.us);
+	}
 
-	return {
-		.addresses{config_.get_addresses()},
-		.group_addresses{config_.get_group_addresses()},
-		.levels{levels_},
-		.group_levels{group_levels_},
-		.group_level_addresses{group_level_addresses_},
-		.broadcast_level = broadcast_level_,
-		.group_sync{group_sync_},
-		.force_refresh{force_refresh_},
-		.broadcast_power_on_level = broadcast_power_on_level_,
-		.broadcast_system_failure_level = broadcast_system_failure_level_,
-	};
+	uint32_t version = snapshot_version_.load(std::memory_order_relaxed) + 1;
+	StateSnapshot &snapshot = snapshots_[version % snapshots_.size()];
+	uint32_t sequence = snapshot.sequence.load(std::memory_order_relaxed);
+
+	snapshot.sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for (unsigned int bus = 0; bus < NUM_DALI_BUSES; bus++) {
+		LightsState &state = snapshot.states[bus];
+		const unsigned int first = bus * Dali::num_addresses;
+
+		std::copy_n(levels_.cbegin() + first, Dali::num_addresses, state.levels.begin());
+		state.group_levels = group_levels_;
+		state.group_level_addresses = Dali::bus_addresses(group_level_addresses_, bus);
+		state.broadcast_level = broadcast_level_;
+		state.group_sync = group_sync_[bus];
+		state.force_refresh = Dali::bus_addresses(force_refresh_, bus);
+		state.broadcast_power_on_level = broadcast_power_on_level_[bus];
+		state.broadcast_system_failure_level = broadcast_system_failure_level_[bus];
+		state.interactive = Dali::bus_addresses(interactive_, bus);
+		std::copy_n(transition_ms_.cbegin() + first, Dali::num_addresses, state.transition_ms.begin());
+		std::copy_n(transition_us_.cbegin() + first, Dali::num_addresses, state.transition_us.begin());
+		state.request_us = request_us_;
+		state.last_activity_us = last_activity_us_;
+		state.trace_origin = trace_origin_;
+		state.trace_state_us = trace_state_us_;
+		state.version = version;
+	}
+
+	snapshot.sequence.store(sequence + 2, std::memory_order_release);
+	snapshot_version_.store(version, std::memory_order_release);
+}
+
+bool LocalLights::get_state(unsigned int bus, LightsState &state) const {
+	uint32_t config_generation = config_.generation();
+	uint32_t version = snapshot_version_.load(std::memory_order_acquire);
+	bool changed = false;
+
+	if (state.config_generation != config_generation) {
+		const auto group_addresses = config_.get_group_addresses();
+
+		state.addresses = Dali::bus_addresses(config_.get_addresses(), bus);
+		for (unsigned int i = 0; i < group_addresses.size(); i++) {
+			state.group_addresses[i] = Dali::bus_addresses(group_addresses[i], bus);
+		}
+		state.config_generation = config_generation;
+		changed = true;
+	}
+
+	if (state.version != version) {
+		const StateSnapshot &snapshot = snapshots_[version % snapshots_.size()];
+		uint32_t sequence = snapshot.sequence.load(std::memory_order_acquire);
+		bool copied = false;
+
+		if (!(sequence & 1)) {
+			copy_state(state, snapshot.states[bus]);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			copied = snapshot.sequence.load(std::memory_order_relaxed) == sequence;
+		}
+
+		if (!copied) {
+			/*
+			 * Both buffers have been written since the version was read,
+			 * so wait for the writer to finish.
+			 */
+			std::lock_guard lock{lights_mutex_};
+
+			version = snapshot_version_.load(std::memory_order_relaxed);
+			copy_state(state, snapshots_[version % snapshots_.size()].states[bus]);
+		}
+
+		changed = true;
+	}
+
+	return changed;
+}
+
+/*
+ * Only the parts of changing and publishing light levels that don't modify
+ * anything are measured.
+ */
+void LocalLights::benchmark(Benchmark &benchmark) const {
+	const Dali::lights_t addresses = config_.get_addresses();
+	const DimmerConfig dimmer = config_.get_dimmer(0);
+	const std::vector<std::string> presets = config_.preset_names();
+	auto state = std::make_unique<LightsState>();
+	const std::array<Dali::Ballast,Dali::num_lights> ballasts = get_ballasts();
+	std::array<Dali::level_fast_t,Dali::num_lights> levels;
+
+	benchmark.run("lights/get_preset", 100, [&] {
+		for (const auto &name : presets) {
+			config_.get_preset(name, levels);
+		}
+	});
+
+	benchmark.run("lights/group_dim_level", 1000, [&] {
+		std::lock_guard lock{lights_mutex_};
+		long result;
+
+		if (dimmer.mode == DimmerMode::GROUP) {
+			for_each_bit(dimmer.groups, [&] (unsigned int group) {
+				group_dim_level(dimmer.group_addresses[group], 1, result);
+			});
+		} else {
+			group_dim_level(dimmer.addresses, 1, result);
+		}
+	});
+
+	benchmark.run("lights/level_values", 1000, [&] {
+		std::lock_guard lock{lights_mutex_};
+
+		level_values(addresses, ballasts);
+	});
+
+	benchmark.run("lights/get_state", 1000, [&] {
+		state->version = 0;
+		get_state(0, *state);
+	});
 }
 
 void LocalLights::completed_force_refresh(unsigned int light_id) const {
@@ -136,6 +377,7 @@ void LocalLights::completed_force_refresh(unsigned int light_id) const {
 	}
 
 	force_refresh_[light_id] = force_refresh_count_[light_id] > 0;
+	publish_state();
 }
 
 bool LocalLights::is_idle() {
@@ -193,26 +435,26 @@ void LocalLights::save_rtc_state() {
 }
 
 void LocalLights::select_preset(std::string name, const std::string &light_ids,
-		bool internal) {
+		bool internal, unsigned long transition_ms) {
 	bool idle_only;
 	const auto lights = config_.parse_light_ids(light_ids, idle_only);
 
-	select_preset(name, lights, idle_only, internal);
+	select_preset(name, lights, idle_only, internal, transition_ms);
 }
 
 void LocalLights::select_preset(std::string name,
 		const std::vector<std::string> &groups, bool internal) {
 	const auto lights = config_.parse_groups(groups);
 
-	select_preset(name, lights, false, internal);
+	select_preset(name, lights, false, internal, 0);
 }
 
-void LocalLights::select_preset(std::string name, Dali::addresses_t lights,
-		bool idle_only, bool internal) {
+void LocalLights::select_preset(std::string name, Dali::lights_t lights,
+		bool idle_only, bool internal, unsigned long transition_ms) {
 	const auto addresses = config_.get_addresses();
 	std::lock_guard publish_lock{publish_mutex_};
 	std::lock_guard lights_lock{lights_mutex_};
-	std::array<Dali::level_fast_t,Dali::num_addresses> preset_levels;
+	std::array<Dali::level_fast_t,Dali::num_lights> preset_levels;
 	unsigned long long ordered_value;
 	bool changed = false;
 
@@ -243,24 +485,21 @@ void LocalLights::select_preset(std::string name, Dali::addresses_t lights,
 
 	clear_group_levels(lights);
 
+	preset_id_t id = preset_id(name);
+	const uint64_t now_us = esp_timer_get_time();
+
 	for (int i = 0; i < levels_.size(); i++) {
 		if (addresses[i]) {
 			if (preset_levels[i] != Dali::LEVEL_NO_CHANGE) {
 				if (lights[i]) {
 					levels_[i] = preset_levels[i];
-					if (active_presets_[i] != name) {
-						republish_presets_.insert(active_presets_[i]);
-						republish_presets_.insert(name);
-						active_presets_[i] = name;
-					}
+					set_active_preset(i, id);
+					set_transition(i, transition_ms, now_us);
 					changed = true;
 				}
 			}
 		} else {
-			if (!active_presets_[i].empty()) {
-				republish_presets_.insert(active_presets_[i]);
-				active_presets_[i] = "";
-			}
+			set_active_preset(i, PRESET_NONE);
 		}
 	}
 
@@ -268,22 +507,29 @@ void LocalLights::select_preset(std::string name, Dali::addresses_t lights,
 		last_activity_us_ = esp_timer_get_time();
 	}
 
+	if (changed) {
+		interactive_ &= ~lights;
+		request_us_[static_cast<size_t>(DaliPriority::PRESET)] = esp_timer_get_time();
+	}
+
+	publish_state();
+
 	if (changed) {
 		save_rtc_state();
 
 		if (!internal) {
-			network_.report(TAG, config_.lights_text(lights) + " = " + name + (idle_only ? " (idle only)" : ""));
+			network_.report(TAG, config_.lights_text(lights) + " = " + name + (idle_only ? " (idle only)" : "")
+				+ (transition_ms ? " (" + std::to_string(transition_ms) + "ms)" : ""));
 		}
 
 		publish_levels(true);
 
-		if (dali_) {
-			dali_->wake_up();
-		}
+		wake_up_dali();
 	}
 }
 
-void LocalLights::set_level(const std::string &light_ids, long level) {
+void LocalLights::set_level(const std::string &light_ids, long level,
+		unsigned long transition_ms) {
 	if (level < 0 || level > MAX_LEVEL) {
 		return;
 	}
@@ -302,36 +548,51 @@ void LocalLights::set_level(const std::string &light_ids, long level) {
 	report_dimmed_levels(lights, 0);
 	clear_group_levels(lights);
 
+	const uint64_t now_us = esp_timer_get_time();
+
 	for (int i = 0; i < levels_.size(); i++) {
 		if (!addresses[i] || !lights[i]) {
 			continue;
 		}
 
 		levels_[i] = level;
-		if (active_presets_[i] != RESERVED_PRESET_CUSTOM) {
-			republish_presets_.insert(active_presets_[i]);
-			republish_presets_.insert(RESERVED_PRESET_CUSTOM);
-			active_presets_[i] = RESERVED_PRESET_CUSTOM;
-		}
+		set_active_preset(i, PRESET_CUSTOM);
+		set_transition(i, transition_ms, now_us);
 		changed = true;
 	}
 
-	last_activity_us_ = esp_timer_get_time();
+	last_activity_us_ = now_us;
+
+	if (changed) {
+		interactive_ &= ~lights;
+		request_us_[static_cast<size_t>(DaliPriority::PRESET)] = last_activity_us_;
+	}
+
+	publish_state();
 
 	if (changed) {
 		save_rtc_state();
 
-		network_.report(TAG, config_.lights_text(lights) + " = " + std::to_string(level));
+		network_.report(TAG, config_.lights_text(lights) + " = " + std::to_string(level)
+			+ (transition_ms ? " (" + std::to_string(transition_ms) + "ms)" : ""));
 
 		publish_levels(true);
 
-		if (dali_) {
-			dali_->wake_up();
-		}
+		wake_up_dali();
 	}
 }
 
-void LocalLights::set_power(const Dali::addresses_t &lights, bool on) {
+/*
+ * The Dali thread starts a new transition every time the request time changes,
+ * from the level that was last transmitted.
+ */
+void LocalLights::set_transition(unsigned int light_id, unsigned long transition_ms,
+		uint64_t now_us) {
+	transition_ms_[light_id] = std::min(transition_ms, Dali::MAX_TRANSITION_MS);
+	transition_us_[light_id] = now_us;
+}
+
+void LocalLights::set_power(const Dali::lights_t &lights, bool on) {
 	std::lock_guard lock{lights_mutex_};
 
 	power_known_ |= lights;
@@ -351,9 +612,9 @@ void LocalLights::set_power(const Dali::addresses_t &lights, bool on) {
 				}
 			}
 
-			if (dali_) {
-				dali_->wake_up();
-			}
+			request_us_[static_cast<size_t>(DaliPriority::FORCE_REFRESH)] = esp_timer_get_time();
+
+			wake_up_dali();
 		}
 
 		power_on_ |= lights;
@@ -369,6 +630,8 @@ void LocalLights::set_power(const Dali::addresses_t &lights, bool on) {
 
 		power_on_ &= ~lights;
 	}
+
+	publish_state();
 }
 
 void LocalLights::dim_adjust(unsigned int dimmer_id, long level) {
@@ -386,7 +649,7 @@ void LocalLights::dim_adjust(DimmerMode mode, const std::string &groups, long le
 	dim_adjust(config_.make_dimmer(mode, groups), level);
 }
 
-bool LocalLights::dim_adjust(DimmerConfig &&dimmer_config, long level) {
+bool LocalLights::dim_adjust(const DimmerConfig &dimmer_config, long level) {
 	if (level < -(long)MAX_LEVEL || level > (long)MAX_LEVEL) {
 		return false;
 	}
@@ -394,153 +657,142 @@ bool LocalLights::dim_adjust(DimmerConfig &&dimmer_config, long level) {
 	std::lock_guard publish_lock{publish_mutex_};
 	std::lock_guard lights_lock{lights_mutex_};
 	uint64_t now = esp_timer_get_time();
-	bool changed;
-	std::array<long,Dali::num_groups> group_level{};
-	long broadcast_level = 0;
+	Dali::lights_t dimmed;
 
 	if (dimmer_config.mode == DimmerMode::GROUP) {
 		if (dimmer_config.all) {
-			unsigned int count = 0;
-
-			for (unsigned int address = 0; address < dimmer_config.addresses.size(); address++) {
-				if (!dimmer_config.addresses[address]) {
-					continue;
-				}
-
-				if (levels_[address] != Dali::LEVEL_NO_CHANGE) {
-					broadcast_level += levels_[address];
-					count++;
-				}
-			}
-
-			if (count > 0) {
-				if (level >= 0) {
-					/* Dimming up: round down */
-					broadcast_level = broadcast_level / count;
-				} else {
-					/* Dimming down: round up */
-					broadcast_level = (broadcast_level + (count - 1)) / count;
-				}
+			long broadcast_level = 0;
 
-				broadcast_level = std::max(0L, std::min((long)MAX_LEVEL, broadcast_level + level));
+			if (group_dim_level(dimmer_config.addresses, level, broadcast_level)) {
 				broadcast_level_ = broadcast_level;
 				group_level_addresses_ |= dimmer_config.addresses;
-				changed = true;
 			}
-		} else {
-			for (unsigned int group = 0; group < dimmer_config.groups.size(); group++) {
-				unsigned int count = 0;
-
-				if (!dimmer_config.groups[group]) {
-					continue;
-				}
 
-				for (unsigned int address = 0; address < dimmer_config.addresses.size(); address++) {
-					if (dimmer_config.address_group[address] != group) {
-						continue;
-					}
+			for_each_bit(dimmer_config.addresses, [&] (unsigned int address) {
+				levels_[address] = broadcast_level;
+			});
+		} else {
+			for_each_bit(dimmer_config.groups, [&] (unsigned int group) {
+				const auto &group_addresses = dimmer_config.group_addresses[group];
+				long group_level = 0;
 
-					if (levels_[address] != Dali::LEVEL_NO_CHANGE) {
-						group_level[group] += levels_[address];
-						count++;
-					}
+				if (group_dim_level(group_addresses, level, group_level)) {
+					group_levels_[group] = group_level;
+					group_level_addresses_ |= group_addresses;
 				}
 
-				if (count > 0) {
-					if (level >= 0) {
-						/* Dimming up: round down */
-						group_level[group] = group_level[group] / count;
-					} else {
-						/* Dimming down: round up */
-						group_level[group] = (group_level[group] + (count - 1)) / count;
-					}
-
-					group_level[group] = std::max(0L, std::min((long)MAX_LEVEL, group_level[group] + level));
-					group_levels_[group] = group_level[group];
-					group_level_addresses_ |= dimmer_config.group_addresses[group];
-					changed = true;
-				}
-			}
+				for_each_bit(group_addresses, [&] (unsigned int address) {
+					levels_[address] = group_level;
+				});
+			});
 		}
+
+		dimmed = dimmer_config.addresses;
 	} else {
 		clear_group_levels(dimmer_config.addresses);
+
+		for_each_bit(dimmer_config.addresses, [&] (unsigned int address) {
+			if (levels_[address] != Dali::LEVEL_NO_CHANGE) {
+				levels_[address] = std::max(0L, std::min((long)MAX_LEVEL, (long)levels_[address] + level));
+				dimmed[address] = true;
+			}
+		});
 	}
 
-	for (int i = 0; i < levels_.size(); i++) {
-		if (!dimmer_config.addresses[i]) {
-			continue;
-		}
+	for_each_bit(dimmed, [&] (unsigned int address) {
+		dim_time_us_[address] = now;
+		set_active_preset(address, PRESET_CUSTOM);
+	});
 
-		if (dimmer_config.mode == DimmerMode::GROUP) {
-			if (dimmer_config.all) {
-				levels_[i] = broadcast_level;
-			} else {
-				levels_[i] = group_level[dimmer_config.address_group[i]];
-			}
-		} else if (levels_[i] == Dali::LEVEL_NO_CHANGE) {
-			continue;
-		} else {
-			levels_[i] = std::max(0L, std::min((long)MAX_LEVEL, (long)levels_[i] + level));
-		}
+	bool changed = dimmed.any();
 
-		dim_time_us_[i] = now;
-		if (active_presets_[i] != RESERVED_PRESET_CUSTOM) {
-			republish_presets_.insert(active_presets_[i]);
-			republish_presets_.insert(RESERVED_PRESET_CUSTOM);
-			active_presets_[i] = RESERVED_PRESET_CUSTOM;
-		}
-		changed = true;
+	last_activity_us_ = esp_timer_get_time();
+
+	if (changed) {
+		interactive_ |= dimmer_config.addresses;
+		request_us_[static_cast<size_t>(DaliPriority::INTERACTIVE)] = last_activity_us_;
 	}
 
-	last_activity_us_ = esp_timer_get_time();
+	publish_state();
 
 	if (changed) {
 		save_rtc_state();
 
 		publish_levels(true);
 
-		if (dali_) {
-			dali_->wake_up();
-		}
+		wake_up_dali();
 	}
 
 	return changed;
 }
 
+bool LocalLights::group_dim_level(const Dali::lights_t &lights, long level, long &result) const {
+	unsigned int count = 0;
+	long total = 0;
+
+	for_each_bit(lights, [&] (unsigned int address) {
+		if (levels_[address] != Dali::LEVEL_NO_CHANGE) {
+			total += levels_[address];
+			count++;
+		}
+	});
+
+	if (count == 0) {
+		return false;
+	}
+
+	if (level >= 0) {
+		/* Dimming up: round down */
+		total = total / count;
+	} else {
+		/* Dimming down: round up */
+		total = (total + (count - 1)) / count;
+	}
+
+	result = std::max(0L, std::min((long)MAX_LEVEL, total + level));
+	return true;
+}
+
 void LocalLights::request_group_sync() {
 	std::lock_guard lock{lights_mutex_};
 
-	group_sync_.set();
+	for (auto &group_sync : group_sync_) {
+		group_sync.set();
+	}
+	request_us_[static_cast<size_t>(DaliPriority::CONFIG)] = esp_timer_get_time();
+	publish_state();
 
 	network_.report(TAG, "Queued group sync for all groups");
 
-	if (dali_) {
-		dali_->wake_up();
-	}
+	wake_up_dali();
 }
 
 void LocalLights::request_group_sync(const std::string &group) {
 	std::lock_guard lock{lights_mutex_};
 	auto id = config_.get_group_id(group);
 
-	if (id < group_sync_.size()) {
-		group_sync_[id] = true;
+	if (id < Dali::num_groups) {
+		for (auto &group_sync : group_sync_) {
+			group_sync[id] = true;
+		}
+		request_us_[static_cast<size_t>(DaliPriority::CONFIG)] = esp_timer_get_time();
+		publish_state();
 
 		network_.report(TAG, "Queued group sync for " + group + " (" + std::to_string(id) + ")");
 
-		if (dali_) {
-			dali_->wake_up();
-		}
+		wake_up_dali();
 	}
 }
 
-void LocalLights::completed_group_sync(Dali::group_t group) const {
+void LocalLights::completed_group_sync(unsigned int bus, Dali::group_t group) const {
 	std::lock_guard lock{lights_mutex_};
 
-	if (group < group_sync_.size()) {
-		group_sync_[group] = false;
+	if (bus < group_sync_.size() && group < Dali::num_groups) {
+		group_sync_[bus][group] = false;
+		publish_state();
 
-		if (group_sync_.none()) {
+		if (std::all_of(group_sync_.cbegin(), group_sync_.cend(),
+				[] (const Dali::groups_t &group_sync) { return group_sync.none(); })) {
 			network_.report(TAG, "Completed group sync commands");
 		}
 	}
@@ -549,45 +801,52 @@ void LocalLights::completed_group_sync(Dali::group_t group) const {
 void LocalLights::request_broadcast_power_on_level() {
 	std::lock_guard lock{lights_mutex_};
 
-	broadcast_power_on_level_ = true;
+	broadcast_power_on_level_.set();
+	request_us_[static_cast<size_t>(DaliPriority::CONFIG)] = esp_timer_get_time();
+	publish_state();
 
 	network_.report(TAG, "Queued broadcast to configure power on level");
 
-	if (dali_) {
-		dali_->wake_up();
-	}
+	wake_up_dali();
 }
 
-void LocalLights::completed_broadcast_power_on_level() const {
+void LocalLights::completed_broadcast_power_on_level(unsigned int bus) const {
 	std::lock_guard lock{lights_mutex_};
 
-	broadcast_power_on_level_ = false;
+	broadcast_power_on_level_[bus] = false;
+	publish_state();
 
-	network_.report(TAG, "Completed broadcast to configure power on level");
+	if (broadcast_power_on_level_.none()) {
+		network_.report(TAG, "Completed broadcast to configure power on level");
+	}
 }
 
 void LocalLights::request_broadcast_system_failure_level() {
 	std::lock_guard lock{lights_mutex_};
 
-	broadcast_system_failure_level_ = true;
+	broadcast_system_failure_level_.set();
+	request_us_[static_cast<size_t>(DaliPriority::CONFIG)] = esp_timer_get_time();
+	publish_state();
 
 	network_.report(TAG, "Queued broadcast to configure system failure level");
 
-	if (dali_) {
-		dali_->wake_up();
-	}
+	wake_up_dali();
 }
 
-void LocalLights::completed_broadcast_system_failure_level() const {
+void LocalLights::completed_broadcast_system_failure_level(unsigned int bus) const {
 	std::lock_guard lock{lights_mutex_};
 
-	broadcast_system_failure_level_ = false;
+	broadcast_system_failure_level_[bus] = false;
+	publish_state();
 
-	network_.report(TAG, "Completed broadcast to configure system failure level");
+	if (broadcast_system_failure_level_.none()) {
+		network_.report(TAG, "Completed broadcast to configure system failure level");
+	}
 }
 
-void LocalLights::clear_group_levels(const Dali::addresses_t &lights) {
-	Dali::addresses_t clear_lights{lights};
+void LocalLights::clear_group_levels(const Dali::lights_t &lights) {
+	Dali::lights_t clear_lights{lights};
+	Dali::lights_t group_lights;
 
 	/* Clear group level when setting individual light levels */
 	for (Dali::group_fast_t i = 0; i < Dali::num_groups; i++) {
@@ -599,17 +858,26 @@ void LocalLights::clear_group_levels(const Dali::addresses_t &lights) {
 
 				/* All lights in the group now get updated individually */
 				clear_lights |= addresses;
+			} else {
+				group_lights |= addresses;
 			}
 		}
 	}
 
+	if (broadcast_level_ != Dali::LEVEL_NO_CHANGE && lights.any()) {
+		broadcast_level_ = Dali::LEVEL_NO_CHANGE;
+
+		/* All lights not in a group now get updated individually */
+		clear_lights |= ~group_lights;
+	}
+
 	group_level_addresses_ &= ~clear_lights;
 }
 
-void LocalLights::report_dimmed_levels(const Dali::addresses_t &lights,
+void LocalLights::report_dimmed_levels(const Dali::lights_t &lights,
 		uint64_t time_us) {
 	std::lock_guard lock{lights_mutex_};
-	Dali::addresses_t dimmed_lights;
+	Dali::lights_t dimmed_lights;
 	Dali::level_fast_t min_level = MAX_LEVEL;
 	Dali::level_fast_t max_level = 0;
 	uint64_t now = esp_timer_get_time();
@@ -634,7 +902,7 @@ void LocalLights::report_dimmed_levels(const Dali::addresses_t &lights,
 	}
 }
 
-void LocalLights::clear_dimmed_levels(const Dali::addresses_t &lights) {
+void LocalLights::clear_dimmed_levels(const Dali::lights_t &lights) {
 	for (unsigned int i = 0; i < lights.size(); i++) {
 		if (lights[i]) {
 			dim_time_us_[i] = 0;
@@ -646,44 +914,72 @@ void LocalLights::publish_active_presets() {
 	std::lock_guard publish_lock{publish_mutex_};
 	bool force = (!last_publish_active_us_ || esp_timer_get_time() - last_publish_active_us_ >= ONE_M);
 
-	if (!force && republish_groups_.empty() && republish_presets_.empty()) {
+	if (!force && republish_groups_.none() && !republish_all_group_ && republish_presets_.none()) {
 		return;
 	}
 
 	const auto groups = config_.group_names();
 	const auto presets = config_.preset_names();
+	const auto addresses = config_.get_addresses();
+	const auto group_addresses = config_.get_group_addresses();
+	std::vector<preset_id_t> preset_ids;
 	size_t i = 0;
 
+	preset_ids.reserve(presets.size());
+	for (const auto &preset : presets) {
+		preset_ids.push_back(preset_id(preset));
+	}
+
 	for (const auto &group : groups) {
-		const auto lights = config_.get_group_addresses(group);
-		bool republish_group = republish_groups_.find(group) != republish_groups_.end();
+		Dali::lights_t lights;
+		size_t slot;
+		bool republish_group;
+
+		if (group == BUILTIN_GROUP_ALL) {
+			lights = addresses;
+			slot = Dali::num_groups;
+			republish_group = republish_all_group_;
+		} else {
+			Dali::group_t group_id = config_.get_group_id(group);
 
-		for (const auto &preset : presets) {
-			bool republish_preset = republish_presets_.find(preset) != republish_presets_.end();
+			if (group_id >= Dali::num_groups) {
+				i += presets.size();
+				continue;
+			}
 
-			if (republish_group || republish_preset
-					|| (force && i >= publish_index_
-						&& i < publish_index_ + REPUBLISH_PER_PERIOD)) {
-				bool is_active = false;
+			lights = group_addresses[group_id];
+			slot = group_id;
+			republish_group = republish_groups_[group_id];
+		}
 
-				for (unsigned int j = 0; j < lights.size(); j++) {
-					if (lights[j] && active_presets_[j] == preset) {
-						is_active = true;
-						break;
-					}
-				}
+		auto &known = published_known_[slot];
+		auto &active = published_active_[slot];
+
+		for (size_t k = 0; k < presets.size(); k++, i++) {
+			preset_id_t id = preset_ids[k];
+			bool is_active = id != PRESET_UNKNOWN && (preset_lights_[id] & lights).any();
 
-				network_.publish(FixedConfig::mqttTopic("/active/")
-					+ group + "/" + preset,
+			/*
+			 * Changes to presets are only published if the active state has
+			 * changed, but changes to groups and the periodic republish are
+			 * always published.
+			 */
+			if (republish_group
+					|| (republish_presets_[id] && (!known[id] || active[id] != is_active))
+					|| (force && i >= publish_index_
+						&& i < publish_index_ + REPUBLISH_PER_PERIOD)) {
+				network_.publish({FixedConfig::mqttTopic(), "/active/", group, "/", presets[k]},
 					is_active ? "1" : "0", true);
-			}
 
-			i++;
+				known[id] = true;
+				active[id] = is_active;
+			}
 		}
 	}
 
-	republish_groups_.clear();
-	republish_presets_.clear();
+	republish_groups_.reset();
+	republish_all_group_ = false;
+	republish_presets_.reset();
 
 	if (force) {
 		/*
@@ -696,17 +992,10 @@ void LocalLights::publish_active_presets() {
 	}
 }
 
-void LocalLights::publish_levels(bool force) {
-	std::lock_guard lock{lights_mutex_};
-
-	if (!force && last_publish_levels_us_
-			&& esp_timer_get_time() - last_publish_levels_us_ < ONE_M) {
-		return;
-	}
-
-	const auto addresses = config_.get_addresses();
-	std::vector<char> buffer(3 * levels_.size() + 1);
-	size_t offset = 0;
+std::array<uint16_t,Dali::num_lights> LocalLights::level_values(
+		const Dali::lights_t &addresses,
+		const std::array<Dali::Ballast,Dali::num_lights> &ballasts) const {
+	std::array<uint16_t,Dali::num_lights> values{};
 
 	for (unsigned int i = 0; i < levels_.size(); i++) {
 		unsigned int value = (levels_[i] & 0xFFU);
@@ -717,21 +1006,199 @@ void LocalLights::publish_levels(bool force) {
 
 		if (power_known_[i]) {
 			value |= power_on_[i] ? LEVEL_POWER_ON : LEVEL_POWER_OFF;
+		} else if (ballasts[i].present) {
+			/* Lights that respond on the bus must have power */
+			value |= LEVEL_POWER_ON;
 		}
 
 		if (group_level_addresses_[i]) {
 			value |= LEVEL_GROUPED;
 		}
 
-		snprintf(&buffer[offset], 4, "%03X", value);
-		offset += 3;
+		values[i] = value;
 	}
 
-	network_.publish(FixedConfig::mqttTopic("/levels"),
-		{buffer.data(), offset}, true);
-	if (!force) {
+	return values;
+}
+
+/*
+ * Changes are published immediately as a delta (and the binary snapshot if
+ * enabled) but the text snapshot is only published at most once every
+ * LEVELS_SNAPSHOT_INTERVAL_US, so that continuous dimming doesn't format
+ * and send the whole thing on every tick.
+ */
+void LocalLights::publish_levels(bool force) {
+	std::lock_guard lock{lights_mutex_};
+	uint64_t now_us = esp_timer_get_time();
+	bool periodic = !last_publish_levels_us_
+		|| now_us - last_publish_levels_us_ >= ONE_M;
+
+	if (force) {
+		levels_snapshot_pending_ = true;
+	}
+
+	bool snapshot = periodic || (levels_snapshot_pending_
+		&& now_us - last_publish_levels_us_ >= LEVELS_SNAPSHOT_INTERVAL_US);
+
+	if (!force && !snapshot) {
+		return;
+	}
+
+	const auto addresses = config_.get_addresses();
+	const auto ballasts = get_ballasts();
+	const auto values = level_values(addresses, ballasts);
+
+	if (force) {
+		publish_levels_delta(values);
+
+		if (FixedConfig::mqttLevelsBinary()) {
+			publish_levels_binary(values);
+		}
+	}
+
+	if (!snapshot) {
+		return;
+	}
+
+	if (!force && FixedConfig::mqttLevelsBinary()) {
+		publish_levels_binary(values);
+	}
+	publish_levels_text(values);
+	if (dali_[0]) {
+		publish_bus_levels(ballasts);
+	}
+	if (periodic) {
 		network_.publish(FixedConfig::mqttTopic("/idle_us"),
-			std::to_string(esp_timer_get_time() - last_activity_us_));
+			std::to_string(now_us - last_activity_us_));
+	}
+	levels_snapshot_pending_ = false;
+	last_publish_levels_us_ = now_us;
+}
+
+/*
+ * The delta is split into multiple messages (each with their own sequence
+ * number) when it doesn't fit in one message. If a message can't be queued
+ * then the lights that weren't published are included in the next delta and
+ * the text snapshot is published soon because a change has been lost.
+ */
+void LocalLights::publish_levels_delta(const std::array<uint16_t,Dali::num_lights> &values) {
+	static constexpr const char *HEX_DIGITS = "0123456789ABCDEF";
+	static constexpr size_t SEQUENCE_LENGTH = 10;
+	static constexpr size_t ENTRY_LENGTH = 6; /* " IIVVV" */
+	const std::initializer_list<std::string_view> topic{FixedConfig::mqttTopic(), "/levels/delta"};
+	const size_t max_length = Message::max_payload_length(topic);
+	const size_t max_entries = max_length > SEQUENCE_LENGTH + ENTRY_LENGTH
+		? (max_length - SEQUENCE_LENGTH) / ENTRY_LENGTH : 1;
+	Dali::lights_t changed;
+
+	for (unsigned int i = 0; i < values.size(); i++) {
+		changed[i] = !published_levels_valid_ || values[i] != published_levels_[i];
 	}
-	last_publish_levels_us_ = esp_timer_get_time();
+
+	while (changed.any()) {
+		const uint32_t sequence = levels_sequence_ + 1;
+		const size_t entries = std::min(changed.count(), max_entries);
+		Dali::lights_t sent;
+
+		bool queued = network_.publish(topic, SEQUENCE_LENGTH + ENTRY_LENGTH * entries,
+				[&] (char *buffer, size_t size) {
+			int ret = snprintf(buffer, size, "%lu", static_cast<unsigned long>(sequence));
+			size_t offset = ret > 0 ? ret : 0;
+			size_t count = 0;
+
+			for (unsigned int i = 0; i < values.size() && count < entries
+					&& offset + ENTRY_LENGTH <= size; i++) {
+				if (!changed[i]) {
+					continue;
+				}
+
+				buffer[offset++] = ' ';
+				buffer[offset++] = HEX_DIGITS[(i >> 4) & 0xF];
+				buffer[offset++] = HEX_DIGITS[i & 0xF];
+				buffer[offset++] = HEX_DIGITS[(values[i] >> 8) & 0xF];
+				buffer[offset++] = HEX_DIGITS[(values[i] >> 4) & 0xF];
+				buffer[offset++] = HEX_DIGITS[values[i] & 0xF];
+				sent[i] = true;
+				count++;
+			}
+
+			return offset;
+		});
+
+		if (!queued) {
+			levels_snapshot_pending_ = true;
+			return;
+		}
+
+		levels_sequence_ = sequence;
+		for_each_bit(sent, [&] (unsigned int i) {
+			published_levels_[i] = values[i];
+		});
+		changed &= ~sent;
+	}
+
+	published_levels_valid_ = true;
+}
+
+void LocalLights::publish_levels_binary(const std::array<uint16_t,Dali::num_lights> &values) {
+	network_.publish({FixedConfig::mqttTopic(), "/levels/bin"}, 2 * values.size(),
+			[&] (char *buffer, size_t size) {
+		size_t offset = 0;
+
+		for (unsigned int i = 0; i < values.size(); i++) {
+			buffer[offset++] = (values[i] >> 8) & 0xFF;
+			buffer[offset++] = values[i] & 0xFF;
+		}
+
+		return offset;
+	}, true);
+}
+
+void LocalLights::publish_levels_text(const std::array<uint16_t,Dali::num_lights> &values) {
+	network_.publish({FixedConfig::mqttTopic(), "/levels"}, 3 * values.size() + 1,
+			[&] (char *buffer, size_t size) {
+		size_t offset = 0;
+
+		for (unsigned int i = 0; i < values.size(); i++) {
+			snprintf(&buffer[offset], size - offset, "%03X", values[i]);
+			offset += 3;
+		}
+
+		return offset;
+	}, true);
+}
+
+void LocalLights::publish_bus_levels(const std::array<Dali::Ballast,Dali::num_lights> &ballasts) {
+	network_.publish({FixedConfig::mqttTopic(), "/levels/bus"}, 3 * ballasts.size() + 1,
+			[&] (char *buffer, size_t size) {
+		size_t offset = 0;
+
+		for (unsigned int i = 0; i < ballasts.size(); i++) {
+			const auto &ballast = ballasts[i];
+			unsigned int value = (ballast.actual_level & 0xFFU);
+
+			if (ballast.present) {
+				value |= BUS_PRESENT;
+
+				if (ballast.status_known) {
+					if (ballast.status & Dali::STATUS_LAMP_ON) {
+						value |= BUS_LAMP_ON;
+					}
+
+					if (ballast.status & Dali::STATUS_CONTROL_GEAR_FAILURE) {
+						value |= BUS_CONTROL_GEAR_FAILURE;
+					}
+				}
+
+				if (ballast.lamp_failure) {
+					value |= BUS_LAMP_FAILURE;
+				}
+			}
+
+			snprintf(&buffer[offset], size - offset, "%03X", value);
+			offset += 3;
+		}
+
+		return offset;
+	}, true);
 }
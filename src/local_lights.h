@@ -19,19 +19,26 @@
 #pragma once
 
 #include <array>
+#include <atomic>
+#include <bitset>
 #include <mutex>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
 #include "config.h"
 #include "dali.h"
+#include "latency.h"
 #include "lights.h"
+#include "profiled_mutex.h"
 #include "util.h"
 
+class Benchmark;
 class Network;
 
+/**
+ * Lights state for one bus, indexed by address on that bus.
+ */
 struct LightsState {
 	Dali::addresses_t addresses; /**< Valid addresses */
 	std::array<Dali::addresses_t,Dali::num_groups> group_addresses; /**< Group members */
@@ -43,10 +50,21 @@ struct LightsState {
 	Dali::addresses_t force_refresh; /**< Force refresh individual lights */
 	bool broadcast_power_on_level; /**< Broadcast store of power on level to DALI bus */
 	bool broadcast_system_failure_level;/**< Broadcast store of system failure level to DALI bus */
+	Dali::addresses_t interactive; /**< Individual lights that are being dimmed interactively */
+	std::array<uint32_t,Dali::num_addresses> transition_ms; /**< Duration of the transition to each light level (ms) */
+	std::array<uint64_t,Dali::num_addresses> transition_us; /**< Time of the most recent preset or level for each light */
+	std::array<uint64_t,NUM_DALI_PRIORITIES> request_us{}; /**< Time of the most recent request for each priority */
+	uint64_t last_activity_us{0}; /**< Time of the most recent change of light levels */
+	LatencyOrigin trace_origin{}; /**< Origin of the most recent traced change */
+	uint64_t trace_state_us{0}; /**< Time of the most recent traced change */
+	uint32_t version{0}; /**< Version of the lights state */
+	uint32_t config_generation{UINT32_MAX}; /**< Generation of the config for addresses and group members */
 };
 
 class LocalLights: public Lights {
 public:
+	static constexpr uint64_t IDLE_US = 10 * ONE_S;
+
 	LocalLights(Network &network, const Config &config);
 
 	static std::string rtc_boot_memory();
@@ -61,50 +79,86 @@ public:
 	void address_config_changed();
 	void address_config_changed(const std::string &group);
 
-	LightsState get_state() const;
+	bool get_state(unsigned int bus, LightsState &state) const;
 	void completed_force_refresh(unsigned int light_id) const;
 
-	void select_preset(std::string name, const std::string &light_ids, bool internal = false) override;
+	void select_preset(std::string name, const std::string &light_ids, bool internal = false,
+		unsigned long transition_ms = 0) override;
 	void select_preset(std::string name, const std::vector<std::string> &groups, bool internal = false) override;
-	void set_level(const std::string &light_ids, long level) override;
-	void set_power(const Dali::addresses_t &lights, bool on);
+	void set_level(const std::string &light_ids, long level, unsigned long transition_ms = 0) override;
+	void set_power(const Dali::lights_t &lights, bool on);
 	void dim_adjust(unsigned int dimmer_id, long level) override;
 	void dim_adjust(DimmerMode mode, const std::string &groups, long level) override;
 
 	void request_group_sync() override;
 	void request_group_sync(const std::string &group) override;
-	void completed_group_sync(Dali::group_t group) const;
+	void completed_group_sync(unsigned int bus, Dali::group_t group) const;
 
 	void request_broadcast_power_on_level() override;
 	void request_broadcast_system_failure_level() override;
-	void completed_broadcast_power_on_level() const;
-	void completed_broadcast_system_failure_level() const;
+	void completed_broadcast_power_on_level(unsigned int bus) const;
+	void completed_broadcast_system_failure_level(unsigned int bus) const;
+
+	void benchmark(Benchmark &benchmark) const;
 
 private:
 	static constexpr const char *TAG = "Lights";
 	static constexpr auto MAX_LEVEL = Dali::MAX_LEVEL;
 	static constexpr size_t REPUBLISH_PER_PERIOD = 5;
-	static constexpr uint64_t IDLE_US = 10 * ONE_S;
 	static constexpr uint64_t DIM_REPORT_DELAY_US = 5 * ONE_S;
+	static constexpr uint64_t LEVELS_SNAPSHOT_INTERVAL_US = ONE_S;
 	static constexpr unsigned int FORCE_REFRESH_COUNT = 2;
 	static constexpr unsigned int LEVEL_PRESENT = (1U << 8);
 	static constexpr unsigned int LEVEL_POWER_ON = (1U << 9);
 	static constexpr unsigned int LEVEL_POWER_OFF = (1U << 10);
 	static constexpr unsigned int LEVEL_GROUPED = (1U << 11);
-	static constexpr size_t RTC_LEVELS_SIZE = (Dali::num_addresses + 3) / 4;
+	static constexpr unsigned int BUS_PRESENT = (1U << 8);
+	static constexpr unsigned int BUS_LAMP_ON = (1U << 9);
+	static constexpr unsigned int BUS_LAMP_FAILURE = (1U << 10);
+	static constexpr unsigned int BUS_CONTROL_GEAR_FAILURE = (1U << 11);
+	static constexpr size_t RTC_LEVELS_SIZE = (Dali::num_lights + 3) / 4;
+
+	/**
+	 * Preset names are interned so that the active preset of each light is
+	 * a small integer. There are enough IDs for a different preset on every
+	 * light plus the reserved names, so unused IDs can always be reclaimed.
+	 */
+	using preset_id_t = uint8_t;
+	static constexpr size_t MAX_PRESET_IDS = 128;
+	static constexpr preset_id_t PRESET_NONE = 0;
+	static constexpr preset_id_t PRESET_UNKNOWN = 1;
+	static constexpr preset_id_t PRESET_CUSTOM = 2;
+	static constexpr preset_id_t PRESET_OFF = 3;
+	static constexpr preset_id_t NUM_RESERVED_PRESET_IDS = 4;
 	static constexpr uint32_t RTC_MAGIC = 0x0d1325ab;
 
 	static uint32_t rtc_crc(const std::array<uint32_t,RTC_LEVELS_SIZE> &levels);
+	static void copy_state(LightsState &dst, const LightsState &src);
 
-	void select_preset(std::string name, Dali::addresses_t lights,
-		bool idle_only, bool internal);
-	bool dim_adjust(DimmerConfig &&dimmer_config, long level);
+	void select_preset(std::string name, Dali::lights_t lights,
+		bool idle_only, bool internal, unsigned long transition_ms);
+	void set_transition(unsigned int light_id, unsigned long transition_ms, uint64_t now_us);
+	bool dim_adjust(const DimmerConfig &dimmer_config, long level);
+	bool group_dim_level(const Dali::lights_t &lights, long level, long &result) const;
 	void publish_active_presets();
+	std::array<uint16_t,Dali::num_lights> level_values(
+		const Dali::lights_t &addresses,
+		const std::array<Dali::Ballast,Dali::num_lights> &ballasts) const;
 	void publish_levels(bool force);
-	void clear_group_levels(const Dali::addresses_t &lights);
-	void report_dimmed_levels(const Dali::addresses_t &lights, uint64_t time_us);
-	void clear_dimmed_levels(const Dali::addresses_t &lights);
+	void publish_levels_delta(const std::array<uint16_t,Dali::num_lights> &values);
+	void publish_levels_binary(const std::array<uint16_t,Dali::num_lights> &values);
+	void publish_levels_text(const std::array<uint16_t,Dali::num_lights> &values);
+	void publish_bus_levels(const std::array<Dali::Ballast,Dali::num_lights> &ballasts);
+	void clear_group_levels(const Dali::lights_t &lights);
+	void report_dimmed_levels(const Dali::lights_t &lights, uint64_t time_us);
+	void clear_dimmed_levels(const Dali::lights_t &lights);
 	bool is_idle();
+	void wake_up_dali() const;
+	std::array<Dali::Ballast,Dali::num_lights> get_ballasts() const;
+	void publish_state() const;
+	preset_id_t preset_id(const std::string &name);
+	bool find_preset_id(const std::string &name, preset_id_t &id) const;
+	void set_active_preset(unsigned int light_id, preset_id_t id);
 
 	void load_rtc_state();
 	void save_rtc_state();
@@ -114,30 +168,63 @@ private:
 
 	Network &network_;
 	const Config &config_;
-	Dali *dali_{nullptr};
+	std::array<Dali*,NUM_DALI_BUSES> dali_{};
 	BootRTCStatus boot_rtc_{BootRTCStatus::UNKNOWN};
 
-	mutable std::recursive_mutex lights_mutex_;
-	std::array<Dali::level_fast_t,Dali::num_addresses> levels_{};
+	mutable ProfiledRecursiveMutex lights_mutex_{"lights"};
+	std::array<Dali::level_fast_t,Dali::num_lights> levels_{};
 	std::array<Dali::level_fast_t,Dali::num_groups> group_levels_{};
 	Dali::level_fast_t broadcast_level_{Dali::LEVEL_NO_CHANGE};
-	Dali::addresses_t group_level_addresses_{};
-	mutable Dali::groups_t group_sync_{};
-	mutable Dali::addresses_t force_refresh_;
-	mutable bool broadcast_power_on_level_{false};
-	mutable bool broadcast_system_failure_level_{false};
-	Dali::addresses_t power_on_;
-	Dali::addresses_t power_known_;
-	std::array<uint64_t,Dali::num_addresses> dim_time_us_{};
-	mutable std::array<unsigned int,Dali::num_addresses> force_refresh_count_{};
+	Dali::lights_t group_level_addresses_{};
+	mutable std::array<Dali::groups_t,NUM_DALI_BUSES> group_sync_{};
+	mutable Dali::lights_t force_refresh_;
+	mutable std::bitset<NUM_DALI_BUSES> broadcast_power_on_level_;
+	mutable std::bitset<NUM_DALI_BUSES> broadcast_system_failure_level_;
+	Dali::lights_t interactive_;
+	std::array<uint32_t,Dali::num_lights> transition_ms_{};
+	std::array<uint64_t,Dali::num_lights> transition_us_{};
+	std::array<uint64_t,NUM_DALI_PRIORITIES> request_us_{};
+	Dali::lights_t power_on_;
+	Dali::lights_t power_known_;
+	std::array<uint64_t,Dali::num_lights> dim_time_us_{};
+	mutable std::array<unsigned int,Dali::num_lights> force_refresh_count_{};
 	uint64_t last_publish_levels_us_{0};
+	std::array<uint16_t,Dali::num_lights> published_levels_{}; /**< Values last published as a delta */
+	bool published_levels_valid_{false};
+	uint32_t levels_sequence_{0};
+	bool levels_snapshot_pending_{false}; /**< Text snapshot is out of date */
 	uint64_t last_activity_us_{0};
-
-	std::mutex publish_mutex_;
+	mutable LatencyOrigin trace_origin_{};
+	mutable uint64_t trace_state_us_{0};
+
+	/**
+	 * Double-buffered copy of the lights state for the Dali threads, split by
+	 * bus and updated while holding lights_mutex_. Each buffer has a sequence
+	 * number that is odd while it's being written.
+	 */
+	struct StateSnapshot {
+		std::atomic<uint32_t> sequence{0};
+		std::array<LightsState,NUM_DALI_BUSES> states{};
+	};
+	mutable std::array<StateSnapshot,2> snapshots_{};
+	mutable std::atomic<uint32_t> snapshot_version_{0};
+
+	ProfiledMutex publish_mutex_{"lights_publish"};
 	bool startup_complete_{false};
-	std::array<std::string,Dali::num_addresses> active_presets_{};
-	std::unordered_set<std::string> republish_groups_;
-	std::unordered_set<std::string> republish_presets_;
+	std::array<std::string,MAX_PRESET_IDS> preset_names_;
+	std::unordered_map<std::string,preset_id_t> preset_ids_;
+	std::array<preset_id_t,Dali::num_lights> active_presets_{};
+	std::array<Dali::lights_t,MAX_PRESET_IDS> preset_lights_{}; /**< Lights that each preset is active on */
+
+	/**
+	 * Active state of each preset that was last published for each group,
+	 * indexed by group ID with the "all" group at the end.
+	 */
+	std::array<std::bitset<MAX_PRESET_IDS>,Dali::num_groups + 1> published_known_{};
+	std::array<std::bitset<MAX_PRESET_IDS>,Dali::num_groups + 1> published_active_{};
+	std::bitset<MAX_PRESET_IDS> republish_presets_;
+	Dali::groups_t republish_groups_;
+	bool republish_all_group_{false};
 	uint64_t last_publish_active_us_{0};
 	size_t publish_index_{0};
 };
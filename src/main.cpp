@@ -21,6 +21,7 @@
 #include <esp_task_wdt.h>
 #include <esp_timer.h>
 
+#include <array>
 #include <functional>
 #include <mutex>
 #include <string>
@@ -28,9 +29,11 @@
 #include "api.h"
 #include "dali.h"
 #include "config.h"
+#include "input_thread.h"
 #include "lights.h"
 #include "local_lights.h"
 #include "network.h"
+#include "profiled_mutex.h"
 #include "remote_lights.h"
 #include "switches.h"
 #include "ui.h"
@@ -47,7 +50,7 @@ std::string FixedConfig::mqtt_remote_topic_str{
  * LittleFS is NOT thread-safe. Lock this global mutex when accessing the
  * filesystem.
  */
-static std::mutex file_mutex;
+static ProfiledMutex file_mutex{"file"};
 
 static Network network;
 static Selector selector;
@@ -97,32 +100,66 @@ void setup() {
 	Switches &switches = *new Switches{network, config, lights};
 	Buttons &buttons = *new Buttons{config, lights};
 	Dimmers &dimmers = *new Dimmers{network, config, lights};
-	Dali &dali = *new Dali{config, local_lights};
+	std::array<Dali*,NUM_DALI_BUSES> dali{};
+
+	for (unsigned int bus = 0; bus < dali.size(); bus++) {
+		dali[bus] = new Dali{config, local_lights, bus};
+	}
 	api = new API{file_mutex, network, config, dali, dimmers, lights, ui};
 
+#if defined(SHARED_INPUT_THREAD)
+	InputThread &inputs = *new InputThread{};
+
 	if (FixedConfig::isLocal()) {
-		dali.setup();
+		inputs.attach(switches);
+	}
+	inputs.attach(buttons);
+	inputs.attach(dimmers);
+#endif
+
+	/*
+	 * Start the DALI bus with the light levels from RTC memory before
+	 * anything else, so that the lights are refreshed as soon as the config
+	 * has loaded the addresses. WiFi can connect while the config is loaded
+	 * but MQTT doesn't start until everything is ready.
+	 */
+	if (FixedConfig::isLocal()) {
+		for (Dali *bus : dali) {
+			bus->setup();
+		}
+		local_lights.setup();
+		for (Dali *bus : dali) {
+			local_lights.set_dali(*bus);
+			bus->start();
+		}
+		ui.boot_stage("dali");
 	}
+	network.setup();
+	ui.boot_stage("network");
 	selector.setup();
 	config.setup();
+	ui.boot_stage("config");
 	if (FixedConfig::isLocal()) {
-		local_lights.setup();
 		switches.setup();
 	}
 	buttons.setup();
 	dimmers.setup();
-	if (FixedConfig::isLocal()) {
-		dali.start();
-	}
+#if defined(SHARED_INPUT_THREAD)
+	inputs.setup();
+#endif
 	ui.setup();
+	ui.set_config(config);
+	ui.set_dimmers(dimmers);
 
 	if (FixedConfig::isLocal()) {
-		local_lights.set_dali(dali);
-		ui.set_dali(dali);
+		for (Dali *bus : dali) {
+			ui.set_dali(*bus);
+		}
 		ui.set_switches(switches);
 	}
+	ui.boot_stage("setup");
 
-	network.setup(std::bind(&API::connected, api),
+	network.start(std::bind(&API::connected, api),
 		std::bind(&API::receive, api, _1, _2));
 
 	if (ota_verification_pending()) {
@@ -150,6 +187,5 @@ void loop() {
 		local_lights.loop();
 	}
 	ui.loop();
-	network.loop();
 	config.loop();
 }
@@ -28,8 +28,11 @@
 #include <cstring>
 #include <functional>
 #include <string>
+#include <thread>
 #include <utility>
 
+#include "latency.h"
+#include "thread.h"
 #include "util.h"
 
 static void json_append_escape(std::string &output, const std::string_view value) {
@@ -42,7 +45,8 @@ static void json_append_escape(std::string &output, const std::string_view value
 }
 
 Network::Network()
-		: device_id_(String("mqtt-dali-controller_") + String(ESP.getEfuseMac(), HEX)) {
+		: WakeupThread("network", false), device_id_(String("mqtt-dali-controller_") + String(ESP.getEfuseMac(), HEX)) {
+	retained_messages_.reserve(MAX_QUEUED_MESSAGES);
 }
 
 void Network::report(const char *tag, const std::string &message) {
@@ -68,11 +72,20 @@ void Network::subscribe(const std::string &topic) {
 	mqtt_.subscribe(topic.c_str());
 }
 
-void Network::publish(const std::string &topic, const std::string &payload,
+void Network::publish(std::string_view topic, std::string_view payload,
 		bool retain, bool immediate) {
+	publish({topic}, payload, retain, immediate);
+}
+
+void Network::publish(std::initializer_list<std::string_view> topic,
+		std::string_view payload, bool retain, bool immediate) {
 	Message message;
 	bool ok = message.write(topic, payload, retain);
 
+	enqueue(std::move(message), ok, immediate);
+}
+
+void Network::enqueue(Message &&message, bool ok, bool immediate) {
 	std::lock_guard lock{messages_mutex_};
 	auto &queue = immediate ? immediate_message_queue_ : message_queue_;
 
@@ -81,22 +94,69 @@ void Network::publish(const std::string &topic, const std::string &payload,
 		return;
 	}
 
+	/*
+	 * Retained messages are the current state of their topic, so a newer
+	 * message replaces any message for the same topic that hasn't been sent
+	 * yet (keeping its position in the queue).
+	 */
+	if (!immediate && message.retain()) {
+		auto it = retained_messages_.find(message.topic());
+
+		if (it != retained_messages_.end()) {
+			Message &queued = message_queue_[it->second - message_queue_start_];
+			auto node = retained_messages_.extract(it);
+
+			queued = std::move(message);
+			node.key() = queued.topic();
+			retained_messages_.insert(std::move(node));
+			coalesced_messages_++;
+			wake_up();
+			return;
+		}
+	}
+
 	while (queue.size() >= MAX_QUEUED_MESSAGES) {
-		queue.pop_front();
+		if (immediate) {
+			queue.pop_front();
+		} else {
+			pop_queued_message();
+		}
+		dropped_messages_++;
+		lost_message_generation_++;
 	}
 
 	queue.push_back(std::move(message));
 	maximum_queue_size_ = std::max(maximum_queue_size_, queue.size());
+	wake_up();
+
+	if (!immediate && queue.back().retain()) {
+		retained_messages_.emplace(queue.back().topic(),
+			message_queue_start_ + queue.size() - 1);
+	}
+}
+
+Message Network::pop_queued_message() {
+	Message message;
+
+	if (message_queue_.front().retain()) {
+		retained_messages_.erase(message_queue_.front().topic());
+	}
+
+	message = std::move(message_queue_.front());
+	message_queue_.pop_front();
+	message_queue_start_++;
+	return message;
 }
 
 void Network::send_queued_messages() {
-	if (!wifi_up_ || !mqtt_.connected()) {
+	if (!wifi_up_ || !mqtt_up_) {
 		return;
 	}
 
 	std::unique_lock lock{messages_mutex_};
 	size_t count = FixedConfig::isLocal() ? (message_queue_.size() / SEND_QUEUE_DIVISOR + 1) : 1;
 	size_t dropped = dropped_messages_;
+	size_t coalesced = coalesced_messages_;
 	size_t oversized = oversized_messages_;
 
 	while (!immediate_message_queue_.empty()) {
@@ -106,11 +166,11 @@ void Network::send_queued_messages() {
 	}
 
 	while (!message_queue_.empty() && send_messages_.size() < count) {
-		send_messages_.push_back(std::move(message_queue_.front()));
-		message_queue_.pop_front();
+		send_messages_.push_back(pop_queued_message());
 	}
 
 	dropped_messages_ = 0;
+	coalesced_messages_ = 0;
 	oversized_messages_ = 0;
 	lock.unlock();
 
@@ -119,6 +179,11 @@ void Network::send_queued_messages() {
 			std::to_string(dropped).c_str());
 	}
 
+	if (coalesced) {
+		mqtt_.publish(FixedConfig::mqttTopic("/stats/coalesced_messages").c_str(),
+			std::to_string(coalesced).c_str());
+	}
+
 	if (oversized) {
 		mqtt_.publish(FixedConfig::mqttTopic("/stats/oversized_messages").c_str(),
 			std::to_string(oversized).c_str());
@@ -128,7 +193,9 @@ void Network::send_queued_messages() {
 		const auto &message = send_messages_.front();
 		auto payload = message.payload();
 
-		mqtt_.publish(message.topic(), payload.first, payload.second, message.retain());
+		if (!mqtt_.publish(message.topic(), payload.first, payload.second, message.retain())) {
+			lost_message_generation_++;
+		}
 		send_messages_.pop_front();
 		sent_messages_++;
 		yield();
@@ -136,6 +203,7 @@ void Network::send_queued_messages() {
 }
 
 void Network::receive(char *topic, uint8_t *payload, unsigned int length) {
+	LatencyTrace trace{LatencySource::MQTT, (uint64_t)esp_timer_get_time()};
 	std::unique_lock lock{messages_mutex_};
 
 	received_messages_++;
@@ -170,8 +238,16 @@ size_t Network::maximum_queue_size() {
 	return size;
 }
 
-void Network::setup(std::function<void()> connected,
-		std::function<void(std::string &&topic, std::string &&payload)> receive) {
+size_t Network::message_pool_exhausted_count() {
+	return Message::pool_exhausted_count();
+}
+
+/*
+ * WiFi starts connecting as soon as the thread is running, but MQTT doesn't
+ * connect until start() is called because the application can't handle
+ * received messages until it has finished starting up.
+ */
+void Network::setup() {
 	using namespace std::placeholders;
 
 	WiFi.persistent(false);
@@ -180,14 +256,24 @@ void Network::setup(std::function<void()> connected,
 	WiFi.setSleep(false);
 	WiFi.mode(WIFI_STA);
 
-	connected_ = connected;
-	receive_ = receive;
 	mqtt_.setServer(FixedConfig::mqttHostname(), FixedConfig::mqttPort());
 	mqtt_.setBufferSize(Message::BUFFER_SIZE);
 	mqtt_.setCallback(std::bind(&Network::receive, this, _1, _2, _3));
+
+	std::thread t;
+	make_thread(t, "network", 8192, 1, 5, &Network::run_loop, this);
+	t.detach();
+}
+
+void Network::start(std::function<void()> connected,
+		std::function<void(std::string_view topic, std::string_view payload)> receive) {
+	connected_ = connected;
+	receive_ = receive;
+	mqtt_enabled_ = true;
+	wake_up();
 }
 
-void Network::loop() {
+unsigned long Network::run_tasks() {
 	switch (WiFi.status()) {
 	case WL_IDLE_STATUS:
 	case WL_NO_SSID_AVAIL:
@@ -217,13 +303,19 @@ void Network::loop() {
 
 	mqtt_.loop();
 
-	if (wifi_up_) {
-		if (!mqtt_.connected() && (!last_mqtt_us_ || esp_timer_get_time() - last_mqtt_us_ > ONE_S)) {
+	if (mqtt_up_ && !mqtt_.connected()) {
+		lost_message_generation_++;
+	}
+	mqtt_up_ = mqtt_.connected();
+
+	if (wifi_up_ && mqtt_enabled_) {
+		if (!mqtt_up_ && (!last_mqtt_us_ || esp_timer_get_time() - last_mqtt_us_ > ONE_S)) {
 			ESP_LOGE(TAG, "MQTT connecting");
 			mqtt_.connect(device_id_.c_str());
 			last_mqtt_us_ = esp_timer_get_time();
+			mqtt_up_ = mqtt_.connected();
 
-			if (mqtt_.connected()) {
+			if (mqtt_up_) {
 				ESP_LOGE(TAG, "MQTT connected");
 				if (connected_) {
 					connected_();
@@ -235,11 +327,134 @@ void Network::loop() {
 	}
 
 	send_queued_messages();
+
+	std::lock_guard lock{messages_mutex_};
+
+	if (mqtt_up_ && !message_queue_.empty()) {
+		/* Continue sending queued messages after checking for received messages */
+		return 1;
+	}
+
+	return RECEIVE_INTERVAL_MS;
+}
+
+void MessagePool::allocate_blocks() {
+	allocated_ = true;
+
+	for (size_t i = 0; i < NUM_BLOCK_SIZES; i++) {
+		uint8_t *blocks = reinterpret_cast<uint8_t*>(::heap_caps_malloc(
+			BLOCK_SIZES[i] * BLOCK_COUNTS[i], MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));
+
+		if (!blocks) {
+			continue;
+		}
+
+		/* Free blocks contain a pointer to the next free block */
+		for (size_t j = 0; j < BLOCK_COUNTS[i]; j++) {
+			uint8_t *block = &blocks[j * BLOCK_SIZES[i]];
+
+			*reinterpret_cast<uint8_t**>(block) = free_[i];
+			free_[i] = block;
+		}
+	}
+}
+
+uint8_t *MessagePool::allocate(size_t size, int &block_size) {
+	std::unique_lock lock{mutex_};
+
+	if (!allocated_) {
+		allocate_blocks();
+	}
+
+	for (size_t i = 0; i < NUM_BLOCK_SIZES; i++) {
+		if (size > BLOCK_SIZES[i]) {
+			continue;
+		}
+
+		if (free_[i]) {
+			uint8_t *block = free_[i];
+
+			free_[i] = *reinterpret_cast<uint8_t**>(block);
+			block_size = i;
+			return block;
+		}
+
+		break;
+	}
+
+	exhausted_++;
+	lock.unlock();
+
+	block_size = HEAP;
+	return reinterpret_cast<uint8_t*>(::heap_caps_malloc(size,
+		MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));
+}
+
+void MessagePool::release(uint8_t *data, int block_size) {
+	if (block_size == HEAP) {
+		::free(data);
+		return;
+	}
+
+	std::lock_guard lock{mutex_};
+
+	*reinterpret_cast<uint8_t**>(data) = free_[block_size];
+	free_[block_size] = data;
+}
+
+size_t MessagePool::exhausted_count() {
+	std::lock_guard lock{mutex_};
+	size_t count = exhausted_;
+
+	exhausted_ = 0;
+	return count;
+}
+
+MessagePool Message::pool_;
+
+Message::~Message() {
+	reset();
+}
+
+Message::Message(Message &&other) noexcept {
+	*this = std::move(other);
+}
+
+Message& Message::operator=(Message &&other) noexcept {
+	if (this != &other) {
+		reset();
+
+		buffer_ = other.buffer_;
+		block_size_ = other.block_size_;
+		topic_len_ = other.topic_len_;
+		payload_len_ = other.payload_len_;
+		retain_ = other.retain_;
+
+		other.buffer_ = nullptr;
+		other.topic_len_ = 0;
+		other.payload_len_ = 0;
+	}
+	return *this;
+}
+
+void Message::reset() {
+	if (buffer_) {
+		pool_.release(buffer_, block_size_);
+		buffer_ = nullptr;
+	}
+
+	topic_len_ = 0;
+	payload_len_ = 0;
+	retain_ = false;
+}
+
+size_t Message::pool_exhausted_count() {
+	return pool_.exhausted_count();
 }
 
 inline const char* Message::topic() const {
 	if (topic_len_) {
-		return reinterpret_cast<char*>(buffer_.get());
+		return reinterpret_cast<char*>(buffer_);
 	} else {
 		return "";
 	}
@@ -247,7 +462,7 @@ inline const char* Message::topic() const {
 
 inline std::pair<const uint8_t *,size_t> Message::payload() const {
 	if (payload_len_) {
-		return {&buffer_.get()[topic_len_], payload_len_};
+		return {&buffer_[topic_len_], payload_len_};
 	} else {
 		return {nullptr, 0};
 	}
@@ -257,20 +472,57 @@ inline bool Message::retain() const {
 	return retain_;
 }
 
-bool Message::write(const std::string &topic, const std::string &payload, bool retain) {
-	if (topic.length() + 1 + payload.length() > BUFFER_SIZE) {
-		topic_len_ = 0;
-		payload_len_ = 0;
-		retain_ = false;
-		return false;
+char *Message::write(std::initializer_list<std::string_view> topic,
+		size_t max_payload_length, bool retain) {
+	size_t topic_length = 0;
+
+	reset();
+
+	for (const auto &part : topic) {
+		topic_length += part.length();
+	}
+
+	if (topic_length + 1 + max_payload_length > BUFFER_SIZE) {
+		return nullptr;
 	}
 
-	buffer_ = MemoryAllocation{reinterpret_cast<uint8_t*>(
-		::heap_caps_malloc(BUFFER_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT))};
-	topic_len_ = topic.length() + 1;
-	payload_len_ = payload.length();
+	buffer_ = pool_.allocate(topic_length + 1 + max_payload_length, block_size_);
+	if (!buffer_) {
+		return nullptr;
+	}
+
+	for (const auto &part : topic) {
+		std::memcpy(&buffer_[topic_len_], part.data(), part.length());
+		topic_len_ += part.length();
+	}
+	buffer_[topic_len_++] = '\0';
+	payload_len_ = max_payload_length;
 	retain_ = retain;
-	std::memcpy(buffer_.get(), topic.c_str(), topic_len_);
-	std::memcpy(&buffer_.get()[topic_len_], payload.c_str(), payload_len_);
+	return reinterpret_cast<char*>(&buffer_[topic_len_]);
+}
+
+void Message::resize_payload(size_t length) {
+	payload_len_ = std::min(payload_len_, length);
+}
+
+size_t Message::max_payload_length(std::initializer_list<std::string_view> topic) {
+	size_t topic_length = 0;
+
+	for (const auto &part : topic) {
+		topic_length += part.length();
+	}
+
+	return topic_length + 1 < BUFFER_SIZE ? BUFFER_SIZE - topic_length - 1 : 0;
+}
+
+bool Message::write(std::initializer_list<std::string_view> topic,
+		std::string_view payload, bool retain) {
+	char *buffer = write(topic, payload.length(), retain);
+
+	if (!buffer) {
+		return false;
+	}
+
+	std::memcpy(buffer, payload.data(), payload.length());
 	return true;
 }
@@ -27,15 +27,51 @@
 #include <deque>
 #include <mutex>
 #include <functional>
+#include <initializer_list>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 
+#include "profiled_mutex.h"
+#include "thread.h"
 #include "util.h"
 
+/**
+ * Preallocated buffers for messages in PSRAM, in a few block sizes so that
+ * small messages don't use a whole maximum size buffer. Messages that don't
+ * fit in a free block are allocated from the heap instead.
+ */
+class MessagePool {
+public:
+	static constexpr size_t NUM_BLOCK_SIZES = 4;
+	static constexpr std::array<size_t,NUM_BLOCK_SIZES> BLOCK_SIZES{64, 128, 256, 512};
+	static constexpr std::array<size_t,NUM_BLOCK_SIZES> BLOCK_COUNTS{512, 256, 64, 32};
+	static constexpr int HEAP = -1;
+
+	MessagePool() = default;
+
+	uint8_t *allocate(size_t size, int &block_size);
+	void release(uint8_t *data, int block_size);
+	size_t exhausted_count();
+
+private:
+	MessagePool(const MessagePool&) = delete;
+	MessagePool& operator=(const MessagePool&) = delete;
+
+	void allocate_blocks();
+
+	std::mutex mutex_;
+	bool allocated_{false};
+	std::array<uint8_t*,NUM_BLOCK_SIZES> free_{};
+	size_t exhausted_{0};
+};
+
 class Message {
 public:
 	Message() = default;
-	Message(Message&&) = default;
-	Message& operator=(Message&&) = default;
+	~Message();
+	Message(Message &&other) noexcept;
+	Message& operator=(Message &&other) noexcept;
 
 	static constexpr size_t BUFFER_SIZE = 512;
 
@@ -43,62 +79,126 @@ public:
 	std::pair<const uint8_t *,size_t> payload() const;
 	bool retain() const;
 
-	bool write(const std::string &topic, const std::string &payload, bool retain);
+	bool write(std::initializer_list<std::string_view> topic,
+		std::string_view payload, bool retain);
+	char *write(std::initializer_list<std::string_view> topic,
+		size_t max_payload_length, bool retain);
+	void resize_payload(size_t length);
+
+	static size_t max_payload_length(std::initializer_list<std::string_view> topic);
+
+	static size_t pool_exhausted_count();
 
 private:
 	Message(const Message&) = delete;
 	Message& operator=(const Message&) = delete;
 
-	MemoryAllocation buffer_;
+	void reset();
+
+	static MessagePool pool_;
+
+	uint8_t *buffer_{nullptr};
+	int block_size_{MessagePool::HEAP};
 	size_t topic_len_{0};
 	size_t payload_len_{0};
 	bool retain_{false};
 };
 
-class Network {
+class Network: public WakeupThread {
 public:
 	Network();
 
-	void setup(std::function<void()> connected,
-		std::function<void(std::string &&topic, std::string &&payload)> receive);
-	void loop();
+	void setup();
+	void start(std::function<void()> connected,
+		std::function<void(std::string_view topic, std::string_view payload)> receive);
 	inline std::string device_id() { return device_id_.c_str(); }
-	inline bool connected() { return wifi_up_ && mqtt_.connected(); }
+	inline bool connected() { return wifi_up_ && mqtt_up_; }
 	inline bool busy() {
 		std::lock_guard lock{messages_mutex_};
 		return !immediate_message_queue_.empty();
 	}
+	inline size_t queued_message_count() {
+		std::lock_guard lock{messages_mutex_};
+		return message_queue_.size();
+	}
+	/**
+	 * Incremented whenever messages may have been lost, because they were
+	 * dropped from the queue, failed to send or MQTT disconnected.
+	 */
+	inline uint32_t lost_message_generation() { return lost_message_generation_; }
 	void report(const char *tag, const std::string &message);
 	void subscribe(const std::string &topic);
-	void publish(const std::string &topic, const std::string &payload,
+	void publish(std::string_view topic, std::string_view payload,
 		bool retain = false, bool immediate = false);
+	void publish(std::initializer_list<std::string_view> topic,
+		std::string_view payload, bool retain = false, bool immediate = false);
+
+	/**
+	 * Publish a message by writing the payload directly into the message
+	 * buffer. The write function is called with a buffer of max_length
+	 * bytes and returns the length of the payload.
+	 *
+	 * Returns false if the message was not queued because it's too large or
+	 * there's no memory available for it.
+	 */
+	template <typename Function>
+	bool publish(std::initializer_list<std::string_view> topic, size_t max_length,
+			Function &&write, bool retain = false, bool immediate = false) {
+		Message message;
+		char *payload = message.write(topic, max_length, retain);
+
+		if (payload) {
+			message.resize_payload(write(payload, max_length));
+		}
+
+		enqueue(std::move(message), payload != nullptr, immediate);
+		return payload != nullptr;
+	}
+
 	void send_queued_messages();
 	size_t received_message_count();
 	size_t sent_message_count();
 	size_t maximum_queue_size();
+	size_t message_pool_exhausted_count();
 
 private:
 	static constexpr const char *TAG = "UI";
 	static constexpr size_t MAX_QUEUED_MESSAGES = 1000;
 	static constexpr size_t SEND_QUEUE_DIVISOR = 10;
 
+	/**
+	 * PubSubClient has to be polled for received messages, so this is the
+	 * maximum latency for receiving a message. Sending messages wakes up the
+	 * thread immediately.
+	 */
+	static constexpr unsigned long RECEIVE_INTERVAL_MS = 10;
+
+	unsigned long run_tasks() override;
 	void receive(char *topic, uint8_t *payload, unsigned int length);
+	void enqueue(Message &&message, bool ok, bool immediate);
+	Message pop_queued_message();
 
 	String device_id_;
 	WiFiClient client_;
 	PubSubClient mqtt_{client_};
 	uint64_t last_wifi_us_{0};
 	std::atomic<bool> wifi_up_{false};
+	std::atomic<bool> mqtt_up_{false};
+	std::atomic<bool> mqtt_enabled_{false}; /**< Connect to MQTT after the application has started */
 	uint64_t last_mqtt_us_{0};
 
 	std::function<void()> connected_;
-	std::function<void(std::string &&topic, std::string &&payload)> receive_;
+	std::function<void(std::string_view topic, std::string_view payload)> receive_;
 
-	std::mutex messages_mutex_;
+	ProfiledMutex messages_mutex_{"network_messages"};
 	std::deque<Message> immediate_message_queue_;
 	std::deque<Message> message_queue_;
+	size_t message_queue_start_{0}; /**< Position of the first message in the queue */
+	std::unordered_map<std::string_view,size_t> retained_messages_; /**< Position of queued retained messages by topic */
 	std::deque<Message> send_messages_;
 	size_t dropped_messages_{0};
+	std::atomic<uint32_t> lost_message_generation_{0};
+	size_t coalesced_messages_{0};
 	size_t oversized_messages_{0};
 	size_t received_messages_{0};
 	size_t sent_messages_{0};
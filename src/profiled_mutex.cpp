@@ -0,0 +1,72 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "profiled_mutex.h"
+
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <atomic>
+
+std::atomic<LockProfile*> LockProfile::first_{nullptr};
+
+LockProfile::LockProfile(const char *name) : name_(name) {
+	LockProfile *first = first_.load(std::memory_order_relaxed);
+
+	do {
+		next_ = first;
+	} while (!first_.compare_exchange_weak(first, this,
+		std::memory_order_release, std::memory_order_relaxed));
+}
+
+/*
+ * Recursive locks are only counted once, from the first time they're
+ * acquired until their final release.
+ */
+void LockProfile::acquired(uint64_t wait_us, bool contended) {
+	if (depth_++ > 0) {
+		return;
+	}
+
+	locked_us_ = esp_timer_get_time();
+	stats_.lock_count++;
+
+	if (contended) {
+		stats_.contended_count++;
+		stats_.wait_us += wait_us;
+		stats_.max_wait_us = std::max(stats_.max_wait_us, wait_us);
+	}
+}
+
+void LockProfile::released() {
+	if (--depth_ > 0) {
+		return;
+	}
+
+	uint64_t hold_us = esp_timer_get_time() - locked_us_;
+
+	stats_.hold_us += hold_us;
+	stats_.max_hold_us = std::max(stats_.max_hold_us, hold_us);
+}
+
+LockStats LockProfile::take_stats() {
+	LockStats stats = stats_;
+
+	stats_ = {};
+	return stats;
+}
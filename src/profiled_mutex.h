@@ -0,0 +1,119 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <esp_timer.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+struct LockStats {
+	uint32_t lock_count{0}; /**< Number of times the lock was acquired */
+	uint32_t contended_count{0}; /**< Number of times the lock was already held by another thread */
+	uint64_t wait_us{0}; /**< Total time spent waiting for the lock (µs) */
+	uint64_t max_wait_us{0}; /**< Maximum time spent waiting for the lock (µs) */
+	uint64_t hold_us{0}; /**< Total time the lock was held (µs) */
+	uint64_t max_hold_us{0}; /**< Maximum time the lock was held (µs) */
+};
+
+/**
+ * Named lock that records how long threads wait for it and how long it's held
+ * for. All profiled locks are in a list so that their stats can be published
+ * without having to know where they are, so they must never be destroyed.
+ */
+class LockProfile {
+public:
+	explicit LockProfile(const char *name);
+
+	static inline LockProfile *first() { return first_.load(std::memory_order_acquire); }
+	inline LockProfile *next() const { return next_; }
+	inline const char *name() const { return name_; }
+
+	/** Get and reset the lock statistics */
+	virtual LockStats get_stats() = 0;
+
+protected:
+	~LockProfile() = default;
+
+	LockProfile(const LockProfile&) = delete;
+	LockProfile& operator=(const LockProfile&) = delete;
+
+	/* These must be called while holding the lock */
+	void acquired(uint64_t wait_us, bool contended);
+	void released();
+	LockStats take_stats();
+
+private:
+	static std::atomic<LockProfile*> first_;
+
+	const char *name_;
+	LockProfile *next_{nullptr};
+	unsigned int depth_{0};
+	uint64_t locked_us_{0};
+	LockStats stats_;
+};
+
+/**
+ * Drop-in replacement for std::mutex or std::recursive_mutex (for use with
+ * std::lock_guard and std::unique_lock) that records lock statistics.
+ */
+template<class Mutex>
+class BasicProfiledMutex: public LockProfile {
+public:
+	explicit BasicProfiledMutex(const char *name) : LockProfile(name) {}
+
+	void lock() {
+		if (mutex_.try_lock()) {
+			acquired(0, false);
+			return;
+		}
+
+		uint64_t start_us = esp_timer_get_time();
+
+		mutex_.lock();
+		acquired(esp_timer_get_time() - start_us, true);
+	}
+
+	bool try_lock() {
+		if (!mutex_.try_lock()) {
+			return false;
+		}
+
+		acquired(0, false);
+		return true;
+	}
+
+	void unlock() {
+		released();
+		mutex_.unlock();
+	}
+
+	LockStats get_stats() override {
+		std::lock_guard lock{mutex_};
+
+		return take_stats();
+	}
+
+private:
+	Mutex mutex_;
+};
+
+using ProfiledMutex = BasicProfiledMutex<std::mutex>;
+using ProfiledRecursiveMutex = BasicProfiledMutex<std::recursive_mutex>;
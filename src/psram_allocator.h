@@ -0,0 +1,68 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <esp_heap_caps.h>
+
+#include <cstddef>
+#include <new>
+
+/**
+ * Allocator for data that isn't used on the hot paths, so that it doesn't
+ * use (and fragment) the internal heap. Allocations are made from PSRAM when
+ * PSRAM_CONFIG is enabled, falling back to the internal heap if PSRAM is
+ * full or not available.
+ */
+template <typename T>
+class PsramAllocator {
+public:
+	using value_type = T;
+
+	PsramAllocator() noexcept = default;
+
+	template <typename U>
+	PsramAllocator(const PsramAllocator<U>&) noexcept {}
+
+	T *allocate(size_t n) {
+		void *ptr = nullptr;
+
+#if defined(PSRAM_CONFIG)
+		ptr = ::heap_caps_malloc(n * sizeof(T), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#endif
+		if (!ptr) {
+			ptr = ::heap_caps_malloc(n * sizeof(T), MALLOC_CAP_DEFAULT);
+		}
+
+		if (!ptr) {
+			throw std::bad_alloc();
+		}
+
+		return static_cast<T*>(ptr);
+	}
+
+	void deallocate(T *ptr, size_t) noexcept {
+		::heap_caps_free(ptr);
+	}
+
+	template <typename U>
+	bool operator==(const PsramAllocator<U>&) const noexcept { return true; }
+
+	template <typename U>
+	bool operator!=(const PsramAllocator<U>&) const noexcept { return false; }
+};
@@ -19,8 +19,12 @@
 #include "remote_lights.h"
 
 #include <Arduino.h>
+#include <CBOR.h>
+#include <CBOR_streams.h>
 
+#include <array>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "config.h"
@@ -29,58 +33,194 @@
 #include "network.h"
 #include "util.h"
 
+/*
+ * Maximum encoded length of the headers and integers in a command, and of
+ * the header for each text item.
+ */
+static constexpr size_t MAX_COMMAND_LENGTH = 32;
+static constexpr size_t MAX_TEXT_HEADER_LENGTH = 9;
+
+static void write_command(cbor::Writer &writer, RemoteCommand command) {
+	writer.beginArray(3);
+	writer.writeUnsignedInt(static_cast<uint8_t>(command));
+}
+
+static void write_text(cbor::Writer &writer, std::string_view text) {
+	writer.beginText(text.size());
+	writer.writeBytes(reinterpret_cast<const uint8_t*>(text.data()), text.size());
+}
+
+static void write_text(cbor::Writer &writer, const std::vector<std::string> &texts) {
+	writer.beginArray(texts.size());
+
+	for (const auto &text : texts) {
+		write_text(writer, text);
+	}
+}
+
+static size_t text_length(const std::vector<std::string> &texts) {
+	size_t length = MAX_TEXT_HEADER_LENGTH;
+
+	for (const auto &text : texts) {
+		length += MAX_TEXT_HEADER_LENGTH + text.size();
+	}
+
+	return length;
+}
+
 RemoteLights::RemoteLights(Network &network, Config &config)
 		: network_(network), config_(config) {
 }
 
+template <typename Function>
+void RemoteLights::publish_binary(size_t max_length, Function &&write, bool immediate) {
+	network_.publish({FixedConfig::mqttRemoteTopic()}, max_length,
+		[&write] (char *buffer, size_t length) {
+			cbor::BytesPrint output{reinterpret_cast<uint8_t*>(buffer), length};
+			cbor::Writer writer{output};
+
+			write(writer);
+			return writer.getWriteSize();
+		}, false, immediate);
+}
+
+/* Transitions are not supported by remote commands */
 void RemoteLights::select_preset(std::string name, const std::string &light_ids,
-		bool internal) {
-	network_.publish(FixedConfig::mqttRemoteTopic(),
-		std::string{"pt "} + name + ' ' + light_ids);
+		bool internal, unsigned long transition_ms) {
+	if (FixedConfig::mqttRemoteBinary()) {
+		publish_binary(MAX_COMMAND_LENGTH + MAX_TEXT_HEADER_LENGTH * 2
+				+ name.size() + light_ids.size(),
+			[&] (cbor::Writer &writer) {
+				writer.beginArray(1);
+				write_command(writer, RemoteCommand::PRESET_LIGHTS);
+				write_text(writer, name);
+				write_text(writer, light_ids);
+			}, false);
+	} else {
+		network_.publish(FixedConfig::mqttRemoteTopic(),
+			std::string{"pt "} + name + ' ' + light_ids);
+	}
 }
 
 void RemoteLights::select_preset(std::string name,
 		const std::vector<std::string> &groups, bool internal) {
-	network_.publish(FixedConfig::mqttRemoteTopic(),
-		std::string{"pt "} + name + ' ' + vector_text(groups));
+	if (FixedConfig::mqttRemoteBinary()) {
+		publish_binary(MAX_COMMAND_LENGTH + MAX_TEXT_HEADER_LENGTH
+				+ name.size() + text_length(groups),
+			[&] (cbor::Writer &writer) {
+				writer.beginArray(1);
+				write_command(writer, RemoteCommand::PRESET_GROUPS);
+				write_text(writer, name);
+				write_text(writer, groups);
+			}, false);
+	} else {
+		network_.publish(FixedConfig::mqttRemoteTopic(),
+			std::string{"pt "} + name + ' ' + vector_text(groups));
+	}
 }
 
-void RemoteLights::set_level(const std::string &light_ids, long level) {
+void RemoteLights::set_level(const std::string &light_ids, long level,
+		unsigned long transition_ms) {
 	if (level < 0 || level > MAX_LEVEL) {
 		return;
 	}
 
-	network_.publish(FixedConfig::mqttRemoteTopic(),
-		std::string{"sl "} + light_ids + ' ' + std::to_string(level));
+	if (FixedConfig::mqttRemoteBinary()) {
+		publish_binary(MAX_COMMAND_LENGTH + MAX_TEXT_HEADER_LENGTH + light_ids.size(),
+			[&] (cbor::Writer &writer) {
+				writer.beginArray(1);
+				write_command(writer, RemoteCommand::SET_LEVEL);
+				write_text(writer, light_ids);
+				writer.writeUnsignedInt(level);
+			}, false);
+	} else {
+		network_.publish(FixedConfig::mqttRemoteTopic(),
+			std::string{"sl "} + light_ids + ' ' + std::to_string(level));
+	}
 }
 
-void RemoteLights::dim_adjust(unsigned int dimmer_id, long level) {
+bool RemoteLights::dim_command(unsigned int dimmer_id, long level,
+		RemoteCommand &command) {
 	if (dimmer_id >= NUM_DIMMERS) {
-		return;
+		return false;
 	}
 
 	if (level < -(long)MAX_LEVEL || level > (long)MAX_LEVEL) {
-		return;
+		return false;
 	}
 
-	std::string payload;
-
 	switch (config_.get_dimmer_mode(dimmer_id)) {
 	case DimmerMode::INDIVIDUAL:
-		payload = "di ";
-		break;
+		command = RemoteCommand::DIM_INDIVIDUAL;
+		return true;
 
 	case DimmerMode::GROUP:
-		payload = "dg ";
-		break;
+		command = RemoteCommand::DIM_GROUP;
+		return true;
 
 	default:
+		return false;
+	}
+}
+
+void RemoteLights::dim_adjust(unsigned int dimmer_id, long level) {
+	RemoteCommand command;
+
+	if (!dim_command(dimmer_id, level, command)) {
+		return;
+	}
+
+	if (FixedConfig::mqttRemoteBinary()) {
+		std::array<long,NUM_DIMMERS> levels{};
+
+		levels[dimmer_id] = level;
+		dim_adjust(levels);
 		return;
 	}
 
+	std::string payload{command == RemoteCommand::DIM_GROUP ? "dg " : "di "};
+
 	payload += std::to_string(level);
 	payload += ' ';
 	payload += vector_text(config_.dimmer_active_groups(dimmer_id));
 
 	network_.publish(FixedConfig::mqttRemoteTopic(), payload, false, true);
 }
+
+void RemoteLights::dim_adjust(const std::array<long,NUM_DIMMERS> &levels) {
+	if (!FixedConfig::mqttRemoteBinary()) {
+		Lights::dim_adjust(levels);
+		return;
+	}
+
+	std::array<RemoteCommand,NUM_DIMMERS> commands;
+	std::array<std::vector<std::string>,NUM_DIMMERS> groups;
+	std::array<bool,NUM_DIMMERS> valid{};
+	size_t count = 0;
+	size_t max_length = MAX_COMMAND_LENGTH;
+
+	for (unsigned int i = 0; i < NUM_DIMMERS; i++) {
+		if (levels[i] && dim_command(i, levels[i], commands[i])) {
+			groups[i] = config_.dimmer_active_groups(i);
+			valid[i] = true;
+			count++;
+			max_length += MAX_COMMAND_LENGTH + text_length(groups[i]);
+		}
+	}
+
+	if (!count) {
+		return;
+	}
+
+	publish_binary(max_length, [&] (cbor::Writer &writer) {
+			writer.beginArray(count);
+
+			for (unsigned int i = 0; i < NUM_DIMMERS; i++) {
+				if (valid[i]) {
+					write_command(writer, commands[i]);
+					writer.writeInt(levels[i]);
+					write_text(writer, groups[i]);
+				}
+			}
+		}, true);
+}
@@ -18,29 +18,59 @@
 
 #pragma once
 
+#include <array>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "config.h"
+#include "dimmers.h"
 #include "lights.h"
 #include "util.h"
 
 class Config;
 class Network;
 
+/**
+ * Command types for the binary encoding of the remote "x" topic. The payload
+ * is a CBOR array of commands that are each an array starting with the
+ * command type, so that several commands can be sent in one message.
+ */
+enum class RemoteCommand : uint8_t {
+	PRESET_LIGHTS = 0,  /**< [type, "preset", "light IDs"] */
+	PRESET_GROUPS = 1,  /**< [type, "preset", ["group", ...]] */
+	SET_LEVEL = 2,      /**< [type, "light IDs", level] */
+	DIM_INDIVIDUAL = 3, /**< [type, level change, ["group", ...]] */
+	DIM_GROUP = 4,      /**< [type, level change, ["group", ...]] */
+};
+
 class RemoteLights: public Lights {
 public:
 	RemoteLights(Network &network, Config &config);
 
-	void select_preset(std::string name, const std::string &light_ids, bool internal = false) override;
+	void select_preset(std::string name, const std::string &light_ids, bool internal = false,
+		unsigned long transition_ms = 0) override;
 	void select_preset(std::string name, const std::vector<std::string> &groups, bool internal = false) override;
-	void set_level(const std::string &light_ids, long level) override;
+	void set_level(const std::string &light_ids, long level, unsigned long transition_ms = 0) override;
 	void dim_adjust(unsigned int dimmer_id, long level) override;
+	void dim_adjust(const std::array<long,NUM_DIMMERS> &levels) override;
+
+	/**
+	 * Binary payloads start with a CBOR array, which can't be confused with
+	 * the first letter of a text command.
+	 */
+	static inline bool binary_payload(std::string_view payload) {
+		return !payload.empty() && (payload[0] & 0xE0) == 0x80;
+	}
 
 private:
 	static constexpr const char *TAG = "Lights";
 	static constexpr auto MAX_LEVEL = Dali::MAX_LEVEL;
 
+	template <typename Function>
+	void publish_binary(size_t max_length, Function &&write, bool immediate);
+	bool dim_command(unsigned int dimmer_id, long level, RemoteCommand &command);
+
 	Network &network_;
 	Config &config_;
 };
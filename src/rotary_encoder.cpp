@@ -20,6 +20,7 @@
 
 #include <Arduino.h>
 #include <driver/gpio.h>
+#include <driver/pcnt.h>
 #include <esp_log.h>
 
 #include <algorithm>
@@ -27,8 +28,11 @@
 #include <array>
 #include <cstring>
 
+#include "latency.h"
 #include "thread.h"
 
+unsigned int RotaryEncoder::pcnt_units_used_{0};
+
 RotaryEncoder::RotaryEncoder(std::array<gpio_num_t,2> pins)
 		: pins_(pins) {
 }
@@ -50,6 +54,13 @@ void RotaryEncoder::start(WakeupThread &wakeup) {
 	config.intr_type = GPIO_INTR_DISABLE;
 
 	ESP_ERROR_CHECK(gpio_config(&config));
+
+#if defined(ROTARY_ENCODER_PCNT)
+	if (start_pcnt()) {
+		return;
+	}
+#endif
+
 	state_[0] = gpio_get_level(pins_[0]) == 0;
 	state_[1] = gpio_get_level(pins_[1]) == 0;
 	ESP_ERROR_CHECK(gpio_isr_handler_add(pins_[0], rotary_encoder_interrupt_handler_0, this));
@@ -60,10 +71,69 @@ void RotaryEncoder::start(WakeupThread &wakeup) {
 	ESP_ERROR_CHECK(gpio_intr_enable(pins_[1]));
 }
 
+/*
+ * Count every state change of both pins in hardware, with the direction
+ * determined by the level of the other pin, and only interrupt when the
+ * count reaches the next or previous detent. The counter is reset to zero
+ * at its limits so contact bounce around a detent doesn't change anything.
+ */
+bool RotaryEncoder::start_pcnt() {
+	if (pcnt_units_used_ >= PCNT_UNIT_MAX) {
+		ESP_LOGW(TAG, "No pulse counter available, using GPIO interrupts");
+		return false;
+	}
+
+	if (pcnt_units_used_ == 0) {
+		ESP_ERROR_CHECK(pcnt_isr_service_install(0));
+	}
+
+	pcnt_unit_ = static_cast<pcnt_unit_t>(pcnt_units_used_++);
+
+	pcnt_config_t config{};
+
+	config.unit = pcnt_unit_;
+	config.counter_h_lim = PCNT_DETENT_COUNT;
+	config.counter_l_lim = -PCNT_DETENT_COUNT;
+
+	/*
+	 * The pins are active low: pin A becoming active first (while pin B is
+	 * inactive) is an increment.
+	 */
+	config.channel = PCNT_CHANNEL_0;
+	config.pulse_gpio_num = pins_[0];
+	config.ctrl_gpio_num = pins_[1];
+	config.pos_mode = PCNT_COUNT_DEC;
+	config.neg_mode = PCNT_COUNT_INC;
+	config.lctrl_mode = PCNT_MODE_REVERSE;
+	config.hctrl_mode = PCNT_MODE_KEEP;
+	ESP_ERROR_CHECK(pcnt_unit_config(&config));
+
+	config.channel = PCNT_CHANNEL_1;
+	config.pulse_gpio_num = pins_[1];
+	config.ctrl_gpio_num = pins_[0];
+	config.pos_mode = PCNT_COUNT_INC;
+	config.neg_mode = PCNT_COUNT_DEC;
+	ESP_ERROR_CHECK(pcnt_unit_config(&config));
+
+	ESP_ERROR_CHECK(pcnt_set_filter_value(pcnt_unit_, PCNT_FILTER_CYCLES));
+	ESP_ERROR_CHECK(pcnt_filter_enable(pcnt_unit_));
+	ESP_ERROR_CHECK(pcnt_event_enable(pcnt_unit_, PCNT_EVT_H_LIM));
+	ESP_ERROR_CHECK(pcnt_event_enable(pcnt_unit_, PCNT_EVT_L_LIM));
+	ESP_ERROR_CHECK(pcnt_counter_pause(pcnt_unit_));
+	ESP_ERROR_CHECK(pcnt_counter_clear(pcnt_unit_));
+	ESP_ERROR_CHECK(pcnt_isr_handler_add(pcnt_unit_, rotary_encoder_pcnt_handler, this));
+	ESP_ERROR_CHECK(pcnt_counter_resume(pcnt_unit_));
+	return true;
+}
+
 long RotaryEncoder::read() {
 	return change_.exchange(0L);
 }
 
+uint64_t RotaryEncoder::change_us() const {
+	return Latency::isr_time(change_us_.load(std::memory_order_relaxed));
+}
+
 void RotaryEncoder::debug(std::array<RotaryEncoderDebug,DEBUG_RECORDS> &records) const {
 	size_t pos = debug_pos_;
 
@@ -81,11 +151,12 @@ IRAM_ATTR void rotary_encoder_interrupt_handler_1(void *arg) {
 
 IRAM_ATTR void RotaryEncoder::interrupt_handler(int pin_id) {
 	bool state = gpio_get_level(pins_[pin_id]) == 0;
+	uint32_t now_us = esp_timer_get_time();
 
 	debug_[debug_pos_] = {
 		.pin = (uint32_t)pin_id,
 		.state = state,
-		.time_us = (uint32_t)esp_timer_get_time(),
+		.time_us = now_us,
 	};
 	debug_pos_ = (debug_pos_ + 1) % debug_.size();
 
@@ -105,6 +176,8 @@ IRAM_ATTR void RotaryEncoder::interrupt_handler(int pin_id) {
 		return;
 	}
 
+	change_us_.store(now_us, std::memory_order_relaxed);
+
 	if (first_ == 0) {
 		change_.fetch_add(1);
 	} else {
@@ -113,3 +186,27 @@ IRAM_ATTR void RotaryEncoder::interrupt_handler(int pin_id) {
 
 	wakeup_->wake_up_isr();
 }
+
+IRAM_ATTR void rotary_encoder_pcnt_handler(void *arg) {
+	static_cast<RotaryEncoder*>(arg)->pcnt_handler();
+}
+
+IRAM_ATTR void RotaryEncoder::pcnt_handler() {
+	uint32_t status = 0;
+
+	pcnt_get_event_status(pcnt_unit_, &status);
+
+	if (!(status & (PCNT_EVT_H_LIM | PCNT_EVT_L_LIM))) {
+		return;
+	}
+
+	change_us_.store(esp_timer_get_time(), std::memory_order_relaxed);
+
+	if (status & PCNT_EVT_H_LIM) {
+		change_.fetch_add(1);
+	} else {
+		change_.fetch_sub(1);
+	}
+
+	wakeup_->wake_up_isr();
+}
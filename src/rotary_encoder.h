@@ -19,6 +19,7 @@
 #pragma once
 
 #include <driver/gpio.h>
+#include <driver/pcnt.h>
 #include <esp_attr.h>
 
 #include <atomic>
@@ -28,6 +29,7 @@ class WakeupThread;
 
 IRAM_ATTR void rotary_encoder_interrupt_handler_0(void *arg);
 IRAM_ATTR void rotary_encoder_interrupt_handler_1(void *arg);
+IRAM_ATTR void rotary_encoder_pcnt_handler(void *arg);
 
 struct RotaryEncoderDebug {
 	uint32_t pin:1;
@@ -38,6 +40,7 @@ struct RotaryEncoderDebug {
 class RotaryEncoder {
 	friend void rotary_encoder_interrupt_handler_0(void *arg);
 	friend void rotary_encoder_interrupt_handler_1(void *arg);
+	friend void rotary_encoder_pcnt_handler(void *arg);
 
 public:
 	/*
@@ -51,9 +54,28 @@ public:
 
 	void start(WakeupThread &wakeup);
 	long read();
+	uint64_t change_us() const;
+	/** Get the recent edges (only recorded when not using a pulse counter) */
 	void debug(std::array<RotaryEncoderDebug,DEBUG_RECORDS> &records) const;
 
 private:
+	static constexpr const char *TAG = "RotaryEncoder";
+
+	/** Number of state changes between detents */
+	static constexpr int16_t PCNT_DETENT_COUNT = 4;
+
+	/**
+	 * Pulses shorter than this are ignored by the pulse counter: 1023 APB
+	 * clock cycles at 80MHz is 12.8µs (the maximum).
+	 */
+	static constexpr uint16_t PCNT_FILTER_CYCLES = 1023;
+
+	static unsigned int pcnt_units_used_;
+
+	bool start_pcnt();
+
+	// cppcheck-suppress unusedPrivateFunction
+	IRAM_ATTR void pcnt_handler();
 	// cppcheck-suppress unusedPrivateFunction
 	IRAM_ATTR void interrupt_handler(int pin_id);
 
@@ -61,8 +83,10 @@ private:
 	const std::array<gpio_num_t,2> pins_;
 	std::array<bool,2> state_{};
 	int first_{-1};
+	pcnt_unit_t pcnt_unit_{PCNT_UNIT_MAX};
 
 	std::atomic<long> change_{0};
+	std::atomic<uint32_t> change_us_{0}; /**< Time of the last change */
 	std::array<RotaryEncoderDebug,DEBUG_RECORDS> debug_{};
 	size_t debug_pos_{0};
 };
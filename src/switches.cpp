@@ -28,6 +28,7 @@
 #include <string>
 
 #include "config.h"
+#include "latency.h"
 #include "lights.h"
 #include "network.h"
 #include "util.h"
@@ -59,9 +60,7 @@ void Switches::setup() {
 		debounce_[i].start(*this);
 	}
 
-	std::thread t;
-	make_thread(t, "switches", 8192, 1, 20, &Switches::run_loop, this);
-	t.detach();
+	start_thread(8192, 1, 20);
 }
 
 std::string Switches::rtc_boot_memory() {
@@ -122,6 +121,8 @@ unsigned long Switches::run_switch(unsigned int switch_id) {
 				+ (debounce_[switch_id].value() ? "ON" : "OFF")
 				+ " (levels reset to " + preset + ")");
 
+			LatencyTrace trace{LatencySource::CONTROL, debounce_[switch_id].interrupt_us()};
+
 			lights_.select_preset(preset, group, true);
 		}
 
@@ -26,6 +26,8 @@
 #include <freertos/semphr.h>
 
 #include <algorithm>
+#include <climits>
+#include <thread>
 
 WakeupThread::WakeupThread(const char *name, bool watchdog) : name_(name),
 		watchdog_(watchdog), semaphore_(xSemaphoreCreateBinary()) {
@@ -50,7 +52,7 @@ void WakeupThread::run_loop() {
 	}
 
 	while (true) {
-		unsigned long wait_ms = std::max(1UL, run_tasks());
+		unsigned long wait_ms = std::min(std::max(1UL, run_tasks()), run_attached());
 
 		esp_timer_stop(timer_);
 		if (wait_ms < ULONG_MAX) {
@@ -64,14 +66,61 @@ void WakeupThread::run_loop() {
 	esp_restart();
 }
 
+void WakeupThread::start_thread(size_t stack_size, int core, size_t prio) {
+	if (host_ != this) {
+		ESP_LOGI(TAG, "Running %s in %s", name_, host_->name_);
+		return;
+	}
+
+	std::thread t;
+	make_thread(t, name_, stack_size, core, prio, &WakeupThread::run_loop, this);
+	t.detach();
+}
+
+void WakeupThread::attach(WakeupThread &thread) {
+	thread.host_ = this;
+	attached_.push_back(&thread);
+}
+
+/*
+ * Attached threads only run their tasks when they've been woken up or when
+ * the time they asked to wait for has elapsed, so that the cost of sharing a
+ * thread is one semaphore and one timer for all of them.
+ */
+unsigned long WakeupThread::run_attached() {
+	unsigned long wait_ms = ULONG_MAX;
+
+	for (WakeupThread *thread : attached_) {
+		uint64_t now_us = esp_timer_get_time();
+
+		if (thread->woken_.exchange(false) || now_us >= thread->due_us_) {
+			const unsigned long thread_wait_ms = std::max(1UL, thread->run_tasks());
+
+			now_us = esp_timer_get_time();
+			thread->due_us_ = thread_wait_ms == ULONG_MAX
+				? UINT64_MAX : now_us + thread_wait_ms * 1000ULL;
+		}
+
+		if (thread->due_us_ != UINT64_MAX) {
+			wait_ms = std::min(wait_ms, thread->due_us_ > now_us
+				? (unsigned long)std::min((thread->due_us_ - now_us + 999U) / 1000U,
+					(uint64_t)ULONG_MAX - 1) : 1UL);
+		}
+	}
+
+	return wait_ms;
+}
+
 void WakeupThread::wake_up() {
-	xSemaphoreGive(semaphore_);
+	woken_ = true;
+	xSemaphoreGive(host_->semaphore_);
 }
 
 void WakeupThread::wake_up_isr() {
 	BaseType_t xHigherPriorityTaskWoken{pdFALSE};
 
-	xSemaphoreGiveFromISR(semaphore_, &xHigherPriorityTaskWoken);
+	woken_ = true;
+	xSemaphoreGiveFromISR(host_->semaphore_, &xHigherPriorityTaskWoken);
 	portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
 }
 
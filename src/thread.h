@@ -23,8 +23,11 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 
+#include <atomic>
+#include <cstdint>
 #include <thread>
 #include <utility>
+#include <vector>
 
 template<class Function, class... Args>
 void make_thread(std::thread &t, const char *name, size_t stack_size,
@@ -43,12 +46,19 @@ class WakeupThread {
 public:
 	IRAM_ATTR void wake_up_isr();
 
+	/**
+	 * Run the tasks of another thread in this thread instead of starting a
+	 * separate thread for it. Must be called before either thread is set up.
+	 */
+	void attach(WakeupThread &thread);
+
 protected:
 	WakeupThread(const char *name, bool watchdog);
 	~WakeupThread() = default;
 
 	virtual unsigned long run_tasks() = 0;
 	void run_loop();
+	void start_thread(size_t stack_size, int core, size_t prio);
 	void wake_up();
 
 private:
@@ -56,8 +66,14 @@ private:
 
 	static void wake_up_timer(void *arg);
 
+	unsigned long run_attached();
+
 	const char *name_;
 	const bool watchdog_;
 	const SemaphoreHandle_t semaphore_;
 	esp_timer_handle_t timer_{nullptr};
+	WakeupThread *host_{this}; /**< Thread that runs the tasks */
+	std::vector<WakeupThread*> attached_; /**< Other threads with tasks to run */
+	std::atomic<bool> woken_{true}; /**< Has been woken up since the tasks last ran */
+	uint64_t due_us_{0}; /**< Time that the tasks need to run again */
 };
@@ -26,13 +26,25 @@
 #include <FS.h>
 #include <LittleFS.h>
 
+#include <cstring>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
+#include "benchmark.h"
+#include "config.h"
 #include "dali.h"
+#include "dimmers.h"
+#include "latency.h"
+#include "littlefs_block_cache.h"
 #include "local_lights.h"
 #include "network.h"
+#include "profiled_mutex.h"
 #include "switches.h"
+#include "thread.h"
 #include "util.h"
 
 extern const uint8_t x509_crt_bundle_start[] asm("_binary_x509_crt_bundle_start");
@@ -40,7 +52,7 @@ extern const uint8_t x509_crt_bundle_end[]   asm("_binary_x509_crt_bundle_end");
 
 static constexpr auto &FS = LittleFS;
 
-UI::UI(std::mutex &file_mutex, Network &network, LocalLights *lights)
+UI::UI(ProfiledMutex &file_mutex, Network &network, LocalLights *lights)
 		: network_(network), lights_(lights), file_mutex_(file_mutex) {
 }
 
@@ -108,6 +120,10 @@ void UI::publish_boot() {
 		network_.publish(topic + "/switches", Switches::rtc_boot_memory()
 			+ " -> " + boot_rtc_status_string(switches_->rtc_boot_status()), true);
 	}
+
+	for (const auto &stage : boot_stages_) {
+		network_.publish(topic + "/" + stage.first + "_us", std::to_string(stage.second), true);
+	}
 }
 
 void UI::publish_partitions() {
@@ -158,9 +174,13 @@ void UI::publish_partitions() {
 void UI::publish_stats() {
 	std::string topic = FixedConfig::mqttTopic("/stats");
 
-	if (dali_) {
-		DaliStats dali_stats = dali_->get_stats();
-		std::string dali_topic = topic + "/dali";
+	for (Dali *dali : dali_) {
+		if (!dali) {
+			continue;
+		}
+
+		DaliStats dali_stats = dali->get_stats();
+		std::string dali_topic = topic + "/" + dali->name();
 
 		network_.publish(dali_topic + "/tx_count", std::to_string(dali_stats.tx_count));
 
@@ -173,7 +193,88 @@ void UI::publish_stats() {
 			network_.publish(dali_topic + "/max_burst_tx_count", std::to_string(dali_stats.max_burst_tx_count));
 			network_.publish(dali_topic + "/max_burst_us", std::to_string(dali_stats.max_burst_us));
 		}
+
+		network_.publish(dali_topic + "/plan_count", std::to_string(dali_stats.plan_count));
+		network_.publish(dali_topic + "/plan_saved_tx_count", std::to_string(dali_stats.plan_saved_tx_count));
+		network_.publish(dali_topic + "/fade_time_tx_count", std::to_string(dali_stats.fade_time_tx_count));
+		network_.publish(dali_topic + "/fade_count", std::to_string(dali_stats.fade_count));
+		network_.publish(dali_topic + "/interpolated_fade_count", std::to_string(dali_stats.interpolated_fade_count));
+		network_.publish(dali_topic + "/interpolated_step_count", std::to_string(dali_stats.interpolated_step_count));
+		network_.publish(dali_topic + "/rx_count", std::to_string(dali_stats.rx_count));
+		network_.publish(dali_topic + "/rx_no_response_count", std::to_string(dali_stats.rx_no_response_count));
+		network_.publish(dali_topic + "/rx_invalid_count", std::to_string(dali_stats.rx_invalid_count));
+		network_.publish(dali_topic + "/refresh_verified_count", std::to_string(dali_stats.refresh_verified_count));
+		network_.publish(dali_topic + "/refresh_corrected_count", std::to_string(dali_stats.refresh_corrected_count));
+		network_.publish(dali_topic + "/group_mismatch_count", std::to_string(dali_stats.group_mismatch_count));
+		network_.publish(dali_topic + "/refresh_count", std::to_string(dali_stats.refresh_count));
+		network_.publish(dali_topic + "/refresh_skipped_count", std::to_string(dali_stats.refresh_skipped_count));
+		network_.publish(dali_topic + "/refresh_period_ms", std::to_string(dali_stats.refresh_period_ms));
+
+		for (size_t i = 0; i < NUM_DALI_PRIORITIES; i++) {
+			const auto &priority_stats = dali_stats.priorities[i];
+			const std::string priority_topic = dali_topic + "/"
+				+ Dali::priority_name(static_cast<DaliPriority>(i));
+
+			network_.publish(priority_topic + "/tx_count", std::to_string(priority_stats.tx_count));
+			network_.publish(priority_topic + "/request_count", std::to_string(priority_stats.request_count));
+			network_.publish(priority_topic + "/max_delay_us", std::to_string(priority_stats.max_delay_us));
+		}
+	}
+
+	if (config_) {
+		LightIdsCacheStats cache_stats = config_->light_ids_cache_stats();
+
+		network_.publish(topic + "/config/light_ids_cache/hit_count", std::to_string(cache_stats.hit_count));
+		network_.publish(topic + "/config/light_ids_cache/miss_count", std::to_string(cache_stats.miss_count));
+		network_.publish(topic + "/config/light_ids_cache/evict_count", std::to_string(cache_stats.evict_count));
+	}
+
+	if (dimmers_) {
+		DimmerStats dimmer_stats = dimmers_->get_stats();
+
+		network_.publish(topic + "/dimmers/tick_count", std::to_string(dimmer_stats.tick_count));
+		network_.publish(topic + "/dimmers/coalesced_tick_count", std::to_string(dimmer_stats.coalesced_tick_count));
+		network_.publish(topic + "/dimmers/flush_count", std::to_string(dimmer_stats.flush_count));
+	}
+
+	for (size_t i = 0; i < NUM_LATENCY_POINTS; i++) {
+		const LatencyPoint point = static_cast<LatencyPoint>(i);
+		const LatencyStats latency_stats = Latency::get_stats(point);
+		const std::string latency_topic = topic + "/latency/" + Latency::name(point);
+
+		network_.publish(latency_topic + "/count", std::to_string(latency_stats.count));
+
+		if (latency_stats.count > 0) {
+			network_.publish(latency_topic + "/p50_us", std::to_string(latency_stats.p50_us));
+			network_.publish(latency_topic + "/p95_us", std::to_string(latency_stats.p95_us));
+			network_.publish(latency_topic + "/p99_us", std::to_string(latency_stats.p99_us));
+			network_.publish(latency_topic + "/max_us", std::to_string(latency_stats.max_us));
+		}
+	}
+
+	for (LockProfile *profile = LockProfile::first(); profile; profile = profile->next()) {
+		const LockStats lock_stats = profile->get_stats();
+		const std::string lock_topic = topic + "/lock/" + profile->name();
+
+		network_.publish(lock_topic + "/lock_count", std::to_string(lock_stats.lock_count));
+		network_.publish(lock_topic + "/contended_count", std::to_string(lock_stats.contended_count));
+		network_.publish(lock_topic + "/wait_us", std::to_string(lock_stats.wait_us));
+		network_.publish(lock_topic + "/max_wait_us", std::to_string(lock_stats.max_wait_us));
+		network_.publish(lock_topic + "/hold_us", std::to_string(lock_stats.hold_us));
+		network_.publish(lock_topic + "/max_hold_us", std::to_string(lock_stats.max_hold_us));
+	}
+
+#if defined(FILESYSTEM_CACHE)
+	{
+		auto flash_cache_stats = app::filesystem_cache::get_stats();
+
+		network_.publish(topic + "/flash/cache/hit_count", std::to_string(flash_cache_stats.hit_count));
+		network_.publish(topic + "/flash/cache/miss_count", std::to_string(flash_cache_stats.miss_count));
+		network_.publish(topic + "/flash/cache/evict_count", std::to_string(flash_cache_stats.evict_count));
+		network_.publish(topic + "/flash/cache/read_ahead_count", std::to_string(flash_cache_stats.read_ahead_count));
+		network_.publish(topic + "/flash/cache/write_through_count", std::to_string(flash_cache_stats.write_through_count));
 	}
+#endif
 
 	network_.publish(topic + "/heap/size_bytes", std::to_string(ESP.getHeapSize()));
 	network_.publish(topic + "/heap/free_bytes", std::to_string(ESP.getFreeHeap()));
@@ -196,12 +297,55 @@ void UI::publish_stats() {
 	network_.publish(topic + "/messages/received", std::to_string(network_.received_message_count()));
 	network_.publish(topic + "/messages/sent", std::to_string(network_.sent_message_count()));
 	network_.publish(topic + "/max_queue_size", std::to_string(network_.maximum_queue_size()));
+	network_.publish(topic + "/messages/pool_exhausted", std::to_string(network_.message_pool_exhausted_count()));
 	network_.publish(topic + "/temperature_c", std::to_string(temperatureRead()));
 	network_.publish(topic + "/uptime_us", std::to_string(esp_timer_get_time()));
 
+	publish_tasks();
 	last_publish_us_ = esp_timer_get_time();
 }
 
+/*
+ * The run time of each task is output as the difference since the last time
+ * it was published, for comparison with the elapsed time (which needs to be
+ * multiplied by the number of cores).
+ */
+void UI::publish_tasks() {
+#if configUSE_TRACE_FACILITY
+	std::string topic = FixedConfig::mqttTopic("/stats");
+	std::vector<TaskStatus_t> tasks(uxTaskGetNumberOfTasks() + 4);
+	uint32_t total_runtime = 0;
+
+	tasks.resize(uxTaskGetSystemState(tasks.data(), tasks.size(), &total_runtime));
+
+#if configGENERATE_RUN_TIME_STATS
+	std::unordered_map<UBaseType_t,uint32_t> task_runtime;
+
+	network_.publish(topic + "/tasks/elapsed_us", std::to_string(total_runtime - total_runtime_));
+#endif
+
+	for (const auto &task : tasks) {
+		std::string task_topic = topic + "/task/" + task.pcTaskName;
+
+		network_.publish(task_topic + "/stack/min_size_bytes", std::to_string(task.usStackHighWaterMark));
+
+#if configGENERATE_RUN_TIME_STATS
+		auto previous = task_runtime_.find(task.xTaskNumber);
+		uint32_t runtime = task.ulRunTimeCounter
+			- (previous != task_runtime_.end() ? previous->second : 0U);
+
+		network_.publish(task_topic + "/runtime_us", std::to_string(runtime));
+		task_runtime.emplace(task.xTaskNumber, task.ulRunTimeCounter);
+#endif
+	}
+
+#if configGENERATE_RUN_TIME_STATS
+	task_runtime_ = std::move(task_runtime);
+	total_runtime_ = total_runtime;
+#endif
+#endif
+}
+
 void UI::setup() {
 	pinMode(LED_GPIO, OUTPUT);
 	digitalWrite(LED_GPIO, LOW);
@@ -212,8 +356,30 @@ void UI::setup() {
 	}
 }
 
+/*
+ * Only the first time is recorded for each stage. Stages are recorded by
+ * the main task during setup() and then by the network thread.
+ */
+void UI::boot_stage(const char *name) {
+	for (const auto &stage : boot_stages_) {
+		if (!std::strcmp(stage.first, name)) {
+			return;
+		}
+	}
+
+	boot_stages_.emplace_back(name, esp_timer_get_time());
+}
+
+void UI::set_config(Config &config) {
+	config_ = &config;
+}
+
 void UI::set_dali(Dali &dali) {
-	dali_ = &dali;
+	dali_[dali.bus()] = &dali;
+}
+
+void UI::set_dimmers(Dimmers &dimmers) {
+	dimmers_ = &dimmers;
 }
 
 void UI::set_switches(Switches &switches) {
@@ -221,6 +387,18 @@ void UI::set_switches(Switches &switches) {
 }
 
 void UI::loop() {
+	if (ota_finished_.exchange(false)) {
+		ota_publish_progress();
+		publish_partitions();
+		ota_running_ = false;
+	} else if (ota_running_ && esp_timer_get_time() - ota_last_progress_us_ >= OTA_PROGRESS_INTERVAL_US) {
+		ota_publish_progress();
+	}
+
+	if (benchmark_.exchange(false)) {
+		run_benchmark();
+	}
+
 	if (startup_complete_ && network_.connected()) {
 		if (!last_publish_us_ || esp_timer_get_time() - last_publish_us_ >= FIVE_M) {
 			publish_stats();
@@ -229,6 +407,49 @@ void UI::loop() {
 }
 
 void UI::ota_update() {
+	if (ota_running_.exchange(true)) {
+		network_.report(TAG, std::string{"OTA already in progress"});
+		return;
+	}
+
+	{
+		std::lock_guard lock{ota_mutex_};
+
+		ota_progress_ = {};
+	}
+
+	/*
+	 * Don't block the network thread (which receives the request) or the
+	 * main loop while downloading the update. Progress is published by the
+	 * main loop.
+	 */
+	std::thread t;
+	make_thread(t, "ota", 8192, 1, 1, &UI::ota_perform, this);
+	t.detach();
+}
+
+void UI::benchmark() {
+	benchmark_ = true;
+}
+
+void UI::run_benchmark() {
+	Benchmark benchmark{network_};
+
+	if (config_) {
+		config_->benchmark(benchmark);
+	}
+
+	if (lights_) {
+		lights_->benchmark(benchmark);
+	}
+
+	/* The buses are the same apart from their lights, so only benchmark one */
+	if (dali_[0]) {
+		dali_[0]->benchmark(benchmark);
+	}
+}
+
+void UI::ota_perform() {
 	esp_http_client_config_t http_config{};
 	esp_https_ota_config_t ota_config{};
 	esp_https_ota_handle_t handle{};
@@ -238,36 +459,117 @@ void UI::ota_update() {
 	http_config.crt_bundle_attach = arduino_esp_crt_bundle_attach;
 	http_config.disable_auto_redirect = true;
 	http_config.url = FixedConfig::otaURL();
+	http_config.buffer_size = OTA_BUFFER_SIZE;
 	ota_config.http_config = &http_config;
 
 	esp_err_t err = esp_https_ota_begin(&ota_config, &handle);
 	if (err) {
 		network_.report(TAG, std::string{"OTA begin failed: "} + std::to_string(err));
-		return;
+	} else {
+		ota_download(handle);
 	}
 
+	ota_finished_ = true;
+}
+
+void UI::ota_download(esp_https_ota_handle_t handle) {
+	const uint64_t start_us = esp_timer_get_time();
 	const int size = esp_https_ota_get_image_size(handle);
+	uint64_t throttled_ms = 0;
+	esp_app_desc_t desc;
+	esp_err_t err;
 
-	network_.report(TAG, std::string{"OTA size: "} + std::to_string(size));
+	{
+		std::lock_guard lock{ota_mutex_};
+
+		ota_progress_.start_us = start_us;
+		ota_progress_.size = size;
+	}
 
-	while (true) {
+	if (!esp_https_ota_get_img_desc(handle, &desc)) {
+		network_.report(TAG, std::string{"OTA size: "} + std::to_string(size)
+			+ ", version: " + null_terminated_string(desc.version));
+	} else {
+		network_.report(TAG, std::string{"OTA size: "} + std::to_string(size));
+	}
+
+	do {
+		throttled_ms += ota_throttle();
 		err = esp_https_ota_perform(handle);
 
-		if (err == ESP_OK) {
-			err = esp_https_ota_finish(handle);
-			if (err) {
-				network_.report(TAG, std::string{"OTA finish failed: "} + std::to_string(err));
-			} else {
-				network_.report(TAG, std::string{"OTA finished"});
+		std::lock_guard lock{ota_mutex_};
+
+		ota_progress_.read = esp_https_ota_get_image_len_read(handle);
+		ota_progress_.throttled_ms = throttled_ms;
+	} while (err == ESP_ERR_HTTPS_OTA_IN_PROGRESS);
+
+	if (err == ESP_OK && !esp_https_ota_is_complete_data_received(handle)) {
+		network_.report(TAG, std::string{"OTA incomplete"});
+		esp_https_ota_abort(handle);
+	} else if (err == ESP_OK) {
+		/* The image (and its SHA-256 hash) is verified before it can be booted */
+		err = esp_https_ota_finish(handle);
+		if (err) {
+			network_.report(TAG, std::string{"OTA finish failed: "} + std::to_string(err));
+		} else {
+			network_.report(TAG, std::string{"OTA finished in "}
+				+ std::to_string((esp_timer_get_time() - start_us) / 1000U) + "ms");
+		}
+	} else {
+		network_.report(TAG, std::string{"OTA perform failed: "} + std::to_string(err));
+		esp_https_ota_abort(handle);
+	}
+}
+
+/*
+ * Wait while the lights are being dimmed, returning the time spent waiting
+ * (ms).
+ */
+unsigned long UI::ota_throttle() {
+	const unsigned long start_ms = millis();
+
+	while (millis() - start_ms < OTA_MAX_THROTTLE_MS) {
+		bool interactive = false;
+
+		for (const Dali *dali : dali_) {
+			if (dali && millis() - dali->last_interactive_ms() < OTA_INTERACTIVE_HOLDOFF_MS) {
+				interactive = true;
 			}
-			publish_partitions();
-			return;
-		} else if (err != ESP_ERR_HTTPS_OTA_IN_PROGRESS) {
-			network_.report(TAG, std::string{"OTA perform failed: "} + std::to_string(err));
-			esp_https_ota_abort(handle);
-			publish_partitions();
-			return;
 		}
+
+		if (!interactive) {
+			break;
+		}
+
+		delay(OTA_THROTTLE_MS);
+	}
+
+	return millis() - start_ms;
+}
+
+void UI::ota_publish_progress() {
+	const std::string topic = FixedConfig::mqttTopic("/ota/progress");
+	std::unique_lock lock{ota_mutex_};
+	const OTAProgress progress = ota_progress_;
+
+	lock.unlock();
+	ota_last_progress_us_ = esp_timer_get_time();
+
+	if (!progress.start_us) {
+		return;
+	}
+
+	const uint64_t elapsed_us = ota_last_progress_us_ - progress.start_us;
+	const uint64_t bytes_per_s = elapsed_us > 0 ? progress.read * ONE_S / elapsed_us : 0;
+
+	network_.publish(topic + "/read_bytes", std::to_string(progress.read));
+	network_.publish(topic + "/size_bytes", std::to_string(progress.size));
+	network_.publish(topic + "/elapsed_ms", std::to_string(elapsed_us / 1000U));
+	network_.publish(topic + "/throttled_ms", std::to_string(progress.throttled_ms));
+	network_.publish(topic + "/bytes_per_s", std::to_string(bytes_per_s));
+
+	if (progress.size > 0 && progress.read <= progress.size && bytes_per_s > 0) {
+		network_.publish(topic + "/eta_s", std::to_string((progress.size - progress.read) / bytes_per_s));
 	}
 }
 
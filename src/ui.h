@@ -18,25 +18,47 @@
 #pragma once
 
 #include <Arduino.h>
+#include <esp_https_ota.h>
 
+#include <array>
+#include <atomic>
 #include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
-class Dali;
+#include "dali.h"
+#include "profiled_mutex.h"
+#include "util.h"
+
+class Config;
+class Dimmers;
 class LocalLights;
 class Network;
 class Switches;
 
+struct OTAProgress {
+	uint64_t start_us{0}; /**< Time that the download started */
+	int size{-1}; /**< Size of the image (if known) */
+	int read{0}; /**< Bytes read */
+	uint64_t throttled_ms{0}; /**< Time spent waiting while the lights are being dimmed */
+};
+
 class UI {
 public:
-	UI(std::mutex &file_mutex, Network &network, LocalLights *lights);
+	UI(ProfiledMutex &file_mutex, Network &network, LocalLights *lights);
 
 	void setup();
+	void boot_stage(const char *name);
+	void set_config(Config &config);
 	void set_dali(Dali &dali);
+	void set_dimmers(Dimmers &dimmers);
 	void set_switches(Switches &switches);
 	void loop();
 	void startup_complete(bool state);
 	void status_report();
 	void ota_update();
+	void benchmark();
 	void ota_good();
 	void ota_bad();
 
@@ -44,6 +66,22 @@ private:
 	static constexpr const char *TAG = "UI";
 	static constexpr unsigned int LED_GPIO = 38;
 
+	/*
+	 * A large download buffer reduces the overhead of each read (and comes
+	 * from PSRAM because it's larger than the internal memory threshold).
+	 */
+	static constexpr int OTA_BUFFER_SIZE = 16384;
+	static constexpr uint64_t OTA_PROGRESS_INTERVAL_US = 5 * ONE_S;
+
+	/*
+	 * Writing to flash stalls everything that isn't running from IRAM, so
+	 * the update waits while the lights are being dimmed (but not for so long
+	 * that the connection times out).
+	 */
+	static constexpr uint32_t OTA_INTERACTIVE_HOLDOFF_MS = 1000;
+	static constexpr unsigned long OTA_THROTTLE_MS = 20;
+	static constexpr unsigned long OTA_MAX_THROTTLE_MS = 5000;
+
 	UI(const UI&) = delete;
 	UI& operator=(const UI&) = delete;
 
@@ -53,13 +91,29 @@ private:
 	void publish_stats();
 	void publish_tasks();
 
+	void run_benchmark();
+	void ota_perform();
+	void ota_download(esp_https_ota_handle_t handle);
+	unsigned long ota_throttle();
+	void ota_publish_progress();
 	void ota_result(bool good);
 
 	Network &network_;
 	LocalLights *lights_;
-	Dali *dali_{nullptr};
+	Config *config_{nullptr};
+	std::array<Dali*,NUM_DALI_BUSES> dali_{};
+	Dimmers *dimmers_{nullptr};
 	Switches *switches_{nullptr};
-	std::mutex &file_mutex_;
+	ProfiledMutex &file_mutex_;
 	uint64_t last_publish_us_{0};
+	std::vector<std::pair<const char*,uint64_t>> boot_stages_; /**< Time that each stage of startup completed */
+	std::unordered_map<UBaseType_t,uint32_t> task_runtime_; /**< Run time of each task when it was last published */
+	uint32_t total_runtime_{0}; /**< Elapsed run time when tasks were last published */
 	bool startup_complete_{false};
+	std::atomic<bool> ota_running_{false}; /**< The update thread is running */
+	std::atomic<bool> ota_finished_{false}; /**< The update thread has finished */
+	std::mutex ota_mutex_;
+	OTAProgress ota_progress_; /**< Progress of the update thread, published by loop() */
+	uint64_t ota_last_progress_us_{0};
+	std::atomic<bool> benchmark_{false};
 };
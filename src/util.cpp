@@ -18,57 +18,37 @@
 
 #include "util.h"
 
-#include <cerrno>
-#include <cstdlib>
+#include <charconv>
 #include <string>
+#include <string_view>
+#include <system_error>
 #include <vector>
 
-bool long_from_string(const std::string &text, long &value) {
-	if (text.empty()) {
-		return false;
-	}
-
-	char *endptr = nullptr;
-
-	errno = 0;
-	value = std::strtol(text.c_str() + (text[0] == '+' ? 1 : 0), &endptr, 10);
-	if (!endptr || endptr[0] || errno) {
-		return false;
+template<typename T>
+static bool integer_from_string(std::string_view text, T &value) {
+	if (!text.empty() && text[0] == '+') {
+		text.remove_prefix(1);
 	}
 
-	return true;
-}
-
-bool ulong_from_string(const std::string &text, unsigned long &value) {
 	if (text.empty()) {
 		return false;
 	}
 
-	char *endptr = nullptr;
+	auto result = std::from_chars(text.data(), text.data() + text.size(), value, 10);
 
-	errno = 0;
-	value = std::strtoul(text.c_str() + (text[0] == '+' ? 1 : 0), &endptr, 10);
-	if (!endptr || endptr[0] || errno) {
-		return false;
-	}
-
-	return true;
+	return result.ec == std::errc{} && result.ptr == text.data() + text.size();
 }
 
-bool ulonglong_from_string(const std::string &text, unsigned long long &value) {
-	if (text.empty()) {
-		return false;
-	}
-
-	char *endptr = nullptr;
+bool long_from_string(std::string_view text, long &value) {
+	return integer_from_string(text, value);
+}
 
-	errno = 0;
-	value = std::strtoull(text.c_str() + (text[0] == '+' ? 1 : 0), &endptr, 10);
-	if (!endptr || endptr[0] || errno) {
-		return false;
-	}
+bool ulong_from_string(std::string_view text, unsigned long &value) {
+	return integer_from_string(text, value);
+}
 
-	return true;
+bool ulonglong_from_string(std::string_view text, unsigned long long &value) {
+	return integer_from_string(text, value);
 }
 
 std::string vector_text(const std::vector<std::string> &vector) {
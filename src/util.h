@@ -19,18 +19,20 @@
 
 #include <Arduino.h>
 
+#include <bitset>
 #include <cstring>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 static constexpr uint64_t ONE_S = 1000 * 1000ULL;
 static constexpr uint64_t ONE_M = 60 * ONE_S;
 static constexpr uint64_t FIVE_M = 5 * ONE_M;
 
-bool long_from_string(const std::string &text, long &value);
-bool ulong_from_string(const std::string &text, unsigned long &value);
-bool ulonglong_from_string(const std::string &text, unsigned long long &value);
+bool long_from_string(std::string_view text, long &value);
+bool ulong_from_string(std::string_view text, unsigned long &value);
+bool ulonglong_from_string(std::string_view text, unsigned long long &value);
 std::string vector_text(const std::vector<std::string> &vector);
 
 template<typename T, size_t size>
@@ -39,6 +41,23 @@ static inline std::string null_terminated_string(T(&data)[size]) {
 	return std::string{&data[0], found ? (found - &data[0]) : size};
 };
 
+/** Call func(index) for each bit that is set, in ascending order. */
+template<size_t size, typename Function>
+static inline void for_each_bit(const std::bitset<size> &bits, Function &&func) {
+	if constexpr (size <= 64) {
+		unsigned long long value = bits.to_ullong();
+
+		while (value) {
+			func(static_cast<unsigned int>(__builtin_ctzll(value)));
+			value &= value - 1;
+		}
+	} else {
+		for (size_t i = bits._Find_first(); i < size; i = bits._Find_next(i)) {
+			func(static_cast<unsigned int>(i));
+		}
+	}
+}
+
 class MemoryDeleter {
 public:
 	void operator()(uint8_t *data) { ::free(data); }
@@ -53,7 +72,18 @@ enum BootRTCStatus {
 	LOADED_OK,
 };
 
-class FixedConfig {
+/**
+ * Defaults for options that may be missing from older fixed_config.h files.
+ * Members defined in fixed_config.h hide these in FixedConfig.
+ */
+class FixedConfigDefaults {
+protected:
+	static constexpr bool MQTT_REMOTE_BINARY = false;
+	static constexpr unsigned long MQTT_REMOTE_DIM_INTERVAL_MS = 40;
+	static constexpr bool MQTT_LEVELS_BINARY = false;
+};
+
+class FixedConfig: private FixedConfigDefaults {
 public:
 	FixedConfig() = default;
 
@@ -69,6 +99,9 @@ public:
 
 	static inline bool isLocal() { return MQTT_REMOTE_TOPIC == nullptr; }
 	static inline bool isRemote() { return MQTT_REMOTE_TOPIC != nullptr; }
+	static inline bool mqttRemoteBinary() { return MQTT_REMOTE_BINARY; }
+	static inline unsigned long mqttRemoteDimIntervalMs() { return MQTT_REMOTE_DIM_INTERVAL_MS; }
+	static inline bool mqttLevelsBinary() { return MQTT_LEVELS_BINARY; }
 
 	static inline bool hasChannel() { return IRC_CHANNEL[0]; }
 	static inline const char *ircChannel() { return IRC_CHANNEL; }
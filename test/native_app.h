@@ -0,0 +1,64 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Definitions that are normally in main.cpp, for the native test environment.
+ * Include this in one file of each test suite.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "util.h"
+
+std::string FixedConfig::mqtt_topic_str{FixedConfig::MQTT_TOPIC};
+std::string FixedConfig::mqtt_remote_topic_str{
+	FixedConfig::MQTT_REMOTE_TOPIC != nullptr
+		? std::string{FixedConfig::MQTT_REMOTE_TOPIC} + "/x" : ""};
+
+/* There are no certificates on the host */
+extern const uint8_t host_crt_bundle_start[1] asm("_binary_x509_crt_bundle_start") = {0};
+extern const uint8_t host_crt_bundle_end[1] asm("_binary_x509_crt_bundle_end") = {0};
+
+/**
+ * Run a function repeatedly and report the average time per iteration. This
+ * uses the real clock because the simulated clock only moves when it's told
+ * to.
+ */
+template<typename Function>
+static inline void host_benchmark(const char *name, unsigned int iterations, Function &&func) {
+	const auto start = std::chrono::steady_clock::now();
+
+	for (unsigned int i = 0; i < iterations; i++) {
+		func();
+	}
+
+	const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start);
+	char message[128];
+
+	snprintf(message, sizeof(message), "%s: %u iterations, %.3fµs each", name,
+		iterations, elapsed.count() / 1000.0 / iterations);
+	TEST_MESSAGE(message);
+}
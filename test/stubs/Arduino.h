@@ -0,0 +1,129 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host stub of the arduino-esp32 core. Time comes from the simulated clock
+ * in esp_timer.h and delay() advances it instead of sleeping.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "Print.h"
+#include "Stream.h"
+#include "driver/gpio.h"
+#include "esp32-hal.h"
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+
+#define LOW 0x0
+#define HIGH 0x1
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+
+#define DEC 10
+#define HEX 16
+
+static inline void pinMode(uint8_t pin, uint8_t mode) { (void)pin; (void)mode; }
+static inline void digitalWrite(uint8_t pin, uint8_t value) { (void)pin; (void)value; }
+static inline int digitalRead(uint8_t pin) { (void)pin; return HIGH; }
+
+static inline unsigned long micros() {
+	return (unsigned long)esp_timer_get_time();
+}
+
+static inline unsigned long millis() {
+	return (unsigned long)(esp_timer_get_time() / 1000ULL);
+}
+
+static inline void delay(uint32_t ms) {
+	host::advance_us(ms * 1000LL);
+}
+
+static inline void yield() {
+}
+
+class String: public std::string {
+public:
+	String() = default;
+	String(const char *str) : std::string(str ? str : "") {}
+	String(const std::string &str) : std::string(str) {}
+
+	String(unsigned long long value, unsigned char base = DEC) {
+		char buf[8 * sizeof(value) + 1];
+
+		lltoa(value, buf, base);
+		assign(buf);
+	}
+
+	String operator+(const String &rhs) const {
+		return String{static_cast<const std::string&>(*this) + rhs};
+	}
+
+private:
+	static void lltoa(unsigned long long value, char *buf, unsigned char base) {
+		char tmp[8 * sizeof(value) + 1];
+		size_t i = 0;
+
+		do {
+			unsigned int digit = value % base;
+
+			tmp[i++] = digit < 10 ? '0' + digit : 'A' + digit - 10;
+			value /= base;
+		} while (value);
+
+		while (i > 0) {
+			*buf++ = tmp[--i];
+		}
+		*buf = '\0';
+	}
+};
+
+class EspClass {
+public:
+	uint32_t getHeapSize() { return 320 * 1024; }
+	uint32_t getFreeHeap() { return 256 * 1024; }
+	uint32_t getMinFreeHeap() { return 192 * 1024; }
+	uint32_t getMaxAllocHeap() { return 128 * 1024; }
+
+	uint32_t getPsramSize() { return 8 * 1024 * 1024; }
+	uint32_t getFreePsram() { return 7 * 1024 * 1024; }
+	uint32_t getMinFreePsram() { return 6 * 1024 * 1024; }
+	uint32_t getMaxAllocPsram() { return 4 * 1024 * 1024; }
+
+	uint64_t getEfuseMac() { return 0x0000563412FECA00ULL; }
+};
+
+inline EspClass ESP;
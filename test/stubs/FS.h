@@ -0,0 +1,188 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stub of the arduino-esp32 filesystem API, files are kept in memory */
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fs {
+
+enum SeekMode {
+	SeekSet = 0,
+	SeekCur = 1,
+	SeekEnd = 2,
+};
+
+using FileData = std::vector<uint8_t>;
+
+class File: public Stream {
+public:
+	File() = default;
+	File(std::shared_ptr<FileData> data, bool readable, bool writable)
+		: data_(std::move(data)), readable_(readable), writable_(writable) {}
+
+	size_t write(uint8_t c) override {
+		return write(&c, 1);
+	}
+
+	size_t write(const uint8_t *buffer, size_t size) override {
+		if (!data_ || !writable_) {
+			setWriteError();
+			return 0;
+		}
+
+		if (data_->size() < position_ + size) {
+			data_->resize(position_ + size);
+		}
+
+		std::copy(buffer, buffer + size, data_->begin() + position_);
+		position_ += size;
+		return size;
+	}
+
+	using Print::write;
+
+	int available() override {
+		return data_ && readable_ ? data_->size() - position_ : 0;
+	}
+
+	int read() override {
+		uint8_t c;
+
+		return read(&c, 1) == 1 ? c : -1;
+	}
+
+	int peek() override {
+		return available() > 0 ? (*data_)[position_] : -1;
+	}
+
+	size_t read(uint8_t *buffer, size_t size) {
+		size = std::min(size, (size_t)std::max(available(), 0));
+
+		std::copy_n(data_->begin() + position_, size, buffer);
+		position_ += size;
+		return size;
+	}
+
+	using Stream::readBytes;
+
+	size_t readBytes(char *buffer, size_t length) override {
+		return read(reinterpret_cast<uint8_t*>(buffer), length);
+	}
+
+	bool seek(uint32_t pos, SeekMode mode) {
+		size_t base = mode == SeekSet ? 0 : (mode == SeekCur ? position_ : size());
+
+		if (!data_ || base + pos > data_->size()) {
+			return false;
+		}
+
+		position_ = base + pos;
+		return true;
+	}
+
+	bool seek(uint32_t pos) { return seek(pos, SeekSet); }
+	size_t position() const { return position_; }
+	size_t size() const { return data_ ? data_->size() : 0; }
+	void close() { data_.reset(); }
+
+	operator bool() const { return (bool)data_; }
+
+private:
+	std::shared_ptr<FileData> data_;
+	bool readable_{false};
+	bool writable_{false};
+	size_t position_{0};
+};
+
+class FS {
+public:
+	File open(const char *path, const char *mode = "r", const bool create = false) {
+		const std::string name{path};
+		const bool plus = strchr(mode, '+') != nullptr;
+		auto it = files_.find(name);
+
+		(void)create;
+
+		if (mode[0] == 'r') {
+			if (it == files_.end()) {
+				return File{};
+			}
+
+			return File{it->second, true, plus};
+		} else if (mode[0] == 'w') {
+			auto data = std::make_shared<FileData>();
+
+			files_[name] = data;
+			return File{data, plus, true};
+		} else if (mode[0] == 'a') {
+			if (it == files_.end()) {
+				it = files_.emplace(name, std::make_shared<FileData>()).first;
+			}
+
+			File file{it->second, plus, true};
+
+			file.seek(0, SeekEnd);
+			return file;
+		}
+
+		return File{};
+	}
+
+	bool exists(const char *path) {
+		return files_.count(path) > 0;
+	}
+
+	bool remove(const char *path) {
+		return files_.erase(path) > 0;
+	}
+
+	bool rename(const char *from, const char *to) {
+		auto it = files_.find(from);
+
+		if (it == files_.end()) {
+			return false;
+		}
+
+		files_[to] = it->second;
+		files_.erase(from);
+		return true;
+	}
+
+protected:
+	std::map<std::string,std::shared_ptr<FileData>> files_;
+};
+
+} // namespace fs
+
+#if !defined(FS_NO_GLOBALS)
+using fs::File;
+using fs::FS;
+using fs::SeekMode;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+#endif
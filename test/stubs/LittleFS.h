@@ -0,0 +1,57 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stub of the arduino-esp32 LittleFS filesystem, kept in memory */
+
+#pragma once
+
+#include <FS.h>
+
+namespace fs {
+
+class LittleFSFS: public FS {
+public:
+	bool begin(bool formatOnFail = false, const char *basePath = "/littlefs",
+			uint8_t maxOpenFiles = 10, const char *partitionLabel = "spiffs") {
+		(void)formatOnFail; (void)basePath; (void)maxOpenFiles; (void)partitionLabel;
+		return true;
+	}
+
+	bool format() {
+		files_.clear();
+		return true;
+	}
+
+	size_t totalBytes() { return 1024 * 1024; }
+
+	size_t usedBytes() {
+		size_t used = 0;
+
+		for (const auto &file : files_) {
+			used += file.second->size();
+		}
+
+		return used;
+	}
+
+	void end() {}
+};
+
+} // namespace fs
+
+inline fs::LittleFSFS LittleFS;
@@ -0,0 +1,65 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stub of the Arduino Print class */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+class Print {
+public:
+	virtual ~Print() = default;
+
+	virtual size_t write(uint8_t c) = 0;
+
+	virtual size_t write(const uint8_t *buffer, size_t size) {
+		size_t n = 0;
+
+		while (size--) {
+			if (write(*buffer++)) {
+				n++;
+			} else {
+				break;
+			}
+		}
+
+		return n;
+	}
+
+	size_t write(const char *str) {
+		return str ? write(reinterpret_cast<const uint8_t*>(str), strlen(str)) : 0;
+	}
+
+	size_t write(const char *buffer, size_t size) {
+		return write(reinterpret_cast<const uint8_t*>(buffer), size);
+	}
+
+	int getWriteError() { return write_error_; }
+	void clearWriteError() { setWriteError(0); }
+
+	virtual void flush() {}
+
+protected:
+	void setWriteError(int err = 1) { write_error_ = err; }
+
+private:
+	int write_error_{0};
+};
@@ -0,0 +1,95 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host stub of the PubSubClient MQTT library, it connects when WiFi is
+ * connected and records the messages that are published.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <WiFi.h>
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+
+namespace host {
+
+struct MqttMessage {
+	std::string topic;
+	std::string payload;
+	bool retain;
+};
+
+inline std::mutex mqtt_mutex;
+inline std::vector<MqttMessage> mqtt_messages;
+
+/** Remove and return the messages that have been published. */
+inline std::vector<MqttMessage> mqtt_published() {
+	std::lock_guard lock{mqtt_mutex};
+	std::vector<MqttMessage> messages;
+
+	messages.swap(mqtt_messages);
+	return messages;
+}
+
+} // namespace host
+
+class PubSubClient {
+public:
+	explicit PubSubClient(WiFiClient &client) { (void)client; }
+
+	PubSubClient &setServer(const char *domain, uint16_t port) { (void)domain; (void)port; return *this; }
+	PubSubClient &setCallback(MQTT_CALLBACK_SIGNATURE) { callback_ = callback; return *this; }
+	bool setBufferSize(uint16_t size) { (void)size; return true; }
+
+	bool connect(const char *id) { (void)id; connected_ = host::wifi_connected.load(); return connected_; }
+	bool connected() { return connected_ && host::wifi_connected; }
+	bool loop() { return connected(); }
+	bool subscribe(const char *topic) { (void)topic; return connected(); }
+
+	bool publish(const char *topic, const char *payload) {
+		return publish(topic, payload, false);
+	}
+	bool publish(const char *topic, const char *payload, bool retained) {
+		return publish(topic, reinterpret_cast<const uint8_t*>(payload), strlen(payload), retained);
+	}
+	bool publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained) {
+		if (!connected()) {
+			return false;
+		}
+
+		std::lock_guard lock{host::mqtt_mutex};
+		host::mqtt_messages.push_back({topic,
+			std::string{reinterpret_cast<const char*>(payload), length}, retained});
+		return true;
+	}
+
+private:
+	std::function<void(char*, uint8_t*, unsigned int)> callback_;
+	std::atomic<bool> connected_{false};
+};
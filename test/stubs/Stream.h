@@ -0,0 +1,61 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stub of the Arduino Stream class */
+
+#pragma once
+
+#include "Print.h"
+
+/**
+ * Unlike the Arduino implementation, reads don't wait for more data to
+ * become available because the clock doesn't advance while waiting.
+ */
+class Stream: public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+
+	void setTimeout(unsigned long timeout) { timeout_ = timeout; }
+	unsigned long getTimeout() const { return timeout_; }
+
+	virtual size_t readBytes(char *buffer, size_t length) {
+		size_t count = 0;
+
+		while (count < length) {
+			int c = read();
+
+			if (c < 0) {
+				break;
+			}
+
+			*buffer++ = (char)c;
+			count++;
+		}
+
+		return count;
+	}
+
+	size_t readBytes(uint8_t *buffer, size_t length) {
+		return readBytes(reinterpret_cast<char*>(buffer), length);
+	}
+
+protected:
+	unsigned long timeout_{1000};
+};
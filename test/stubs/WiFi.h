@@ -0,0 +1,69 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host stub of the arduino-esp32 WiFi library, it only connects when a test
+ * sets host::wifi_connected.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <atomic>
+
+typedef enum {
+	WL_NO_SHIELD = 255,
+	WL_IDLE_STATUS = 0,
+	WL_NO_SSID_AVAIL = 1,
+	WL_SCAN_COMPLETED = 2,
+	WL_CONNECTED = 3,
+	WL_CONNECT_FAILED = 4,
+	WL_CONNECTION_LOST = 5,
+	WL_DISCONNECTED = 6,
+} wl_status_t;
+
+typedef enum {
+	WIFI_OFF = 0,
+	WIFI_STA = 1,
+} wifi_mode_t;
+
+namespace host {
+
+inline std::atomic<bool> wifi_connected{false};
+
+} // namespace host
+
+class WiFiClass {
+public:
+	void persistent(bool persistent) { (void)persistent; }
+	bool setHostname(const char *hostname) { (void)hostname; return true; }
+	bool setAutoReconnect(bool reconnect) { (void)reconnect; return true; }
+	bool setSleep(bool sleep) { (void)sleep; return true; }
+	bool mode(wifi_mode_t mode) { (void)mode; return true; }
+	wl_status_t begin(const char *ssid, const char *password) { (void)ssid; (void)password; return WL_DISCONNECTED; }
+	bool disconnect() { return true; }
+	wl_status_t status() { return host::wifi_connected ? WL_CONNECTED : WL_DISCONNECTED; }
+};
+
+class WiFiClient {
+public:
+	bool connected() { return host::wifi_connected; }
+};
+
+inline WiFiClass WiFi;
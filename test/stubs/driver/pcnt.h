@@ -0,0 +1,82 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stub of the ESP-IDF pulse counter driver, there are no units */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef enum {
+	PCNT_UNIT_0,
+	PCNT_UNIT_MAX = 0,
+} pcnt_unit_t;
+
+typedef enum {
+	PCNT_CHANNEL_0,
+	PCNT_CHANNEL_1,
+} pcnt_channel_t;
+
+typedef enum {
+	PCNT_COUNT_DIS,
+	PCNT_COUNT_INC,
+	PCNT_COUNT_DEC,
+} pcnt_count_mode_t;
+
+typedef enum {
+	PCNT_MODE_KEEP,
+	PCNT_MODE_REVERSE,
+	PCNT_MODE_DISABLE,
+} pcnt_ctrl_mode_t;
+
+typedef enum {
+	PCNT_EVT_THRES_1 = 1 << 2,
+	PCNT_EVT_THRES_0 = 1 << 3,
+	PCNT_EVT_L_LIM = 1 << 4,
+	PCNT_EVT_H_LIM = 1 << 5,
+	PCNT_EVT_ZERO = 1 << 6,
+} pcnt_evt_type_t;
+
+typedef struct {
+	int pulse_gpio_num;
+	int ctrl_gpio_num;
+	pcnt_ctrl_mode_t lctrl_mode;
+	pcnt_ctrl_mode_t hctrl_mode;
+	pcnt_count_mode_t pos_mode;
+	pcnt_count_mode_t neg_mode;
+	int16_t counter_h_lim;
+	int16_t counter_l_lim;
+	pcnt_unit_t unit;
+	pcnt_channel_t channel;
+} pcnt_config_t;
+
+static inline esp_err_t pcnt_isr_service_install(int flags) { (void)flags; return ESP_ERR_NOT_FOUND; }
+static inline esp_err_t pcnt_unit_config(const pcnt_config_t *config) { (void)config; return ESP_ERR_NOT_FOUND; }
+static inline esp_err_t pcnt_set_filter_value(pcnt_unit_t unit, uint16_t value) { (void)unit; (void)value; return ESP_ERR_NOT_FOUND; }
+static inline esp_err_t pcnt_filter_enable(pcnt_unit_t unit) { (void)unit; return ESP_ERR_NOT_FOUND; }
+static inline esp_err_t pcnt_event_enable(pcnt_unit_t unit, pcnt_evt_type_t event) { (void)unit; (void)event; return ESP_ERR_NOT_FOUND; }
+static inline esp_err_t pcnt_counter_pause(pcnt_unit_t unit) { (void)unit; return ESP_ERR_NOT_FOUND; }
+static inline esp_err_t pcnt_counter_clear(pcnt_unit_t unit) { (void)unit; return ESP_ERR_NOT_FOUND; }
+static inline esp_err_t pcnt_counter_resume(pcnt_unit_t unit) { (void)unit; return ESP_ERR_NOT_FOUND; }
+static inline esp_err_t pcnt_get_event_status(pcnt_unit_t unit, uint32_t *status) { (void)unit; *status = 0; return ESP_ERR_NOT_FOUND; }
+static inline esp_err_t pcnt_isr_handler_add(pcnt_unit_t unit, void (*handler)(void *arg), void *arg) {
+	(void)unit; (void)handler; (void)arg;
+	return ESP_ERR_NOT_FOUND;
+}
@@ -0,0 +1,89 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host stub of the ESP-IDF RMT driver and the arduino-esp32 v2 RMT API.
+ * There is no RMT peripheral so no channels can be allocated; use the
+ * DALI_SIMULATOR build option instead.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "hal/rmt_types.h"
+
+typedef struct {
+	union {
+		struct {
+			uint32_t duration0 :15;
+			uint32_t level0 :1;
+			uint32_t duration1 :15;
+			uint32_t level1 :1;
+		};
+		uint32_t val;
+	};
+} rmt_data_t;
+
+typedef enum {
+	RMT_RX_MODE = 0,
+	RMT_TX_MODE = 1,
+} rmt_ch_dir_t;
+
+typedef enum {
+	RMT_MEM_64 = 1,
+	RMT_MEM_128 = 2,
+	RMT_MEM_192 = 3,
+	RMT_MEM_256 = 4,
+} rmt_reserve_memsize_t;
+
+/* Defined by the application, copied from esp32-hal-rmt.c */
+typedef struct rmt_obj_s rmt_obj_t;
+
+typedef void (*rmt_rx_data_cb_t)(uint32_t *data, size_t len, void *arg);
+typedef void (*rmt_tx_end_fn_t)(rmt_channel_t channel, void *arg);
+
+static inline rmt_obj_t *rmtInit(int pin, rmt_ch_dir_t direction, rmt_reserve_memsize_t size) {
+	(void)pin; (void)direction; (void)size;
+	return nullptr;
+}
+
+static inline float rmtSetTick(rmt_obj_t *rmt, float tick) { (void)rmt; return tick; }
+
+static inline bool rmtWrite(rmt_obj_t *rmt, rmt_data_t *data, size_t size) {
+	(void)rmt; (void)data; (void)size;
+	return false;
+}
+
+static inline bool rmtWriteBlocking(rmt_obj_t *rmt, rmt_data_t *data, size_t size) {
+	(void)rmt; (void)data; (void)size;
+	return false;
+}
+
+static inline esp_err_t rmt_wait_tx_done(rmt_channel_t channel, TickType_t wait) {
+	(void)channel; (void)wait;
+	return ESP_ERR_INVALID_STATE;
+}
+
+static inline rmt_tx_end_fn_t rmt_register_tx_end_callback(rmt_tx_end_fn_t function, void *arg) {
+	(void)function; (void)arg;
+	return nullptr;
+}
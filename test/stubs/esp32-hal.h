@@ -0,0 +1,41 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stub of the arduino-esp32 HAL system functions */
+
+#pragma once
+
+#include "esp_system.h"
+
+typedef enum {
+	NO_MEAN = 0,
+	POWERON_RESET = 1,
+} RESET_REASON;
+
+static inline RESET_REASON rtc_get_reset_reason(int cpu) {
+	(void)cpu;
+	return POWERON_RESET;
+}
+
+static inline unsigned int rtc_get_wakeup_cause() {
+	return 0;
+}
+
+static inline float temperatureRead() {
+	return 40.0f;
+}
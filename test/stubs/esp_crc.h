@@ -0,0 +1,39 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stub of the ESP-IDF CRC functions */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Same as the ROM implementation: the CRC is inverted before and after. */
+static inline uint32_t esp_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+	crc = ~crc;
+
+	while (len--) {
+		crc ^= *buf++;
+
+		for (int i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xEDB88320U & -(crc & 1U));
+		}
+	}
+
+	return ~crc;
+}
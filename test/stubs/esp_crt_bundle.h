@@ -0,0 +1,28 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stub of the arduino-esp32 certificate bundle */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+static inline esp_err_t arduino_esp_crt_bundle_attach(void *conf) { (void)conf; return ESP_OK; }
+static inline void arduino_esp_crt_bundle_set(const uint8_t *bundle) { (void)bundle; }
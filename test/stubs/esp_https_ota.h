@@ -0,0 +1,62 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stub of the ESP-IDF HTTPS OTA functions, there is no network */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "esp_ota_ops.h"
+
+#define ESP_ERR_HTTPS_OTA_BASE 0x9000
+#define ESP_ERR_HTTPS_OTA_IN_PROGRESS (ESP_ERR_HTTPS_OTA_BASE + 1)
+
+typedef struct {
+	const char *url;
+	esp_err_t (*crt_bundle_attach)(void *conf);
+	bool disable_auto_redirect;
+	int buffer_size;
+} esp_http_client_config_t;
+
+typedef struct {
+	const esp_http_client_config_t *http_config;
+} esp_https_ota_config_t;
+
+typedef void *esp_https_ota_handle_t;
+
+static inline esp_err_t esp_https_ota_begin(const esp_https_ota_config_t *config,
+		esp_https_ota_handle_t *handle) {
+	(void)config;
+	*handle = nullptr;
+	return ESP_FAIL;
+}
+
+static inline esp_err_t esp_https_ota_perform(esp_https_ota_handle_t handle) { (void)handle; return ESP_FAIL; }
+static inline bool esp_https_ota_is_complete_data_received(esp_https_ota_handle_t handle) { (void)handle; return false; }
+static inline esp_err_t esp_https_ota_finish(esp_https_ota_handle_t handle) { (void)handle; return ESP_FAIL; }
+static inline esp_err_t esp_https_ota_abort(esp_https_ota_handle_t handle) { (void)handle; return ESP_OK; }
+static inline int esp_https_ota_get_image_len_read(esp_https_ota_handle_t handle) { (void)handle; return 0; }
+static inline int esp_https_ota_get_image_size(esp_https_ota_handle_t handle) { (void)handle; return -1; }
+
+static inline esp_err_t esp_https_ota_get_img_desc(esp_https_ota_handle_t handle,
+		esp_app_desc_t *desc) {
+	(void)handle; (void)desc;
+	return ESP_FAIL;
+}
@@ -0,0 +1,118 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stub of the ESP-IDF OTA functions, with one factory partition */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef enum {
+	ESP_PARTITION_TYPE_APP = 0x00,
+	ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef enum {
+	ESP_PARTITION_SUBTYPE_APP_FACTORY = 0x00,
+	ESP_PARTITION_SUBTYPE_APP_OTA_0 = 0x10,
+} esp_partition_subtype_t;
+
+typedef struct {
+	esp_partition_type_t type;
+	esp_partition_subtype_t subtype;
+	uint32_t address;
+	uint32_t size;
+	char label[17];
+	bool encrypted;
+} esp_partition_t;
+
+typedef struct {
+	uint32_t magic_word;
+	uint32_t secure_version;
+	uint32_t reserv1[2];
+	char version[32];
+	char project_name[32];
+	char time[16];
+	char date[16];
+	char idf_ver[32];
+	uint8_t app_elf_sha256[32];
+	uint32_t reserv2[20];
+} esp_app_desc_t;
+
+typedef enum {
+	ESP_OTA_IMG_NEW = 0x0U,
+	ESP_OTA_IMG_PENDING_VERIFY = 0x1U,
+	ESP_OTA_IMG_VALID = 0x2U,
+	ESP_OTA_IMG_INVALID = 0x3U,
+	ESP_OTA_IMG_ABORTED = 0x4U,
+	ESP_OTA_IMG_UNDEFINED = 0xFFFFFFFFU,
+} esp_ota_img_states_t;
+
+namespace host {
+
+inline const esp_partition_t app_partition{ESP_PARTITION_TYPE_APP,
+	ESP_PARTITION_SUBTYPE_APP_FACTORY, 0x10000, 0x100000, "factory", false};
+inline const esp_app_desc_t app_description{0xABCD5432, 0, {}, "native",
+	"mqtt-dali-controller", "00:00:00", "Jan  1 2025", "host", {}, {}};
+
+} // namespace host
+
+static inline const esp_app_desc_t *esp_ota_get_app_description() {
+	return &host::app_description;
+}
+
+static inline const esp_partition_t *esp_ota_get_running_partition() {
+	return &host::app_partition;
+}
+
+static inline const esp_partition_t *esp_ota_get_boot_partition() {
+	return &host::app_partition;
+}
+
+static inline const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start) {
+	(void)start;
+	return &host::app_partition;
+}
+
+static inline uint8_t esp_ota_get_app_partition_count() {
+	return 1;
+}
+
+static inline esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition,
+		esp_ota_img_states_t *state) {
+	(void)partition;
+	*state = ESP_OTA_IMG_VALID;
+	return ESP_OK;
+}
+
+static inline esp_err_t esp_ota_get_partition_description(const esp_partition_t *partition,
+		esp_app_desc_t *desc) {
+	(void)partition;
+	*desc = host::app_description;
+	return ESP_OK;
+}
+
+static inline esp_err_t esp_ota_mark_app_valid_cancel_rollback() {
+	return ESP_OK;
+}
+
+static inline esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot() {
+	return ESP_FAIL;
+}
@@ -0,0 +1,42 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stub of the ESP-IDF pthread configuration */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "esp_err.h"
+
+typedef struct {
+	size_t stack_size;
+	size_t prio;
+	bool inherit_cfg;
+	const char *thread_name;
+	int pin_to_core;
+} esp_pthread_cfg_t;
+
+static inline esp_pthread_cfg_t esp_pthread_get_default_config() {
+	return {};
+}
+
+static inline esp_err_t esp_pthread_set_cfg(const esp_pthread_cfg_t *cfg) {
+	(void)cfg;
+	return ESP_OK;
+}
@@ -0,0 +1,137 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host stub of the ESP-IDF high resolution timer, driven by a simulated
+ * clock so that tests control the passage of time. Timers run their
+ * callbacks (in the caller's thread) when the clock is advanced past them.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <mutex>
+
+#include "esp_err.h"
+
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef enum {
+	ESP_TIMER_TASK,
+	ESP_TIMER_ISR,
+} esp_timer_dispatch_t;
+
+typedef struct {
+	esp_timer_cb_t callback;
+	void *arg;
+	esp_timer_dispatch_t dispatch_method;
+	const char *name;
+	bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+struct esp_timer {
+	esp_timer_create_args_t args;
+	bool armed;
+	int64_t due_us;
+};
+
+typedef struct esp_timer *esp_timer_handle_t;
+
+namespace host {
+
+/* The clock starts at 1s so that a time of 0 can be distinguished */
+inline std::atomic<int64_t> clock_us{1000000};
+inline std::mutex timers_mutex;
+inline std::list<esp_timer> timers;
+
+/** Set the simulated clock, running any timers that are due. */
+inline void set_time_us(int64_t now_us) {
+	while (true) {
+		esp_timer *next = nullptr;
+
+		{
+			std::lock_guard lock{timers_mutex};
+
+			for (auto &timer : timers) {
+				if (timer.armed && timer.due_us <= now_us
+						&& (!next || timer.due_us < next->due_us)) {
+					next = &timer;
+				}
+			}
+
+			if (!next) {
+				break;
+			}
+
+			next->armed = false;
+			clock_us = std::max(clock_us.load(), next->due_us);
+		}
+
+		next->args.callback(next->args.arg);
+	}
+
+	/* Another thread may have already moved the clock further */
+	std::lock_guard lock{timers_mutex};
+	clock_us = std::max(clock_us.load(), now_us);
+}
+
+/** Advance the simulated clock, running any timers that are due. */
+inline void advance_us(int64_t us) {
+	set_time_us(clock_us + us);
+}
+
+} // namespace host
+
+static inline int64_t esp_timer_get_time() {
+	return host::clock_us;
+}
+
+static inline esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+		esp_timer_handle_t *handle) {
+	std::lock_guard lock{host::timers_mutex};
+
+	*handle = &host::timers.emplace_back(esp_timer{*args, false, 0});
+	return ESP_OK;
+}
+
+static inline esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+	std::lock_guard lock{host::timers_mutex};
+
+	if (timer->armed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	timer->armed = true;
+	timer->due_us = host::clock_us + timeout_us;
+	return ESP_OK;
+}
+
+static inline esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+	std::lock_guard lock{host::timers_mutex};
+
+	if (!timer->armed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	timer->armed = false;
+	return ESP_OK;
+}
@@ -0,0 +1,91 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stub of FreeRTOS, tasks are host threads */
+
+#pragma once
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "sdkconfig.h"
+
+#include <vector>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void *TaskHandle_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFFUL)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portYIELD_FROM_ISR(woken) do { (void)(woken); } while (0)
+
+typedef enum {
+	eRunning,
+	eReady,
+	eBlocked,
+	eSuspended,
+	eDeleted,
+	eInvalid,
+} eTaskState;
+
+typedef struct {
+	TaskHandle_t xHandle;
+	const char *pcTaskName;
+	UBaseType_t xTaskNumber;
+	eTaskState eCurrentState;
+	UBaseType_t uxCurrentPriority;
+	UBaseType_t uxBasePriority;
+	uint32_t ulRunTimeCounter;
+	void *pxStackBase;
+	uint32_t usStackHighWaterMark;
+	BaseType_t xCoreID;
+} TaskStatus_t;
+
+static inline UBaseType_t uxTaskGetNumberOfTasks() {
+	return 1;
+}
+
+static inline UBaseType_t uxTaskGetSystemState(TaskStatus_t *tasks,
+		UBaseType_t size, uint32_t *total_runtime) {
+	if (total_runtime) {
+		*total_runtime = 0;
+	}
+
+	if (size < 1) {
+		return 0;
+	}
+
+	tasks[0] = {};
+	tasks[0].pcTaskName = "main";
+	tasks[0].xTaskNumber = 1;
+	tasks[0].eCurrentState = eRunning;
+	return 1;
+}
+
+static inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+	(void)task;
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host stub of FreeRTOS semaphores, using a mutex and condition variable.
+ * Threads waiting indefinitely for a semaphore that hasn't been given are
+ * counted as idle so that tests can wait for them to finish their work.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "FreeRTOS.h"
+
+struct host_semaphore {
+	std::mutex mutex;
+	std::condition_variable cv;
+	unsigned int count{0};
+	unsigned int max_count{1};
+	bool idle_waiter{false};
+};
+
+namespace host {
+
+inline std::atomic<unsigned int> idle_threads{0};
+
+/** Wait (in real time) until a number of threads are idle. */
+inline bool wait_idle(unsigned int count, std::chrono::milliseconds timeout = std::chrono::seconds(10)) {
+	const auto end = std::chrono::steady_clock::now() + timeout;
+
+	while (idle_threads != count) {
+		if (std::chrono::steady_clock::now() >= end) {
+			return false;
+		}
+
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+
+	return true;
+}
+
+} // namespace host
+
+typedef struct host_semaphore *SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateBinary() {
+	return new host_semaphore{};
+}
+
+static inline void vSemaphoreDelete(SemaphoreHandle_t sem) {
+	delete sem;
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+	std::unique_lock lock{sem->mutex};
+	auto available = [sem] { return sem->count > 0; };
+
+	if (ticks == portMAX_DELAY) {
+		if (!available()) {
+			sem->idle_waiter = true;
+			host::idle_threads++;
+		}
+
+		sem->cv.wait(lock, available);
+	} else if (!sem->cv.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), available)) {
+		return pdFALSE;
+	}
+
+	sem->count--;
+	return pdTRUE;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+	std::lock_guard lock{sem->mutex};
+
+	if (sem->count >= sem->max_count) {
+		return pdFALSE;
+	}
+
+	sem->count++;
+	if (sem->idle_waiter) {
+		sem->idle_waiter = false;
+		host::idle_threads--;
+	}
+	sem->cv.notify_one();
+	return pdTRUE;
+}
+
+static inline BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken) {
+	if (woken) {
+		*woken = pdFALSE;
+	}
+
+	return xSemaphoreGive(sem);
+}
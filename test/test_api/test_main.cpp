@@ -0,0 +1,323 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <Arduino.h>
+#include <CBOR.h>
+#include <CBOR_streams.h>
+#include <LittleFS.h>
+#include <unity.h>
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../native_app.h"
+#include "api.h"
+#include "config.h"
+#include "dali.h"
+#include "dimmers.h"
+#include "lights.h"
+#include "local_lights.h"
+#include "network.h"
+#include "profiled_mutex.h"
+#include "remote_lights.h"
+#include "selector.h"
+#include "ui.h"
+
+namespace cbor = qindesign::cbor;
+
+/** Lights that only record the calls made to them. */
+class RecordingLights: public Lights {
+public:
+	void address_config_changed(const std::string &group) override {
+		calls.push_back("address_config_changed " + group);
+	}
+
+	void select_preset(std::string name, const std::string &light_ids, bool internal,
+			unsigned long transition_ms) override {
+		calls.push_back("select_preset " + name + " " + light_ids + " "
+			+ std::to_string(transition_ms));
+	}
+
+	void select_preset(std::string name, const std::vector<std::string> &groups,
+			bool internal) override {
+		calls.push_back("select_preset " + name + " [" + vector_text(groups) + "]");
+	}
+
+	void set_level(const std::string &light_ids, long level, unsigned long transition_ms) override {
+		calls.push_back("set_level " + light_ids + " " + std::to_string(level)
+			+ " " + std::to_string(transition_ms));
+	}
+
+	void dim_adjust(unsigned int dimmer_id, long level) override {
+		calls.push_back("dim_adjust " + std::to_string(dimmer_id) + " " + std::to_string(level));
+	}
+
+	void dim_adjust(DimmerMode mode, const std::string &groups, long level) override {
+		calls.push_back(std::string{"dim_adjust "} + Dimmers::mode_text(mode) + " "
+			+ groups + " " + std::to_string(level));
+	}
+
+	void request_group_sync() override {
+		calls.push_back("request_group_sync");
+	}
+
+	void request_group_sync(const std::string &group) override {
+		calls.push_back("request_group_sync " + group);
+	}
+
+	void request_broadcast_power_on_level() override {
+		calls.push_back("request_broadcast_power_on_level");
+	}
+
+	std::vector<std::string> calls;
+};
+
+static ProfiledMutex file_mutex{"file"};
+static Network network;
+static Selector selector;
+static Config config{file_mutex, network, selector};
+static LocalLights local_lights{network, config};
+static std::array<Dali*,NUM_DALI_BUSES> dali = [] {
+	std::array<Dali*,NUM_DALI_BUSES> buses;
+
+	for (unsigned int bus = 0; bus < NUM_DALI_BUSES; bus++) {
+		buses[bus] = new Dali{config, local_lights, bus};
+	}
+
+	return buses;
+}();
+static RecordingLights lights;
+static Dimmers &dimmers = *new Dimmers{network, config, lights};
+static UI ui{file_mutex, network, nullptr};
+static API &api = *new API{file_mutex, network, config, dali, dimmers, lights, ui};
+
+static std::string topic(const char *suffix) {
+	return FixedConfig::mqttTopic(suffix);
+}
+
+static void receive(std::string_view topic, std::string_view payload) {
+	api.receive(topic, payload);
+}
+
+static void check_calls(std::vector<std::string> expected) {
+	TEST_ASSERT_EQUAL_STRING(vector_text(expected).c_str(), vector_text(lights.calls).c_str());
+	lights.calls.clear();
+}
+
+void setUp() {
+	LittleFS.format();
+	config.load_config();
+	lights.calls.clear();
+}
+
+void tearDown() {
+}
+
+static void test_set() {
+	receive(topic("/set/1,2"), "128");
+	check_calls({"set_level 1,2 128 0"});
+
+	receive(topic("/set/kitchen"), "10 500");
+	check_calls({"set_level kitchen 10 500"});
+
+	/* Invalid levels and transition times are ignored */
+	receive(topic("/set/1"), "");
+	receive(topic("/set/1"), "x");
+	receive(topic("/set/1"), "10 x");
+	receive(topic("/set/1"), "10 -1");
+	receive(topic("/set/1"), "10 " + std::to_string(Dali::MAX_TRANSITION_MS + 1));
+	check_calls({});
+}
+
+static void test_preset() {
+	receive(topic("/preset/bright"), "");
+	check_calls({"select_preset bright all 0"});
+
+	receive(topic("/preset/bright"), "kitchen 250");
+	check_calls({"select_preset bright kitchen 250"});
+
+	receive(topic("/preset/bright"), "kitchen x");
+	check_calls({});
+
+	/* Preset levels are configured without selecting the preset */
+	config.set_addresses("010203");
+	receive(topic("/preset/dim/1-2"), "40");
+	check_calls({});
+
+	std::array<Dali::level_fast_t,Dali::num_lights> levels;
+	TEST_ASSERT_TRUE(config.get_preset("dim", levels));
+	TEST_ASSERT_EQUAL_UINT(40, levels[1]);
+	TEST_ASSERT_EQUAL_UINT(40, levels[2]);
+	TEST_ASSERT_EQUAL_UINT(Dali::LEVEL_NO_CHANGE, levels[3]);
+
+	receive(topic("/preset/order"), "dim,off");
+	std::string name;
+	TEST_ASSERT_TRUE(config.get_ordered_preset(1, name));
+	TEST_ASSERT_EQUAL_STRING("off", name.c_str());
+
+	receive(topic("/preset/dim/delete"), "");
+	TEST_ASSERT_FALSE(config.get_preset("dim", levels));
+}
+
+static void test_group() {
+	receive(topic("/group/kitchen"), "0102");
+	check_calls({"address_config_changed kitchen", "request_group_sync kitchen"});
+	TEST_ASSERT_EQUAL_STRING("0102", config.group_addresses_text("kitchen").c_str());
+
+	/* Unchanged addresses aren't synchronised again */
+	receive(topic("/group/kitchen"), "0102");
+	check_calls({});
+
+	receive(topic("/group/kitchen"), "sync");
+	receive(topic("/group/sync"), "");
+	check_calls({"request_group_sync kitchen", "request_group_sync"});
+
+	receive(topic("/group/kitchen"), "");
+	TEST_ASSERT_EQUAL_UINT(Dali::GROUP_NONE, config.get_group_id("kitchen"));
+}
+
+static void test_settings() {
+	receive(topic("/addresses"), "00013F");
+	check_calls({"address_config_changed all"});
+	TEST_ASSERT_EQUAL_STRING("00013F", config.addresses_text().c_str());
+
+	receive(topic("/switch/1/name"), "Door");
+	receive(topic("/button/0/preset"), "bright");
+	receive(topic("/dimmer/1/level_steps"), "3");
+	receive(topic("/dimmer/1/mode"), "group");
+	receive(topic("/selector/2/groups"), "all");
+	check_calls({});
+
+	TEST_ASSERT_EQUAL_STRING("Door", config.get_switch_name(1).c_str());
+	TEST_ASSERT_EQUAL_STRING("bright", config.get_button_preset(0).c_str());
+	TEST_ASSERT_EQUAL_UINT(3, config.get_dimmer_level_steps(1));
+	TEST_ASSERT_TRUE(config.get_dimmer_mode(1) == DimmerMode::GROUP);
+	TEST_ASSERT_TRUE(config.get_selector_groups(2) == std::vector<std::string>{"all"});
+
+	receive(topic("/command/store/power_on_level"), "");
+	check_calls({"request_broadcast_power_on_level"});
+}
+
+static void test_remote_text() {
+	receive(topic("/x"), "pt bright 1-2");
+	receive(topic("/x"), "sl kitchen 20");
+	receive(topic("/x"), "dg -5 kitchen,hall");
+	receive(topic("/x"), "di 5 hall");
+	check_calls({
+		"select_preset bright 1-2 0",
+		"set_level kitchen 20 0",
+		"dim_adjust group kitchen,hall -5",
+		"dim_adjust individual hall 5",
+	});
+
+	receive(topic("/x"), "");
+	receive(topic("/x"), "pt bright");
+	receive(topic("/x"), "sl kitchen");
+	receive(topic("/x"), "zz 1 2");
+	check_calls({});
+}
+
+static void test_remote_binary() {
+	std::array<uint8_t,256> buffer;
+	cbor::BytesPrint output{buffer.data(), buffer.size()};
+	cbor::Writer writer{output};
+	auto write_text = [&] (std::string_view text) {
+		writer.beginText(text.size());
+		writer.writeBytes(reinterpret_cast<const uint8_t*>(text.data()), text.size());
+	};
+
+	writer.beginArray(4);
+
+	writer.beginArray(3);
+	writer.writeUnsignedInt(static_cast<uint8_t>(RemoteCommand::PRESET_GROUPS));
+	write_text("bright");
+	writer.beginArray(2);
+	write_text("kitchen");
+	write_text("hall");
+
+	writer.beginArray(3);
+	writer.writeUnsignedInt(static_cast<uint8_t>(RemoteCommand::SET_LEVEL));
+	write_text("3");
+	writer.writeUnsignedInt(254);
+
+	/* Out of range, so it's skipped without stopping */
+	writer.beginArray(3);
+	writer.writeUnsignedInt(static_cast<uint8_t>(RemoteCommand::SET_LEVEL));
+	write_text("3");
+	writer.writeUnsignedInt(Dali::MAX_LEVEL + 1);
+
+	writer.beginArray(3);
+	writer.writeUnsignedInt(static_cast<uint8_t>(RemoteCommand::DIM_INDIVIDUAL));
+	writer.writeInt(-3);
+	writer.beginArray(1);
+	write_text("hall");
+
+	receive(topic("/x"), {reinterpret_cast<const char*>(buffer.data()), writer.getWriteSize()});
+	check_calls({
+		"select_preset bright [kitchen,hall]",
+		"set_level 3 254 0",
+		"dim_adjust individual hall -3",
+	});
+
+	/* A truncated message is processed until the error */
+	receive(topic("/x"), {reinterpret_cast<const char*>(buffer.data()), 26});
+	check_calls({"select_preset bright [kitchen,hall]"});
+}
+
+static void test_unknown() {
+	receive(topic(""), "1");
+	receive(topic("/"), "1");
+	receive(topic("/unknown/1"), "1");
+	receive(topic("/setx/1"), "1");
+	receive("other/set/1", "1");
+	receive(topic("x/set/1"), "1");
+	receive("set/1", "1");
+	receive(topic("/set"), "1");
+	check_calls({});
+}
+
+static void test_receive_benchmark() {
+	const auto set_topic = topic("/set/1");
+	const auto unknown_topic = topic("/unknown/1");
+
+	host_benchmark("API::receive set", 100000, [&] {
+		receive(set_topic, "10");
+	});
+	lights.calls.clear();
+
+	host_benchmark("API::receive unknown", 100000, [&] {
+		receive(unknown_topic, "10");
+	});
+	check_calls({});
+}
+
+int main() {
+	UNITY_BEGIN();
+	RUN_TEST(test_set);
+	RUN_TEST(test_preset);
+	RUN_TEST(test_group);
+	RUN_TEST(test_settings);
+	RUN_TEST(test_remote_text);
+	RUN_TEST(test_remote_binary);
+	RUN_TEST(test_unknown);
+	RUN_TEST(test_receive_benchmark);
+	return UNITY_END();
+}
@@ -0,0 +1,454 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "../native_app.h"
+#include "littlefs_block_cache.h"
+
+typedef uint32_t lfs_block_t;
+typedef uint32_t lfs_off_t;
+typedef uint32_t lfs_size_t;
+
+struct lfs_config {
+	int unused;
+};
+
+extern "C" {
+
+int __wrap_littlefs_esp_part_read(const struct lfs_config *c, lfs_block_t block,
+	lfs_off_t off, void *buffer, lfs_size_t size);
+int __wrap_littlefs_esp_part_prog(const struct lfs_config *c, lfs_block_t block,
+	lfs_off_t off, const void *buffer, lfs_size_t size);
+int __wrap_littlefs_esp_part_erase(const struct lfs_config *c, lfs_block_t block);
+
+}
+
+using app::filesystem_cache::Stats;
+
+static constexpr int LFS_ERR_IO = -5;
+
+/* Same as the host build of the cache */
+static constexpr size_t BLOCK_SIZE = 4096;
+static constexpr size_t CACHED_BLOCKS = 64;
+static constexpr size_t CACHE_BLOCKS = 16;
+
+/* Blocks after the filesystem aren't cached */
+static constexpr size_t FLASH_BLOCKS = CACHED_BLOCKS + 2;
+
+/**
+ * Flat image of the flash, where programming can only clear bits and
+ * erasing sets a whole block.
+ */
+class FlashImage {
+public:
+	FlashImage() : data_(FLASH_BLOCKS * BLOCK_SIZE) {}
+
+	uint8_t *data(lfs_block_t block, lfs_off_t off) {
+		return &data_[block * BLOCK_SIZE + off];
+	}
+
+	void prog(lfs_block_t block, lfs_off_t off, const uint8_t *buffer, lfs_size_t size) {
+		uint8_t *data = this->data(block, off);
+
+		for (size_t i = 0; i < size; i++) {
+			data[i] &= buffer[i];
+		}
+	}
+
+	void erase(lfs_block_t block, lfs_size_t size = BLOCK_SIZE) {
+		std::memset(data(block, 0), 0xFF, size);
+	}
+
+	std::vector<uint8_t> data_;
+};
+
+/**
+ * Flash underneath the cache. Failures leave half of the prog or erase
+ * done, so the cache must not assume anything about the contents.
+ */
+static FlashImage flash;
+static unsigned int flash_reads = 0;
+static unsigned int fail_read = 0; /**< Number of the flash read to fail */
+static bool fail_prog = false;
+static bool fail_erase = false;
+
+/* What the flash should contain */
+static FlashImage reference;
+static const lfs_config config{};
+
+extern "C" {
+
+int __real_littlefs_esp_part_read(const struct lfs_config *c,
+		lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+	TEST_ASSERT_TRUE(c == &config);
+	TEST_ASSERT_LESS_OR_EQUAL(FLASH_BLOCKS * BLOCK_SIZE, block * BLOCK_SIZE + off + size);
+	if (++flash_reads == fail_read) {
+		return LFS_ERR_IO;
+	}
+
+	std::memcpy(buffer, flash.data(block, off), size);
+	return 0;
+}
+
+int __real_littlefs_esp_part_prog(const struct lfs_config *c,
+		lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size) {
+	TEST_ASSERT_TRUE(c == &config);
+
+	if (fail_prog) {
+		fail_prog = false;
+		flash.prog(block, off, reinterpret_cast<const uint8_t*>(buffer), size / 2);
+		return LFS_ERR_IO;
+	}
+
+	flash.prog(block, off, reinterpret_cast<const uint8_t*>(buffer), size);
+	return 0;
+}
+
+int __real_littlefs_esp_part_erase(const struct lfs_config *c, lfs_block_t block) {
+	TEST_ASSERT_TRUE(c == &config);
+
+	if (fail_erase) {
+		fail_erase = false;
+		flash.erase(block, BLOCK_SIZE / 2);
+		return LFS_ERR_IO;
+	}
+
+	flash.erase(block);
+	return 0;
+}
+
+}
+
+enum class OpType {
+	READ,
+	PROG,
+	ERASE,
+	SYNC,
+};
+
+struct Op {
+	OpType type;
+	lfs_block_t block;
+	lfs_off_t off;
+	lfs_size_t size;
+	bool fail;
+};
+
+using Trace = std::vector<Op>;
+
+static std::mt19937 random_data{1};
+
+static void check_read(lfs_block_t block, lfs_off_t off, lfs_size_t size) {
+	std::vector<uint8_t> buffer(size);
+
+	TEST_ASSERT_EQUAL_INT(0, __wrap_littlefs_esp_part_read(&config, block, off, buffer.data(), size));
+	TEST_ASSERT_EQUAL_MEMORY(reference.data(block, off), buffer.data(), size);
+}
+
+/* Replay a trace, comparing every read with the reference image */
+static void replay(const Trace &trace) {
+	std::vector<uint8_t> buffer;
+
+	for (const auto &op : trace) {
+		switch (op.type) {
+		case OpType::READ:
+			check_read(op.block, op.off, op.size);
+			break;
+
+		case OpType::PROG:
+			buffer.resize(op.size);
+			for (auto &value : buffer) {
+				value = random_data();
+			}
+
+			fail_prog = op.fail;
+			TEST_ASSERT_EQUAL_INT(op.fail ? LFS_ERR_IO : 0,
+				__wrap_littlefs_esp_part_prog(&config, op.block, op.off, buffer.data(), op.size));
+			reference.prog(op.block, op.off, buffer.data(), op.fail ? op.size / 2 : op.size);
+			break;
+
+		case OpType::ERASE:
+			fail_erase = op.fail;
+			TEST_ASSERT_EQUAL_INT(op.fail ? LFS_ERR_IO : 0,
+				__wrap_littlefs_esp_part_erase(&config, op.block));
+			reference.erase(op.block, op.fail ? BLOCK_SIZE / 2 : BLOCK_SIZE);
+			break;
+
+		case OpType::SYNC:
+			/* Nothing to write back, so check the whole filesystem */
+			for (lfs_block_t block = 0; block < FLASH_BLOCKS; block++) {
+				check_read(block, 0, BLOCK_SIZE);
+			}
+			break;
+		}
+	}
+}
+
+/*
+ * Metadata pairs that are read together and have commits appended until
+ * they're compacted into the other block, and files written sequentially
+ * and read back.
+ */
+static Trace metadata_trace(unsigned int commits) {
+	Trace trace;
+	std::array<lfs_off_t,2> commit_off{};
+	std::array<unsigned int,2> current{};
+	lfs_block_t file_block = 8;
+
+	for (unsigned int pair = 0; pair < 2; pair++) {
+		trace.push_back({OpType::ERASE, pair * 2, 0, 0, false});
+		trace.push_back({OpType::ERASE, pair * 2 + 1, 0, 0, false});
+	}
+
+	for (unsigned int i = 0; i < commits; i++) {
+		const unsigned int pair = i % 2;
+		const lfs_block_t block = pair * 2 + current[pair];
+
+		trace.push_back({OpType::READ, pair * 2, 0, 16, false});
+		trace.push_back({OpType::READ, pair * 2 + 1, 0, 16, false});
+		trace.push_back({OpType::READ, block, 0, commit_off[pair], false});
+
+		if (commit_off[pair] + 256 > BLOCK_SIZE) {
+			current[pair] ^= 1;
+			commit_off[pair] = 0;
+			trace.push_back({OpType::ERASE, pair * 2 + current[pair], 0, 0, false});
+			continue;
+		}
+
+		trace.push_back({OpType::PROG, block, commit_off[pair], 64 + (i % 4) * 48, false});
+		commit_off[pair] += 256;
+
+		if (i % 7 == 0) {
+			trace.push_back({OpType::ERASE, file_block, 0, 0, false});
+			for (lfs_off_t off = 0; off < BLOCK_SIZE; off += 512) {
+				trace.push_back({OpType::PROG, file_block, off, 512, false});
+			}
+			trace.push_back({OpType::READ, file_block, 0, BLOCK_SIZE, false});
+
+			file_block = 8 + (file_block - 8 + 1) % (CACHED_BLOCKS - 8);
+		}
+
+		if (i % 10 == 0) {
+			trace.push_back({OpType::SYNC, 0, 0, 0, false});
+		}
+	}
+
+	trace.push_back({OpType::SYNC, 0, 0, 0, false});
+	return trace;
+}
+
+/*
+ * Random operations anywhere in the flash, including reads and progs that
+ * span several blocks or have an offset past the end of the block, and
+ * failed progs and erases.
+ */
+static Trace random_trace(unsigned int seed, unsigned int count) {
+	std::mt19937 random{seed};
+	Trace trace;
+
+	auto random_range = [&] (lfs_block_t &block, lfs_off_t &off, lfs_size_t &size) {
+		block = random() % FLASH_BLOCKS;
+		off = random() % (BLOCK_SIZE * 2);
+		size = 1 + random() % (BLOCK_SIZE * 2);
+
+		const size_t end = FLASH_BLOCKS * BLOCK_SIZE;
+		const size_t start = block * BLOCK_SIZE + off;
+
+		if (start >= end) {
+			off = 0;
+		}
+		size = std::min<size_t>(size, end - (block * BLOCK_SIZE + off));
+	};
+
+	for (unsigned int i = 0; i < count; i++) {
+		const unsigned int type = random() % 100;
+		Op op{OpType::READ, 0, 0, 0, false};
+
+		if (type < 60) {
+			/* Mostly reads of a small number of blocks */
+			random_range(op.block, op.off, op.size);
+			if (random() % 4) {
+				op.block %= CACHE_BLOCKS;
+			}
+		} else if (type < 85) {
+			op.type = OpType::PROG;
+			random_range(op.block, op.off, op.size);
+			op.fail = random() % 10 == 0;
+		} else if (type < 98) {
+			op.type = OpType::ERASE;
+			op.block = random() % FLASH_BLOCKS;
+			op.fail = random() % 10 == 0;
+		} else {
+			op.type = OpType::SYNC;
+		}
+
+		trace.push_back(op);
+	}
+
+	trace.push_back({OpType::SYNC, 0, 0, 0, false});
+	return trace;
+}
+
+void setUp() {
+}
+
+void tearDown() {
+	fail_read = 0;
+	fail_prog = false;
+	fail_erase = false;
+}
+
+/* This must be the first test, while the cache is empty */
+static void test_stats() {
+	std::array<uint8_t,16> buffer;
+	Stats stats;
+
+	/* Each miss reads the next block in advance */
+	check_read(0, 0, 16);
+	check_read(1, 0, 16);
+	check_read(0, BLOCK_SIZE + 32, 16);
+	check_read(3, BLOCK_SIZE - 8, 16);
+
+	stats = app::filesystem_cache::get_stats();
+	TEST_ASSERT_EQUAL_UINT32(3, stats.hit_count);
+	TEST_ASSERT_EQUAL_UINT32(2, stats.miss_count);
+	TEST_ASSERT_EQUAL_UINT32(2, stats.read_ahead_count);
+	TEST_ASSERT_EQUAL_UINT32(0, stats.evict_count);
+
+	/* Cached blocks are updated instead of being read again */
+	buffer.fill(0x0F);
+	TEST_ASSERT_EQUAL_INT(0, __wrap_littlefs_esp_part_prog(&config, 0, 8, buffer.data(), buffer.size()));
+	reference.prog(0, 8, buffer.data(), buffer.size());
+	TEST_ASSERT_EQUAL_INT(0, __wrap_littlefs_esp_part_erase(&config, 1));
+	reference.erase(1);
+	TEST_ASSERT_EQUAL_INT(0, __wrap_littlefs_esp_part_erase(&config, 10));
+	reference.erase(10);
+
+	flash_reads = 0;
+	check_read(0, 0, 32);
+	check_read(1, 0, 32);
+	TEST_ASSERT_EQUAL_UINT(0, flash_reads);
+
+	stats = app::filesystem_cache::get_stats();
+	TEST_ASSERT_EQUAL_UINT32(2, stats.hit_count);
+	TEST_ASSERT_EQUAL_UINT32(0, stats.miss_count);
+	TEST_ASSERT_EQUAL_UINT32(2, stats.write_through_count);
+
+	/* Blocks after the filesystem are read from flash every time */
+	flash_reads = 0;
+	check_read(CACHED_BLOCKS, 0, 16);
+	check_read(CACHED_BLOCKS, 0, 16);
+	TEST_ASSERT_EQUAL_UINT(2, flash_reads);
+
+	/* Reading more blocks than the cache can hold evicts some of them */
+	for (lfs_block_t block = 0; block < CACHE_BLOCKS * 2; block++) {
+		check_read(block, 0, 16);
+	}
+
+	stats = app::filesystem_cache::get_stats();
+	TEST_ASSERT_GREATER_THAN(0, stats.evict_count);
+}
+
+static void test_read_failure() {
+	const lfs_block_t block = 60;
+	std::array<uint8_t,16> buffer;
+
+	/* A block that failed to be read isn't cached */
+	flash_reads = 0;
+	fail_read = 1;
+	TEST_ASSERT_EQUAL_INT(LFS_ERR_IO, __wrap_littlefs_esp_part_read(&config, block, 0, buffer.data(), buffer.size()));
+
+	app::filesystem_cache::get_stats();
+	check_read(block, 0, 16);
+
+	Stats stats = app::filesystem_cache::get_stats();
+	TEST_ASSERT_EQUAL_UINT32(0, stats.hit_count);
+	TEST_ASSERT_EQUAL_UINT32(1, stats.miss_count);
+}
+
+static void test_read_ahead_failure() {
+	const lfs_block_t block = 50;
+
+	/* Only the read ahead fails, which doesn't affect the read */
+	app::filesystem_cache::get_stats();
+	flash_reads = 0;
+	fail_read = 2;
+	check_read(block, 0, 16);
+	TEST_ASSERT_EQUAL_UINT(2, flash_reads);
+
+	/* The next block is read when it's needed instead */
+	check_read(block + 1, 0, 16);
+	TEST_ASSERT_EQUAL_UINT(4, flash_reads);
+
+	Stats stats = app::filesystem_cache::get_stats();
+	TEST_ASSERT_EQUAL_UINT32(0, stats.hit_count);
+	TEST_ASSERT_EQUAL_UINT32(2, stats.miss_count);
+	TEST_ASSERT_EQUAL_UINT32(1, stats.read_ahead_count);
+}
+
+static void test_replay_metadata() {
+	replay(metadata_trace(500));
+}
+
+static void test_replay_random() {
+	for (unsigned int seed = 1; seed <= 20; seed++) {
+		replay(random_trace(seed, 2000));
+	}
+}
+
+static void test_replay_benchmark() {
+	const Trace trace = metadata_trace(2000);
+	char message[128];
+
+	app::filesystem_cache::get_stats();
+	host_benchmark("BlockCache replay (metadata)", 1, [&] {
+		replay(trace);
+	});
+
+	Stats stats = app::filesystem_cache::get_stats();
+
+	snprintf(message, sizeof(message), "%u hits, %u misses, %u read ahead, %u evicted",
+		stats.hit_count, stats.miss_count, stats.read_ahead_count, stats.evict_count);
+	TEST_MESSAGE(message);
+}
+
+int main() {
+	std::mt19937 random{0};
+
+	for (size_t i = 0; i < flash.data_.size(); i++) {
+		flash.data_[i] = reference.data_[i] = random();
+	}
+
+	UNITY_BEGIN();
+	RUN_TEST(test_stats);
+	RUN_TEST(test_read_failure);
+	RUN_TEST(test_read_ahead_failure);
+	RUN_TEST(test_replay_metadata);
+	RUN_TEST(test_replay_random);
+	RUN_TEST(test_replay_benchmark);
+	return UNITY_END();
+}
@@ -0,0 +1,300 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <unity.h>
+
+#include <array>
+#include <memory>
+#include <string>
+
+#include "../native_app.h"
+#include "config.h"
+#include "dali.h"
+#include "network.h"
+#include "profiled_mutex.h"
+#include "selector.h"
+
+static ProfiledMutex file_mutex{"file"};
+static Network network;
+static Selector selector;
+
+static std::unique_ptr<Config> new_config() {
+	auto config = std::make_unique<Config>(file_mutex, network, selector);
+
+	config->setup();
+	return config;
+}
+
+static Dali::lights_t lights(std::initializer_list<unsigned int> ids) {
+	Dali::lights_t value;
+
+	for (auto id : ids) {
+		value[id] = true;
+	}
+
+	return value;
+}
+
+static void check_lights(const Dali::lights_t &expected, const Dali::lights_t &actual) {
+	TEST_ASSERT_EQUAL_STRING(Config::addresses_text(expected).c_str(),
+		Config::addresses_text(actual).c_str());
+}
+
+void setUp() {
+	LittleFS.format();
+}
+
+void tearDown() {
+}
+
+static void test_parse_light_ids_numbers() {
+	auto config = new_config();
+	bool idle_only = true;
+
+	check_lights(lights({0, 3, 63}), config->parse_light_ids("3,0,63", idle_only));
+	TEST_ASSERT_FALSE(idle_only);
+
+	check_lights(lights({10, 11, 12, 20}), config->parse_light_ids("10-12,20", idle_only));
+	check_lights(lights({5}), config->parse_light_ids("5-5", idle_only));
+}
+
+static void test_parse_light_ids_invalid() {
+	auto config = new_config();
+	bool idle_only;
+
+	/* Reversed and out of range items are ignored, the rest are used */
+	check_lights(lights({1}), config->parse_light_ids("12-10,1", idle_only));
+	check_lights(lights({2}), config->parse_light_ids(std::to_string(Dali::num_lights) + ",2", idle_only));
+	check_lights(lights({}), config->parse_light_ids("0-" + std::to_string(Dali::num_lights), idle_only));
+	check_lights(lights({}), config->parse_light_ids("x,-1,1-,-,unknown", idle_only));
+	check_lights(lights({}), config->parse_light_ids("", idle_only));
+}
+
+static void test_parse_light_ids_groups() {
+	auto config = new_config();
+	bool idle_only;
+
+	TEST_ASSERT_TRUE(config->set_group_addresses("kitchen", "0102"));
+	TEST_ASSERT_TRUE(config->set_group_addresses("hall", "0A"));
+
+	check_lights(lights({1, 2, 10}), config->parse_light_ids("kitchen,hall", idle_only));
+	check_lights(lights({1, 2, 30}), config->parse_light_ids("kitchen,30", idle_only));
+	TEST_ASSERT_FALSE(idle_only);
+
+	check_lights(lights({1, 2}), config->parse_light_ids("idle,kitchen", idle_only));
+	TEST_ASSERT_TRUE(idle_only);
+
+	check_lights(Dali::lights_t{}.set(), config->parse_light_ids("all", idle_only));
+	TEST_ASSERT_FALSE(idle_only);
+}
+
+static void test_parse_light_ids_cache() {
+	auto config = new_config();
+	bool idle_only;
+
+	TEST_ASSERT_TRUE(config->set_group_addresses("kitchen", "0102"));
+	config->light_ids_cache_stats();
+
+	check_lights(lights({1, 2}), config->parse_light_ids("kitchen", idle_only));
+	check_lights(lights({1, 2}), config->parse_light_ids("kitchen", idle_only));
+
+	auto stats = config->light_ids_cache_stats();
+	TEST_ASSERT_EQUAL_UINT64(1, stats.hit_count);
+	TEST_ASSERT_EQUAL_UINT64(1, stats.miss_count);
+
+	/* Changing the group addresses invalidates the cached entry */
+	TEST_ASSERT_TRUE(config->set_group_addresses("kitchen", "03"));
+	check_lights(lights({3}), config->parse_light_ids("kitchen", idle_only));
+
+	stats = config->light_ids_cache_stats();
+	TEST_ASSERT_EQUAL_UINT64(0, stats.hit_count);
+	TEST_ASSERT_EQUAL_UINT64(1, stats.miss_count);
+}
+
+static void test_parse_light_ids_benchmark() {
+	auto config = new_config();
+	bool idle_only;
+
+	TEST_ASSERT_TRUE(config->set_group_addresses("kitchen", "0102030405"));
+
+	host_benchmark("parse_light_ids (cached)", 100000, [&] {
+		config->parse_light_ids("kitchen,10-20,idle", idle_only);
+	});
+
+	unsigned int i = 0;
+
+	host_benchmark("parse_light_ids (uncached)", 100000, [&] {
+		config->parse_light_ids(std::to_string(i++ % Dali::num_lights) + ",kitchen,10-20", idle_only);
+	});
+}
+
+static void modify(Config &config) {
+	config.set_addresses("00010203040A3F");
+	config.set_group_addresses("kitchen", "0102");
+	config.set_group_addresses("hall", "0A3F");
+	config.set_switch_name(0, "Door");
+	config.set_switch_group(0, "hall");
+	config.set_switch_preset(0, "bright");
+	config.set_button_groups(1, "kitchen,hall");
+	config.set_button_preset(1, "dim");
+	config.set_dimmer_groups(0, "kitchen");
+	config.set_dimmer_mode(0, "group");
+	config.set_dimmer_encoder_steps(0, -4);
+	config.set_dimmer_level_steps(0, 3);
+	config.set_selector_groups(0, "hall");
+	config.set_preset("bright", "all", 254);
+	config.set_preset("dim", "kitchen", 40);
+	config.set_preset("dim", "hall", Config::LEVEL_NO_CHANGE);
+	config.set_ordered_presets("dim,bright,off");
+}
+
+static void check_equal(const Config &expected, const Config &actual) {
+	TEST_ASSERT_EQUAL_STRING(expected.addresses_text().c_str(), actual.addresses_text().c_str());
+	TEST_ASSERT_TRUE(expected.group_names() == actual.group_names());
+
+	for (const auto &name : expected.group_names()) {
+		TEST_ASSERT_EQUAL_UINT(expected.get_group_id(name), actual.get_group_id(name));
+		check_lights(expected.get_group_addresses(name), actual.get_group_addresses(name));
+	}
+
+	for (unsigned int i = 0; i < NUM_SWITCHES; i++) {
+		TEST_ASSERT_EQUAL_STRING(expected.get_switch_name(i).c_str(), actual.get_switch_name(i).c_str());
+		TEST_ASSERT_EQUAL_STRING(expected.get_switch_group(i).c_str(), actual.get_switch_group(i).c_str());
+		TEST_ASSERT_EQUAL_STRING(expected.get_switch_preset(i).c_str(), actual.get_switch_preset(i).c_str());
+	}
+
+	for (unsigned int i = 0; i < NUM_BUTTONS; i++) {
+		TEST_ASSERT_TRUE(expected.get_button_groups(i) == actual.get_button_groups(i));
+		TEST_ASSERT_EQUAL_STRING(expected.get_button_preset(i).c_str(), actual.get_button_preset(i).c_str());
+	}
+
+	for (unsigned int i = 0; i < NUM_DIMMERS; i++) {
+		TEST_ASSERT_TRUE(expected.get_dimmer_groups(i) == actual.get_dimmer_groups(i));
+		TEST_ASSERT_TRUE(expected.get_dimmer_mode(i) == actual.get_dimmer_mode(i));
+		TEST_ASSERT_EQUAL_INT(expected.get_dimmer_encoder_steps(i), actual.get_dimmer_encoder_steps(i));
+		TEST_ASSERT_EQUAL_UINT(expected.get_dimmer_level_steps(i), actual.get_dimmer_level_steps(i));
+	}
+
+	for (unsigned int i = 0; i < NUM_OPTIONS; i++) {
+		TEST_ASSERT_TRUE(expected.get_selector_groups(i) == actual.get_selector_groups(i));
+	}
+
+	TEST_ASSERT_TRUE(expected.preset_names() == actual.preset_names());
+
+	for (const auto &name : expected.preset_names()) {
+		std::array<Dali::level_fast_t,Dali::num_lights> expected_levels;
+		std::array<Dali::level_fast_t,Dali::num_lights> actual_levels;
+
+		/* The reserved "custom" preset has no levels */
+		bool found = expected.get_preset(name, expected_levels);
+
+		TEST_ASSERT_EQUAL(found, actual.get_preset(name, actual_levels));
+		if (!found) {
+			continue;
+		}
+
+		TEST_ASSERT_EQUAL_STRING(Config::preset_levels_text(expected_levels, nullptr).c_str(),
+			Config::preset_levels_text(actual_levels, nullptr).c_str());
+	}
+
+	for (unsigned int i = 0; i < 3; i++) {
+		std::string expected_name, actual_name;
+
+		TEST_ASSERT_TRUE(expected.get_ordered_preset(i, expected_name));
+		TEST_ASSERT_TRUE(actual.get_ordered_preset(i, actual_name));
+		TEST_ASSERT_EQUAL_STRING(expected_name.c_str(), actual_name.c_str());
+	}
+}
+
+static void test_config_round_trip_cbor() {
+	auto saved = new_config();
+
+	modify(*saved);
+	saved->save_config();
+	TEST_ASSERT_TRUE(LittleFS.exists("/config.cbor"));
+
+	/* Without the snapshot, the CBOR file has to be parsed */
+	TEST_ASSERT_TRUE(LittleFS.remove("/config.bin"));
+
+	auto loaded = new_config();
+	check_equal(*saved, *loaded);
+
+	std::array<Dali::level_fast_t,Dali::num_lights> levels;
+	TEST_ASSERT_TRUE(loaded->get_preset("dim", levels));
+	TEST_ASSERT_EQUAL_UINT(40, levels[1]);
+	TEST_ASSERT_EQUAL_UINT(Dali::LEVEL_NO_CHANGE, levels[10]);
+	TEST_ASSERT_EQUAL_UINT(Dali::LEVEL_NO_CHANGE, levels[5]);
+
+	/* Reading the CBOR file writes a new snapshot */
+	TEST_ASSERT_TRUE(LittleFS.exists("/config.bin"));
+	check_equal(*saved, *new_config());
+}
+
+static void test_config_round_trip_journal() {
+	auto saved = new_config();
+
+	modify(*saved);
+	saved->save_config();
+
+	/* Later changes are appended to the journal */
+	saved->set_switch_name(0, "Front door");
+	TEST_ASSERT_TRUE(saved->set_group_addresses("kitchen", "010203"));
+	saved->set_preset("bright", "kitchen", 200);
+	saved->delete_preset("dim");
+	saved->set_ordered_presets("bright,off");
+	saved->save_config();
+	TEST_ASSERT_TRUE(LittleFS.exists("/config.journal"));
+
+	auto loaded = new_config();
+	check_equal(*saved, *loaded);
+	TEST_ASSERT_EQUAL_STRING("Front door", loaded->get_switch_name(0).c_str());
+
+	/* The same again, ignoring the snapshot */
+	LittleFS.remove("/config.bin");
+	check_equal(*saved, *new_config());
+}
+
+static void test_config_unchanged_not_saved() {
+	auto config = new_config();
+
+	modify(*config);
+	config->save_config();
+	config->save_config();
+	TEST_ASSERT_FALSE(LittleFS.exists("/config.journal"));
+
+	/* Setting the same values again doesn't add to the journal */
+	modify(*config);
+	config->save_config();
+	TEST_ASSERT_FALSE(LittleFS.exists("/config.journal"));
+}
+
+int main() {
+	UNITY_BEGIN();
+	RUN_TEST(test_parse_light_ids_numbers);
+	RUN_TEST(test_parse_light_ids_invalid);
+	RUN_TEST(test_parse_light_ids_groups);
+	RUN_TEST(test_parse_light_ids_cache);
+	RUN_TEST(test_parse_light_ids_benchmark);
+	RUN_TEST(test_config_round_trip_cbor);
+	RUN_TEST(test_config_round_trip_journal);
+	RUN_TEST(test_config_unchanged_not_saved);
+	return UNITY_END();
+}
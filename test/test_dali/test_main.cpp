@@ -0,0 +1,322 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#include <unity.h>
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include "../native_app.h"
+#include "config.h"
+#include "dali.h"
+#include "local_lights.h"
+#include "network.h"
+#include "profiled_mutex.h"
+#include "selector.h"
+
+/*
+ * Duration of a power level frame on the bus, including the minimum idle
+ * time before the next frame (µs). The simulator keeps the bus busy for the
+ * same time as the RMT transmission would, measured with the simulated
+ * clock.
+ */
+static constexpr int64_t FRAME_US = 25000;
+
+static constexpr uint8_t BROADCAST_POWER = 0xFE;
+static constexpr uint8_t FADE_TIME = 0;
+
+static ProfiledMutex file_mutex{"file"};
+static Network network;
+static Selector selector;
+static Config config{file_mutex, network, selector};
+static LocalLights lights{network, config};
+static Dali &dali = *new Dali{config, lights};
+static uint32_t trace_sequence = 0;
+
+static std::unique_ptr<LightsState> new_state(unsigned int count) {
+	auto state = std::make_unique<LightsState>();
+
+	for (unsigned int address = 0; address < count; address++) {
+		state->addresses[address] = true;
+	}
+	state->levels.fill(Dali::LEVEL_NO_CHANGE);
+	state->group_levels.fill(Dali::LEVEL_NO_CHANGE);
+	state->broadcast_level = Dali::LEVEL_NO_CHANGE;
+	return state;
+}
+
+static std::array<Dali::level_fast_t,Dali::num_addresses> nothing_sent() {
+	std::array<Dali::level_fast_t,Dali::num_addresses> tx_levels;
+
+	tx_levels.fill(Dali::LEVEL_NO_CHANGE);
+	return tx_levels;
+}
+
+static std::array<Dali::level_fast_t,Dali::num_addresses> same_fade_times() {
+	std::array<Dali::level_fast_t,Dali::num_addresses> fade_times;
+
+	fade_times.fill(FADE_TIME);
+	return fade_times;
+}
+
+static unsigned int group_count(const Dali::Plan &plan) {
+	unsigned int count = 0;
+
+	for (auto level : plan.group_levels) {
+		if (level != Dali::LEVEL_NO_CHANGE) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static void test_plan_broadcast() {
+	auto state = new_state(8);
+
+	state->levels.fill(200);
+	state->levels[7] = 100;
+
+	auto plan = Dali::plan_levels(*state, nothing_sent(), same_fade_times());
+
+	TEST_ASSERT_EQUAL_UINT(200, plan.broadcast_level);
+	TEST_ASSERT_EQUAL_UINT(0, group_count(plan));
+	TEST_ASSERT_EQUAL_UINT(2, plan.tx_count);
+	TEST_ASSERT_EQUAL_UINT(8, plan.individual_tx_count);
+}
+
+static void test_plan_groups() {
+	auto state = new_state(8);
+
+	for (unsigned int address = 0; address < 8; address++) {
+		state->levels[address] = address < 4 ? 50 : 100;
+		state->group_addresses[address < 4 ? 2 : 5][address] = true;
+	}
+
+	auto plan = Dali::plan_levels(*state, nothing_sent(), same_fade_times());
+
+	/* Both levels are as common, so the lowest one is broadcast */
+	TEST_ASSERT_EQUAL_UINT(50, plan.broadcast_level);
+	TEST_ASSERT_EQUAL_UINT(1, group_count(plan));
+	TEST_ASSERT_EQUAL_UINT(100, plan.group_levels[5]);
+	TEST_ASSERT_EQUAL_UINT(2, plan.tx_count);
+
+	/* Groups aren't used while they're being synchronised to the bus */
+	state->group_sync[5] = true;
+	plan = Dali::plan_levels(*state, nothing_sent(), same_fade_times());
+
+	TEST_ASSERT_EQUAL_UINT(0, group_count(plan));
+	TEST_ASSERT_EQUAL_UINT(5, plan.tx_count);
+
+	/* Without every level known, only groups can be used */
+	state->group_sync[5] = false;
+	state->addresses[8] = true;
+	plan = Dali::plan_levels(*state, nothing_sent(), same_fade_times());
+
+	TEST_ASSERT_EQUAL_UINT(Dali::LEVEL_NO_CHANGE, plan.broadcast_level);
+	TEST_ASSERT_EQUAL_UINT(50, plan.group_levels[2]);
+	TEST_ASSERT_EQUAL_UINT(100, plan.group_levels[5]);
+	TEST_ASSERT_EQUAL_UINT(2, plan.tx_count);
+}
+
+static void test_plan_not_used() {
+	auto state = new_state(8);
+	auto tx_levels = nothing_sent();
+
+	state->levels.fill(200);
+
+	/* Levels that have already been transmitted */
+	tx_levels.fill(200);
+	tx_levels[3] = 100;
+
+	auto plan = Dali::plan_levels(*state, tx_levels, same_fade_times());
+	TEST_ASSERT_EQUAL_UINT(Dali::LEVEL_NO_CHANGE, plan.broadcast_level);
+	TEST_ASSERT_EQUAL_UINT(1, plan.tx_count);
+
+	/* The dimmer is using a group level */
+	state->group_levels[0] = 10;
+	plan = Dali::plan_levels(*state, nothing_sent(), same_fade_times());
+	TEST_ASSERT_EQUAL_UINT(Dali::LEVEL_NO_CHANGE, plan.broadcast_level);
+	TEST_ASSERT_EQUAL_UINT(8, plan.tx_count);
+
+	/* The lights would fade at different rates */
+	auto fade_times = same_fade_times();
+
+	state->group_levels[0] = Dali::LEVEL_NO_CHANGE;
+	fade_times[4] = FADE_TIME + 1;
+	plan = Dali::plan_levels(*state, nothing_sent(), fade_times);
+	TEST_ASSERT_EQUAL_UINT(Dali::LEVEL_NO_CHANGE, plan.broadcast_level);
+	TEST_ASSERT_EQUAL_UINT(8, plan.tx_count);
+}
+
+static void test_plan_force_refresh() {
+	auto state = new_state(8);
+
+	state->levels.fill(200);
+	state->force_refresh[7] = true;
+
+	/* The light being refreshed is transmitted separately */
+	auto plan = Dali::plan_levels(*state, nothing_sent(), same_fade_times());
+	TEST_ASSERT_EQUAL_UINT(200, plan.broadcast_level);
+	TEST_ASSERT_EQUAL_UINT(1, plan.tx_count);
+	TEST_ASSERT_EQUAL_UINT(7, plan.individual_tx_count);
+}
+
+static void test_plan_benchmark() {
+	auto state = new_state(Dali::num_addresses);
+
+	for (unsigned int address = 0; address < Dali::num_addresses; address++) {
+		state->levels[address] = address % 3 == 0 ? 100 : 254;
+		state->group_addresses[address % Dali::num_groups][address] = true;
+	}
+
+	host_benchmark("Dali::plan_levels", 10000, [&] {
+		Dali::plan_levels(*state, nothing_sent(), same_fade_times());
+	});
+}
+
+/* Wait for the DALI thread to finish, returning the frames it transmitted */
+static std::vector<DaliTraceFrame> transmitted(DaliPriority priority) {
+	std::vector<DaliTraceFrame> frames;
+	uint32_t first_sequence;
+
+	TEST_ASSERT_TRUE_MESSAGE(host::wait_idle(1), "DALI thread is still running");
+
+	for (const auto &frame : dali.get_trace(first_sequence)) {
+		/* Skip frames that were returned by the previous call */
+		if (static_cast<int32_t>(first_sequence++ - trace_sequence) < 0) {
+			continue;
+		}
+
+		if (((frame.flags >> DaliTraceFrame::PRIORITY_SHIFT) & DaliTraceFrame::PRIORITY_MASK)
+				== static_cast<unsigned int>(priority)) {
+			frames.push_back(frame);
+		}
+	}
+
+	trace_sequence = first_sequence;
+	return frames;
+}
+
+static void test_bus_preset() {
+	config.set_preset("bright", "all", 200);
+	config.set_preset("bright", "7", 100);
+
+	const int64_t start_us = esp_timer_get_time();
+
+	dali.get_stats();
+	lights.select_preset("bright", "all");
+
+	auto frames = transmitted(DaliPriority::PRESET);
+
+	TEST_ASSERT_EQUAL_size_t(2, frames.size());
+	TEST_ASSERT_EQUAL_HEX8(BROADCAST_POWER, frames[0].address);
+	TEST_ASSERT_EQUAL_UINT(200, frames[0].data);
+	TEST_ASSERT_EQUAL_HEX8(7 << 1, frames[1].address);
+	TEST_ASSERT_EQUAL_UINT(100, frames[1].data);
+
+	/* Each frame occupies the bus for the same amount of simulated time */
+	const uint32_t frame_us = frames[1].time_us - frames[0].time_us;
+
+	TEST_ASSERT_GREATER_OR_EQUAL(FRAME_US, frame_us);
+	TEST_ASSERT_LESS_OR_EQUAL(FRAME_US + 1000, frame_us);
+	TEST_ASSERT_GREATER_OR_EQUAL(static_cast<uint32_t>(start_us), frames[0].time_us);
+
+	auto stats = dali.get_stats();
+
+	TEST_ASSERT_EQUAL_UINT64(1, stats.plan_count);
+	TEST_ASSERT_EQUAL_UINT64(6, stats.plan_saved_tx_count);
+	TEST_ASSERT_EQUAL_UINT64(2, stats.priorities[static_cast<unsigned int>(DaliPriority::PRESET)].tx_count);
+
+	/* Nothing else is sent until the clock moves */
+	TEST_ASSERT_EQUAL_size_t(0, transmitted(DaliPriority::PRESET).size());
+	TEST_ASSERT_EQUAL_size_t(0, transmitted(DaliPriority::REFRESH).size());
+}
+
+static void test_bus_level_change() {
+	lights.set_level("0-5", 200);
+	lights.set_level("3", 10);
+
+	/* Only the changed levels are sent, so there's no broadcast */
+	auto frames = transmitted(DaliPriority::PRESET);
+
+	TEST_ASSERT_EQUAL_size_t(1, frames.size());
+	TEST_ASSERT_EQUAL_HEX8(3 << 1, frames[0].address);
+	TEST_ASSERT_EQUAL_UINT(10, frames[0].data);
+}
+
+static void test_bus_refresh() {
+	dali.get_stats();
+
+	/*
+	 * The refresh is spread out over the refresh period, so it only happens
+	 * as the simulated clock advances.
+	 */
+	for (unsigned int i = 0; i < 200; i++) {
+		host::advance_us(100 * 1000);
+		TEST_ASSERT_TRUE(host::wait_idle(1));
+	}
+
+	Dali::addresses_t refreshed;
+
+	for (const auto &frame : transmitted(DaliPriority::REFRESH)) {
+		refreshed[frame.address >> 1] = true;
+	}
+
+	/* The simulated lights are all at the level they were set to */
+	auto stats = dali.get_stats();
+
+	TEST_ASSERT_EQUAL_HEX8(0xFF, refreshed.to_ullong());
+	TEST_ASSERT_GREATER_OR_EQUAL(8, stats.refresh_verified_count);
+	TEST_ASSERT_EQUAL_UINT64(0, stats.refresh_corrected_count);
+	TEST_ASSERT_EQUAL_size_t(0, transmitted(DaliPriority::PRESET).size());
+}
+
+int main() {
+	UNITY_BEGIN();
+	RUN_TEST(test_plan_broadcast);
+	RUN_TEST(test_plan_groups);
+	RUN_TEST(test_plan_not_used);
+	RUN_TEST(test_plan_force_refresh);
+	RUN_TEST(test_plan_benchmark);
+
+	LittleFS.format();
+	config.load_config();
+	config.set_addresses("0001020304050607");
+	lights.set_dali(dali);
+	dali.setup();
+	dali.start();
+	transmitted(DaliPriority::PRESET);
+
+	RUN_TEST(test_bus_preset);
+	RUN_TEST(test_bus_level_change);
+	RUN_TEST(test_bus_refresh);
+	return UNITY_END();
+}
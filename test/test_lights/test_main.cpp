@@ -0,0 +1,199 @@
+/*
+ * mqtt-dali-controller
+ * Copyright 2025  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <PubSubClient.h>
+#include <WiFi.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#include <unity.h>
+
+#include <cstdio>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../native_app.h"
+#include "config.h"
+#include "dali.h"
+#include "local_lights.h"
+#include "network.h"
+#include "profiled_mutex.h"
+#include "selector.h"
+
+static constexpr unsigned int LEVEL = 0x64;
+static constexpr unsigned int LEVEL_PRESENT = 0x100;
+
+static ProfiledMutex file_mutex{"file"};
+static Network network;
+static Selector selector;
+static Config config{file_mutex, network, selector};
+static LocalLights lights{network, config};
+
+struct Delta {
+	unsigned long sequence{0};
+	std::map<unsigned int,unsigned int> levels;
+};
+
+/** Wait for the network thread to send all of the queued messages. */
+static std::vector<host::MqttMessage> published(const char *suffix) {
+	const std::string topic = FixedConfig::mqttTopic(suffix);
+	std::vector<host::MqttMessage> messages;
+
+	for (unsigned int i = 0; i < 100; i++) {
+		TEST_ASSERT_TRUE(host::wait_idle(1));
+
+		if (!network.busy() && !network.queued_message_count()) {
+			break;
+		}
+
+		host::advance_us(1000);
+	}
+
+	for (auto &message : host::mqtt_published()) {
+		if (message.topic == topic) {
+			messages.push_back(std::move(message));
+		}
+	}
+
+	return messages;
+}
+
+static Delta decode_delta(const host::MqttMessage &message) {
+	std::istringstream input{message.payload};
+	std::string entry;
+	Delta delta;
+
+	TEST_ASSERT_FALSE(message.retain);
+	TEST_ASSERT_TRUE(static_cast<bool>(input >> delta.sequence));
+
+	while (input >> entry) {
+		TEST_ASSERT_EQUAL_MESSAGE(5, entry.length(), entry.c_str());
+
+		unsigned int id = std::stoul(entry.substr(0, 2), nullptr, 16);
+
+		TEST_ASSERT_LESS_THAN(Dali::num_lights, id);
+		TEST_ASSERT_TRUE_MESSAGE(delta.levels.emplace(id,
+			std::stoul(entry.substr(2), nullptr, 16)).second, entry.c_str());
+	}
+
+	return delta;
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+/*
+ * The first delta has all of the lights, which is split across multiple
+ * messages if it doesn't fit in one message.
+ */
+static void test_levels_delta_all() {
+	const size_t max_entries = (Message::BUFFER_SIZE
+		- FixedConfig::mqttTopic("/levels/delta").length() - 1 - 10) / 6;
+
+	host::mqtt_published();
+	lights.set_level("all", LEVEL);
+
+	auto messages = published("/levels/delta");
+	std::map<unsigned int,unsigned int> levels;
+
+	TEST_ASSERT_EQUAL_size_t((Dali::num_lights + max_entries - 1) / max_entries,
+		messages.size());
+
+	for (unsigned int i = 0; i < messages.size(); i++) {
+		auto delta = decode_delta(messages[i]);
+
+		TEST_ASSERT_EQUAL_UINT32(i + 1, delta.sequence);
+		TEST_ASSERT_LESS_OR_EQUAL(max_entries, delta.levels.size());
+		levels.merge(delta.levels);
+		TEST_ASSERT_TRUE(delta.levels.empty());
+	}
+
+	TEST_ASSERT_EQUAL_size_t(Dali::num_lights, levels.size());
+
+	for (const auto &[id, value] : levels) {
+		TEST_ASSERT_EQUAL_HEX16(LEVEL_PRESENT | LEVEL, value);
+	}
+}
+
+/* Later deltas only have the lights that changed, and none if nothing changed */
+static void test_levels_delta_changes() {
+	const unsigned int last_id = Dali::num_lights - 1;
+	unsigned long sequence;
+
+	lights.set_level("1,3," + std::to_string(last_id), LEVEL / 2);
+
+	auto messages = published("/levels/delta");
+
+	TEST_ASSERT_EQUAL_size_t(1, messages.size());
+
+	auto delta = decode_delta(messages[0]);
+
+	sequence = delta.sequence;
+	TEST_ASSERT_EQUAL_size_t(3, delta.levels.size());
+	TEST_ASSERT_EQUAL_HEX16(LEVEL_PRESENT | (LEVEL / 2), delta.levels[1]);
+	TEST_ASSERT_EQUAL_HEX16(LEVEL_PRESENT | (LEVEL / 2), delta.levels[3]);
+	TEST_ASSERT_EQUAL_HEX16(LEVEL_PRESENT | (LEVEL / 2), delta.levels[last_id]);
+
+	lights.set_level("1", LEVEL / 2);
+	TEST_ASSERT_EQUAL_size_t(0, published("/levels/delta").size());
+
+	lights.set_level("3", LEVEL);
+	messages = published("/levels/delta");
+	TEST_ASSERT_EQUAL_size_t(1, messages.size());
+
+	delta = decode_delta(messages[0]);
+	TEST_ASSERT_EQUAL_UINT32(sequence + 1, delta.sequence);
+	TEST_ASSERT_EQUAL_size_t(1, delta.levels.size());
+	TEST_ASSERT_EQUAL_HEX16(LEVEL_PRESENT | LEVEL, delta.levels[3]);
+}
+
+int main() {
+	std::string addresses;
+
+	LittleFS.format();
+	config.load_config();
+
+	for (unsigned int id = 0; id < Dali::num_lights; id++) {
+		char text[3];
+
+		snprintf(text, sizeof(text), "%02X", id);
+		addresses += text;
+	}
+	config.set_addresses(addresses);
+
+	host::wifi_connected = true;
+	network.setup();
+	network.start(nullptr, nullptr);
+
+	for (unsigned int i = 0; i < 10 && !network.connected(); i++) {
+		host::wait_idle(1);
+		host::advance_us(1000 * 1000);
+	}
+
+	UNITY_BEGIN();
+	TEST_ASSERT_TRUE(network.connected());
+	RUN_TEST(test_levels_delta_all);
+	RUN_TEST(test_levels_delta_changes);
+	return UNITY_END();
+}